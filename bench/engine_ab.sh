@@ -0,0 +1,24 @@
+#!/bin/sh
+# A/B benchmark of the epoll and io_uring engines
+# Usage: bench/engine_ab.sh [directory] [path] [threads] [seconds]
+set -e
+
+DIR=${1:-.}
+URL_PATH=${2:-/README.md}
+THREADS=${3:-8}
+SECONDS_PER_RUN=${4:-5}
+PORT=18080
+
+make -s http_server bench/http_load
+
+for ENGINE in epoll io_uring; do
+    ./http_server --engine "$ENGINE" "$PORT" "$DIR" > /dev/null 2>&1 &
+    SERVER_PID=$!
+    sleep 0.5
+
+    printf '%-9s ' "$ENGINE"
+    bench/http_load "$PORT" "$URL_PATH" "$THREADS" "$SECONDS_PER_RUN"
+
+    kill "$SERVER_PID"
+    wait "$SERVER_PID" 2> /dev/null || true
+done
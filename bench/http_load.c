@@ -0,0 +1,330 @@
+#include <getopt.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+// A load generator for a server on this machine: every thread keeps one request in flight
+// Closed loop, a thread sends its next request as soon as the last response is in
+// Open loop (--rate), requests are due on a fixed schedule and latency counts from when a request was due,
+// so a slow response also charges the requests queued up behind it
+
+static const char *HOST = "127.0.0.1";
+static const char *PORT;
+static const char *PATH;
+static double DURATION; // In seconds
+static int KEEP_ALIVE; // One persistent HTTP/1.1 connection per thread instead of one HTTP/1.0 connection per request
+static double RATE; // Requests per second over all threads, 0 for a closed loop
+
+// What a thread counted
+struct load_thread {
+    pthread_t thread;
+    double interval; // Between requests in an open loop
+    long requests;
+    long errors;
+    double total_latency;
+
+    // Every latency in microseconds, for the percentiles
+    float *latencies;
+    size_t latency_count;
+    size_t latency_capacity;
+};
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Waits until a point in time from now_seconds()
+static void sleep_until(double when)
+{
+    double left = when - now_seconds();
+    if (left > 0){
+        struct timespec ts = {(time_t)left, (long)((left - (time_t)left) * 1e9)};
+        nanosleep(&ts, NULL);
+    }
+}
+
+static int record_latency(struct load_thread *self, double latency)
+{
+    if (self->latency_count == self->latency_capacity){
+        size_t capacity = self->latency_capacity ? self->latency_capacity * 2 : 65536;
+        float *latencies = realloc(self->latencies, capacity * sizeof(float));
+        if (latencies == NULL){
+            return -1;
+        }
+        self->latencies = latencies;
+        self->latency_capacity = capacity;
+    }
+    self->latencies[self->latency_count++] = latency * 1e6;
+    self->total_latency += latency;
+    return 0;
+}
+
+static int connect_to_server(struct addrinfo *ai)
+{
+    int fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (fd < 0){
+        return -1;
+    }
+    if (connect(fd, ai->ai_addr, ai->ai_addrlen) < 0){
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Reads one response off a persistent connection, which has to carry a Content-Length
+// Returns 0, 1 if the server is closing the connection after it, or -1 on error
+static int read_response(int fd)
+{
+    char buf[65536];
+    size_t have = 0;
+    ssize_t nbytes;
+    char *end;
+
+    for (;;){
+        nbytes = recv(fd, buf + have, sizeof(buf) - 1 - have, 0);
+        if (nbytes <= 0){
+            return -1;
+        }
+        have += nbytes;
+        buf[have] = '\0';
+        if ((end = strstr(buf, "\r\n\r\n")) != NULL){
+            break;
+        }
+        if (have == sizeof(buf) - 1){
+            return -1;
+        }
+    }
+    if (strncmp(buf, "HTTP/1.1 2", 10) && strncmp(buf, "HTTP/1.1 3", 10)){
+        return -1;
+    }
+    char *length = strcasestr(buf, "\r\nContent-Length:");
+    if (length == NULL || length > end){
+        return -1;
+    }
+
+    size_t body_len = strtoull(length + 17, NULL, 10);
+    size_t body_have = have - (end + 4 - buf);
+    if (body_have > body_len){
+        return -1; // We never pipeline, so nothing should follow
+    }
+    char *connection = strcasestr(buf, "\r\nConnection: close");
+    int closing = connection != NULL && connection < end;
+
+    for (size_t remaining = body_len - body_have; remaining > 0; remaining -= nbytes){
+        nbytes = recv(fd, buf, remaining < sizeof(buf) ? remaining : sizeof(buf), 0);
+        if (nbytes <= 0){
+            return -1;
+        }
+    }
+    return closing;
+}
+
+// Sends one request, on *fd if it's open (and keep-alive is on), otherwise on a new connection
+static int one_request(struct addrinfo *ai, int *fd, const char *request, size_t request_len)
+{
+    if (*fd < 0 && (*fd = connect_to_server(ai)) < 0){
+        return -1;
+    }
+    if (send(*fd, request, request_len, MSG_NOSIGNAL) != (ssize_t)request_len){
+        goto failed;
+    }
+
+    if (KEEP_ALIVE){
+        int retval = read_response(*fd);
+        if (retval < 0){
+            goto failed;
+        }
+        if (retval == 1){ // --max-requests was reached, the next request opens a new connection
+            close(*fd);
+            *fd = -1;
+        }
+        return 0;
+    }
+
+    // HTTP/1.0, the response ends when the server closes the connection
+    char buf[65536];
+    ssize_t nbytes;
+    size_t total = 0;
+    while ((nbytes = recv(*fd, buf, sizeof(buf), 0)) > 0){
+        total += nbytes;
+    }
+    close(*fd);
+    *fd = -1;
+    return (nbytes < 0 || total == 0) ? -1 : 0;
+
+failed:
+    close(*fd);
+    *fd = -1;
+    return -1;
+}
+
+static void *load_main(void *arg)
+{
+    struct load_thread *self = arg;
+    struct addrinfo hints, *ai;
+    char request[1024];
+    int fd = -1;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(HOST, PORT, &hints, &ai) != 0){
+        fprintf(stderr, "http_load - getaddrinfo failed\n");
+        return NULL;
+    }
+
+    int request_len = KEEP_ALIVE ?
+        snprintf(request, sizeof(request), "GET %s HTTP/1.1\r\nHost: %s\r\n\r\n", PATH, HOST) :
+        snprintf(request, sizeof(request), "GET %s HTTP/1.0\r\nHost: %s\r\n\r\n", PATH, HOST);
+    double start_time = now_seconds();
+    double end = start_time + DURATION;
+    unsigned seed = (unsigned)(size_t)self;
+    double due = start_time + self->interval * (rand_r(&seed) / (double)RAND_MAX); // Threads shouldn't fire in step
+
+    while (now_seconds() < end){
+        double start;
+        if (RATE > 0){
+            sleep_until(due);
+            start = due;
+            due += self->interval;
+        } else {
+            start = now_seconds();
+        }
+
+        if (one_request(ai, &fd, request, request_len) < 0){
+            self->errors++;
+            continue;
+        }
+        if (record_latency(self, now_seconds() - start) < 0){
+            fprintf(stderr, "http_load - error allocating memory\n");
+            break;
+        }
+        self->requests++;
+    }
+
+    if (fd >= 0){
+        close(fd);
+    }
+    freeaddrinfo(ai);
+    return NULL;
+}
+
+static int compare_floats(const void *a, const void *b)
+{
+    float x = *(const float *)a, y = *(const float *)b;
+    return (x > y) - (x < y);
+}
+
+// The latency below which a fraction of the sorted latencies fall
+static double percentile(const float *sorted, size_t count, double fraction)
+{
+    if (count == 0){
+        return 0;
+    }
+    size_t index = (size_t)(fraction * count);
+    return sorted[index < count ? index : count - 1];
+}
+
+static void print_usage(const char *program_name)
+{
+    fprintf(stderr, "Usage: %s [--keep-alive] [--rate R] <port> <path> <threads> <seconds>\n"
+                    "  --keep-alive  Each thread sends its requests over one HTTP/1.1 connection\n"
+                    "  --rate R      Open loop: R requests per second over all threads, latency counts from when\n"
+                    "                each request was due\n",
+                    program_name);
+}
+
+int main(int argc, char *argv[])
+{
+    static struct option long_options[] = {
+        {"keep-alive", no_argument, NULL, 'k'},
+        {"rate", required_argument, NULL, 'r'},
+        {NULL, 0, NULL, 0}
+    };
+    int option;
+    while ((option = getopt_long(argc, argv, "", long_options, NULL)) != -1){
+        switch (option){
+            case 'k':
+                KEEP_ALIVE = 1;
+                break;
+            case 'r':
+                RATE = atof(optarg);
+                if (RATE <= 0){
+                    fprintf(stderr, "http_load - the rate must be positive\n");
+                    return EXIT_FAILURE;
+                }
+                break;
+            default:
+                print_usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if (argc - optind != 4){
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    PORT = argv[optind];
+    PATH = argv[optind + 1];
+    int thread_count = atoi(argv[optind + 2]);
+    DURATION = atof(argv[optind + 3]);
+    if (thread_count < 1 || DURATION <= 0){
+        fprintf(stderr, "http_load - threads and seconds must be positive\n");
+        return EXIT_FAILURE;
+    }
+
+    struct load_thread *threads = calloc(thread_count, sizeof(struct load_thread));
+    if (threads == NULL){
+        perror("http_load - error allocating memory");
+        return EXIT_FAILURE;
+    }
+
+    for (int i = 0; i < thread_count; i++){
+        threads[i].interval = RATE > 0 ? thread_count / RATE : 0;
+        pthread_create(&threads[i].thread, NULL, load_main, &threads[i]);
+    }
+
+    long requests = 0, errors = 0;
+    double total_latency = 0;
+    size_t latency_count = 0;
+    for (int i = 0; i < thread_count; i++){
+        pthread_join(threads[i].thread, NULL);
+        requests += threads[i].requests;
+        errors += threads[i].errors;
+        total_latency += threads[i].total_latency;
+        latency_count += threads[i].latency_count;
+    }
+
+    // Every thread's latencies together, sorted for the percentiles
+    float *latencies = malloc((latency_count ? latency_count : 1) * sizeof(float));
+    if (latencies == NULL){
+        perror("http_load - error allocating memory");
+        return EXIT_FAILURE;
+    }
+    size_t offset = 0;
+    for (int i = 0; i < thread_count; i++){
+        memcpy(latencies + offset, threads[i].latencies, threads[i].latency_count * sizeof(float));
+        offset += threads[i].latency_count;
+        free(threads[i].latencies);
+    }
+    qsort(latencies, latency_count, sizeof(float), compare_floats);
+
+    printf("requests=%ld errors=%ld rps=%.0f mean_latency_us=%.1f p50_us=%.1f p99_us=%.1f p999_us=%.1f max_us=%.1f\n",
+           requests, errors, requests / DURATION,
+           requests ? total_latency / requests * 1e6 : 0.0,
+           percentile(latencies, latency_count, 0.5), percentile(latencies, latency_count, 0.99),
+           percentile(latencies, latency_count, 0.999), latency_count ? latencies[latency_count - 1] : 0.0);
+
+    free(latencies);
+    free(threads);
+    return EXIT_SUCCESS;
+}
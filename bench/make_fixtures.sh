@@ -0,0 +1,37 @@
+#!/bin/sh
+# Generates the benchmark fixture tree: small files, large files and a huge directory
+# Usage: bench/make_fixtures.sh [directory]
+# Does nothing if the tree is already there, remove it to regenerate
+set -e
+
+DIR=${1:-bench/fixtures}
+
+if [ -f "$DIR/.complete" ]; then
+    exit 0
+fi
+rm -rf "$DIR"
+mkdir -p "$DIR/small" "$DIR/large" "$DIR/huge"
+
+# 1000 small files of 512 bytes to 8 KiB, in the formats a site serves
+i=1
+while [ $i -le 1000 ]; do
+    case $((i % 4)) in
+        0) EXT=html ;;
+        1) EXT=css ;;
+        2) EXT=js ;;
+        3) EXT=png ;;
+    esac
+    head -c $((512 + (i * 7919) % 7680)) /dev/urandom > "$DIR/small/file-$(printf '%04d' $i).$EXT"
+    i=$((i + 1))
+done
+cp "$DIR/small/file-0004.html" "$DIR/index.html"
+
+# Large files, one that still fits the cache's budget and ones that are sent from disk
+head -c 1048576 /dev/urandom > "$DIR/large/1m.bin"
+head -c 16777216 /dev/urandom > "$DIR/large/16m.bin"
+head -c 67108864 /dev/urandom > "$DIR/large/64m.bin"
+
+# A directory of 100000 entries
+(cd "$DIR/huge" && seq -f "entry-%06g.txt" 1 100000 | xargs touch)
+
+touch "$DIR/.complete"
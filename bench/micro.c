@@ -0,0 +1,174 @@
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../src/directory_listing.h"
+#include "../src/directory_resolution.h"
+#include "../src/http_scan.h"
+#include "../src/mime_types.h"
+#include "../src/request_parsing.h"
+#include "../src/response_headers.h"
+
+// Per-call cost of the pieces every request goes through: URI decoding, MIME lookup, header building
+// and directory listings (rendered from scratch, served from the cache and paged as JSON)
+// Takes the fixture tree from bench/make_fixtures.sh, whose small/ and huge/ directories are listed
+
+// Request URIs as they arrive: plain, percent-encoded, with '+' for spaces
+static const char *URIS[] = {
+    "/index.html",
+    "/static/js/app.3f9a2c.js",
+    "/images/2024/summer%20campaign/hero%20banner%20(wide)+final.webp",
+    "/docs/%E6%97%A5%E6%9C%AC%E8%AA%9E/%E3%83%9E%E3%83%8B%E3%83%A5%E3%82%A2%E3%83%AB.pdf",
+    "/downloads/release-1.2.3/source+code+archive.tar.gz",
+};
+#define URI_COUNT (sizeof(URIS) / sizeof(URIS[0]))
+
+static const char *NAMES[] = {
+    "/srv/www/index.html", "/srv/www/css/site.css", "/srv/www/js/app.js", "/srv/www/img/logo.png",
+    "/srv/www/img/photo.jpg", "/srv/www/fonts/body.woff2", "/srv/www/data/feed.json", "/srv/www/notes.unknownext",
+};
+#define NAME_COUNT (sizeof(NAMES) / sizeof(NAMES[0]))
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Returns nanoseconds per decode_URI() call, or -1 if one fails
+static double time_decode(long iterations)
+{
+    char buffer[512];
+    size_t lengths[URI_COUNT];
+    for (size_t u = 0; u < URI_COUNT; u++){
+        lengths[u] = strlen(URIS[u]);
+    }
+
+    double start = now_seconds();
+    for (long i = 0; i < iterations; i++){
+        size_t u = i % URI_COUNT;
+        memcpy(buffer, URIS[u], lengths[u] + 1); // Decoded in place, like the server does
+        if (decode_URI(buffer, buffer) < 0){
+            fprintf(stderr, "micro - %s didn't decode\n", URIS[u]);
+            return -1;
+        }
+    }
+    return (now_seconds() - start) * 1e9 / iterations;
+}
+
+// Returns nanoseconds per get_MIME_type() call
+static double time_mime(long iterations)
+{
+    volatile size_t sink = 0;
+    double start = now_seconds();
+    for (long i = 0; i < iterations; i++){
+        sink += (size_t)get_MIME_type(NAMES[i % NAME_COUNT]);
+    }
+    (void)sink;
+    return (now_seconds() - start) * 1e9 / iterations;
+}
+
+// Returns nanoseconds per header block of a typical 200 for a cached file
+static double time_headers(long iterations)
+{
+    static const char extra[] = "Last-Modified: Sat, 17 Oct 2026 00:24:39 GMT\r\n"
+                                "ETag: \"ce805a-4e200-6ad2c047.22878462\"\r\n"
+                                "Accept-Ranges: bytes\r\n";
+    char buffer[HEADER_BUF_SIZE];
+    volatile ssize_t sink = 0;
+
+    double start = now_seconds();
+    for (long i = 0; i < iterations; i++){
+        struct header_builder builder;
+        header_builder_init(&builder, buffer, sizeof(buffer));
+        header_append_status(&builder, 200);
+        header_append_content_type(&builder, "text/html");
+        header_append_content_length(&builder, 4096 + (i & 1023));
+        header_append(&builder, extra, sizeof(extra) - 1);
+        sink += header_builder_finish(&builder, i & 1);
+    }
+    (void)sink;
+    return (now_seconds() - start) * 1e9 / iterations;
+}
+
+// Gets (and drops) a directory's listing iterations times, returns microseconds per listing or -1 on error
+// With a format other than the whole HTML listing, a page of limit entries from the middle is rendered too
+static double time_listing(const char *directory, long iterations, enum listing_format format, size_t limit)
+{
+    double start = now_seconds();
+    for (long i = 0; i < iterations; i++){
+        struct directory_listing *listing = directory_listing_get(directory);
+        if (listing == NULL){
+            fprintf(stderr, "micro - couldn't list %s\n", directory);
+            return -1;
+        }
+        if (format != LISTING_HTML || limit != SIZE_MAX){
+            struct directory_listing *view = directory_listing_view(listing, format, listing->entry_count / 2, limit);
+            if (view == NULL){
+                directory_listing_release(listing);
+                return -1;
+            }
+            directory_listing_release(view);
+        }
+        directory_listing_release(listing);
+    }
+    return (now_seconds() - start) * 1e6 / iterations;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2){
+        fprintf(stderr, "Usage: %s <fixture directory> [iterations]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    long iterations = argc > 2 ? atol(argv[2]) : 2000000;
+    if (iterations <= 0){
+        fprintf(stderr, "micro - iterations must be positive\n");
+        return EXIT_FAILURE;
+    }
+
+    resolve_dir(argv[1]);
+    http_scan_init();
+    if (mime_types_init(NULL) < 0){
+        return EXIT_FAILURE;
+    }
+    char small_dir[PATH_MAX + 16], huge_dir[PATH_MAX + 16];
+    snprintf(small_dir, sizeof(small_dir), "%s/small", BASE_DIR);
+    snprintf(huge_dir, sizeof(huge_dir), "%s/huge", BASE_DIR);
+
+    double decode_ns = time_decode(iterations);
+    if (decode_ns < 0){
+        return EXIT_FAILURE;
+    }
+    printf("decode_uri ns_per_call=%.1f\n", decode_ns);
+    printf("mime_lookup ns_per_call=%.1f\n", time_mime(iterations));
+    printf("header_build ns_per_call=%.1f\n", time_headers(iterations));
+
+    // Listings are rendered from scratch with the cache off, then come out of it
+    long listing_iterations = iterations / 10000 > 0 ? iterations / 10000 : 1;
+    struct {
+        const char *name;
+        const char *directory;
+        size_t cache_bytes;
+        enum listing_format format;
+        size_t limit;
+        long iterations;
+    } listings[] = {
+        {"listing_small_render", small_dir, 0, LISTING_HTML, SIZE_MAX, listing_iterations},
+        {"listing_huge_render", huge_dir, 0, LISTING_HTML, SIZE_MAX, listing_iterations / 20 + 1},
+        {"listing_small_cached", small_dir, 256 * 1024 * 1024, LISTING_HTML, SIZE_MAX, iterations / 10},
+        {"listing_huge_cached", huge_dir, 256 * 1024 * 1024, LISTING_HTML, SIZE_MAX, iterations / 10},
+        {"listing_huge_json_page", huge_dir, 256 * 1024 * 1024, LISTING_JSON, 100, iterations / 100},
+    };
+    for (size_t l = 0; l < sizeof(listings) / sizeof(listings[0]); l++){
+        directory_listing_init(listings[l].cache_bytes);
+        double us = time_listing(listings[l].directory, listings[l].iterations, listings[l].format, listings[l].limit);
+        if (us < 0){
+            return EXIT_FAILURE;
+        }
+        printf("%s us_per_call=%.2f\n", listings[l].name, us);
+    }
+    return 0;
+}
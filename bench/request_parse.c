@@ -0,0 +1,140 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../src/http_parser.h"
+#include "../src/http_scan.h"
+
+// Per-request cost of the request parser, fed whole requests or a few bytes at a time like a slow client,
+// with each scanning kernel the CPU supports
+
+// What a current browser sends for a page, an asset and a revalidation
+static const char *REQUESTS[] = {
+    "GET /index.html HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:131.0) Gecko/20100101 Firefox/131.0\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate, br, zstd\r\n"
+    "Connection: keep-alive\r\n"
+    "Upgrade-Insecure-Requests: 1\r\n"
+    "Sec-Fetch-Dest: document\r\n"
+    "Sec-Fetch-Mode: navigate\r\n"
+    "Sec-Fetch-Site: none\r\n"
+    "Sec-Fetch-User: ?1\r\n"
+    "Priority: u=0, i\r\n"
+    "\r\n",
+
+    "GET /static/js/app.3f9a2c.js HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "User-Agent: Mozilla/5.0 (Windows NT 10.0; Win64; x64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/129.0.0.0 Safari/537.36\r\n"
+    "Accept: */*\r\n"
+    "Sec-Fetch-Site: same-origin\r\n"
+    "Sec-Fetch-Mode: no-cors\r\n"
+    "Sec-Fetch-Dest: script\r\n"
+    "Referer: https://www.example.com/index.html\r\n"
+    "Accept-Encoding: gzip, deflate, br, zstd\r\n"
+    "Accept-Language: en-GB,en-US;q=0.9,en;q=0.8\r\n"
+    "Cookie: session=8c1f0e6a9b7d4c3e2f1a0b9c8d7e6f5a; theme=dark\r\n"
+    "\r\n",
+
+    "GET /images/2024/summer%20campaign/hero%20banner%20(wide)+final.webp HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "User-Agent: Mozilla/5.0 (Macintosh; Intel Mac OS X 14_6) AppleWebKit/605.1.15 (KHTML, like Gecko) Version/18.0 Safari/605.1.15\r\n"
+    "Accept: image/webp,image/avif,image/*,*/*;q=0.8\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "If-None-Match: \"ce805a-4e200-6ad2c047.22878462\"\r\n"
+    "If-Modified-Since: Sat, 17 Oct 2026 00:24:39 GMT\r\n"
+    "Range: bytes=0-65535\r\n"
+    "Connection: keep-alive\r\n"
+    "\r\n",
+};
+#define REQUEST_COUNT (sizeof(REQUESTS) / sizeof(REQUESTS[0]))
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Parses every request iterations times, handing the parser step more bytes per call
+// Returns nanoseconds per request, or -1 if a request didn't parse
+static double time_parser(long iterations, size_t step)
+{
+    char buffer[4096];
+    size_t lengths[REQUEST_COUNT];
+    for (size_t r = 0; r < REQUEST_COUNT; r++){
+        lengths[r] = strlen(REQUESTS[r]);
+    }
+
+    double start = now_seconds();
+    for (long i = 0; i < iterations; i++){
+        size_t r = i % REQUEST_COUNT;
+        memcpy(buffer, REQUESTS[r], lengths[r] + 1); // The parser terminates values in place
+
+        struct http_parser parser;
+        http_parser_init(&parser);
+        ssize_t parsed = 0;
+        for (size_t arrived = step; parsed == 0; arrived += step){
+            parsed = http_parser_execute(&parser, buffer, arrived < lengths[r] ? arrived : lengths[r]);
+        }
+        if (parsed != (ssize_t)lengths[r] || parser.host.data == NULL){
+            fprintf(stderr, "request_parse - request %zu didn't parse (%zd)\n", r, parsed);
+            return -1;
+        }
+    }
+    return (now_seconds() - start) * 1e9 / iterations;
+}
+
+// Runs just the kernels over every request: line ends across the whole header block, then the URI's specials
+// Returns nanoseconds per request
+static double time_kernels(long iterations)
+{
+    volatile size_t sink = 0;
+    double start = now_seconds();
+    for (long i = 0; i < iterations; i++){
+        const char *request = REQUESTS[i % REQUEST_COUNT];
+        size_t len = strlen(request), offset = 0;
+        while (offset < len){
+            offset += scan_line_end(request + offset, len - offset) + 1;
+        }
+        const char *uri = request + scan_space(request, len) + 1;
+        size_t uri_len = scan_space(uri, len - (uri - request));
+        for (size_t uri_offset = 0; uri_offset < uri_len; uri_offset++){
+            uri_offset += scan_uri_special(uri + uri_offset, uri_len - uri_offset);
+        }
+        sink += offset;
+    }
+    (void)sink;
+    return (now_seconds() - start) * 1e9 / iterations;
+}
+
+int main(int argc, char *argv[])
+{
+    long iterations = argc > 1 ? atol(argv[1]) : 2000000;
+    if (iterations <= 0){
+        fprintf(stderr, "Usage: %s [iterations]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    enum scan_kernel kernel_list[] = {SCAN_SCALAR, SCAN_SSE42, SCAN_AVX2};
+    for (size_t k = 0; k < sizeof(kernel_list) / sizeof(kernel_list[0]); k++){
+        if (http_scan_use(kernel_list[k]) < 0){
+            printf("kernel=%d unsupported\n", (int)kernel_list[k]);
+            continue;
+        }
+        printf("kernel=%s scan_ns_per_request=%.1f\n", http_scan_kernel_name(), time_kernels(iterations));
+
+        // The memcpy() that resets the buffer is part of every figure
+        size_t steps[] = {4096, 1460, 64, 1};
+        for (size_t s = 0; s < sizeof(steps) / sizeof(steps[0]); s++){
+            double ns = time_parser(s == 3 ? iterations / 10 : iterations, steps[s]);
+            if (ns < 0){
+                return EXIT_FAILURE;
+            }
+            printf("kernel=%s bytes_per_read=%zu ns_per_request=%.1f\n", http_scan_kernel_name(), steps[s], ns);
+        }
+    }
+    return 0;
+}
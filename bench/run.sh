@@ -0,0 +1,75 @@
+#!/bin/sh
+# Runs the benchmark suite and saves every figure as JSON, for comparing runs
+# Usage: bench/run.sh [seconds per workload] [threads] [open-loop rate]
+# The server runs with $SERVER_OPTIONS, results go to bench/results/<date>-<commit>.json
+set -e
+
+SECONDS_PER_RUN=${1:-5}
+THREADS=${2:-8}
+RATE=${3:-20000}
+FIXTURES=bench/fixtures
+PORT=18081
+
+make -s http_server bench/http_load bench/micro bench/request_parse
+sh bench/make_fixtures.sh "$FIXTURES"
+
+mkdir -p bench/results
+COMMIT=$(git rev-parse --short HEAD 2> /dev/null || echo unknown)
+RESULTS="bench/results/$(date -u +%Y%m%d-%H%M%S)-$COMMIT.json"
+LINES=$(mktemp)
+
+./http_server $SERVER_OPTIONS "$PORT" "$FIXTURES" > /dev/null 2>&1 &
+SERVER_PID=$!
+trap 'kill "$SERVER_PID" 2> /dev/null || true; rm -f "$LINES"' EXIT
+sleep 0.5
+
+# Each workload: name, then http_load's arguments
+load() {
+    NAME=$1
+    shift
+    OUTPUT=$(bench/http_load "$@")
+    printf '%-28s %s\n' "$NAME" "$OUTPUT"
+    echo "$NAME $OUTPUT" >> "$LINES"
+}
+
+load small_keepalive_closed --keep-alive "$PORT" /small/file-0004.html "$THREADS" "$SECONDS_PER_RUN"
+load small_keepalive_open --keep-alive --rate "$RATE" "$PORT" /small/file-0004.html "$THREADS" "$SECONDS_PER_RUN"
+load small_connection_per_request "$PORT" /small/file-0004.html "$THREADS" "$SECONDS_PER_RUN"
+load large_1m_keepalive --keep-alive "$PORT" /large/1m.bin "$THREADS" "$SECONDS_PER_RUN"
+load large_64m_keepalive --keep-alive "$PORT" /large/64m.bin 2 "$SECONDS_PER_RUN"
+load listing_small_keepalive --keep-alive "$PORT" /small/ "$THREADS" "$SECONDS_PER_RUN"
+load listing_huge_keepalive --keep-alive "$PORT" /huge/ 2 "$SECONDS_PER_RUN"
+load listing_huge_json_page --keep-alive "$PORT" "/huge/?format=json&offset=50000&limit=100" "$THREADS" "$SECONDS_PER_RUN"
+
+kill "$SERVER_PID"
+wait "$SERVER_PID" 2> /dev/null || true
+
+bench/micro "$FIXTURES" | tee -a "$LINES"
+bench/request_parse | sed 's/^/request_parse /' | tee -a "$LINES"
+
+# Every line is a name followed by key=value pairs, each one becomes an object
+awk -v commit="$COMMIT" -v date="$(date -u +%Y-%m-%dT%H:%M:%SZ)" -v seconds="$SECONDS_PER_RUN" \
+    -v threads="$THREADS" -v rate="$RATE" '
+BEGIN {
+    printf "{\n  \"commit\": \"%s\",\n  \"date\": \"%s\",\n", commit, date
+    printf "  \"seconds_per_run\": %s,\n  \"threads\": %s,\n  \"open_loop_rate\": %s,\n", seconds, threads, rate
+    printf "  \"results\": ["
+    count = 0
+}
+{
+    printf "%s\n    {\"name\": \"%s\"", (count++ ? "," : ""), $1
+    for (i = 2; i <= NF; i++){
+        split($i, pair, "=")
+        value = pair[2]
+        if (value !~ /^-?[0-9]+(\.[0-9]+)?$/){
+            value = "\"" value "\""
+        }
+        printf ", \"%s\": %s", pair[1], value
+    }
+    printf "}"
+}
+END {
+    printf "\n  ]\n}\n"
+}' "$LINES" > "$RESULTS"
+
+echo "Saved $RESULTS"
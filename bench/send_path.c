@@ -0,0 +1,295 @@
+#include <linux/tcp.h>
+#include <netdb.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/ptrace.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+// Runs the server under ptrace and asks it for the same file over one persistent connection,
+// counting the system calls the server makes and the data packets that reach us per response
+
+#define MAX_SYSCALL 512
+#define WARMUP_REQUESTS 50
+
+// Filled in by the tracing process, read by the client process
+struct shared_counters {
+    pid_t server_pid;
+    unsigned long syscalls[MAX_SYSCALL];
+};
+
+static struct shared_counters *COUNTERS;
+
+#ifndef SYS_openat2
+#define SYS_openat2 437
+#endif
+
+// Names for the system calls the server makes while answering, the others are printed by number
+static const struct {
+    long number;
+    const char *name;
+} SYSCALL_NAMES[] = {
+    {SYS_read, "read"}, {SYS_write, "write"}, {SYS_writev, "writev"}, {SYS_sendto, "sendto"},
+    {SYS_sendmsg, "sendmsg"}, {SYS_recvfrom, "recvfrom"}, {SYS_sendfile, "sendfile"}, {SYS_splice, "splice"},
+    {SYS_pread64, "pread64"}, {SYS_epoll_wait, "epoll_wait"}, {SYS_epoll_pwait, "epoll_pwait"},
+    {SYS_epoll_ctl, "epoll_ctl"}, {SYS_io_uring_enter, "io_uring_enter"}, {SYS_setsockopt, "setsockopt"},
+    {SYS_openat, "openat"}, {SYS_close, "close"}, {SYS_fstat, "fstat"}, {SYS_newfstatat, "newfstatat"},
+    {SYS_statx, "statx"}, {SYS_readlink, "readlink"}, {SYS_poll, "poll"}, {SYS_clock_gettime, "clock_gettime"},
+    {SYS_openat2, "openat2"}, {SYS_getdents64, "getdents64"},
+};
+
+static const char *syscall_name(long number)
+{
+    for (size_t i = 0; i < sizeof(SYSCALL_NAMES) / sizeof(SYSCALL_NAMES[0]); i++){
+        if (SYSCALL_NAMES[i].number == number){
+            return SYSCALL_NAMES[i].name;
+        }
+    }
+    return NULL;
+}
+
+// Counts every system call entry of the server and its threads until it exits
+// The client is our child too, its exit status ends up in client_status
+static void trace_server(pid_t server_pid, pid_t client_pid, int *client_status)
+{
+    int status;
+
+    waitpid(server_pid, &status, 0); // Stopped before exec
+    ptrace(PTRACE_SETOPTIONS, server_pid, 0,
+           PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACECLONE | PTRACE_O_EXITKILL);
+    ptrace(PTRACE_SYSCALL, server_pid, 0, 0);
+
+    for (;;){
+        pid_t pid = waitpid(-1, &status, __WALL);
+        if (pid < 0){
+            return;
+        }
+        if (pid == client_pid){
+            *client_status = status;
+            continue;
+        }
+        if (WIFEXITED(status) || WIFSIGNALED(status)){
+            if (pid == server_pid){
+                return;
+            }
+            continue;
+        }
+
+        int signal_number = 0;
+        if (WSTOPSIG(status) == (SIGTRAP | 0x80)){
+            struct __ptrace_syscall_info info;
+            if (ptrace(PTRACE_GET_SYSCALL_INFO, pid, sizeof(info), &info) > 0 &&
+                info.op == PTRACE_SYSCALL_INFO_ENTRY && info.entry.nr < MAX_SYSCALL){
+                __atomic_fetch_add(&COUNTERS->syscalls[info.entry.nr], 1, __ATOMIC_RELAXED);
+            }
+        } else if (WSTOPSIG(status) != SIGTRAP && WSTOPSIG(status) != SIGSTOP){
+            signal_number = WSTOPSIG(status); // A real signal, pass it on
+        }
+        ptrace(PTRACE_SYSCALL, pid, 0, signal_number);
+    }
+}
+
+// Connects to the server, waiting for it to come up
+static int connect_to_server(const char *port)
+{
+    struct addrinfo hints, *ai;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo("127.0.0.1", port, &hints, &ai) != 0){
+        fprintf(stderr, "send_path - getaddrinfo failed\n");
+        return -1;
+    }
+
+    for (int attempt = 0; attempt < 100; attempt++){
+        int fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd < 0){
+            break;
+        }
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0){
+            freeaddrinfo(ai);
+            return fd;
+        }
+        close(fd);
+        usleep(50 * 1000);
+    }
+    freeaddrinfo(ai);
+    fprintf(stderr, "send_path - couldn't connect to the server\n");
+    return -1;
+}
+
+// Sends one request and reads its whole response (which has to carry a Content-Length)
+static int one_request(int fd, const char *request, size_t request_len)
+{
+    static char buf[1 << 20];
+    size_t have = 0;
+    ssize_t nbytes;
+
+    if (send(fd, request, request_len, MSG_NOSIGNAL) != (ssize_t)request_len){
+        return -1;
+    }
+
+    // Headers first
+    char *end;
+    for (;;){
+        nbytes = recv(fd, buf + have, sizeof(buf) - 1 - have, 0);
+        if (nbytes <= 0){
+            return -1;
+        }
+        have += nbytes;
+        buf[have] = '\0';
+        if ((end = strstr(buf, "\r\n\r\n")) != NULL){
+            break;
+        }
+    }
+    char *length = strcasestr(buf, "\r\nContent-Length:");
+    if (length == NULL || length > end){
+        fprintf(stderr, "send_path - the response has no Content-Length\n");
+        return -1;
+    }
+    size_t remaining = strtoull(length + 17, NULL, 10) - (have - (end + 4 - buf));
+
+    // Then the body, thrown away
+    while (remaining > 0){
+        nbytes = recv(fd, buf, remaining < sizeof(buf) ? remaining : sizeof(buf), 0);
+        if (nbytes <= 0){
+            return -1;
+        }
+        remaining -= nbytes;
+    }
+    return 0;
+}
+
+static unsigned data_segments_in(int fd)
+{
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+    memset(&info, 0, sizeof(info));
+    getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len);
+    return info.tcpi_data_segs_in;
+}
+
+// Runs the requests and prints what each cost, returns the exit status
+static int run_client(const char *port, const char *path, int requests)
+{
+    char request[1024];
+    int request_len = snprintf(request, sizeof(request), "GET %s HTTP/1.1\r\nHost: 127.0.0.1\r\n\r\n", path);
+    unsigned long before[MAX_SYSCALL];
+
+    int fd = connect_to_server(port);
+    if (fd < 0){
+        return EXIT_FAILURE;
+    }
+    for (int i = 0; i < WARMUP_REQUESTS; i++){
+        if (one_request(fd, request, request_len) < 0){
+            fprintf(stderr, "send_path - warm-up request failed\n");
+            return EXIT_FAILURE;
+        }
+    }
+
+    memcpy(before, COUNTERS->syscalls, sizeof(before));
+    unsigned segments_before = data_segments_in(fd);
+    for (int i = 0; i < requests; i++){
+        if (one_request(fd, request, request_len) < 0){
+            fprintf(stderr, "send_path - request %d failed\n", i);
+            return EXIT_FAILURE;
+        }
+    }
+    unsigned segments = data_segments_in(fd) - segments_before;
+    usleep(100 * 1000); // Let the server get back to waiting, so that call is counted for every request
+    unsigned long total = 0;
+    for (int i = 0; i < MAX_SYSCALL; i++){
+        total += COUNTERS->syscalls[i] - before[i];
+    }
+
+    printf("requests=%d syscalls_per_request=%.2f packets_per_response=%.2f\n",
+           requests, (double)total / requests, (double)segments / requests);
+    for (int i = 0; i < MAX_SYSCALL; i++){
+        unsigned long count = COUNTERS->syscalls[i] - before[i];
+        if (count > 0){
+            const char *name = syscall_name(i);
+            if (name != NULL){
+                printf("  %-16s %.2f\n", name, (double)count / requests);
+            } else {
+                printf("  syscall %-8d %.2f\n", i, (double)count / requests);
+            }
+        }
+    }
+
+    close(fd);
+    return EXIT_SUCCESS;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 5){
+        fprintf(stderr, "Usage: %s <server> <port> <directory|-> <path> [requests] [server options...]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    const char *server = argv[1];
+    const char *port = argv[2];
+    const char *directory = argv[3];
+    const char *path = argv[4];
+    int requests = argc > 5 ? atoi(argv[5]) : 1000;
+    if (requests < 1){
+        fprintf(stderr, "send_path - requests must be positive\n");
+        return EXIT_FAILURE;
+    }
+
+    COUNTERS = mmap(NULL, sizeof(struct shared_counters), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (COUNTERS == MAP_FAILED){
+        perror("send_path - mmap");
+        return EXIT_FAILURE;
+    }
+
+    // The server: enough requests for one connection, its options, then the port and directory (if any)
+    char max_requests[32];
+    snprintf(max_requests, sizeof(max_requests), "%d", WARMUP_REQUESTS + requests + 1);
+    char *server_argv[argc + 2];
+    int server_argc = 0;
+    server_argv[server_argc++] = (char *)server;
+    server_argv[server_argc++] = "--max-requests";
+    server_argv[server_argc++] = max_requests;
+    for (int i = 6; i < argc; i++){
+        server_argv[server_argc++] = argv[i];
+    }
+    server_argv[server_argc++] = (char *)port;
+    if (strcmp(directory, "-")){ // "-" when the options name an --archive instead
+        server_argv[server_argc++] = (char *)directory;
+    }
+    server_argv[server_argc] = NULL;
+
+    pid_t server_pid = fork();
+    if (server_pid == 0){
+        freopen("/dev/null", "w", stdout);
+        ptrace(PTRACE_TRACEME, 0, 0, 0);
+        raise(SIGSTOP);
+        execv(server, server_argv);
+        perror("send_path - execv");
+        _exit(EXIT_FAILURE);
+    }
+    COUNTERS->server_pid = server_pid;
+
+    // The client runs in its own process while this one traces the server
+    pid_t client_pid = fork();
+    if (client_pid == 0){
+        int status = run_client(port, path, requests);
+        kill(COUNTERS->server_pid, SIGTERM);
+        fflush(stdout);
+        _exit(status);
+    }
+
+    int status = -1;
+    trace_server(server_pid, client_pid, &status);
+    if (status == -1){
+        waitpid(client_pid, &status, 0);
+    }
+    return WIFEXITED(status) ? WEXITSTATUS(status) : EXIT_FAILURE;
+}
@@ -0,0 +1,119 @@
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "byte_ranges.h"
+#include "validators.h"
+
+// Reads a non-negative decimal number, returns -1 if there isn't one (or it overflows)
+static off_t parse_offset(const char **cursor)
+{
+    const char *c = *cursor;
+    off_t value = 0;
+
+    if (!isdigit((unsigned char)*c)){
+        return -1;
+    }
+    while (isdigit((unsigned char)*c)){
+        if (value > (((off_t)1 << 62) - 1) / 10){
+            return -1;
+        }
+        value = value * 10 + (*c++ - '0');
+    }
+    *cursor = c;
+    return value;
+}
+
+// Parses a Range header value against the size of the file
+// Returns how many satisfiable ranges were put into ranges, 0 if none of them can be satisfied (416),
+// or -1 if the header should be ignored and the whole file sent
+int parse_range_header(const char *header_value, off_t file_size, struct byte_range *ranges, int max_ranges)
+{
+    const char *c = header_value;
+    int range_count = 0;
+
+    // Bytes are the only unit we know, anything else is ignored
+    if (strncasecmp(c, "bytes", 5)){
+        return -1;
+    }
+    c += 5;
+    c += strspn(c, " \t");
+    if (*c++ != '='){
+        return -1;
+    }
+
+    while (*c){
+        c += strspn(c, " \t,");
+        if (*c == '\0'){
+            break;
+        }
+
+        off_t first, last;
+        if (*c == '-'){ // The last n bytes
+            c++;
+            off_t suffix_length = parse_offset(&c);
+            if (suffix_length < 0){
+                return -1;
+            }
+            if (suffix_length == 0 || file_size == 0){
+                goto next_range; // Unsatisfiable, but the others may still be fine
+            }
+            first = suffix_length < file_size ? file_size - suffix_length : 0;
+            last = file_size - 1;
+        } else {
+            first = parse_offset(&c);
+            if (first < 0 || *c++ != '-'){
+                return -1;
+            }
+            c += strspn(c, " \t");
+            if (isdigit((unsigned char)*c)){
+                last = parse_offset(&c);
+                if (last < 0 || last < first){
+                    return -1; // A syntactically invalid range makes the whole header invalid
+                }
+            } else {
+                last = file_size - 1;
+            }
+            if (first >= file_size){
+                goto next_range;
+            }
+            if (last >= file_size){
+                last = file_size - 1;
+            }
+        }
+
+        if (range_count == max_ranges){
+            return -1; // Asking for this many pieces isn't worth answering piece by piece
+        }
+        ranges[range_count].first = first;
+        ranges[range_count].last = last;
+        range_count++;
+
+    next_range:
+        c += strspn(c, " \t");
+        if (*c != ',' && *c != '\0'){
+            return -1;
+        }
+    }
+
+    return range_count;
+}
+
+// Whether an If-Range validator still matches the file, so the Range header applies
+int if_range_matches(const char *header_value, const struct stat *file_stat)
+{
+    // Entity tags are compared strongly, so a weak one never matches
+    if (*header_value == '"' || !strncmp(header_value, "W/", 2)){
+        char etag[ETAG_SIZE];
+        format_etag(etag, sizeof(etag), file_stat, NULL);
+        size_t etag_len = strlen(etag);
+        return !strncmp(header_value, etag, etag_len) && header_value[etag_len + strspn(header_value + etag_len, " \t")] == '\0';
+    }
+
+    // Otherwise only the exact Last-Modified date counts
+    time_t validator_date;
+    if (parse_http_date(header_value, &validator_date)){
+        return 0;
+    }
+    return validator_date == file_stat->st_mtime;
+}
@@ -0,0 +1,23 @@
+#ifndef BYTE_RANGES_H
+#define BYTE_RANGES_H
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#define MAX_RANGES 16 // More ranges than this in one request and we just send the whole file
+
+// An inclusive range of bytes in a file
+struct byte_range {
+    off_t first;
+    off_t last;
+};
+
+// Parses a Range header value against the size of the file
+// Returns how many satisfiable ranges were put into ranges, 0 if none of them can be satisfied (416),
+// or -1 if the header should be ignored and the whole file sent
+int parse_range_header(const char *header_value, off_t file_size, struct byte_range *ranges, int max_ranges);
+
+// Whether an If-Range validator still matches the file, so the Range header applies
+int if_range_matches(const char *header_value, const struct stat *file_stat);
+
+#endif
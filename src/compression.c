@@ -0,0 +1,405 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#include "compression.h"
+#include "logging.h"
+
+#define CHUNK_HEADER_ROOM 18 // Hex length and CRLF in front of a chunk's data
+#define CHUNK_TRAILER_ROOM 7 // CRLF after the data, then "0\r\n\r\n" after the last chunk
+
+static int compression_level = 0;
+
+// One compression run, whichever library does it
+struct compressor {
+    enum content_encoding encoding;
+    z_stream zlib;
+#ifdef HAVE_ZSTD
+    ZSTD_CCtx *zstd;
+#endif
+};
+
+struct compressed_stream {
+    struct compressor compressor;
+    int file_fd;
+    const char *source; // Compressed straight from memory instead of the file, if set
+    off_t offset; // Where the next read from the file starts
+    size_t remaining; // How much of the file hasn't been read yet
+    const char *input; // in, or the piece of source being compressed
+    size_t in_len, in_pos; // Read but not yet compressed: input[in_pos..in_len)
+    int finished; // The compressor has put out everything
+    int done; // The last chunk has been produced
+    char in[COMPRESS_CHUNK_SIZE];
+    char out[CHUNK_HEADER_ROOM + COMPRESS_CHUNK_SIZE + CHUNK_TRAILER_ROOM];
+};
+
+// Sets the compression level, 0 turns on-the-fly compression off
+void compression_init(int level)
+{
+    compression_level = level;
+}
+
+// Returns the ENCODING_* bits we can compress to on the fly
+int compression_encodings(void)
+{
+    if (compression_level == 0){
+        return 0;
+    }
+#ifdef HAVE_ZSTD
+    return ENCODING_ZSTD | ENCODING_GZIP;
+#else
+    return ENCODING_GZIP;
+#endif
+}
+
+// Whether a MIME type is worth compressing (text, JSON, SVG and the like)
+int is_compressible_MIME_type(const char *MIME_type)
+{
+    static const char *compressible_types[] = {
+        "application/javascript",
+        "application/json",
+        "application/x-sh",
+        "application/x-csh",
+        "application/x-httpd-php",
+        "application/rtf",
+        "image/svg+xml",
+        "image/bmp",
+        "font/ttf",
+        "font/otf",
+        NULL // Last one must be NULL
+    };
+
+    if (!strncmp(MIME_type, "text/", strlen("text/"))){
+        return 1;
+    }
+
+    // Structured syntax suffixes (application/ld+json, application/xhtml+xml, ...)
+    size_t type_len = strlen(MIME_type);
+    if ((type_len > 5 && !strcmp(MIME_type + type_len - 5, "+json")) ||
+        (type_len > 4 && !strcmp(MIME_type + type_len - 4, "+xml")) ||
+        !strcmp(MIME_type, "application/xml")){
+        return 1;
+    }
+
+    for (int i = 0; compressible_types[i] != NULL; i++){
+        if (!strcmp(MIME_type, compressible_types[i])){
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int compressor_init(struct compressor *compressor, enum content_encoding encoding)
+{
+    memset(compressor, 0, sizeof(struct compressor));
+    compressor->encoding = encoding;
+
+    if (encoding == ENCODING_GZIP){
+        // 16 more window bits asks zlib for a gzip wrapper
+        if (deflateInit2(&compressor->zlib, compression_level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK){
+            log_message(LEVEL_ERROR, "compressor_init - deflateInit2 failed");
+            return -1;
+        }
+        return 0;
+    }
+#ifdef HAVE_ZSTD
+    if (encoding == ENCODING_ZSTD){
+        if ((compressor->zstd = ZSTD_createCCtx()) == NULL){
+            log_message(LEVEL_ERROR, "compressor_init - ZSTD_createCCtx failed");
+            return -1;
+        }
+        ZSTD_CCtx_setParameter(compressor->zstd, ZSTD_c_compressionLevel, compression_level);
+        return 0;
+    }
+#endif
+    log_message(LEVEL_ERROR, "compressor_init - unsupported encoding %d", encoding);
+    return -1;
+}
+
+static void compressor_end(struct compressor *compressor)
+{
+    if (compressor->encoding == ENCODING_GZIP){
+        deflateEnd(&compressor->zlib);
+    }
+#ifdef HAVE_ZSTD
+    if (compressor->encoding == ENCODING_ZSTD){
+        ZSTD_freeCCtx(compressor->zstd);
+    }
+#endif
+}
+
+// Compresses as much of in as fits into out, finish says no more input follows
+// Returns 1 once everything has been put out, 0 if it needs more room or input, -1 on error
+static int compressor_run(struct compressor *compressor, const char *in, size_t in_len, int finish,
+                          char *out, size_t out_size, size_t *consumed, size_t *produced)
+{
+    if (compressor->encoding == ENCODING_GZIP){
+        z_stream *zlib = &compressor->zlib;
+        zlib->next_in = (Bytef *)in;
+        zlib->avail_in = in_len;
+        zlib->next_out = (Bytef *)out;
+        zlib->avail_out = out_size;
+
+        int retval = deflate(zlib, finish ? Z_FINISH : Z_NO_FLUSH);
+        *consumed = in_len - zlib->avail_in;
+        *produced = out_size - zlib->avail_out;
+        if (retval == Z_STREAM_END){
+            return 1;
+        }
+        if (retval == Z_OK || retval == Z_BUF_ERROR){ // Z_BUF_ERROR only means no progress was possible
+            return 0;
+        }
+        log_message(LEVEL_ERROR, "compressor_run - deflate failed: %d", retval);
+        return -1;
+    }
+#ifdef HAVE_ZSTD
+    if (compressor->encoding == ENCODING_ZSTD){
+        ZSTD_inBuffer input = {in, in_len, 0};
+        ZSTD_outBuffer output = {out, out_size, 0};
+
+        size_t left = ZSTD_compressStream2(compressor->zstd, &output, &input, finish ? ZSTD_e_end : ZSTD_e_continue);
+        *consumed = input.pos;
+        *produced = output.pos;
+        if (ZSTD_isError(left)){
+            log_message(LEVEL_ERROR, "compressor_run - zstd: %s", ZSTD_getErrorName(left));
+            return -1;
+        }
+        return (finish && left == 0) ? 1 : 0;
+    }
+#endif
+    return -1;
+}
+
+// Grows a compression output buffer when it's full, returns -1 on error
+static int grow_output(char **out, size_t *out_size, size_t out_len)
+{
+    if (out_len < *out_size){
+        return 0;
+    }
+    char *temp_out = realloc(*out, *out_size * 2);
+    if (temp_out == NULL){
+        log_perror("compress - error reallocating memory");
+        return -1;
+    }
+    *out = temp_out;
+    *out_size *= 2;
+    return 0;
+}
+
+// Compresses a buffer (Remember to free() afterwards), returns NULL on error
+char *compress_buffer(enum content_encoding encoding, const char *data, size_t data_len, size_t *compressed_len)
+{
+    struct compressor compressor;
+    size_t out_size = data_len / 2 + 1024, out_len = 0, data_pos = 0;
+    int retval = 0;
+
+    char *out = malloc(out_size);
+    if (out == NULL){
+        log_perror("compress_buffer - error allocating memory");
+        return NULL;
+    }
+    if (compressor_init(&compressor, encoding) < 0){
+        free(out);
+        return NULL;
+    }
+
+    while (retval == 0){
+        size_t consumed, produced;
+        if (grow_output(&out, &out_size, out_len) < 0){
+            retval = -1;
+            break;
+        }
+        retval = compressor_run(&compressor, data + data_pos, data_len - data_pos, 1,
+                                out + out_len, out_size - out_len, &consumed, &produced);
+        data_pos += consumed;
+        out_len += produced;
+    }
+    compressor_end(&compressor);
+
+    if (retval < 0){
+        free(out);
+        return NULL;
+    }
+    *compressed_len = out_len;
+    return out;
+}
+
+// Compresses file_size bytes of an open file (Remember to free() afterwards), returns NULL on error
+char *compress_file(enum content_encoding encoding, int file_fd, size_t file_size, size_t *compressed_len)
+{
+    struct compressed_stream *stream = compressed_stream_new(encoding, file_fd, file_size);
+    if (stream == NULL){
+        return NULL;
+    }
+
+    // Same as streaming it, just collected in one buffer without the chunk framing
+    size_t out_size = file_size / 2 + 1024, out_len = 0;
+    char *out = malloc(out_size);
+    if (out == NULL){
+        log_perror("compress_file - error allocating memory");
+        compressed_stream_free(stream);
+        return NULL;
+    }
+
+    int retval = 0;
+    while (retval == 0){
+        size_t consumed, produced;
+        if (stream->in_pos == stream->in_len && stream->remaining > 0){
+            ssize_t nbytes = pread(file_fd, stream->in, stream->remaining < COMPRESS_CHUNK_SIZE ?
+                                   stream->remaining : COMPRESS_CHUNK_SIZE, stream->offset);
+            if (nbytes < 0 && errno == EINTR){
+                continue;
+            }
+            if (nbytes <= 0){ // The file got shorter (or broke), the length we promised can't be kept
+                log_perror("compress_file - pread");
+                retval = -1;
+                break;
+            }
+            stream->in_len = nbytes;
+            stream->in_pos = 0;
+            stream->offset += nbytes;
+            stream->remaining -= nbytes;
+        }
+        if (grow_output(&out, &out_size, out_len) < 0){
+            retval = -1;
+            break;
+        }
+
+        retval = compressor_run(&stream->compressor, stream->input + stream->in_pos, stream->in_len - stream->in_pos,
+                                stream->remaining == 0, out + out_len, out_size - out_len, &consumed, &produced);
+        stream->in_pos += consumed;
+        out_len += produced;
+    }
+    compressed_stream_free(stream);
+
+    if (retval < 0){
+        free(out);
+        return NULL;
+    }
+    *compressed_len = out_len;
+    return out;
+}
+
+// Starts compressing file_size bytes of an open file, the descriptor has to stay open until the stream is freed
+struct compressed_stream *compressed_stream_new(enum content_encoding encoding, int file_fd, size_t file_size)
+{
+    struct compressed_stream *stream = malloc(sizeof(struct compressed_stream));
+    if (stream == NULL){
+        log_perror("compressed_stream_new - error allocating memory");
+        return NULL;
+    }
+    if (compressor_init(&stream->compressor, encoding) < 0){
+        free(stream);
+        return NULL;
+    }
+
+    stream->file_fd = file_fd;
+    stream->source = NULL;
+    stream->input = stream->in;
+    stream->offset = 0;
+    stream->remaining = file_size;
+    stream->in_len = 0;
+    stream->in_pos = 0;
+    stream->finished = 0;
+    stream->done = 0;
+    return stream;
+}
+
+// Starts compressing data_len bytes of memory, the data has to stay valid until the stream is freed
+struct compressed_stream *compressed_stream_new_buffer(enum content_encoding encoding, const char *data, size_t data_len)
+{
+    struct compressed_stream *stream = compressed_stream_new(encoding, -1, data_len);
+    if (stream != NULL){
+        stream->source = data;
+    }
+    return stream;
+}
+
+// Produces the next chunk of the body, *data stays valid until the next call
+// *data_len is 0 once the last chunk has been produced, returns -1 on error
+int compressed_stream_next(struct compressed_stream *stream, const char **data, size_t *data_len)
+{
+    char *payload = stream->out + CHUNK_HEADER_ROOM;
+    size_t payload_len = 0;
+
+    if (stream->done){
+        *data_len = 0;
+        return 0;
+    }
+
+    // Fill the chunk until it's full or the compressor is done
+    while (!stream->finished && payload_len < COMPRESS_CHUNK_SIZE){
+        if (stream->in_pos == stream->in_len && stream->remaining > 0 && stream->source != NULL){
+            stream->input = stream->source + stream->offset;
+            stream->in_len = stream->remaining < COMPRESS_CHUNK_SIZE ? stream->remaining : COMPRESS_CHUNK_SIZE;
+            stream->in_pos = 0;
+            stream->offset += stream->in_len;
+            stream->remaining -= stream->in_len;
+        }
+        if (stream->in_pos == stream->in_len && stream->remaining > 0){
+            ssize_t nbytes = pread(stream->file_fd, stream->in, stream->remaining < COMPRESS_CHUNK_SIZE ?
+                                   stream->remaining : COMPRESS_CHUNK_SIZE, stream->offset);
+            if (nbytes < 0 && errno == EINTR){
+                continue;
+            }
+            if (nbytes < 0){
+                log_perror("compressed_stream_next - pread");
+                return -1;
+            }
+            if (nbytes == 0){ // The file got shorter, finish with what there was
+                stream->remaining = 0;
+                continue;
+            }
+            stream->in_len = nbytes;
+            stream->in_pos = 0;
+            stream->offset += nbytes;
+            stream->remaining -= nbytes;
+        }
+
+        size_t consumed, produced;
+        int retval = compressor_run(&stream->compressor, stream->input + stream->in_pos, stream->in_len - stream->in_pos,
+                                    stream->remaining == 0, payload + payload_len, COMPRESS_CHUNK_SIZE - payload_len,
+                                    &consumed, &produced);
+        if (retval < 0){
+            return -1;
+        }
+        stream->in_pos += consumed;
+        payload_len += produced;
+        stream->finished = retval;
+    }
+
+    // Frame it as a chunk, the header goes right in front of the payload
+    char *chunk = payload;
+    size_t chunk_len = 0;
+    if (payload_len > 0){
+        char chunk_header[CHUNK_HEADER_ROOM + 1];
+        int header_len = snprintf(chunk_header, sizeof(chunk_header), "%zx\r\n", payload_len);
+        chunk = payload - header_len;
+        memcpy(chunk, chunk_header, header_len);
+        memcpy(payload + payload_len, "\r\n", 2);
+        chunk_len = header_len + payload_len + 2;
+    }
+    if (stream->finished){
+        memcpy(chunk + chunk_len, "0\r\n\r\n", 5);
+        chunk_len += 5;
+        stream->done = 1;
+    }
+
+    *data = chunk;
+    *data_len = chunk_len;
+    return 0;
+}
+
+void compressed_stream_free(struct compressed_stream *stream)
+{
+    if (stream == NULL){
+        return;
+    }
+    compressor_end(&stream->compressor);
+    free(stream);
+}
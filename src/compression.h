@@ -0,0 +1,42 @@
+#ifndef COMPRESSION_H
+#define COMPRESSION_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include "content_encoding.h"
+
+#define COMPRESS_MIN_SIZE 256 // Smaller bodies aren't worth compressing
+#define COMPRESS_BUFFER_MAX (1024 * 1024) // Larger files are compressed as they're sent instead of up front
+#define COMPRESS_CHUNK_SIZE 65536 // How much of a file a compressed stream reads at a time
+
+// Compresses a file as it's sent, framed as chunked transfer coding
+struct compressed_stream;
+
+// Sets the compression level, 0 turns on-the-fly compression off
+void compression_init(int level);
+
+// Returns the ENCODING_* bits we can compress to on the fly
+int compression_encodings(void);
+
+// Whether a MIME type is worth compressing (text, JSON, SVG and the like)
+int is_compressible_MIME_type(const char *MIME_type);
+
+// Compresses a buffer (Remember to free() afterwards), returns NULL on error
+char *compress_buffer(enum content_encoding encoding, const char *data, size_t data_len, size_t *compressed_len);
+
+// Compresses file_size bytes of an open file (Remember to free() afterwards), returns NULL on error
+char *compress_file(enum content_encoding encoding, int file_fd, size_t file_size, size_t *compressed_len);
+
+// Starts compressing file_size bytes of an open file, the descriptor has to stay open until the stream is freed
+struct compressed_stream *compressed_stream_new(enum content_encoding encoding, int file_fd, size_t file_size);
+
+// Starts compressing data_len bytes of memory, the data has to stay valid until the stream is freed
+struct compressed_stream *compressed_stream_new_buffer(enum content_encoding encoding, const char *data, size_t data_len);
+
+// Produces the next chunk of the body, *data stays valid until the next call
+// *data_len is 0 once the last chunk has been produced, returns -1 on error
+int compressed_stream_next(struct compressed_stream *stream, const char **data, size_t *data_len);
+
+void compressed_stream_free(struct compressed_stream *stream);
+
+#endif
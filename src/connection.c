@@ -0,0 +1,453 @@
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+#include "connection.h"
+#include "compression.h"
+#include "directory_listing.h"
+#include "file_cache.h"
+#include "logging.h"
+#include "metadata_cache.h"
+#include "server_stats.h"
+#include "options.h"
+#include "socket_operations.h"
+
+// Allocates a connection for an accepted socket (or returns NULL)
+struct connection *connection_new(int fd)
+{
+    struct connection *conn = malloc(sizeof(struct connection));
+    if (conn == NULL){
+        log_perror("connection_new - error allocating memory");
+        return NULL;
+    }
+
+    conn->fd = fd;
+    conn->state = CONN_READING_REQUEST;
+    conn->peer_addr.ss_family = 0;
+    conn->recv_len = 0;
+    conn->recv_buf[0] = '\0';
+    conn->request_len = 0;
+    http_parser_init(&conn->parser);
+    conn->peer_closed = 0;
+    conn->keep_alive = 0;
+    conn->requests_served = 0;
+    conn->accept_encodings = 0;
+    conn->is_http11 = 0;
+    conn->range = NULL;
+    conn->if_range = NULL;
+    conn->if_none_match = NULL;
+    conn->if_modified_since = NULL;
+    conn->query = NULL;
+    conn->parse_ns = 0;
+    conn->request_start = 0;
+    conn->send_start = 0;
+
+    conn->header_data = NULL;
+    conn->header_owned = NULL;
+    conn->body_data = NULL;
+    conn->body_owned = NULL;
+    conn->cache_entry = NULL;
+    conn->body_stream = NULL;
+    conn->listing = NULL;
+    conn->parts = NULL;
+    conn->body_fd = -1;
+    conn->metadata = NULL;
+    conn->splice_pipe[0] = -1;
+    conn->splice_pipe[1] = -1;
+    connection_reset_response(conn);
+
+    conn->uring_chunk = NULL;
+    conn->chunk_len = 0;
+    conn->chunk_sent = 0;
+    conn->uring_inflight = 0;
+
+    timer_init(&conn->timer);
+    conn->deadline_kind = DEADLINE_NONE;
+    conn->deadline = 0;
+    conn->deadline_requests = 0;
+    conn->deadline_bytes = 0;
+
+    stats_connection_opened();
+    return conn;
+}
+
+// Frees everything the connection holds, including its socket
+void connection_free(struct connection *conn)
+{
+    connection_reset_response(conn);
+    timer_cancel(&conn->timer);
+    if (conn->splice_pipe[0] >= 0){
+        close(conn->splice_pipe[0]);
+        close(conn->splice_pipe[1]);
+    }
+    free(conn->uring_chunk);
+    close(conn->fd);
+    free(conn);
+    stats_connection_closed();
+}
+
+// Releases the current response's buffers and file
+void connection_reset_response(struct connection *conn)
+{
+    conn->status_code = 200;
+    conn->response_bytes = 0;
+
+    free(conn->header_owned);
+    conn->header_data = NULL;
+    conn->header_owned = NULL;
+    conn->header_len = 0;
+    conn->header_sent = 0;
+
+    free(conn->body_owned);
+    conn->body_data = NULL;
+    conn->body_owned = NULL;
+    conn->body_len = 0;
+    conn->body_sent = 0;
+    if (conn->cache_entry != NULL){
+        file_cache_release(conn->cache_entry);
+    }
+    conn->cache_entry = NULL;
+    compressed_stream_free(conn->body_stream);
+    conn->body_stream = NULL;
+    if (conn->listing != NULL){ // Only after the stream that may be reading it
+        directory_listing_release(conn->listing);
+    }
+    conn->listing = NULL;
+    free(conn->parts);
+    conn->parts = NULL;
+    conn->part_count = 0;
+    conn->next_part = 0;
+
+    if (conn->metadata != NULL){
+        metadata_cache_release(conn->metadata);
+    } else if (conn->body_fd >= 0){
+        close(conn->body_fd);
+    }
+    conn->metadata = NULL;
+    conn->body_fd = -1;
+    conn->body_offset = 0;
+    conn->body_remaining = 0;
+    conn->use_splice = 0;
+    conn->pipe_pending = 0;
+    conn->chunk_len = 0;
+    conn->chunk_sent = 0;
+}
+
+// Sets the response header block (owned is free()d later if not NULL)
+void connection_set_headers(struct connection *conn, const char *headers, size_t len, char *owned)
+{
+    // Every header block starts with "HTTP/1.1 NNN"
+    conn->status_code = (headers[9] - '0') * 100 + (headers[10] - '0') * 10 + (headers[11] - '0');
+    conn->header_data = headers;
+    conn->header_owned = owned;
+    conn->header_len = len;
+    conn->header_sent = 0;
+    conn->state = CONN_SENDING_HEADERS;
+}
+
+// Sets an in-memory response body (owned is free()d later if not NULL)
+void connection_set_body_buffer(struct connection *conn, const char *body, size_t len, char *owned)
+{
+    conn->body_data = body;
+    conn->body_owned = owned;
+    conn->body_len = len;
+    conn->body_sent = 0;
+    conn->state = CONN_SENDING_HEADERS;
+}
+
+// Sets length bytes of a file from offset on as the response body, the file is closed when the response is done
+void connection_set_body_file(struct connection *conn, int file_fd, off_t offset, size_t length)
+{
+    conn->body_fd = file_fd;
+    conn->body_offset = offset;
+    conn->body_remaining = length;
+    conn->use_splice = 0;
+    conn->pipe_pending = 0;
+    conn->state = CONN_SENDING_HEADERS;
+}
+
+// Like connection_set_body_file(), but the file stays open in the metadata cache, taking over the entry's reference
+void connection_set_body_cached_file(struct connection *conn, struct metadata_entry *entry, off_t offset, size_t length)
+{
+    connection_set_body_file(conn, entry->fd, offset, length);
+    conn->metadata = entry;
+}
+
+// Sets a compressed stream as the response body, reading from the metadata entry's file, taking over its reference
+// The first chunk is produced right away so it can go out with the headers, returns -1 on error
+int connection_set_body_stream(struct connection *conn, struct compressed_stream *stream, struct metadata_entry *entry)
+{
+    conn->body_stream = stream;
+    conn->metadata = entry; // Keeps the file open while the stream reads it
+    conn->body_data = NULL;
+    conn->body_len = 0;
+    conn->body_sent = 0;
+    conn->state = CONN_SENDING_HEADERS;
+    return connection_refill_body(conn);
+}
+
+// Sets a directory listing as the response body, taking over the listing's reference
+// With a stream (reading from the listing), the body is the stream's chunks instead, returns -1 on error
+int connection_set_body_listing(struct connection *conn, struct directory_listing *listing,
+                                struct compressed_stream *stream)
+{
+    conn->listing = listing;
+    if (stream == NULL){
+        connection_set_body_buffer(conn, listing->body, listing->body_len, NULL);
+        return 0;
+    }
+
+    conn->body_stream = stream;
+    conn->body_data = NULL;
+    conn->body_len = 0;
+    conn->body_sent = 0;
+    conn->state = CONN_SENDING_HEADERS;
+    return connection_refill_body(conn);
+}
+
+// Sends the file of a metadata entry in pieces, each with its own preamble (see struct body_part)
+// Takes over the entry's reference and the parts allocation
+void connection_set_body_parts(struct connection *conn, struct metadata_entry *entry, struct body_part *parts, int part_count)
+{
+    connection_set_body_cached_file(conn, entry, 0, 0);
+    conn->parts = parts;
+    conn->part_count = part_count;
+    conn->next_part = 0;
+    connection_refill_body(conn); // Loads the first part
+}
+
+// Moves on once the current piece of the body is sent: the compressed stream's next chunk
+// or the next part of a multipart body, if there is one. Returns -1 on error
+int connection_refill_body(struct connection *conn)
+{
+    if (conn->body_sent < conn->body_len){
+        return 0;
+    }
+
+    if (conn->parts != NULL){
+        if (conn->next_part == conn->part_count || conn->body_remaining > 0 || conn->pipe_pending > 0 ||
+            conn->chunk_sent < conn->chunk_len){
+            return 0;
+        }
+        struct body_part *part = &conn->parts[conn->next_part++];
+        conn->body_data = part->preamble;
+        conn->body_len = part->preamble_len;
+        conn->body_sent = 0;
+        conn->body_offset = part->file_offset;
+        conn->body_remaining = part->file_len;
+        return 0;
+    }
+
+    if (conn->body_stream == NULL){
+        return 0;
+    }
+
+    const char *chunk;
+    size_t chunk_len;
+    if (compressed_stream_next(conn->body_stream, &chunk, &chunk_len) < 0){
+        return -1;
+    }
+    conn->body_data = chunk;
+    conn->body_len = chunk_len;
+    conn->body_sent = 0;
+    return 0;
+}
+
+// Sends the rest of a file body without copying it through userspace
+// Returns 0 when the file is done, 1 if the socket would block, -1 on error
+static int flush_file_body(struct connection *conn)
+{
+    size_t unsent = conn->body_remaining + conn->pipe_pending;
+    int retval = -2;
+
+    if (!conn->use_splice){
+        retval = sendfile_nonblocking(conn->fd, conn->body_fd, &conn->body_offset, &conn->body_remaining);
+        if (retval == -2){
+            conn->use_splice = 1; // Stick with splice() for the rest of this file
+        }
+    }
+    if (retval == -2){
+        retval = splice_nonblocking(conn->fd, conn->body_fd, conn->splice_pipe, &conn->pipe_pending,
+                                    &conn->body_offset, &conn->body_remaining);
+    }
+
+    conn->response_bytes += unsent - (conn->body_remaining + conn->pipe_pending);
+    return retval;
+}
+
+// Whether file data follows what's in memory, so the kernel should hold a partial packet back for it
+static int file_body_follows(const struct connection *conn)
+{
+    return conn->body_fd >= 0 && (conn->body_remaining > 0 || conn->pipe_pending > 0);
+}
+
+// Adds the answered request to the access log, from the request line the parser left in the buffer
+static void log_request(const struct connection *conn, uint64_t now)
+{
+    const struct http_parser *request = &conn->parser;
+    struct access_entry entry = {
+        .peer = &conn->peer_addr,
+        .method = NULL,
+        .status_code = conn->status_code,
+        .bytes_sent = conn->response_bytes,
+        .duration_ns = now - conn->request_start,
+    };
+
+    if (request->state != PARSER_REQUEST_LINE){ // Otherwise it didn't get as far as a whole request line
+        entry.method = request->method.data;
+        entry.method_len = request->method.len;
+        entry.uri = request->uri.data;
+        entry.uri_len = request->uri.len;
+        entry.version = request->is_http09 ? NULL : request->version.data;
+        entry.version_len = request->version.len;
+    }
+    log_access(&entry);
+}
+
+// Drops the answered request from the buffer and either waits for the next one or closes
+void connection_response_done(struct connection *conn)
+{
+    uint64_t now = stats_now_ns();
+    stats_count_response(conn->status_code, conn->response_bytes);
+    stats_record_phase(PHASE_SEND, now - conn->send_start);
+    if (log_access_enabled()){
+        log_request(conn, now);
+    }
+    connection_reset_response(conn);
+    conn->requests_served++;
+
+    if (!conn->keep_alive){
+        conn->state = CONN_CLOSING;
+        return;
+    }
+
+    // Pipelined requests move to the front of the buffer
+    memmove(conn->recv_buf, conn->recv_buf + conn->request_len, conn->recv_len - conn->request_len);
+    conn->recv_len -= conn->request_len;
+    conn->recv_buf[conn->recv_len] = '\0';
+    conn->request_len = 0;
+    http_parser_init(&conn->parser);
+    conn->state = CONN_READING_REQUEST;
+}
+
+// Sends as much of the response as the socket takes, finishing it with connection_response_done()
+int connection_flush(struct connection *conn)
+{
+    int retval;
+
+    // Headers and an in-memory body go out together in one sendmsg(), usually as one packet
+    if (conn->state == CONN_SENDING_HEADERS && conn->body_sent < conn->body_len){
+        size_t header_left = conn->header_len - conn->header_sent;
+        struct iovec iov[2] = {
+            { (char *)conn->header_data + conn->header_sent, header_left },
+            { (char *)conn->body_data + conn->body_sent, conn->body_len - conn->body_sent },
+        };
+        size_t sent;
+        retval = sendv_nonblocking(conn->fd, iov, 2, file_body_follows(conn), &sent);
+
+        conn->response_bytes += sent;
+        size_t header_part = sent < header_left ? sent : header_left;
+        conn->header_sent += header_part;
+        conn->body_sent += sent - header_part;
+        if (retval != 0){
+            return retval;
+        }
+    }
+
+    // Headers in front of a file are held back to fill the first packet along with sendfile()'s data
+    if (conn->state == CONN_SENDING_HEADERS){
+        size_t to_send = conn->header_len - conn->header_sent;
+        retval = send_nonblocking(conn->fd, conn->header_data + conn->header_sent, &to_send, file_body_follows(conn));
+        conn->header_sent += to_send;
+        conn->response_bytes += to_send;
+        if (retval != 0){
+            return retval;
+        }
+        conn->state = CONN_SENDING_BODY;
+    }
+
+    if (conn->state == CONN_SENDING_BODY){
+        // A compressed stream or multipart body comes in pieces, each memory and/or file
+        for (;;){
+            if (connection_refill_body(conn) < 0){
+                return -1;
+            }
+            if (conn->body_sent == conn->body_len && (conn->body_fd < 0 || conn->body_remaining == 0) &&
+                conn->pipe_pending == 0){
+                break;
+            }
+
+            if (conn->body_sent < conn->body_len){
+                size_t to_send = conn->body_len - conn->body_sent;
+                retval = send_nonblocking(conn->fd, conn->body_data + conn->body_sent, &to_send,
+                                          file_body_follows(conn));
+                conn->body_sent += to_send;
+                conn->response_bytes += to_send;
+                if (retval != 0){
+                    return retval;
+                }
+            }
+
+            if (conn->body_fd >= 0 && (retval = flush_file_body(conn)) != 0){
+                return retval;
+            }
+        }
+
+        connection_response_done(conn);
+    }
+
+    return 0;
+}
+
+// Sets the deadline for the connection's state and arms its timer if it has to go off sooner
+// Only a change of state, a new request or a response making progress moves a deadline,
+// so bytes trickling in don't keep a connection alive. This mostly only stores the new deadline
+void connection_update_deadline(struct connection *conn, struct timer_wheel *wheel)
+{
+    if (conn->state == CONN_CLOSING){
+        return; // Whatever is left of it is on its way out
+    }
+    enum deadline_kind kind = DEADLINE_SEND;
+    if (conn->state == CONN_READING_REQUEST){
+        kind = conn->recv_len == 0 && conn->requests_served > 0 ? DEADLINE_IDLE : DEADLINE_HEADERS;
+    }
+    if (kind == conn->deadline_kind && conn->requests_served == conn->deadline_requests &&
+        (kind != DEADLINE_SEND || conn->response_bytes == conn->deadline_bytes)){
+        return;
+    }
+
+    int timeout = OPTIONS.send_timeout;
+    if (kind == DEADLINE_HEADERS){
+        timeout = OPTIONS.header_timeout;
+    } else if (kind == DEADLINE_IDLE){
+        timeout = OPTIONS.keepalive_timeout;
+    }
+    conn->deadline_kind = kind;
+    conn->deadline_requests = conn->requests_served;
+    conn->deadline_bytes = conn->response_bytes;
+    conn->deadline = wheel->now + timeout + 1; // The wheel's tick may be up to a second old, and partly gone
+
+    // A timer that goes off too early just gets pushed back then
+    if (!timer_armed(&conn->timer) || conn->timer.expires > conn->deadline){
+        timer_wheel_arm(wheel, &conn->timer, conn->deadline);
+    }
+}
+
+// Returns 1 if the deadline of the connection whose timer went off has passed, otherwise re-arms the timer for it
+int connection_deadline_passed(struct connection *conn, struct timer_wheel *wheel)
+{
+    if (conn->deadline > wheel->now){
+        timer_wheel_arm(wheel, &conn->timer, conn->deadline);
+        return 0;
+    }
+    return 1;
+}
+
+// The connection a timer belongs to
+struct connection *connection_from_timer(struct timer *timer)
+{
+    return (struct connection *)((char *)timer - offsetof(struct connection, timer));
+}
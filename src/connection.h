@@ -0,0 +1,181 @@
+#ifndef CONNECTION_H
+#define CONNECTION_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+#include "compression.h"
+#include "directory_listing.h"
+#include "file_cache.h"
+#include "http_parser.h"
+#include "metadata_cache.h"
+#include "response_headers.h"
+#include "timer_wheel.h"
+
+#define RECV_BUF_SIZE 8192 // Maximum size of a request we'll accept
+
+// The states a client connection moves through
+enum connection_state {
+    CONN_READING_REQUEST,
+    CONN_SENDING_HEADERS,
+    CONN_SENDING_BODY,
+    CONN_CLOSING
+};
+
+// Which deadline a connection is up against
+enum deadline_kind {
+    DEADLINE_NONE,
+    DEADLINE_HEADERS, // The whole request has to arrive within the header timeout of its first byte
+    DEADLINE_IDLE, // A persistent connection may wait for its next request for the keep-alive timeout
+    DEADLINE_SEND // The client has to take some of the response within every send timeout
+};
+
+// One part of a multipart body: headers in memory, then a range of the body's file
+struct body_part {
+    const char *preamble;
+    size_t preamble_len;
+    off_t file_offset;
+    size_t file_len;
+};
+
+// A single client connection handled by the event loop
+struct connection {
+    int fd;
+    enum connection_state state;
+    struct sockaddr_storage peer_addr; // The client's address, family 0 if it isn't known
+
+    // The request as it arrives, pipelined requests wait behind it in the same buffer
+    char recv_buf[RECV_BUF_SIZE];
+    size_t recv_len;
+    size_t request_len; // How much of recv_buf the request being answered takes up
+    struct http_parser parser; // Where parsing the request at the front of recv_buf has got to
+    int peer_closed; // The client won't send anything more
+
+    // Persistent connection bookkeeping
+    int keep_alive; // Whether the connection stays open after this response
+    int requests_served;
+
+    // What the request being answered asked for
+    int accept_encodings; // ENCODING_* bits from Accept-Encoding
+    int is_http11; // Whether chunked bodies can be sent
+    const char *range; // The Range and conditional header values, only valid while the request is parsed
+    const char *if_range;
+    const char *if_none_match;
+    const char *if_modified_since;
+    const char *query; // What followed the '?' in the URI (or NULL), only valid while the request is parsed
+    uint64_t parse_ns; // Spent running the parser over the request so far, it may take many reads to arrive
+    uint64_t request_start; // When the request was complete (stats_now_ns())
+
+    // How the response is going, counted once it's done
+    int status_code; // From the status line, 200 for HTTP/0.9
+    uint64_t response_bytes; // Written to the socket so far
+    uint64_t send_start; // When the response was queued (stats_now_ns())
+
+    // The header block of the response (or NULL for HTTP/0.9), usually assembled in header_buf
+    char header_buf[HEADER_BUF_SIZE];
+    const char *header_data;
+    char *header_owned; // free()d when the response is done, if set
+    size_t header_len;
+    size_t header_sent;
+
+    // An in-memory body (directory listings, cached files)
+    const char *body_data;
+    char *body_owned;
+    size_t body_len;
+    size_t body_sent;
+    struct file_cache_entry *cache_entry; // Released when the response is done, if set
+    struct compressed_stream *body_stream; // Refills the in-memory body once it's sent, if set
+    struct directory_listing *listing; // Released when the response is done, if set
+
+    // A file body, sent with sendfile() from body_offset on
+    int body_fd;
+    struct metadata_entry *metadata; // Owns body_fd instead of the connection, if set
+    off_t body_offset;
+    size_t body_remaining;
+
+    // Further pieces of a multipart body, loaded one after the other once the file range before is sent
+    struct body_part *parts; // free()d with the response, preambles may live in the same allocation
+    int part_count;
+    int next_part;
+
+    // Only used for files sendfile() refuses, data sitting in the pipe survives a blocked socket
+    int use_splice;
+    int splice_pipe[2];
+    size_t pipe_pending;
+
+    // Only used by the io_uring engine, file bodies go through uring_chunk with linked read/send
+    char *uring_chunk;
+    size_t chunk_len;
+    size_t chunk_sent;
+    int uring_inflight; // Submitted operations that haven't completed yet
+
+    // The deadline the connection is up against, see connection_update_deadline()
+    struct timer timer; // Armed for the deadline or earlier, it's checked again when it goes off
+    enum deadline_kind deadline_kind;
+    uint64_t deadline; // The wheel tick it falls on
+    int deadline_requests; // requests_served when it was set, a new request starts a new deadline
+    uint64_t deadline_bytes; // response_bytes when it was set, sending more starts a new one
+};
+
+// Allocates a connection for an accepted socket (or returns NULL)
+struct connection *connection_new(int fd);
+
+// Frees everything the connection holds, including its socket
+void connection_free(struct connection *conn);
+
+// Releases the current response's buffers and file
+void connection_reset_response(struct connection *conn);
+
+// Sets the response header block (owned is free()d later if not NULL)
+void connection_set_headers(struct connection *conn, const char *headers, size_t len, char *owned);
+
+// Sets an in-memory response body (owned is free()d later if not NULL)
+void connection_set_body_buffer(struct connection *conn, const char *body, size_t len, char *owned);
+
+// Sets length bytes of a file from offset on as the response body, the file is closed when the response is done
+void connection_set_body_file(struct connection *conn, int file_fd, off_t offset, size_t length);
+
+// Like connection_set_body_file(), but the file stays open in the metadata cache, taking over the entry's reference
+void connection_set_body_cached_file(struct connection *conn, struct metadata_entry *entry, off_t offset, size_t length);
+
+// Sets a compressed stream as the response body, reading from the metadata entry's file, taking over its reference
+// The first chunk is produced right away so it can go out with the headers, returns -1 on error
+int connection_set_body_stream(struct connection *conn, struct compressed_stream *stream, struct metadata_entry *entry);
+
+// Sets a directory listing as the response body, taking over the listing's reference
+// With a stream (reading from the listing), the body is the stream's chunks instead, returns -1 on error
+int connection_set_body_listing(struct connection *conn, struct directory_listing *listing,
+                                struct compressed_stream *stream);
+
+// Sends the file of a metadata entry in pieces, each with its own preamble (see struct body_part)
+// Takes over the entry's reference and the parts allocation
+void connection_set_body_parts(struct connection *conn, struct metadata_entry *entry, struct body_part *parts, int part_count);
+
+// Moves on once the current piece of the body is sent: the compressed stream's next chunk
+// or the next part of a multipart body, if there is one. Returns -1 on error
+int connection_refill_body(struct connection *conn);
+
+// Drops the answered request from the buffer and either waits for the next one or closes
+void connection_response_done(struct connection *conn);
+
+// Sets the deadline for the connection's state and arms its timer if it has to go off sooner
+// Only a change of state, a new request or a response making progress moves a deadline,
+// so bytes trickling in don't keep a connection alive. This mostly only stores the new deadline
+void connection_update_deadline(struct connection *conn, struct timer_wheel *wheel);
+
+// Returns 1 if the deadline of the connection whose timer went off has passed, otherwise re-arms the timer for it
+int connection_deadline_passed(struct connection *conn, struct timer_wheel *wheel);
+
+// The connection a timer belongs to
+struct connection *connection_from_timer(struct timer *timer);
+
+// Sends as much of the response as the socket takes, finishing it with connection_response_done()
+// Returns 0 when the response is done, 1 if the socket would block, -1 on error
+int connection_flush(struct connection *conn);
+
+#endif
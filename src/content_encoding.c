@@ -0,0 +1,83 @@
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "content_encoding.h"
+
+const struct encoding_info ENCODINGS[] = {
+    {ENCODING_BR, "br", ".br"},
+    {ENCODING_ZSTD, "zstd", ".zst"},
+    {ENCODING_GZIP, "gzip", ".gz"},
+    {0, NULL, NULL} // Last token must be NULL
+};
+
+// Whether the parameters after a coding (like ";q=0.5") rule it out
+static int has_zero_quality(const char *params, size_t params_len)
+{
+    const char *q = params;
+    while ((q = memchr(q, ';', params + params_len - q)) != NULL){
+        q++;
+        q += strspn(q, " \t");
+        if ((*q == 'q' || *q == 'Q') && q[1] == '='){
+            return strtod(q + 2, NULL) <= 0.0;
+        }
+    }
+    return 0;
+}
+
+// Returns the ENCODING_* bits an Accept-Encoding header value allows (NULL allows none)
+int parse_accept_encoding(const char *header_value)
+{
+    int accepted = 0, refused = 0, wildcard = 0;
+
+    if (header_value == NULL){
+        return 0;
+    }
+
+    while (*header_value){
+        header_value += strspn(header_value, " \t,");
+        size_t item_len = strcspn(header_value, ",");
+        size_t token_len = strcspn(header_value, " \t;,");
+        int zero_quality = has_zero_quality(header_value + token_len, item_len - token_len);
+
+        if (token_len == 1 && *header_value == '*'){
+            wildcard = !zero_quality;
+        }
+        for (int i = 0; ENCODINGS[i].token != NULL; i++){
+            size_t known_len = strlen(ENCODINGS[i].token);
+            int matches = token_len == known_len && !strncasecmp(header_value, ENCODINGS[i].token, known_len);
+            if (ENCODINGS[i].encoding == ENCODING_GZIP && token_len == 6 && !strncasecmp(header_value, "x-gzip", 6)){
+                matches = 1;
+            }
+            if (matches){
+                if (zero_quality){
+                    refused |= ENCODINGS[i].encoding;
+                } else {
+                    accepted |= ENCODINGS[i].encoding;
+                }
+            }
+        }
+        header_value += item_len;
+    }
+
+    // "*" covers every coding that isn't named on its own
+    if (wildcard){
+        for (int i = 0; ENCODINGS[i].token != NULL; i++){
+            accepted |= ENCODINGS[i].encoding;
+        }
+    }
+    return accepted & ~refused;
+}
+
+// Returns the coding whose sibling suffix ends path (or NULL)
+const struct encoding_info *encoding_from_suffix(const char *path)
+{
+    size_t path_len = strlen(path);
+
+    for (int i = 0; ENCODINGS[i].token != NULL; i++){
+        size_t suffix_len = strlen(ENCODINGS[i].suffix);
+        if (path_len > suffix_len && !strcmp(path + path_len - suffix_len, ENCODINGS[i].suffix)){
+            return &ENCODINGS[i];
+        }
+    }
+    return NULL;
+}
@@ -0,0 +1,29 @@
+#ifndef CONTENT_ENCODING_H
+#define CONTENT_ENCODING_H
+
+#include <stddef.h>
+
+// Content codings we know about, as bits so a client's Accept-Encoding fits in an int
+enum content_encoding {
+    ENCODING_BR = 1,
+    ENCODING_ZSTD = 2,
+    ENCODING_GZIP = 4
+};
+
+// A content coding with the names it goes by
+struct encoding_info {
+    enum content_encoding encoding;
+    const char *token; // As used in Accept-Encoding and Content-Encoding
+    const char *suffix; // Of a precompressed sibling file
+};
+
+// Known codings, best compression first, terminated by an entry with a NULL token
+extern const struct encoding_info ENCODINGS[];
+
+// Returns the ENCODING_* bits an Accept-Encoding header value allows (NULL allows none)
+int parse_accept_encoding(const char *header_value);
+
+// Returns the coding whose sibling suffix ends path (or NULL)
+const struct encoding_info *encoding_from_suffix(const char *path);
+
+#endif
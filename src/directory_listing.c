@@ -0,0 +1,559 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "directory_listing.h"
+#include "directory_resolution.h"
+#include "logging.h"
+
+#define BUCKET_COUNT 1024 // Hash buckets (power of 2)
+#define DIRENT_BATCH_SIZE 65536 // How much getdents64() reads at a time
+
+#define LISTING_ENTRY_MARKUP "<li><a href=\"\"></a></li>\n"
+#define LISTING_END "</ul></body></html>"
+
+// What getdents64() fills its buffer with
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct directory_listing *buckets[BUCKET_COUNT];
+static struct directory_listing *lru_head = NULL;
+static struct directory_listing *lru_tail = NULL;
+static size_t cache_max_bytes = 0;
+static size_t bytes_used = 0;
+
+// FNV-1a over the path
+static size_t hash_path(const char *path)
+{
+    size_t hash = 14695981039346656037ULL;
+    while (*path){
+        hash ^= (unsigned char)*path++;
+        hash *= 1099511628211ULL;
+    }
+    return hash & (BUCKET_COUNT - 1);
+}
+
+static void free_listing(struct directory_listing *listing)
+{
+    free(listing->path);
+    free(listing->names);
+    free(listing->entries);
+    free(listing->body);
+    free(listing);
+}
+
+// Drops a reference, the caller holds cache_lock
+static void release_locked(struct directory_listing *listing)
+{
+    if (--listing->refcount == 0){
+        free_listing(listing);
+    }
+}
+
+// Takes a listing out of the hash and the LRU list, the caller holds cache_lock
+static void unlink_listing(struct directory_listing *listing)
+{
+    struct directory_listing **link = &buckets[hash_path(listing->path)];
+    while (*link != listing){
+        link = &(*link)->hash_next;
+    }
+    *link = listing->hash_next;
+
+    if (listing->lru_prev != NULL){
+        listing->lru_prev->lru_next = listing->lru_next;
+    } else {
+        lru_head = listing->lru_next;
+    }
+    if (listing->lru_next != NULL){
+        listing->lru_next->lru_prev = listing->lru_prev;
+    } else {
+        lru_tail = listing->lru_prev;
+    }
+
+    listing->cached = 0;
+    bytes_used -= listing->charge;
+    release_locked(listing); // Connections still sending it keep it alive
+}
+
+// Moves a listing to the front of the LRU list, the caller holds cache_lock
+static void touch_listing(struct directory_listing *listing)
+{
+    if (listing == lru_head){
+        return;
+    }
+    listing->lru_prev->lru_next = listing->lru_next;
+    if (listing->lru_next != NULL){
+        listing->lru_next->lru_prev = listing->lru_prev;
+    } else {
+        lru_tail = listing->lru_prev;
+    }
+
+    listing->lru_prev = NULL;
+    listing->lru_next = lru_head;
+    lru_head->lru_prev = listing;
+    lru_head = listing;
+}
+
+// Finds a listing without taking a reference, the caller holds cache_lock
+static struct directory_listing *find_locked(const char *path)
+{
+    for (struct directory_listing *listing = buckets[hash_path(path)]; listing != NULL; listing = listing->hash_next){
+        if (!strcmp(listing->path, path)){
+            return listing;
+        }
+    }
+    return NULL;
+}
+
+// Puts a rendered listing into the hash and the LRU list (replacing an older one), evicting what doesn't fit
+// Listings bigger than the whole cache are only handed to the caller
+static void link_listing(struct directory_listing *listing)
+{
+    listing->charge = sizeof(struct directory_listing) + strlen(listing->path) + listing->names_size +
+                      listing->entry_count * sizeof(struct listing_entry) + listing->body_len;
+    if (listing->charge > cache_max_bytes){
+        listing->refcount = 1;
+        return;
+    }
+    listing->refcount = 2; // The cache's and the caller's
+    listing->cached = 1;
+
+    pthread_mutex_lock(&cache_lock);
+
+    struct directory_listing *existing = find_locked(listing->path);
+    if (existing != NULL){
+        unlink_listing(existing);
+    }
+    while (lru_tail != NULL && bytes_used + listing->charge > cache_max_bytes){
+        unlink_listing(lru_tail);
+    }
+
+    size_t bucket = hash_path(listing->path);
+    listing->hash_next = buckets[bucket];
+    buckets[bucket] = listing;
+    listing->lru_next = lru_head;
+    if (lru_head != NULL){
+        lru_head->lru_prev = listing;
+    } else {
+        lru_tail = listing;
+    }
+    lru_head = listing;
+    bytes_used += listing->charge;
+
+    pthread_mutex_unlock(&cache_lock);
+}
+
+// Sets up the listing cache, max_bytes of 0 renders every listing afresh
+void directory_listing_init(size_t max_bytes)
+{
+    cache_max_bytes = max_bytes;
+}
+
+// Makes room for one more entry with a name_len byte name (and its NUL), doubling the arrays as needed
+// Returns -1 on error
+static int index_reserve(struct directory_listing *listing, size_t *capacity, size_t *names_len, size_t name_len)
+{
+    if (listing->entry_count == *capacity){
+        size_t new_capacity = *capacity ? *capacity * 2 : 256;
+        struct listing_entry *temp_entries = realloc(listing->entries, new_capacity * sizeof(struct listing_entry));
+        if (temp_entries == NULL){
+            log_perror("directory_listing - error reallocating memory");
+            return -1;
+        }
+        listing->entries = temp_entries;
+        *capacity = new_capacity;
+    }
+
+    if (listing->names_size - *names_len < name_len + 1){
+        size_t new_size = listing->names_size ? listing->names_size * 2 : 16384;
+        while (new_size - *names_len < name_len + 1){
+            new_size *= 2;
+        }
+        char *temp_names = realloc(listing->names, new_size);
+        if (temp_names == NULL){
+            log_perror("directory_listing - error reallocating memory");
+            return -1;
+        }
+        listing->names = temp_names;
+        listing->names_size = new_size;
+    }
+    return 0;
+}
+
+// Reads every entry of an open directory into the listing's index, directories get a '/' appended
+// Returns -1 on error
+static int read_directory(int dir_fd, struct directory_listing *listing)
+{
+    char batch[DIRENT_BATCH_SIZE] __attribute__((aligned(__alignof__(struct linux_dirent64))));
+    size_t capacity = 0, names_len = 0;
+    long nbytes;
+
+    while ((nbytes = syscall(SYS_getdents64, dir_fd, batch, sizeof(batch))) > 0){
+        for (long position = 0; position < nbytes; ){
+            struct linux_dirent64 *dir_entry = (struct linux_dirent64 *)(batch + position);
+            position += dir_entry->d_reclen;
+
+            const char *name = dir_entry->d_name;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))){
+                continue;
+            }
+
+            // Something removed since getdents64() saw it just has no size
+            struct stat entry_stat;
+            if (fstatat(dir_fd, name, &entry_stat, AT_SYMLINK_NOFOLLOW) < 0){
+                memset(&entry_stat, 0, sizeof(entry_stat));
+            }
+            // Some filesystems don't fill in d_type
+            int is_dir = dir_entry->d_type == DT_DIR || (dir_entry->d_type == DT_UNKNOWN && S_ISDIR(entry_stat.st_mode));
+
+            size_t name_len = strlen(name);
+            if (index_reserve(listing, &capacity, &names_len, name_len + is_dir) < 0){
+                return -1;
+            }
+            char *stored = listing->names + names_len;
+            memcpy(stored, name, name_len);
+            if (is_dir){
+                stored[name_len++] = '/';
+            }
+            stored[name_len] = '\0';
+
+            struct listing_entry *entry = &listing->entries[listing->entry_count++];
+            entry->name_offset = names_len;
+            entry->name_len = name_len;
+            entry->size = entry_stat.st_size;
+            entry->mtime = entry_stat.st_mtime;
+            entry->is_dir = is_dir;
+            names_len += name_len + 1;
+        }
+    }
+
+    if (nbytes < 0){
+        log_perror("directory_listing - getdents64");
+        return -1;
+    }
+    return 0;
+}
+
+// Little function for qsort_r() inside build_listing(), the names live in the buffer passed along
+static int simple_compare(const void *a, const void *b, void *names)
+{
+    return strcasecmp((const char *)names + ((const struct listing_entry *)a)->name_offset,
+                      (const char *)names + ((const struct listing_entry *)b)->name_offset);
+}
+
+// Writes the path a listing is for, always ending with a '/', returns how long it is
+static int format_relative_path(char *relative_path, size_t size, const struct directory_listing *listing)
+{
+    const char *path = listing->path + strlen(BASE_DIR);
+    size_t path_len = strlen(path);
+    return snprintf(relative_path, size, "%s%s", path, (path_len && path[path_len - 1] == '/') ? "" : "/");
+}
+
+// Renders entries [first, first + count) of the index as the HTML document, sized exactly up front
+// Returns the body (Remember to free() afterwards), or NULL on error
+static char *render_html(const struct directory_listing *listing, size_t first, size_t count, size_t *body_len)
+{
+    char relative_path[PATH_MAX + 2];
+    format_relative_path(relative_path, sizeof(relative_path), listing);
+
+    int beginning_len = snprintf(NULL, 0,
+                                 "<html><head><title>Directory listing for %s</title></head>\n"
+                                 "<body><h1>Directory listing for %s</h1><ul>\n",
+                                 relative_path, relative_path);
+    size_t body_size = beginning_len + strlen(LISTING_END) + 1;
+    for (size_t i = first; i < first + count; i++){
+        body_size += strlen(LISTING_ENTRY_MARKUP) + 2 * listing->entries[i].name_len;
+    }
+
+    char *body = malloc(body_size);
+    if (body == NULL){
+        log_perror("directory_listing - error allocating memory");
+        return NULL;
+    }
+    char *position = body;
+    position += snprintf(position, body_size,
+                         "<html><head><title>Directory listing for %s</title></head>\n"
+                         "<body><h1>Directory listing for %s</h1><ul>\n",
+                         relative_path, relative_path);
+    for (size_t i = first; i < first + count; i++){
+        const char *name = listing->names + listing->entries[i].name_offset;
+        size_t name_len = listing->entries[i].name_len;
+        memcpy(position, "<li><a href=\"", 13);
+        memcpy(position + 13, name, name_len);
+        position += 13 + name_len;
+        memcpy(position, "\">", 2);
+        memcpy(position + 2, name, name_len);
+        position += 2 + name_len;
+        memcpy(position, "</a></li>\n", 10);
+        position += 10;
+    }
+    memcpy(position, LISTING_END, strlen(LISTING_END) + 1);
+    position += strlen(LISTING_END);
+
+    *body_len = position - body;
+    return body;
+}
+
+// How many bytes a string takes up as the inside of a JSON string
+static size_t json_escaped_len(const char *string, size_t len)
+{
+    size_t escaped_len = len;
+    for (size_t i = 0; i < len; i++){
+        unsigned char c = string[i];
+        if (c == '"' || c == '\\'){
+            escaped_len += 1;
+        } else if (c < 0x20){
+            escaped_len += 5; // \u00XX
+        }
+    }
+    return escaped_len;
+}
+
+// Copies a string escaped for the inside of a JSON string, returns where the copy ends
+static char *json_escape(char *destination, const char *string, size_t len)
+{
+    for (size_t i = 0; i < len; i++){
+        unsigned char c = string[i];
+        if (c == '"' || c == '\\'){
+            *destination++ = '\\';
+            *destination++ = c;
+        } else if (c < 0x20){
+            destination += sprintf(destination, "\\u%04x", c);
+        } else {
+            *destination++ = c;
+        }
+    }
+    return destination;
+}
+
+// Renders entries [first, first + count) of the index as a JSON document, with the total so clients can page
+// Returns the body (Remember to free() afterwards), or NULL on error
+static char *render_json(const struct directory_listing *listing, size_t first, size_t count, size_t *body_len)
+{
+    char relative_path[PATH_MAX + 2];
+    int relative_path_len = format_relative_path(relative_path, sizeof(relative_path), listing);
+
+    // Numbers are given all the room they could need, the rest is exact
+    const size_t number_room = 20;
+    size_t body_size = strlen("{\"path\":\"\",\"total\":,\"offset\":,\"entries\":[\n]}\n") +
+                       json_escaped_len(relative_path, relative_path_len) + 2 * number_room + 1;
+    for (size_t i = first; i < first + count; i++){
+        const struct listing_entry *entry = &listing->entries[i];
+        body_size += strlen("{\"name\":\"\",\"type\":\"directory\",\"size\":,\"mtime\":},\n") + 2 * number_room +
+                     json_escaped_len(listing->names + entry->name_offset, entry->name_len - entry->is_dir);
+    }
+
+    char *body = malloc(body_size);
+    if (body == NULL){
+        log_perror("directory_listing - error allocating memory");
+        return NULL;
+    }
+    char *position = body;
+    position += sprintf(position, "{\"path\":\"");
+    position = json_escape(position, relative_path, relative_path_len);
+    position += sprintf(position, "\",\"total\":%zu,\"offset\":%zu,\"entries\":[\n", listing->entry_count, first);
+    for (size_t i = first; i < first + count; i++){
+        const struct listing_entry *entry = &listing->entries[i];
+        position += sprintf(position, "{\"name\":\"");
+        position = json_escape(position, listing->names + entry->name_offset, entry->name_len - entry->is_dir);
+        position += sprintf(position, "\",\"type\":\"%s\",\"size\":%lld,\"mtime\":%lld}%s\n",
+                            entry->is_dir ? "directory" : "file", (long long)entry->size, (long long)entry->mtime,
+                            i + 1 < first + count ? "," : "");
+    }
+    position += sprintf(position, "]}\n");
+
+    *body_len = position - body;
+    return body;
+}
+
+// Reads a directory into a new listing's sorted index and renders the whole HTML listing
+// The mtime it's keyed by is taken before reading, so a change while it's read makes the next request
+// read it again (or NULL on error)
+static struct directory_listing *build_listing(const char *path)
+{
+    struct directory_listing *listing = calloc(1, sizeof(struct directory_listing));
+    if (listing == NULL || (listing->path = strdup(path)) == NULL){
+        log_perror("directory_listing - error allocating memory");
+        free(listing);
+        return NULL;
+    }
+    listing->MIME_type = "text/html";
+
+    int dir_fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd < 0){
+        log_perror("directory_listing - error opening directory");
+        free_listing(listing);
+        return NULL;
+    }
+    struct stat dir_stat;
+    if (fstat(dir_fd, &dir_stat) < 0){
+        log_perror("directory_listing - fstat");
+        close(dir_fd);
+        free_listing(listing);
+        return NULL;
+    }
+    listing->mtime = dir_stat.st_mtim;
+    listing->inode = dir_stat.st_ino;
+
+    int retval = read_directory(dir_fd, listing);
+    close(dir_fd);
+    if (retval < 0){
+        free_listing(listing);
+        return NULL;
+    }
+
+    // Sorted once here, every page and format after this just walks the index
+    qsort_r(listing->entries, listing->entry_count, sizeof(struct listing_entry), simple_compare, listing->names);
+    if ((listing->body = render_html(listing, 0, listing->entry_count, &listing->body_len)) == NULL){
+        free_listing(listing);
+        return NULL;
+    }
+    return listing;
+}
+
+// Reads a non-negative decimal query value, returns -1 if it isn't one
+static int parse_query_number(const char *value, size_t value_len, size_t *number)
+{
+    if (value_len == 0 || value_len > 18){
+        return -1;
+    }
+    *number = 0;
+    for (size_t i = 0; i < value_len; i++){
+        if (value[i] < '0' || value[i] > '9'){
+            return -1;
+        }
+        *number = *number * 10 + (value[i] - '0');
+    }
+    return 0;
+}
+
+// Reads format=html|json, offset=N and limit=N out of a query string, other parameters are ignored
+// Leaves the defaults (HTML, everything) in place for what's missing, returns -1 if a value is invalid (400)
+int directory_listing_parse_query(const char *query, enum listing_format *format, size_t *offset, size_t *limit)
+{
+    while (*query){
+        size_t param_len = strcspn(query, "&");
+        const char *equals = memchr(query, '=', param_len);
+        size_t key_len = equals != NULL ? (size_t)(equals - query) : param_len;
+        const char *value = equals != NULL ? equals + 1 : query + param_len;
+        size_t value_len = query + param_len - value;
+
+        if (key_len == 6 && !strncmp(query, "format", 6)){
+            if (value_len == 4 && !strncmp(value, "json", 4)){
+                *format = LISTING_JSON;
+            } else if (value_len == 4 && !strncmp(value, "html", 4)){
+                *format = LISTING_HTML;
+            } else {
+                return -1;
+            }
+        } else if (key_len == 6 && !strncmp(query, "offset", 6)){
+            if (parse_query_number(value, value_len, offset) < 0){
+                return -1;
+            }
+        } else if (key_len == 5 && !strncmp(query, "limit", 5)){
+            if (parse_query_number(value, value_len, limit) < 0){
+                return -1;
+            }
+        }
+
+        query += param_len;
+        query += *query == '&';
+    }
+    return 0;
+}
+
+// Renders a page of a listing in a format as a listing of its own, which isn't cached
+// Returns it with the only reference taken (or NULL on error)
+struct directory_listing *directory_listing_view(const struct directory_listing *listing, enum listing_format format,
+                                                 size_t offset, size_t limit)
+{
+    struct directory_listing *view = calloc(1, sizeof(struct directory_listing));
+    if (view == NULL || (view->path = strdup(listing->path)) == NULL){
+        log_perror("directory_listing - error allocating memory");
+        free(view);
+        return NULL;
+    }
+    view->mtime = listing->mtime;
+    view->inode = listing->inode;
+    view->is_view = 1;
+    view->refcount = 1;
+
+    size_t first = offset < listing->entry_count ? offset : listing->entry_count;
+    size_t count = listing->entry_count - first < limit ? listing->entry_count - first : limit;
+    if (format == LISTING_JSON){
+        view->MIME_type = "application/json";
+        view->body = render_json(listing, first, count, &view->body_len);
+    } else {
+        view->MIME_type = "text/html";
+        view->body = render_html(listing, first, count, &view->body_len);
+    }
+    if (view->body == NULL){
+        free_listing(view);
+        return NULL;
+    }
+    return view;
+}
+
+// Returns the listing of a directory under BASE_DIR with a reference taken, rendering it if the cached one
+// is missing or stale (or NULL on error)
+struct directory_listing *directory_listing_get(const char *directory_path)
+{
+    // One key per directory, however the path ends
+    char path[PATH_MAX + 1];
+    size_t path_len = strlen(directory_path);
+    while (path_len > 1 && directory_path[path_len - 1] == '/'){
+        path_len--;
+    }
+    if (path_len > PATH_MAX){
+        return NULL;
+    }
+    memcpy(path, directory_path, path_len);
+    path[path_len] = '\0';
+
+    if (cache_max_bytes > 0){
+        struct stat dir_stat;
+        if (stat(path, &dir_stat) < 0){
+            log_perror("directory_listing - stat");
+            return NULL;
+        }
+
+        pthread_mutex_lock(&cache_lock);
+        struct directory_listing *listing = find_locked(path);
+        if (listing != NULL && listing->inode == dir_stat.st_ino &&
+            listing->mtime.tv_sec == dir_stat.st_mtim.tv_sec && listing->mtime.tv_nsec == dir_stat.st_mtim.tv_nsec){
+            touch_listing(listing);
+            listing->refcount++;
+            pthread_mutex_unlock(&cache_lock);
+            return listing;
+        }
+        pthread_mutex_unlock(&cache_lock);
+    }
+
+    struct directory_listing *listing = build_listing(path);
+    if (listing != NULL){
+        link_listing(listing);
+    }
+    return listing;
+}
+
+// Drops a reference taken by directory_listing_get() or directory_listing_view()
+void directory_listing_release(struct directory_listing *listing)
+{
+    pthread_mutex_lock(&cache_lock);
+    release_locked(listing);
+    pthread_mutex_unlock(&cache_lock);
+}
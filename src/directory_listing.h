@@ -0,0 +1,68 @@
+#ifndef DIRECTORY_LISTING_H
+#define DIRECTORY_LISTING_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <time.h>
+
+// The formats a listing can be asked for in
+enum listing_format {
+    LISTING_HTML,
+    LISTING_JSON
+};
+
+// One entry of a directory's sorted index
+struct listing_entry {
+    size_t name_offset; // Into the listing's names, directories end with '/'
+    size_t name_len;
+    off_t size;
+    time_t mtime;
+    int is_dir;
+};
+
+// A directory's sorted index and HTML listing, built once and shared until the directory changes
+struct directory_listing {
+    char *path; // The directory without a trailing '/', the key
+    struct timespec mtime; // The directory's mtime when it was read, the listing is stale once it differs
+    ino_t inode;
+    const char *MIME_type;
+
+    // The index, sorted by name (NULL in views)
+    struct listing_entry *entries;
+    size_t entry_count;
+    char *names; // Every name one after the other, NUL-terminated
+    size_t names_size;
+
+    char *body; // The whole listing as HTML, or a view's page of it
+    size_t body_len;
+    int is_view; // Rendered for one request from another listing's index
+
+    size_t charge; // How much of the cache's budget the listing uses
+    int refcount; // The cache holds one reference, every connection sending it another
+    int cached; // Cleared once the listing is evicted or replaced
+
+    struct directory_listing *hash_next;
+    struct directory_listing *lru_prev; // Most recently used at the head
+    struct directory_listing *lru_next;
+};
+
+// Sets up the listing cache, max_bytes of 0 renders every listing afresh
+void directory_listing_init(size_t max_bytes);
+
+// Returns the listing of a directory under BASE_DIR with a reference taken, rendering it if the cached one
+// is missing or stale (or NULL on error)
+struct directory_listing *directory_listing_get(const char *directory_path);
+
+// Reads format=html|json, offset=N and limit=N out of a query string, other parameters are ignored
+// Leaves the defaults (HTML, everything) in place for what's missing, returns -1 if a value is invalid (400)
+int directory_listing_parse_query(const char *query, enum listing_format *format, size_t *offset, size_t *limit);
+
+// Renders a page of a listing in a format as a listing of its own, which isn't cached
+// Returns it with the only reference taken (or NULL on error)
+struct directory_listing *directory_listing_view(const struct directory_listing *listing, enum listing_format format,
+                                                 size_t offset, size_t limit);
+
+// Drops a reference taken by directory_listing_get() or directory_listing_view()
+void directory_listing_release(struct directory_listing *listing);
+
+#endif
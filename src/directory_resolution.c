@@ -1,34 +1,45 @@
 #include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include "logging.h"
 
 char BASE_DIR[PATH_MAX + 1];
+int BASE_DIR_FD = -1;
 
+// Resolve the program argument into our global variables
 void resolve_dir(char *dirpath)
 {
     char resolved_path[PATH_MAX + 1];
 
     // Resolve the directory path
     if (realpath(dirpath, resolved_path) == NULL) {
-        perror("resolve_dir - error resolving file path");
+        log_perror("resolve_dir - error resolving file path");
         exit(EXIT_FAILURE);
     }
 
     // Validate the directory and check if it's not just a file
     struct stat path_stat;
     if (stat(resolved_path, &path_stat)) {
-        perror("resolve_dir - error filling stat object");
+        log_perror("resolve_dir - error filling stat object");
         exit(EXIT_FAILURE);
     }
 
     if (!S_ISDIR(path_stat.st_mode)) {
-        fprintf(stderr, "%s is not a directory\n", resolved_path);
+        log_message(LEVEL_ERROR, "%s is not a directory", resolved_path);
         exit(EXIT_FAILURE);
     }
 
     // Paste the path into our global variable
     strcpy(BASE_DIR, resolved_path);
+
+    // Keep the directory itself at hand, so lookups don't walk from / every time
+    BASE_DIR_FD = open(BASE_DIR, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (BASE_DIR_FD < 0) {
+        log_perror("resolve_dir - error opening directory");
+        exit(EXIT_FAILURE);
+    }
 }
\ No newline at end of file
@@ -11,7 +11,10 @@
 // The root directory of the running server
 extern char BASE_DIR[PATH_MAX + 1];
 
-// Resolve the program argument into our global variable
+// BASE_DIR opened once, requested paths are looked up relative to it
+extern int BASE_DIR_FD;
+
+// Resolve the program argument into our global variables
 void resolve_dir(char *dirpath);
 
 #endif
\ No newline at end of file
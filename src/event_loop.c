@@ -0,0 +1,207 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <time.h>
+#include <unistd.h>
+#include "connection.h"
+#include "event_loop.h"
+#include "file_cache.h"
+#include "logging.h"
+#include "metadata_cache.h"
+#include "options.h"
+#include "request_parsing.h"
+#include "socket_operations.h"
+
+static int MAX_EVENTS = 256; // How many events we take from epoll_wait() at once
+
+// Mark the listening socket and the file cache's inotify descriptor in epoll's data.ptr
+// (connections use their struct connection)
+static int listener_tag;
+static int inotify_tag;
+
+// Accepts every pending connection and registers it with epoll
+// The listener is edge-triggered, so anything left in the backlog has to be picked up on the next tick
+static void accept_connections(struct event_loop *loop)
+{
+    int client_fd;
+    struct sockaddr_storage client_addr;
+
+    while ((client_fd = accept_and_print(loop->listener, &client_addr)) != -2){
+        if (client_fd < 0){
+            if (errno == ECONNABORTED || errno == EPROTO || errno == EINTR){
+                continue; // Only this one connection is gone
+            }
+            if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM){
+                loop->accept_paused = 1; // Trying again straight away would only fail again
+            }
+            return;
+        }
+        if (OPTIONS.tcp_nodelay){
+            set_tcp_nodelay(client_fd); // Only costs latency if it fails
+        }
+
+        struct connection *conn = connection_new(client_fd);
+        if (conn == NULL){
+            close(client_fd);
+            continue;
+        }
+        conn->peer_addr = client_addr;
+
+        // Edge-triggered, so we'll only hear about a socket again once it changes state
+        struct epoll_event event;
+        event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        event.data.ptr = conn;
+        if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, client_fd, &event) < 0){
+            log_perror("accept_connections - epoll_ctl");
+            connection_free(conn);
+            continue;
+        }
+
+        // The request has to arrive within the header timeout
+        connection_update_deadline(conn, &loop->timers);
+    }
+}
+
+// Reads what's available and queues a response once the next request is complete
+// Returns 1 if a response was queued, 0 if we're waiting for more data, -1 to close the connection
+static int read_request(struct connection *conn)
+{
+    if (!conn->peer_closed){
+        int retval = recv_nonblocking(conn->fd, conn->recv_buf, sizeof(conn->recv_buf), &conn->recv_len);
+        if (retval < 0){
+            return -1;
+        }
+        conn->peer_closed = (retval == 1);
+    }
+
+    int retval = handle_buffered_request(conn);
+    if (retval == 0 && conn->peer_closed){ // The client hung up without finishing another request
+        log_message(LEVEL_DEBUG, "Connection on socket %d closed by client", conn->fd);
+        return -1;
+    }
+    return retval;
+}
+
+// Moves a connection's state machine along after epoll reported events on it
+// Pipelined requests already in the buffer are answered one after another without waiting on epoll
+// Returns 0 to keep the connection, -1 to close it
+static int handle_connection(struct connection *conn, uint32_t events)
+{
+    if (events & EPOLLERR){
+        return -1;
+    }
+
+    for (;;){
+        if (conn->state == CONN_READING_REQUEST){
+            int retval = read_request(conn);
+            if (retval <= 0){
+                return retval;
+            }
+        }
+
+        int retval = connection_flush(conn);
+        if (retval != 0){
+            return retval < 0 ? -1 : 0;
+        }
+        log_message(LEVEL_DEBUG, "Response sent succesfully on socket %d", conn->fd);
+
+        if (conn->state == CONN_CLOSING){
+            return -1;
+        }
+    }
+}
+
+// Closes a connection whose timer went off, if its deadline has really passed
+static void expire_connection(struct timer *timer, void *arg)
+{
+    struct event_loop *loop = arg;
+    struct connection *conn = connection_from_timer(timer);
+
+    if (connection_deadline_passed(conn, &loop->timers)){
+        log_message(LEVEL_DEBUG, "run_event_loop - timeout reached on socket %d", conn->fd);
+        connection_free(conn); // Also removes the socket from epoll by closing it
+    }
+}
+
+// Runs the edge-triggered epoll loop on a non-blocking listening socket (never returns unless epoll fails)
+int run_event_loop(const int listener)
+{
+    struct epoll_event events[MAX_EVENTS];
+    struct epoll_event listener_event;
+    struct event_loop loop = {
+        .listener = listener,
+    };
+    timer_wheel_init(&loop.timers);
+
+    loop.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop.epoll_fd < 0){
+        log_perror("run_event_loop - epoll_create1");
+        return -1;
+    }
+
+    listener_event.events = EPOLLIN | EPOLLET;
+    listener_event.data.ptr = &listener_tag;
+    if (epoll_ctl(loop.epoll_fd, EPOLL_CTL_ADD, listener, &listener_event) < 0){
+        log_perror("run_event_loop - epoll_ctl");
+        close(loop.epoll_fd);
+        return -1;
+    }
+
+    // Every loop watches the file cache's inotify events, whichever reads them first invalidates
+    int inotify_fd = file_cache_inotify_fd();
+    if (inotify_fd >= 0){
+        struct epoll_event inotify_event;
+        inotify_event.events = EPOLLIN;
+        inotify_event.data.ptr = &inotify_tag;
+        if (epoll_ctl(loop.epoll_fd, EPOLL_CTL_ADD, inotify_fd, &inotify_event) < 0){
+            log_perror("run_event_loop - epoll_ctl inotify");
+        }
+    }
+
+    for(;;){
+        int event_count = epoll_wait(loop.epoll_fd, events, MAX_EVENTS, 1000);
+        if (event_count < 0){
+            if (errno == EINTR){
+                continue;
+            }
+            log_perror("run_event_loop - epoll_wait");
+            close(loop.epoll_fd);
+            return -1;
+        }
+
+        for (int i = 0; i < event_count; i++){
+            if (events[i].data.ptr == &listener_tag){
+                accept_connections(&loop);
+                continue;
+            }
+            if (events[i].data.ptr == &inotify_tag){
+                file_cache_process_events();
+                continue;
+            }
+
+            struct connection *conn = events[i].data.ptr;
+            if (handle_connection(conn, events[i].events) < 0){
+                connection_free(conn); // Also removes the socket from epoll by closing it
+            } else {
+                connection_update_deadline(conn, &loop.timers);
+            }
+        }
+
+        // Connections are only timed out once this round's events are handled, which may have freed them
+        // The rest runs about once a second
+        uint64_t last_tick = loop.timers.now;
+        timer_wheel_advance(&loop.timers, expire_connection, &loop);
+        if (loop.timers.now != last_tick){
+            metadata_cache_expire();
+            if (file_cache_report_if_requested()){
+                metadata_cache_report();
+            }
+            if (loop.accept_paused){
+                loop.accept_paused = 0;
+                accept_connections(&loop);
+            }
+        }
+    }
+}
@@ -0,0 +1,19 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include <sys/epoll.h>
+#include "connection.h"
+#include "timer_wheel.h"
+
+// One worker's loop, every connection it accepts stays with it
+struct event_loop {
+    int epoll_fd;
+    int listener;
+    struct timer_wheel timers; // Every connection's deadline
+    int accept_paused; // Out of descriptors or memory, the backlog is accepted again on the next tick
+};
+
+// Runs the edge-triggered epoll loop on a non-blocking listening socket (never returns unless epoll fails)
+int run_event_loop(const int listener);
+
+#endif
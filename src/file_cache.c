@@ -0,0 +1,559 @@
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "content_encoding.h"
+#include "directory_resolution.h"
+#include "file_cache.h"
+#include "logging.h"
+#include "metadata_cache.h"
+
+#define BUCKET_COUNT 16384 // Hash buckets (power of 2)
+
+// Everything that changes a file's bytes or where it is
+static const uint32_t WATCH_MASK = IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_CREATE | IN_DELETE |
+                                   IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF;
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct file_cache_entry *buckets[BUCKET_COUNT];
+static struct file_cache_entry *lru_head = NULL;
+static struct file_cache_entry *lru_tail = NULL;
+static struct file_cache_stats stats;
+static size_t cache_max_bytes = 0;
+static size_t cache_max_file_size = 0;
+
+// inotify watches, indexed by watch descriptor
+static int inotify_fd = -1;
+static char **watched_dirs = NULL;
+static int watched_capacity = 0;
+static unsigned long event_batches = 0; // Bumped under cache_lock for every read of inotify events
+
+static volatile sig_atomic_t stats_requested = 0;
+
+// FNV-1a over the path
+static size_t hash_path(const char *path)
+{
+    size_t hash = 14695981039346656037ULL;
+    while (*path){
+        hash ^= (unsigned char)*path++;
+        hash *= 1099511628211ULL;
+    }
+    return hash & (BUCKET_COUNT - 1);
+}
+
+static void free_entry(struct file_cache_entry *entry)
+{
+    free(entry->path);
+    free(entry->headers);
+    free(entry->body);
+    free(entry);
+}
+
+// Drops a reference, the caller holds cache_lock
+static void release_locked(struct file_cache_entry *entry)
+{
+    if (--entry->refcount == 0){
+        free_entry(entry);
+    }
+}
+
+// Takes an entry out of the hash and the LRU list, the caller holds cache_lock
+static void unlink_entry(struct file_cache_entry *entry)
+{
+    struct file_cache_entry **link = &buckets[hash_path(entry->path)];
+    while (*link != entry){
+        link = &(*link)->hash_next;
+    }
+    *link = entry->hash_next;
+
+    if (entry->lru_prev != NULL){
+        entry->lru_prev->lru_next = entry->lru_next;
+    } else {
+        lru_head = entry->lru_next;
+    }
+    if (entry->lru_next != NULL){
+        entry->lru_next->lru_prev = entry->lru_prev;
+    } else {
+        lru_tail = entry->lru_prev;
+    }
+
+    entry->cached = 0;
+    stats.entries--;
+    stats.bytes_used -= entry->charge;
+    release_locked(entry); // Connections still sending it keep it alive
+}
+
+// Moves an entry to the front of the LRU list, the caller holds cache_lock
+static void touch_entry(struct file_cache_entry *entry)
+{
+    if (entry == lru_head){
+        return;
+    }
+    entry->lru_prev->lru_next = entry->lru_next;
+    if (entry->lru_next != NULL){
+        entry->lru_next->lru_prev = entry->lru_prev;
+    } else {
+        lru_tail = entry->lru_prev;
+    }
+
+    entry->lru_prev = NULL;
+    entry->lru_next = lru_head;
+    lru_head->lru_prev = entry;
+    lru_head = entry;
+}
+
+// Finds an entry without taking a reference, the caller holds cache_lock
+static struct file_cache_entry *find_locked(const char *path)
+{
+    for (struct file_cache_entry *entry = buckets[hash_path(path)]; entry != NULL; entry = entry->hash_next){
+        if (!strcmp(entry->path, path)){
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+// Watches a directory, the caller holds cache_lock
+// Returns 1 if it was already watched under that name, 0 if it's watched now, -1 on error
+static int watch_dir(const char *dir)
+{
+    int wd = inotify_add_watch(inotify_fd, dir, WATCH_MASK);
+    if (wd < 0){
+        log_perror("file_cache - inotify_add_watch");
+        return -1;
+    }
+
+    if (wd >= watched_capacity){
+        int new_capacity = watched_capacity ? watched_capacity * 2 : 64;
+        while (new_capacity <= wd){
+            new_capacity *= 2;
+        }
+        char **temp_watched_dirs = realloc(watched_dirs, new_capacity * sizeof(char *));
+        if (temp_watched_dirs == NULL){
+            log_perror("file_cache - error reallocating memory");
+            return -1;
+        }
+        memset(temp_watched_dirs + watched_capacity, 0, (new_capacity - watched_capacity) * sizeof(char *));
+        watched_dirs = temp_watched_dirs;
+        watched_capacity = new_capacity;
+    }
+    if (watched_dirs[wd] != NULL && !strcmp(watched_dirs[wd], dir)){
+        return 1;
+    }
+
+    // A watch follows its directory when it's moved, so it may come back under a new name
+    char *name = strdup(dir);
+    if (name == NULL){
+        log_perror("file_cache - error allocating memory");
+        return -1;
+    }
+    free(watched_dirs[wd]);
+    watched_dirs[wd] = name;
+    return 0;
+}
+
+// Makes sure every directory from BASE_DIR down to the one holding path is watched, the caller holds cache_lock
+// Renaming or replacing any of them changes what the path leads to
+static void watch_parent_dir(const char *path)
+{
+    char dir[PATH_MAX + 1];
+    const char *slash = strrchr(path, '/');
+    if (slash == NULL || slash - path > PATH_MAX){
+        return;
+    }
+    memcpy(dir, path, slash - path);
+    dir[slash - path] = '\0';
+
+    // Upwards from the parent, a directory that's already watched has its ancestors watched too
+    size_t base_len = strlen(BASE_DIR);
+    for (;;){
+        if (watch_dir(dir) != 0 || strlen(dir) <= base_len){
+            return;
+        }
+        char *parent_slash = strrchr(dir, '/');
+        if (parent_slash == NULL || (size_t)(parent_slash - dir) < base_len){
+            return;
+        }
+        *parent_slash = '\0';
+    }
+}
+
+static void request_stats(int signum)
+{
+    (void)signum;
+    stats_requested = 1;
+}
+
+// Sets up the cache and its inotify watch on BASE_DIR, max_bytes of 0 disables it
+int file_cache_init(size_t max_bytes, size_t max_file_size)
+{
+    cache_max_bytes = max_bytes;
+    cache_max_file_size = max_file_size < max_bytes ? max_file_size : max_bytes;
+    signal(SIGUSR1, request_stats);
+    if (max_bytes == 0){
+        return 0;
+    }
+
+    inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd < 0){
+        log_perror("file_cache_init - inotify_init1");
+        cache_max_bytes = 0; // Without invalidation the cache could serve stale files
+        return -1;
+    }
+
+    char base_file[PATH_MAX + 2];
+    snprintf(base_file, sizeof(base_file), "%s/", BASE_DIR);
+    watch_parent_dir(base_file);
+    return 0;
+}
+
+// Whether a file of this size may go into the cache
+int file_cache_accepts(size_t file_size)
+{
+    return cache_max_bytes > 0 && file_size <= cache_max_file_size;
+}
+
+// Builds the key an encoded variant of a file is cached under, which no real path can clash with
+// Returns -1 if it doesn't fit
+int file_cache_variant_key(char *key, size_t key_size, const char *path, const char *encoding_token)
+{
+    // Resolved paths never have "//" in them
+    int key_len = snprintf(key, key_size, "%s//%s", path, encoding_token);
+    return (key_len < 0 || (size_t)key_len >= key_size) ? -1 : 0;
+}
+
+// Returns the entry for a resolved path with a reference taken (or NULL on a miss)
+struct file_cache_entry *file_cache_lookup(const char *path)
+{
+    if (cache_max_bytes == 0){
+        return NULL;
+    }
+
+    pthread_mutex_lock(&cache_lock);
+    struct file_cache_entry *entry = find_locked(path);
+    if (entry != NULL){
+        touch_entry(entry);
+        entry->refcount++;
+        stats.hits++;
+    } else {
+        stats.misses++;
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    return entry;
+}
+
+// Allocates an entry with copies of the key and headers, the body is up to the caller
+static struct file_cache_entry *new_entry(const char *key, const char *headers, size_t header_len)
+{
+    struct file_cache_entry *entry = calloc(1, sizeof(struct file_cache_entry));
+    if (entry == NULL){
+        log_perror("file_cache_insert - error allocating memory");
+        return NULL;
+    }
+    entry->path = strdup(key);
+    entry->headers = malloc(header_len ? header_len : 1);
+    if (entry->path == NULL || entry->headers == NULL){
+        log_perror("file_cache_insert - error allocating memory");
+        free_entry(entry);
+        return NULL;
+    }
+    memcpy(entry->headers, headers, header_len);
+    entry->header_len = header_len;
+    return entry;
+}
+
+// Watches the directories leading to what a key caches, before its body is read
+// Returns the event batch count to hand to link_entry(), an event read in between may have been about it
+static unsigned long watch_key(const char *key)
+{
+    pthread_mutex_lock(&cache_lock);
+
+    // An encoded variant changes along with the file it's a variant of
+    const char *variant_separator = strstr(key, "//");
+    if (variant_separator != NULL){
+        char path[PATH_MAX + 1];
+        snprintf(path, sizeof(path), "%.*s", (int)(variant_separator - key), key);
+        watch_parent_dir(path);
+    } else {
+        watch_parent_dir(key);
+    }
+    unsigned long batches_seen = event_batches;
+
+    pthread_mutex_unlock(&cache_lock);
+    return batches_seen;
+}
+
+// Puts a filled in entry into the hash and the LRU list, evicting what doesn't fit anymore
+// An entry over the whole budget, or one inotify events were read for since watch_key(), stays out
+// with just the caller's reference
+static void link_entry(struct file_cache_entry *entry, unsigned long batches_seen)
+{
+    entry->charge = sizeof(struct file_cache_entry) + strlen(entry->path) + entry->header_len + entry->body_len;
+
+    // One that's bigger than the whole budget would only flush everything else and still not fit
+    if (entry->charge > cache_max_bytes){
+        entry->refcount = 1; // Only the caller's, it's freed once sent
+        entry->cached = 0;
+        return;
+    }
+    pthread_mutex_lock(&cache_lock);
+
+    // The events may have been about this file, and with nothing cached yet they dropped nothing
+    if (event_batches != batches_seen){
+        pthread_mutex_unlock(&cache_lock);
+        entry->refcount = 1;
+        entry->cached = 0;
+        return;
+    }
+    entry->refcount = 2; // The cache's and the caller's
+    entry->cached = 1;
+
+    // Another worker may have cached it in the meantime
+    struct file_cache_entry *existing = find_locked(entry->path);
+    if (existing != NULL){
+        unlink_entry(existing);
+    }
+
+    // Make room by evicting the least recently used files
+    while (lru_tail != NULL && stats.bytes_used + entry->charge > cache_max_bytes){
+        unlink_entry(lru_tail);
+        stats.evictions++;
+    }
+
+    size_t bucket = hash_path(entry->path);
+    entry->hash_next = buckets[bucket];
+    buckets[bucket] = entry;
+    entry->lru_next = lru_head;
+    if (lru_head != NULL){
+        lru_head->lru_prev = entry;
+    } else {
+        lru_tail = entry;
+    }
+    lru_head = entry;
+
+    stats.insertions++;
+    stats.entries++;
+    stats.bytes_used += entry->charge;
+
+    pthread_mutex_unlock(&cache_lock);
+}
+
+// Reads file_size bytes of an open file into a new entry, returns it with a reference taken (or NULL)
+// The cache keeps its own copy of the headers, which were made from file_stat
+struct file_cache_entry *file_cache_insert(const char *path, int file_fd, size_t file_size, const struct stat *file_stat,
+                                           const char *headers, size_t header_len, int variants)
+{
+    if (!file_cache_accepts(file_size)){
+        return NULL;
+    }
+
+    struct file_cache_entry *entry = new_entry(path, headers, header_len);
+    if (entry == NULL){
+        return NULL;
+    }
+    entry->body = malloc(file_size ? file_size : 1);
+    if (entry->body == NULL){
+        log_perror("file_cache_insert - error allocating memory");
+        free_entry(entry);
+        return NULL;
+    }
+
+    // Changes from here on are reported, the ones before show up in the fstat() below
+    unsigned long batches_seen = watch_key(path);
+
+    // Read the whole file in (it's small)
+    size_t total = 0;
+    while (total < file_size){
+        ssize_t nbytes = pread(file_fd, entry->body + total, file_size - total, total);
+        if (nbytes < 0 && errno == EINTR){
+            continue;
+        }
+        if (nbytes <= 0){
+            if (nbytes < 0){
+                log_perror("file_cache_insert - pread");
+            }
+            free_entry(entry);
+            return NULL;
+        }
+        total += nbytes;
+    }
+    entry->body_len = file_size;
+    entry->variants = variants;
+
+    // What was read has to be the file the headers describe
+    struct stat read_stat;
+    if (fstat(file_fd, &read_stat) < 0 || read_stat.st_nlink == 0 || read_stat.st_ino != file_stat->st_ino ||
+        read_stat.st_size != file_stat->st_size || read_stat.st_mtim.tv_sec != file_stat->st_mtim.tv_sec ||
+        read_stat.st_mtim.tv_nsec != file_stat->st_mtim.tv_nsec){
+        free_entry(entry);
+        return NULL;
+    }
+
+    link_entry(entry, batches_seen);
+    return entry;
+}
+
+// Caches a body built in memory (like a compressed variant), taking it over if an entry is returned
+// Returns the entry with a reference taken (or NULL, the caller keeps the body then)
+struct file_cache_entry *file_cache_insert_buffer(const char *key, char *body, size_t body_len, const char *headers,
+                                                  size_t header_len, const struct timespec *source_mtime)
+{
+    if (!file_cache_accepts(body_len)){
+        return NULL;
+    }
+
+    struct file_cache_entry *entry = new_entry(key, headers, header_len);
+    if (entry == NULL){
+        return NULL;
+    }
+    entry->body = body;
+    entry->body_len = body_len;
+    entry->source_mtime = *source_mtime;
+
+    link_entry(entry, watch_key(key));
+    return entry;
+}
+
+// Drops a reference taken by file_cache_lookup(), file_cache_insert() or file_cache_insert_buffer()
+void file_cache_release(struct file_cache_entry *entry)
+{
+    pthread_mutex_lock(&cache_lock);
+    release_locked(entry);
+    pthread_mutex_unlock(&cache_lock);
+}
+
+// The inotify descriptor event loops should watch (or -1 if the cache is off)
+int file_cache_inotify_fd(void)
+{
+    return cache_max_bytes > 0 ? inotify_fd : -1;
+}
+
+// Drops the entry for a path, and everything under it if it's a directory, the caller holds cache_lock
+static void invalidate_locked(const char *path, int is_dir)
+{
+    char variant_key[PATH_MAX + 16];
+    struct file_cache_entry *entry = find_locked(path);
+    if (entry != NULL){
+        unlink_entry(entry);
+        stats.invalidations++;
+    }
+
+    // Along with its encoded variants
+    for (int i = 0; ENCODINGS[i].token != NULL; i++){
+        if (file_cache_variant_key(variant_key, sizeof(variant_key), path, ENCODINGS[i].token) == 0 &&
+            (entry = find_locked(variant_key)) != NULL){
+            unlink_entry(entry);
+            stats.invalidations++;
+        }
+    }
+
+    if (!is_dir){
+        return;
+    }
+    size_t path_len = strlen(path);
+    entry = lru_head;
+    while (entry != NULL){
+        struct file_cache_entry *next = entry->lru_next;
+        if (!strncmp(entry->path, path, path_len) && entry->path[path_len] == '/'){
+            unlink_entry(entry);
+            stats.invalidations++;
+        }
+        entry = next;
+    }
+}
+
+// Reads pending inotify events and drops the entries they affect
+void file_cache_process_events(void)
+{
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    char path[PATH_MAX + 1];
+    ssize_t nbytes;
+
+    if (inotify_fd < 0){
+        return;
+    }
+
+    // Several event loops may race for the same events, whoever reads them handles them
+    while ((nbytes = read(inotify_fd, events, sizeof(events))) > 0){
+        pthread_mutex_lock(&cache_lock);
+        event_batches++;
+
+        for (char *ptr = events; ptr < events + nbytes; ){
+            struct inotify_event *event = (struct inotify_event *)ptr;
+            ptr += sizeof(struct inotify_event) + event->len;
+
+            // Events were lost, so anything might have changed
+            if (event->mask & IN_Q_OVERFLOW){
+                log_message(LEVEL_WARNING, "file_cache - inotify queue overflowed, dropping every cached file");
+                while (lru_tail != NULL){
+                    unlink_entry(lru_tail);
+                    stats.invalidations++;
+                }
+                metadata_cache_invalidate_all();
+                continue;
+            }
+            if (event->wd < 0 || event->wd >= watched_capacity || watched_dirs[event->wd] == NULL){
+                continue;
+            }
+            char *dir = watched_dirs[event->wd];
+
+            if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)){
+                invalidate_locked(dir, 1);
+                if (event->mask & IN_MOVE_SELF){ // Watched again under its new name if anything there is cached
+                    inotify_rm_watch(inotify_fd, event->wd);
+                }
+                if (event->mask & IN_IGNORED){ // The kernel dropped the watch
+                    free(dir);
+                    watched_dirs[event->wd] = NULL;
+                }
+                continue;
+            }
+
+            if (event->len > 0){
+                snprintf(path, sizeof(path), "%s/%s", dir, event->name);
+                invalidate_locked(path, event->mask & IN_ISDIR);
+                metadata_cache_invalidate(path); // So a new or removed sibling shows up right away
+
+                // A precompressed sibling changes which variants the original file has
+                const struct encoding_info *sibling_encoding = encoding_from_suffix(path);
+                if (sibling_encoding != NULL){
+                    path[strlen(path) - strlen(sibling_encoding->suffix)] = '\0';
+                    invalidate_locked(path, 0);
+                }
+            }
+        }
+
+        pthread_mutex_unlock(&cache_lock);
+    }
+}
+
+// Copies the current counters
+void file_cache_get_stats(struct file_cache_stats *stats_copy)
+{
+    pthread_mutex_lock(&cache_lock);
+    *stats_copy = stats;
+    pthread_mutex_unlock(&cache_lock);
+}
+
+// Prints the counters if SIGUSR1 asked for them since the last call, returns 1 if it did
+int file_cache_report_if_requested(void)
+{
+    if (!stats_requested || !__atomic_exchange_n(&stats_requested, 0, __ATOMIC_ACQ_REL)){
+        return 0;
+    }
+
+    struct file_cache_stats current;
+    file_cache_get_stats(&current);
+    log_message(LEVEL_INFO, "File cache: %lu hits, %lu misses, %lu insertions, %lu evictions, %lu invalidations, "
+                "%zu entries, %zu bytes",
+                current.hits, current.misses, current.insertions, current.evictions, current.invalidations,
+                current.entries, current.bytes_used);
+    return 1;
+}
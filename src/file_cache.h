@@ -0,0 +1,77 @@
+#ifndef FILE_CACHE_H
+#define FILE_CACHE_H
+
+#include <stddef.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <time.h>
+
+// A small file held in memory along with its ready-built response headers
+struct file_cache_entry {
+    char *path; // Resolved path, the key
+    char *headers; // From Content-Type to the last header line, each response adds the status line, Date and Connection
+    size_t header_len;
+    char *body;
+    size_t body_len;
+    int variants; // ENCODING_* bits of the encoded variants the file had when it was cached
+    struct timespec source_mtime; // For variants compressed here, the mtime of the file they came from
+
+    size_t charge; // How much of the cache's budget the entry uses
+    int refcount; // The cache holds one reference, every connection sending it another
+    int cached; // Cleared once the entry is evicted or invalidated
+
+    struct file_cache_entry *hash_next;
+    struct file_cache_entry *lru_prev; // Most recently used at the head
+    struct file_cache_entry *lru_next;
+};
+
+// Counters for how well the cache is doing
+struct file_cache_stats {
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long insertions;
+    unsigned long evictions;
+    unsigned long invalidations;
+    size_t entries;
+    size_t bytes_used;
+};
+
+// Sets up the cache and its inotify watch on BASE_DIR, max_bytes of 0 disables it
+int file_cache_init(size_t max_bytes, size_t max_file_size);
+
+// Whether a file of this size may go into the cache
+int file_cache_accepts(size_t file_size);
+
+// Builds the key an encoded variant of a file is cached under, which no real path can clash with
+// Returns -1 if it doesn't fit
+int file_cache_variant_key(char *key, size_t key_size, const char *path, const char *encoding_token);
+
+// Returns the entry for a resolved path with a reference taken (or NULL on a miss)
+struct file_cache_entry *file_cache_lookup(const char *path);
+
+// Reads file_size bytes of an open file into a new entry, returns it with a reference taken (or NULL)
+// The cache keeps its own copy of the headers, which were made from file_stat
+struct file_cache_entry *file_cache_insert(const char *path, int file_fd, size_t file_size, const struct stat *file_stat,
+                                           const char *headers, size_t header_len, int variants);
+
+// Caches a body built in memory (like a compressed variant), taking it over if an entry is returned
+// Returns the entry with a reference taken (or NULL, the caller keeps the body then)
+struct file_cache_entry *file_cache_insert_buffer(const char *key, char *body, size_t body_len, const char *headers,
+                                                  size_t header_len, const struct timespec *source_mtime);
+
+// Drops a reference taken by file_cache_lookup(), file_cache_insert() or file_cache_insert_buffer()
+void file_cache_release(struct file_cache_entry *entry);
+
+// The inotify descriptor event loops should watch (or -1 if the cache is off)
+int file_cache_inotify_fd(void);
+
+// Reads pending inotify events and drops the entries they affect
+void file_cache_process_events(void);
+
+// Copies the current counters
+void file_cache_get_stats(struct file_cache_stats *stats);
+
+// Prints the counters if SIGUSR1 asked for them since the last call, returns 1 if it did
+int file_cache_report_if_requested(void);
+
+#endif
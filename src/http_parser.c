@@ -0,0 +1,212 @@
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include "http_parser.h"
+#include "http_scan.h"
+
+// Gets a parser ready for the next request
+void http_parser_init(struct http_parser *parser)
+{
+    memset(parser, 0, sizeof(struct http_parser));
+    parser->state = PARSER_REQUEST_LINE;
+}
+
+// Cuts the next space-separated word off a line, returns 0 if there's none left
+static int next_word(char **cursor, char *line_end, struct slice *word)
+{
+    char *c = *cursor;
+    while (c < line_end && *c == ' '){
+        c++;
+    }
+    if (c == line_end){
+        return 0;
+    }
+
+    word->data = c;
+    word->len = scan_space(c, line_end - c);
+    *cursor = c + word->len;
+    return 1;
+}
+
+// Reads up to three digits, returns -1 if there are none (or more)
+static int parse_version_number(const char **cursor)
+{
+    const char *c = *cursor;
+    int value = 0, digits = 0;
+    while (*c >= '0' && *c <= '9'){
+        if (++digits > 3){
+            return -1;
+        }
+        value = value * 10 + (*c++ - '0');
+    }
+    *cursor = c;
+    return digits ? value : -1;
+}
+
+// Splits the request line into method, URI and version, returns 0 or -status
+static int parse_request_line(struct http_parser *parser, char *line, char *line_end)
+{
+    char *cursor = line;
+    if (!next_word(&cursor, line_end, &parser->method) || !next_word(&cursor, line_end, &parser->uri)){
+        return -400;
+    }
+
+    // HTTP/0.9 requests don't have a version, and only know GET
+    if (!next_word(&cursor, line_end, &parser->version)){
+        if (parser->method.len != 3 || memcmp(parser->method.data, "GET", 3)){
+            return -400;
+        }
+        parser->version.data = NULL;
+        parser->is_http09 = 1;
+    }
+    struct slice extra_word;
+    if (next_word(&cursor, line_end, &extra_word)){
+        return -400;
+    }
+
+    parser->method.data[parser->method.len] = '\0';
+    parser->uri.data[parser->uri.len] = '\0';
+    if (parser->is_http09){
+        return 0;
+    }
+    parser->version.data[parser->version.len] = '\0';
+
+    // "HTTP/" major "." minor, nothing else
+    const char *c = parser->version.data;
+    if (strncmp(c, "HTTP/", 5)){
+        return -400;
+    }
+    c += 5;
+    if ((parser->major_version = parse_version_number(&c)) < 0 || *c++ != '.' ||
+        (parser->minor_version = parse_version_number(&c)) < 0 || *c != '\0'){
+        return -400;
+    }
+    return 0;
+}
+
+// Returns where a header's value goes if it's one we act on (or NULL)
+static struct slice *known_header(struct http_parser *parser, const char *name, size_t name_len)
+{
+    // The length alone narrows it down to one candidate
+    switch (name_len){
+        case 4: return !strncasecmp(name, "Host", 4) ? &parser->host : NULL;
+        case 5: return !strncasecmp(name, "Range", 5) ? &parser->range : NULL;
+        case 8: return !strncasecmp(name, "If-Range", 8) ? &parser->if_range : NULL;
+        case 10: return !strncasecmp(name, "Connection", 10) ? &parser->connection : NULL;
+        case 13: return !strncasecmp(name, "If-None-Match", 13) ? &parser->if_none_match : NULL;
+        case 14: return !strncasecmp(name, "Content-Length", 14) ? &parser->content_length : NULL;
+        case 15: return !strncasecmp(name, "Accept-Encoding", 15) ? &parser->accept_encoding : NULL;
+        case 17:
+            if (!strncasecmp(name, "Transfer-Encoding", 17)){
+                return &parser->transfer_encoding;
+            }
+            return !strncasecmp(name, "If-Modified-Since", 17) ? &parser->if_modified_since : NULL;
+        default: return NULL;
+    }
+}
+
+// Picks the value out of a "Name: value" line if it's a header we act on, returns 0 or -status
+static int parse_header_line(struct http_parser *parser, char *line, char *line_end)
+{
+    char *colon = memchr(line, ':', line_end - line);
+
+    // Folded lines are long obsolete, and whitespace before the colon is a smuggling hazard
+    if (colon == NULL || colon == line || *line == ' ' || *line == '\t' || colon[-1] == ' ' || colon[-1] == '\t'){
+        return -400;
+    }
+
+    struct slice *value = known_header(parser, line, colon - line);
+    if (value == NULL){
+        return 0;
+    }
+    if ((value == &parser->host || value == &parser->content_length) && value->data != NULL){
+        return -400; // Which host (or body length) would it be?
+    }
+
+    // Trim the whitespace around the value
+    char *value_start = colon + 1;
+    while (value_start < line_end && (*value_start == ' ' || *value_start == '\t')){
+        value_start++;
+    }
+    char *value_end = line_end;
+    while (value_end > value_start && (value_end[-1] == ' ' || value_end[-1] == '\t')){
+        value_end--;
+    }
+
+    value->data = value_start;
+    value->len = value_end - value_start;
+    *value_end = '\0';
+    return 0;
+}
+
+// Works out the body's length once the headers are done, returns 0 or -status
+// A body the server can't frame would be read as the next request, so anything doubtful is refused
+static int parse_body_length(struct http_parser *parser)
+{
+    if (parser->transfer_encoding.data != NULL){
+        return -501; // We don't take chunked (or any other coded) bodies
+    }
+    if (parser->content_length.data == NULL){
+        return 0;
+    }
+    const char *c = parser->content_length.data;
+    if (*c == '\0'){
+        return -400;
+    }
+    size_t length = 0;
+    for (; *c != '\0'; c++){
+        if (*c < '0' || *c > '9' || length > (SIZE_MAX - 9) / 10){
+            return -400; // Not a single plain number, or one no buffer could hold anyway
+        }
+        length = length * 10 + (*c - '0');
+    }
+    parser->body_length = length;
+    return 0;
+}
+
+// Parses whatever arrived since the last call (the request starts at buffer, len bytes have arrived so far)
+// Returns the length of the request's head once it's complete (the body_length bytes after it are the body),
+// 0 if more is needed, or -status (like -400) if it's malformed
+ssize_t http_parser_execute(struct http_parser *parser, char *buffer, size_t len)
+{
+    while (parser->state != PARSER_DONE){
+        // Only the bytes that weren't looked at last time get searched
+        size_t stop = parser->scanned + scan_line_end(buffer + parser->scanned, len - parser->scanned);
+        if (stop == len){
+            parser->scanned = len;
+            return 0;
+        }
+        if (buffer[stop] != '\n'){
+            return -400; // A control character has no business in a request
+        }
+        char *newline = buffer + stop;
+
+        char *line = buffer + parser->offset;
+        char *line_end = newline;
+        if (line_end > line && line_end[-1] == '\r'){
+            line_end--;
+        }
+        parser->offset = parser->scanned = newline - buffer + 1;
+
+        int retval = 0;
+        if (parser->state == PARSER_REQUEST_LINE){
+            if (line_end == line){
+                continue; // Empty lines before a request are tolerated
+            }
+            retval = parse_request_line(parser, line, line_end);
+            if (retval == 0){ // A malformed request line leaves the state be, so nothing trusts its pieces
+                parser->state = parser->is_http09 ? PARSER_DONE : PARSER_HEADERS;
+            }
+        } else if (line_end == line){
+            parser->state = PARSER_DONE; // The empty line ends the headers
+            retval = parse_body_length(parser);
+        } else {
+            retval = parse_header_line(parser, line, line_end);
+        }
+        if (retval < 0){
+            return retval;
+        }
+    }
+
+    return parser->offset;
+}
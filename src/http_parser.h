@@ -0,0 +1,58 @@
+#ifndef HTTP_PARSER_H
+#define HTTP_PARSER_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+// A piece of the receive buffer
+// The parser also NUL-terminates it in place (over the space or line end behind it), so data works as a C string
+struct slice {
+    char *data; // NULL if it wasn't in the request
+    size_t len;
+};
+
+// How far a request has been parsed
+enum parser_state {
+    PARSER_REQUEST_LINE,
+    PARSER_HEADERS,
+    PARSER_DONE
+};
+
+// Parses one request as it arrives, picking up where the last call stopped when more bytes come in
+struct http_parser {
+    enum parser_state state;
+    size_t offset; // Start of the first line that isn't parsed yet
+    size_t scanned; // How far the search for that line's end got
+
+    // The request line
+    struct slice method;
+    struct slice uri;
+    struct slice version;
+    int major_version;
+    int minor_version;
+    int is_http09; // Just "GET <uri>", without a version or headers
+
+    // The headers we act on, everything else is skipped
+    struct slice host;
+    struct slice connection;
+    struct slice accept_encoding;
+    struct slice range;
+    struct slice if_range;
+    struct slice if_none_match;
+    struct slice if_modified_since;
+
+    // How the request's body is framed, there's only ever a Content-Length one (Transfer-Encoding is refused)
+    struct slice content_length;
+    struct slice transfer_encoding;
+    size_t body_length; // What Content-Length said, once the headers are done
+};
+
+// Gets a parser ready for the next request
+void http_parser_init(struct http_parser *parser);
+
+// Parses whatever arrived since the last call (the request starts at buffer, len bytes have arrived so far)
+// Returns the length of the request's head once it's complete (the body_length bytes after it are the body),
+// 0 if more is needed, or -status (like -400) if it's malformed
+ssize_t http_parser_execute(struct http_parser *parser, char *buffer, size_t len);
+
+#endif
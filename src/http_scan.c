@@ -0,0 +1,221 @@
+#include <string.h>
+#include "http_scan.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS
+#endif
+
+// One set of kernels
+struct scan_kernels {
+    const char *name;
+    size_t (*line_end)(const char *data, size_t len);
+    size_t (*space)(const char *data, size_t len);
+    size_t (*uri_special)(const char *data, size_t len);
+};
+
+// Whether a byte ends a line or can't appear in one
+static inline int is_line_stop(unsigned char c)
+{
+    return (c < 0x20 && c != '\t' && c != '\r') || c == 0x7f;
+}
+
+// Whether decode_URI() has to deal with a byte
+static inline int is_uri_special(unsigned char c)
+{
+    return c < 0x20 || c == 0x7f || c == '%' || c == '+';
+}
+
+static size_t scalar_line_end(const char *data, size_t len)
+{
+    size_t i = 0;
+    while (i < len && !is_line_stop((unsigned char)data[i])){
+        i++;
+    }
+    return i;
+}
+
+static size_t scalar_space(const char *data, size_t len)
+{
+    const char *space = memchr(data, ' ', len);
+    return space != NULL ? (size_t)(space - data) : len;
+}
+
+static size_t scalar_uri_special(const char *data, size_t len)
+{
+    size_t i = 0;
+    while (i < len && !is_uri_special((unsigned char)data[i])){
+        i++;
+    }
+    return i;
+}
+
+static const struct scan_kernels SCALAR_KERNELS = {"scalar", scalar_line_end, scalar_space, scalar_uri_special};
+
+#ifdef HAVE_X86_KERNELS
+
+// PCMPESTRI looks for any byte inside a list of ranges, so each kernel is one ranges string
+#define SSE42_RANGES (_SIDD_UBYTE_OPS | _SIDD_CMP_RANGES | _SIDD_LEAST_SIGNIFICANT)
+
+// Runs PCMPESTRI over 16 bytes at a time, the last few bytes go through the scalar kernel
+__attribute__((target("sse4.2")))
+static inline size_t sse42_find_ranges(const char *data, size_t len, __m128i ranges, int ranges_len,
+                                       size_t (*scalar)(const char *, size_t))
+{
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16){
+        __m128i chunk = _mm_loadu_si128((const __m128i *)(data + i));
+        int index = _mm_cmpestri(ranges, ranges_len, chunk, 16, SSE42_RANGES);
+        if (index < 16){
+            return i + index;
+        }
+    }
+    return i + scalar(data + i, len - i);
+}
+
+__attribute__((target("sse4.2")))
+static size_t sse42_line_end(const char *data, size_t len)
+{
+    const __m128i ranges = _mm_setr_epi8(0x00, 0x08, 0x0a, 0x0c, 0x0e, 0x1f, 0x7f, 0x7f, 0, 0, 0, 0, 0, 0, 0, 0);
+    return sse42_find_ranges(data, len, ranges, 8, scalar_line_end);
+}
+
+__attribute__((target("sse4.2")))
+static size_t sse42_space(const char *data, size_t len)
+{
+    const __m128i ranges = _mm_setr_epi8(' ', ' ', 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+    return sse42_find_ranges(data, len, ranges, 2, scalar_space);
+}
+
+__attribute__((target("sse4.2")))
+static size_t sse42_uri_special(const char *data, size_t len)
+{
+    const __m128i ranges = _mm_setr_epi8(0x00, 0x1f, '%', '%', '+', '+', 0x7f, 0x7f, 0, 0, 0, 0, 0, 0, 0, 0);
+    return sse42_find_ranges(data, len, ranges, 8, scalar_uri_special);
+}
+
+// The AVX2 kernels leave anything shorter than 32 bytes to the SSE4.2 ones (every AVX2 CPU has SSE4.2),
+// as most header lines are only a few dozen bytes long
+
+// Bytes at or below 0x1f, as a compare mask (AVX2 only has signed compares, so it goes through an unsigned min)
+__attribute__((target("avx2")))
+static inline __m256i avx2_controls(__m256i chunk)
+{
+    return _mm256_cmpeq_epi8(_mm256_min_epu8(chunk, _mm256_set1_epi8(0x1f)), chunk);
+}
+
+__attribute__((target("avx2")))
+static size_t avx2_line_end(const char *data, size_t len)
+{
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32){
+        __m256i chunk = _mm256_loadu_si256((const __m256i *)(data + i));
+        __m256i allowed = _mm256_or_si256(_mm256_cmpeq_epi8(chunk, _mm256_set1_epi8('\t')),
+                                          _mm256_cmpeq_epi8(chunk, _mm256_set1_epi8('\r')));
+        __m256i stops = _mm256_or_si256(_mm256_andnot_si256(allowed, avx2_controls(chunk)),
+                                        _mm256_cmpeq_epi8(chunk, _mm256_set1_epi8(0x7f)));
+        unsigned mask = _mm256_movemask_epi8(stops);
+        if (mask != 0){
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return i + sse42_line_end(data + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static size_t avx2_space(const char *data, size_t len)
+{
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32){
+        __m256i chunk = _mm256_loadu_si256((const __m256i *)(data + i));
+        unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, _mm256_set1_epi8(' ')));
+        if (mask != 0){
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return i + sse42_space(data + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static size_t avx2_uri_special(const char *data, size_t len)
+{
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32){
+        __m256i chunk = _mm256_loadu_si256((const __m256i *)(data + i));
+        __m256i specials = _mm256_or_si256(_mm256_cmpeq_epi8(chunk, _mm256_set1_epi8('%')),
+                                           _mm256_cmpeq_epi8(chunk, _mm256_set1_epi8('+')));
+        specials = _mm256_or_si256(specials, _mm256_cmpeq_epi8(chunk, _mm256_set1_epi8(0x7f)));
+        unsigned mask = _mm256_movemask_epi8(_mm256_or_si256(specials, avx2_controls(chunk)));
+        if (mask != 0){
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return i + sse42_uri_special(data + i, len - i);
+}
+
+static const struct scan_kernels SSE42_KERNELS = {"sse4.2", sse42_line_end, sse42_space, sse42_uri_special};
+static const struct scan_kernels AVX2_KERNELS = {"avx2", avx2_line_end, avx2_space, avx2_uri_special};
+
+#endif
+
+// Set once at startup, before any worker thread runs
+static const struct scan_kernels *kernels = &SCALAR_KERNELS;
+
+// Switches to a kernel, returns -1 if the CPU doesn't support it
+int http_scan_use(enum scan_kernel kernel)
+{
+    switch (kernel){
+        case SCAN_SCALAR:
+            kernels = &SCALAR_KERNELS;
+            return 0;
+#ifdef HAVE_X86_KERNELS
+        case SCAN_SSE42:
+            if (!__builtin_cpu_supports("sse4.2")){
+                return -1;
+            }
+            kernels = &SSE42_KERNELS;
+            return 0;
+        case SCAN_AVX2:
+            if (!__builtin_cpu_supports("avx2")){
+                return -1;
+            }
+            kernels = &AVX2_KERNELS;
+            return 0;
+#endif
+        default:
+            return -1;
+    }
+}
+
+// Picks the fastest kernel the CPU supports
+void http_scan_init(void)
+{
+    if (http_scan_use(SCAN_AVX2) < 0 && http_scan_use(SCAN_SSE42) < 0){
+        http_scan_use(SCAN_SCALAR);
+    }
+}
+
+// The name of the kernel in use (like "avx2")
+const char *http_scan_kernel_name(void)
+{
+    return kernels->name;
+}
+
+// Returns the offset of the first '\n' or forbidden control character (anything below 0x20 but tab and '\r',
+// and DEL), or len if there's neither
+size_t scan_line_end(const char *data, size_t len)
+{
+    return kernels->line_end(data, len);
+}
+
+// Returns the offset of the first space, or len
+size_t scan_space(const char *data, size_t len)
+{
+    return kernels->space(data, len);
+}
+
+// Returns the offset of the first byte decode_URI() has to look at ('%', '+' or a control character), or len
+size_t scan_uri_special(const char *data, size_t len)
+{
+    return kernels->uri_special(data, len);
+}
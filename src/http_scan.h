@@ -0,0 +1,32 @@
+#ifndef HTTP_SCAN_H
+#define HTTP_SCAN_H
+
+#include <stddef.h>
+
+// The byte-scanning kernels the parser can run on
+enum scan_kernel {
+    SCAN_SCALAR,
+    SCAN_SSE42, // 16 bytes at a time with PCMPESTRI
+    SCAN_AVX2 // 32 bytes at a time
+};
+
+// Picks the fastest kernel the CPU supports
+void http_scan_init(void);
+
+// Switches to a kernel, returns -1 if the CPU doesn't support it
+int http_scan_use(enum scan_kernel kernel);
+
+// The name of the kernel in use (like "avx2")
+const char *http_scan_kernel_name(void);
+
+// Returns the offset of the first '\n' or forbidden control character (anything below 0x20 but tab and '\r',
+// and DEL), or len if there's neither
+size_t scan_line_end(const char *data, size_t len);
+
+// Returns the offset of the first space, or len
+size_t scan_space(const char *data, size_t len);
+
+// Returns the offset of the first byte decode_URI() has to look at ('%', '+' or a control character), or len
+size_t scan_uri_special(const char *data, size_t len);
+
+#endif
@@ -0,0 +1,543 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "logging.h"
+
+// Every thread logs into its own ring without locks or system calls, a single writer thread drains
+// them all every few milliseconds and writes each output in large batches
+#define RING_SIZE (512 * 1024) // Per thread, a power of two
+#define RECORD_ALIGN 8
+#define MESSAGE_MAX 1024 // Longer messages are cut off
+#define URI_MAX 2048 // Longer URIs are cut off in the access log
+#define SHORT_FIELD_MAX 32 // Same for the method and the version
+#define OUTPUT_BUF_SIZE (64 * 1024)
+#define LINE_MAX_LEN (6 * URI_MAX + 1024) // The most one formatted line can take, escaping included
+
+// The writer sleeps this long while there's something to write, and backs off to WRITER_MAX_SLEEP_NS when idle
+#define WRITER_MIN_SLEEP_NS 1000000
+#define WRITER_MAX_SLEEP_NS 32000000
+
+enum record_kind {
+    RECORD_PADDING, // Fills the end of the ring when the next record doesn't fit there
+    RECORD_MESSAGE,
+    RECORD_ACCESS
+};
+
+// What every record in a ring starts with
+struct record_header {
+    uint32_t size; // Of the whole record, a multiple of RECORD_ALIGN
+    uint16_t kind;
+    uint16_t level; // Of a message
+    int64_t seconds; // Wall-clock time the record was made
+    int64_t microseconds;
+};
+
+// A log message, its text follows
+struct message_record {
+    struct record_header header;
+    uint32_t text_len;
+    char text[];
+};
+
+// An access log entry, the method, URI and version follow back to back
+struct access_record {
+    struct record_header header;
+    uint64_t bytes_sent;
+    uint64_t duration_ns;
+    int32_t status_code;
+    uint16_t family; // AF_INET, AF_INET6 or 0 if the address isn't known
+    uint8_t address[16];
+    uint16_t method_len; // 0 without a request line
+    uint16_t uri_len;
+    uint16_t version_len; // 0 for HTTP/0.9
+    char strings[];
+};
+
+// One thread's records, written by that thread and read by the writer
+struct log_ring {
+    char *data;
+    size_t head __attribute__((aligned(64))); // Only moved by the owning thread
+    uint64_t dropped; // Records that didn't fit, also only written by the owning thread
+    size_t tail __attribute__((aligned(64))); // Only moved by the writer
+    struct log_ring *next;
+};
+
+// Where the writer's batches go
+enum output_index {
+    OUTPUT_STDOUT,
+    OUTPUT_STDERR,
+    OUTPUT_ACCESS,
+    OUTPUT_COUNT
+};
+
+// A batch of lines waiting for one write()
+struct log_output {
+    int fd;
+    size_t len;
+    char buf[OUTPUT_BUF_SIZE];
+};
+
+static const char *LEVEL_NAMES[] = {"error", "warning", "info", "debug"};
+static const char *MONTH_NAMES[] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+
+static enum log_level log_level = LEVEL_INFO;
+static enum access_log_format access_format = ACCESS_LOG_CLF;
+static int access_enabled = 0;
+static int writer_running = 0;
+
+// Every thread's ring, the lock only guards adding to the list
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct log_ring *registry_head = NULL;
+
+static __thread struct log_ring *local_ring = NULL;
+
+// Only one thread drains at a time: the writer, or one flushing at exit
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct log_output outputs[OUTPUT_COUNT] = {
+    [OUTPUT_STDOUT] = {.fd = STDOUT_FILENO},
+    [OUTPUT_STDERR] = {.fd = STDERR_FILENO},
+    [OUTPUT_ACCESS] = {.fd = -1},
+};
+static uint64_t dropped_reported = 0;
+
+// The rendered dates of the last second a record was made in (only used while draining)
+static int64_t date_second = -1;
+static char iso_date[32]; // 2026-10-17T01:05:40
+static char clf_date[32]; // 17/Oct/2026:01:05:40 +0000
+
+// Returns the calling thread's ring, registering it on first use (or NULL if that failed)
+static struct log_ring *log_ring_get(void)
+{
+    if (local_ring != NULL){
+        return local_ring;
+    }
+
+    struct log_ring *ring = calloc(1, sizeof(struct log_ring));
+    if (ring == NULL){
+        return NULL;
+    }
+    ring->data = malloc(RING_SIZE);
+    if (ring->data == NULL){
+        free(ring);
+        return NULL;
+    }
+    pthread_mutex_lock(&registry_lock);
+    ring->next = registry_head;
+    __atomic_store_n(&registry_head, ring, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&registry_lock);
+
+    local_ring = ring;
+    return ring;
+}
+
+// Makes room for a record of size bytes at the ring's head, *next_head is where the head goes once it's written
+// Returns where to write it, or NULL if the ring is full (the record is counted as dropped)
+static void *ring_reserve(struct log_ring *ring, size_t size, size_t *next_head)
+{
+    size_t head = ring->head;
+    size_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    size_t offset = head & (RING_SIZE - 1);
+    size_t padding = offset + size > RING_SIZE ? RING_SIZE - offset : 0; // Records never wrap around
+
+    if (head + padding + size - tail > RING_SIZE){
+        __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    if (padding > 0){
+        struct record_header *filler = (struct record_header *)(ring->data + offset);
+        filler->size = padding;
+        filler->kind = RECORD_PADDING;
+        offset = 0;
+    }
+    *next_head = head + padding + size;
+    return ring->data + offset;
+}
+
+// Hands a reserved record over to the writer
+static void ring_commit(struct log_ring *ring, size_t next_head)
+{
+    __atomic_store_n(&ring->head, next_head, __ATOMIC_RELEASE);
+}
+
+// Fills in a record's header with the current time
+static void record_header_init(struct record_header *header, size_t size, enum record_kind kind, enum log_level level)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    header->size = size;
+    header->kind = kind;
+    header->level = level;
+    header->seconds = now.tv_sec;
+    header->microseconds = now.tv_nsec / 1000;
+}
+
+// Rounds a record's size up to RECORD_ALIGN
+static size_t record_size(size_t size)
+{
+    return (size + RECORD_ALIGN - 1) & ~(size_t)(RECORD_ALIGN - 1);
+}
+
+// Renders the dates of a second, unless they're already there
+static void render_dates(int64_t seconds)
+{
+    if (seconds == date_second){
+        return;
+    }
+    time_t time_value = seconds;
+    struct tm tm;
+    gmtime_r(&time_value, &tm);
+    snprintf(iso_date, sizeof(iso_date), "%04d-%02d-%02dT%02d:%02d:%02d",
+             tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec);
+    snprintf(clf_date, sizeof(clf_date), "%02d/%s/%04d:%02d:%02d:%02d +0000",
+             tm.tm_mday, MONTH_NAMES[tm.tm_mon], tm.tm_year + 1900, tm.tm_hour, tm.tm_min, tm.tm_sec);
+    date_second = seconds;
+}
+
+// Renders a message line into out (which has room for LINE_MAX_LEN), returns its length
+static size_t format_message(char *out, const struct record_header *header, const char *text, size_t text_len)
+{
+    render_dates(header->seconds);
+    int len = snprintf(out, LINE_MAX_LEN, "%s.%03dZ [%s] ", iso_date, (int)(header->microseconds / 1000),
+                       LEVEL_NAMES[header->level]);
+    memcpy(out + len, text, text_len);
+    out[len + text_len] = '\n';
+    return len + text_len + 1;
+}
+
+// Copies a string from a request into a log line, escaping what would break the line's syntax
+// In JSON, quotes, backslashes and bytes outside printable ASCII become \uXXXX, in CLF \xXX
+static size_t escape_string(char *out, const char *string, size_t len, int json)
+{
+    static const char HEX[] = "0123456789abcdef";
+    size_t out_len = 0;
+
+    for (size_t i = 0; i < len; i++){
+        unsigned char c = string[i];
+        if (c >= 0x20 && c < 0x7f && c != '"' && c != '\\'){
+            out[out_len++] = c;
+        } else if (json){
+            memcpy(out + out_len, "\\u00", 4);
+            out[out_len + 4] = HEX[c >> 4];
+            out[out_len + 5] = HEX[c & 15];
+            out_len += 6;
+        } else {
+            out[out_len] = '\\';
+            out[out_len + 1] = 'x';
+            out[out_len + 2] = HEX[c >> 4];
+            out[out_len + 3] = HEX[c & 15];
+            out_len += 4;
+        }
+    }
+    return out_len;
+}
+
+// Renders an access log line into out (which has room for LINE_MAX_LEN), returns its length
+static size_t format_access(char *out, const struct access_record *record)
+{
+    int json = access_format == ACCESS_LOG_JSON;
+    char address[INET6_ADDRSTRLEN] = "-";
+    if (record->family != 0){
+        inet_ntop(record->family, record->address, address, sizeof(address));
+    }
+    const char *method = record->strings;
+    const char *uri = method + record->method_len;
+    const char *version = uri + record->uri_len;
+    size_t len;
+
+    render_dates(record->header.seconds);
+    if (json){
+        len = snprintf(out, LINE_MAX_LEN, "{\"time\":\"%s.%03dZ\",\"remote\":\"%s\",\"method\":\"", iso_date,
+                       (int)(record->header.microseconds / 1000), address);
+        len += escape_string(out + len, method, record->method_len, 1);
+        len += snprintf(out + len, LINE_MAX_LEN - len, "\",\"uri\":\"");
+        len += escape_string(out + len, uri, record->uri_len, 1);
+        len += snprintf(out + len, LINE_MAX_LEN - len, "\",\"protocol\":\"");
+        len += escape_string(out + len, version, record->version_len, 1);
+        len += snprintf(out + len, LINE_MAX_LEN - len, "\",\"status\":%d,\"bytes\":%lu,\"duration_us\":%lu}\n",
+                        record->status_code, record->bytes_sent, record->duration_ns / 1000);
+        return len;
+    }
+
+    // host ident authuser [date] "request line" status bytes
+    len = snprintf(out, LINE_MAX_LEN, "%s - - [%s] \"", address, clf_date);
+    if (record->method_len == 0){
+        out[len++] = '-';
+    } else {
+        len += escape_string(out + len, method, record->method_len, 0);
+        out[len++] = ' ';
+        len += escape_string(out + len, uri, record->uri_len, 0);
+        if (record->version_len > 0){
+            out[len++] = ' ';
+            len += escape_string(out + len, version, record->version_len, 0);
+        }
+    }
+    if (record->bytes_sent > 0){
+        len += snprintf(out + len, LINE_MAX_LEN - len, "\" %d %lu\n", record->status_code, record->bytes_sent);
+    } else {
+        len += snprintf(out + len, LINE_MAX_LEN - len, "\" %d -\n", record->status_code);
+    }
+    return len;
+}
+
+// Writes everything out, a write() that fails loses the batch rather than stalling the writer
+static void write_all(int fd, const char *buf, size_t len)
+{
+    while (len > 0){
+        ssize_t written = write(fd, buf, len);
+        if (written < 0){
+            if (errno == EINTR){
+                continue;
+            }
+            return;
+        }
+        buf += written;
+        len -= written;
+    }
+}
+
+// Writes an output's batch
+static void output_flush(struct log_output *output)
+{
+    if (output->len > 0){
+        write_all(output->fd, output->buf, output->len);
+        output->len = 0;
+    }
+}
+
+// Returns where the next line of an output goes, with room for LINE_MAX_LEN
+static char *output_line(struct log_output *output)
+{
+    if (output->len + LINE_MAX_LEN > sizeof(output->buf)){
+        output_flush(output);
+    }
+    return output->buf + output->len;
+}
+
+// Renders a record into its output's batch
+static void write_record(const struct record_header *header)
+{
+    if (header->kind == RECORD_MESSAGE){
+        const struct message_record *message = (const struct message_record *)header;
+        struct log_output *output = &outputs[header->level <= LEVEL_WARNING ? OUTPUT_STDERR : OUTPUT_STDOUT];
+        output->len += format_message(output_line(output), header, message->text, message->text_len);
+    } else if (header->kind == RECORD_ACCESS && outputs[OUTPUT_ACCESS].fd >= 0){
+        struct log_output *output = &outputs[OUTPUT_ACCESS];
+        output->len += format_access(output_line(output), (const struct access_record *)header);
+    }
+}
+
+// Renders every record of every ring into the batches and writes them, drain_lock must be held
+// Returns how many records there were
+static size_t drain_rings(void)
+{
+    size_t count = 0;
+    uint64_t dropped = 0;
+
+    for (struct log_ring *ring = __atomic_load_n(&registry_head, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next){
+        size_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        size_t tail = ring->tail;
+        while (tail != head){
+            const struct record_header *header = (const struct record_header *)(ring->data + (tail & (RING_SIZE - 1)));
+            write_record(header);
+            tail += header->size;
+            count++;
+        }
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+        dropped += __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+    }
+
+    if (dropped > dropped_reported){
+        struct log_output *output = &outputs[OUTPUT_STDERR];
+        char text[128];
+        int text_len = snprintf(text, sizeof(text), "log - %lu records were dropped, the writer couldn't keep up",
+                                dropped - dropped_reported);
+        struct record_header header;
+        record_header_init(&header, 0, RECORD_MESSAGE, LEVEL_WARNING);
+        output->len += format_message(output_line(output), &header, text, text_len);
+        dropped_reported = dropped;
+    }
+
+    for (int i = 0; i < OUTPUT_COUNT; i++){
+        output_flush(&outputs[i]);
+    }
+    return count;
+}
+
+// Drains the rings every few milliseconds, for as long as the process runs
+static void *writer_main(void *arg)
+{
+    (void)arg;
+    long sleep_ns = WRITER_MIN_SLEEP_NS;
+
+    for (;;){
+        pthread_mutex_lock(&drain_lock);
+        size_t count = drain_rings();
+        pthread_mutex_unlock(&drain_lock);
+
+        if (count > 0){
+            sleep_ns = WRITER_MIN_SLEEP_NS;
+        } else if (sleep_ns < WRITER_MAX_SLEEP_NS){
+            sleep_ns *= 2;
+        }
+        struct timespec pause = {.tv_sec = 0, .tv_nsec = sleep_ns};
+        nanosleep(&pause, NULL);
+    }
+    return NULL;
+}
+
+// Starts the background writer and opens the access log (path "-" is stdout, NULL for no access log)
+// Until then, messages are written straight away. Returns -1 on error
+int log_init(enum log_level level, const char *access_log_path, enum access_log_format format)
+{
+    log_level = level;
+    access_format = format;
+
+    if (access_log_path != NULL){
+        if (!strcmp(access_log_path, "-")){
+            outputs[OUTPUT_ACCESS].fd = STDOUT_FILENO;
+        } else {
+            outputs[OUTPUT_ACCESS].fd = open(access_log_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+            if (outputs[OUTPUT_ACCESS].fd < 0){
+                log_perror("log_init - error opening the access log");
+                return -1;
+            }
+        }
+        access_enabled = 1;
+    }
+
+    pthread_t writer;
+    int retval = pthread_create(&writer, NULL, writer_main, NULL);
+    if (retval != 0){
+        log_message(LEVEL_ERROR, "log_init - pthread_create: %s", strerror(retval));
+        return -1;
+    }
+    pthread_detach(writer);
+    writer_running = 1;
+    atexit(log_flush);
+    return 0;
+}
+
+// Whether messages of a level are logged, for skipping work that only feeds them
+int log_level_enabled(enum log_level level)
+{
+    return level <= log_level;
+}
+
+// Puts a message into the calling thread's ring, or writes it straight away if there's no writer (yet)
+static void log_text(enum log_level level, const char *text, size_t text_len)
+{
+    struct log_ring *ring = writer_running ? log_ring_get() : NULL;
+    if (ring == NULL){
+        struct record_header header;
+        char line[LINE_MAX_LEN];
+        record_header_init(&header, 0, RECORD_MESSAGE, level);
+        pthread_mutex_lock(&drain_lock); // For the cached dates
+        size_t len = format_message(line, &header, text, text_len);
+        pthread_mutex_unlock(&drain_lock);
+        write_all(level <= LEVEL_WARNING ? STDERR_FILENO : STDOUT_FILENO, line, len);
+        return;
+    }
+
+    size_t size = record_size(offsetof(struct message_record, text) + text_len);
+    size_t next_head;
+    struct message_record *record = ring_reserve(ring, size, &next_head);
+    if (record == NULL){
+        return;
+    }
+    record_header_init(&record->header, size, RECORD_MESSAGE, level);
+    record->text_len = text_len;
+    memcpy(record->text, text, text_len);
+    ring_commit(ring, next_head);
+}
+
+// Logs a message (errors and warnings go to stderr, the rest to stdout), no newline needed
+void log_message(enum log_level level, const char *format, ...)
+{
+    if (level > log_level){
+        return;
+    }
+    int saved_errno = errno; // Callers may still look at it
+    char text[MESSAGE_MAX];
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(text, sizeof(text), format, args);
+    va_end(args);
+    if (len >= 0){
+        log_text(level, text, (size_t)len < sizeof(text) ? (size_t)len : sizeof(text) - 1);
+    }
+    errno = saved_errno;
+}
+
+// Logs an error along with errno's description, like perror()
+void log_perror(const char *message)
+{
+    char error[256];
+    const char *description = strerror_r(errno, error, sizeof(error));
+    log_message(LEVEL_ERROR, "%s: %s", message, description);
+}
+
+// Whether there is an access log
+int log_access_enabled(void)
+{
+    return access_enabled;
+}
+
+// Adds a request to the access log
+void log_access(const struct access_entry *entry)
+{
+    struct log_ring *ring = log_ring_get();
+    if (ring == NULL){
+        return;
+    }
+    size_t method_len = entry->method != NULL ? entry->method_len : 0;
+    size_t uri_len = entry->method != NULL ? entry->uri_len : 0;
+    size_t version_len = entry->method != NULL && entry->version != NULL ? entry->version_len : 0;
+    method_len = method_len < SHORT_FIELD_MAX ? method_len : SHORT_FIELD_MAX;
+    uri_len = uri_len < URI_MAX ? uri_len : URI_MAX;
+    version_len = version_len < SHORT_FIELD_MAX ? version_len : SHORT_FIELD_MAX;
+
+    size_t size = record_size(offsetof(struct access_record, strings) + method_len + uri_len + version_len);
+    size_t next_head;
+    struct access_record *record = ring_reserve(ring, size, &next_head);
+    if (record == NULL){
+        return;
+    }
+    record_header_init(&record->header, size, RECORD_ACCESS, LEVEL_INFO);
+    record->bytes_sent = entry->bytes_sent;
+    record->duration_ns = entry->duration_ns;
+    record->status_code = entry->status_code;
+    record->family = 0;
+    if (entry->peer != NULL && entry->peer->ss_family == AF_INET){
+        record->family = AF_INET;
+        memcpy(record->address, &((const struct sockaddr_in *)entry->peer)->sin_addr, 4);
+    } else if (entry->peer != NULL && entry->peer->ss_family == AF_INET6){
+        record->family = AF_INET6;
+        memcpy(record->address, &((const struct sockaddr_in6 *)entry->peer)->sin6_addr, 16);
+    }
+    record->method_len = method_len;
+    record->uri_len = uri_len;
+    record->version_len = version_len;
+    if (method_len > 0){
+        memcpy(record->strings, entry->method, method_len);
+        memcpy(record->strings + method_len, entry->uri, uri_len);
+    }
+    if (version_len > 0){
+        memcpy(record->strings + method_len + uri_len, entry->version, version_len);
+    }
+    ring_commit(ring, next_head);
+}
+
+// Writes out everything logged so far (at exit, from any thread)
+void log_flush(void)
+{
+    pthread_mutex_lock(&drain_lock);
+    drain_rings();
+    pthread_mutex_unlock(&drain_lock);
+}
@@ -0,0 +1,58 @@
+#ifndef LOGGING_H
+#define LOGGING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+// How much gets logged, every level includes the ones before it
+enum log_level {
+    LEVEL_ERROR,
+    LEVEL_WARNING,
+    LEVEL_INFO,
+    LEVEL_DEBUG // Every connection and response
+};
+
+// How access log lines look
+enum access_log_format {
+    ACCESS_LOG_CLF, // Common Log Format
+    ACCESS_LOG_JSON // One JSON object per line
+};
+
+// One answered request for the access log, the strings don't need to be NUL-terminated
+struct access_entry {
+    const struct sockaddr_storage *peer; // NULL (or family 0) if the client's address isn't known
+    const char *method; // NULL if the request line couldn't be parsed
+    size_t method_len;
+    const char *uri;
+    size_t uri_len;
+    const char *version; // NULL for HTTP/0.9
+    size_t version_len;
+    int status_code;
+    uint64_t bytes_sent;
+    uint64_t duration_ns;
+};
+
+// Starts the background writer and opens the access log (path "-" is stdout, NULL for no access log)
+// Until then, messages are written straight away. Returns -1 on error
+int log_init(enum log_level level, const char *access_log_path, enum access_log_format format);
+
+// Whether messages of a level are logged, for skipping work that only feeds them
+int log_level_enabled(enum log_level level);
+
+// Logs a message (errors and warnings go to stderr, the rest to stdout), no newline needed
+void log_message(enum log_level level, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+// Logs an error along with errno's description, like perror()
+void log_perror(const char *message);
+
+// Whether there is an access log
+int log_access_enabled(void);
+
+// Adds a request to the access log
+void log_access(const struct access_entry *entry);
+
+// Writes out everything logged so far (at exit, from any thread)
+void log_flush(void);
+
+#endif
@@ -1,58 +1,307 @@
 #include <ctype.h>
 #include <errno.h>
+#include <getopt.h>
 #include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include "compression.h"
+#include "directory_listing.h"
 #include "directory_resolution.h"
-#include "request_parsing.h"
+#include "event_loop.h"
+#include "file_cache.h"
+#include "http_scan.h"
+#include "logging.h"
+#include "metadata_cache.h"
+#include "mime_types.h"
+#include "options.h"
+#include "path_index.h"
+#include "site_archive.h"
 #include "socket_operations.h"
+#include "workers.h"
 
 void check_valid_port(char *portstr);
+void parse_options(int argc, char *argv[]);
+size_t parse_size(const char *sizestr);
+void print_usage(const char *program_name);
 
 int main(int argc, char *argv[])
 {
-    if (argc != 3){
-        fprintf(stderr,"Usage: %s <port> <directory>\n", argv[0]);
+    parse_options(argc, argv);
+    if (argc - optind != (OPTIONS.archive_path != NULL ? 1 : 2)){
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    char *port = argv[optind];
+    char *directory = argv[optind + 1]; // NULL when serving an archive
+    if (log_init(OPTIONS.log_level, OPTIONS.access_log_path, OPTIONS.access_log_format) < 0){
         return EXIT_FAILURE;
     }
 
-    int listener, client_fd; // Listen on listener, new connection on client_fd
-    char req_buf[4096]; // Buffer for client's request
-
-    // Check if the port is valid, and resolve the directory if it's also valid
-    check_valid_port(argv[1]);
-    resolve_dir(argv[2]);
+    int listener; // Listen on listener, the event loop takes care of the connections
 
-    // Set up and get a listening socket
-    listener = get_listener(argv[1]);
+    // Check if the port is valid, and resolve the directory (or map the archive) if it's also valid
+    check_valid_port(port);
+    if (OPTIONS.archive_path != NULL){
+        if (site_archive_open(OPTIONS.archive_path) < 0){
+            return EXIT_FAILURE;
+        }
+    } else {
+        resolve_dir(directory);
+        file_cache_init(OPTIONS.cache_size, OPTIONS.cache_max_file);
+    }
+    metadata_cache_init(OPTIONS.meta_cache_size, OPTIONS.meta_cache_ttl);
+    directory_listing_init(OPTIONS.listing_cache_size);
+    compression_init(OPTIONS.compress_level);
+    if (mime_types_init(OPTIONS.mime_types_path) < 0){
+        return EXIT_FAILURE;
+    }
+    if (OPTIONS.path_index && OPTIONS.archive_path == NULL){
+        path_index_init(); // Lookups go to the filesystem if it can't be built
+    }
+    http_scan_init();
 
-    printf("Ready for connections...\n");
+    // Several workers each get their own listener and loop
+    if (OPTIONS.workers > 1){
+        log_message(LEVEL_INFO, "Ready for connections...");
+        run_workers(port, OPTIONS.workers, OPTIONS.pin_cpus);
+        return EXIT_FAILURE; // Only if the workers failed
+    }
 
-    for(;;){ // Main loop
-        // Accept a new connection
-        if ((client_fd = accept_and_print(listener)) < 0){
-            continue;
-        }
+    // Set up and get a listening socket
+    listener = get_listener(port, 0);
+    if (set_nonblocking(listener) < 0){
+        return EXIT_FAILURE;
+    }
 
-        // recv() data from a client on the connection
-        if (poll_recv(client_fd, req_buf, sizeof(req_buf)) < 0){
-            close(client_fd);
-            continue;
-        }
+    log_message(LEVEL_INFO, "Ready for connections...");
 
-        if (parse_request_and_send_response(client_fd, req_buf) == 0){
-            printf("Response sent succesfully on socket %d\n", client_fd);
-        }
-        close(client_fd);
+    // Main loop
+    if (run_selected_loop(listener) < 0){
+        return EXIT_FAILURE;
     }
     
     return 0; // We never get here
 }
 
 
+// Prints how the program is meant to be run
+void print_usage(const char *program_name)
+{
+    fprintf(stderr, "Usage: %s [options] <port> <directory>\n"
+                    "       %s [options] --archive FILE <port>\n"
+                    "Options:\n"
+                    "  --workers N   Serve from N threads, each with its own listener (default 1)\n"
+                    "  --pin-cpus    Pin each worker thread to its own CPU\n"
+                    "  --engine E    I/O engine, epoll (default) or io_uring\n"
+                    "  --keepalive-timeout S   Close idle persistent connections after S seconds (default 5)\n"
+                    "  --header-timeout S      Close a connection whose request hasn't all arrived S seconds in (default 10)\n"
+                    "  --send-timeout S        Close a connection whose client hasn't taken any data for S seconds (default 10)\n"
+                    "  --max-requests N        Close a connection after N requests (default 100)\n"
+                    "  --no-nodelay            Leave Nagle's algorithm on for client sockets (TCP_NODELAY is set by default)\n"
+                    "  --cache-size BYTES      Memory for cached small files, K/M/G suffixes work (default 64M, 0 = off)\n"
+                    "  --cache-max-file BYTES  Largest file the cache takes (default 256K)\n"
+                    "  --meta-cache-size BYTES Memory for cached path lookups and open files (default 4M, 0 = off)\n"
+                    "  --meta-cache-ttl S      How long path lookups, 404s included, are reused (default 2, 0 = off)\n"
+                    "  --listing-cache-size BYTES  Memory for rendered directory listings (default 64M, 0 = off)\n"
+                    "  --index                 Index the whole directory in memory at startup, kept up to date with inotify\n"
+                    "  --compress-level N      Level for compressing text responses on the fly, 1-9 (default 6, 0 = off)\n"
+                    "  --mime-types FILE       Add the types of a mime.types file (like /etc/mime.types) to the built-in ones\n"
+                    "  --stats-path PATH       Serve the counters in the Prometheus text format at PATH (default /_stats, '' = off)\n"
+                    "  --log-level L           error, warning, info (default) or debug, which logs every connection too\n"
+                    "  --access-log FILE       Log every answered request to FILE ('-' for stdout)\n"
+                    "  --access-log-format F   clf (Common Log Format, default) or json\n"
+                    "  --archive FILE          Serve the site packed into FILE by tools/site_pack instead of a directory\n",
+                    program_name, program_name);
+}
+
+// Parses a byte count with an optional K, M or G suffix (or exits)
+size_t parse_size(const char *sizestr)
+{
+    char *end;
+    unsigned long long size = strtoull(sizestr, &end, 10);
+
+    if (end == sizestr){
+        fprintf(stderr, "'%s' is not a valid size.\n", sizestr);
+        exit(EXIT_FAILURE);
+    }
+    switch (*end){
+        case 'G': case 'g': size *= 1024; // Fall through
+        case 'M': case 'm': size *= 1024; // Fall through
+        case 'K': case 'k': size *= 1024; end++; break;
+        case '\0': break;
+        default:
+            fprintf(stderr, "'%s' is not a valid size.\n", sizestr);
+            exit(EXIT_FAILURE);
+    }
+    if (*end != '\0'){
+        fprintf(stderr, "'%s' is not a valid size.\n", sizestr);
+        exit(EXIT_FAILURE);
+    }
+
+    return size;
+}
+
+// Fills OPTIONS from the command line (or exits)
+void parse_options(int argc, char *argv[])
+{
+    static struct option long_options[] = {
+        {"workers", required_argument, NULL, 'w'},
+        {"pin-cpus", no_argument, NULL, 'p'},
+        {"engine", required_argument, NULL, 'e'},
+        {"keepalive-timeout", required_argument, NULL, 'k'},
+        {"header-timeout", required_argument, NULL, 'H'},
+        {"send-timeout", required_argument, NULL, 'T'},
+        {"max-requests", required_argument, NULL, 'm'},
+        {"no-nodelay", no_argument, NULL, 'n'},
+        {"cache-size", required_argument, NULL, 'c'},
+        {"cache-max-file", required_argument, NULL, 'f'},
+        {"meta-cache-size", required_argument, NULL, 's'},
+        {"meta-cache-ttl", required_argument, NULL, 't'},
+        {"listing-cache-size", required_argument, NULL, 'l'},
+        {"index", no_argument, NULL, 'i'},
+        {"archive", required_argument, NULL, 'A'},
+        {"compress-level", required_argument, NULL, 'z'},
+        {"mime-types", required_argument, NULL, 'y'},
+        {"stats-path", required_argument, NULL, 'S'},
+        {"log-level", required_argument, NULL, 'L'},
+        {"access-log", required_argument, NULL, 'a'},
+        {"access-log-format", required_argument, NULL, 'F'},
+        {NULL, 0, NULL, 0}
+    };
+    int option;
+
+    while ((option = getopt_long(argc, argv, "", long_options, NULL)) != -1){
+        switch (option){
+            case 'w':
+                OPTIONS.workers = atoi(optarg);
+                if (OPTIONS.workers < 1){
+                    fprintf(stderr, "'%s' is not a valid number of workers.\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'p':
+                OPTIONS.pin_cpus = 1;
+                break;
+            case 'e':
+                if (!strcmp(optarg, "epoll")){
+                    OPTIONS.engine = ENGINE_EPOLL;
+                } else if (!strcmp(optarg, "io_uring")){
+                    OPTIONS.engine = ENGINE_IO_URING;
+                } else {
+                    fprintf(stderr, "'%s' is not a known engine, use epoll or io_uring.\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'k':
+                OPTIONS.keepalive_timeout = atoi(optarg);
+                if (OPTIONS.keepalive_timeout < 1){
+                    fprintf(stderr, "'%s' is not a valid keep-alive timeout.\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'H':
+                OPTIONS.header_timeout = atoi(optarg);
+                if (OPTIONS.header_timeout < 1){
+                    fprintf(stderr, "'%s' is not a valid header timeout.\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'T':
+                OPTIONS.send_timeout = atoi(optarg);
+                if (OPTIONS.send_timeout < 1){
+                    fprintf(stderr, "'%s' is not a valid send timeout.\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'm':
+                OPTIONS.max_requests = atoi(optarg);
+                if (OPTIONS.max_requests < 1){
+                    fprintf(stderr, "'%s' is not a valid number of requests.\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'n':
+                OPTIONS.tcp_nodelay = 0;
+                break;
+            case 'c':
+                OPTIONS.cache_size = parse_size(optarg);
+                break;
+            case 'f':
+                OPTIONS.cache_max_file = parse_size(optarg);
+                break;
+            case 's':
+                OPTIONS.meta_cache_size = parse_size(optarg);
+                break;
+            case 't':
+                OPTIONS.meta_cache_ttl = atoi(optarg);
+                if (OPTIONS.meta_cache_ttl < 0){
+                    fprintf(stderr, "'%s' is not a valid TTL.\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'l':
+                OPTIONS.listing_cache_size = parse_size(optarg);
+                break;
+            case 'i':
+                OPTIONS.path_index = 1;
+                break;
+            case 'A':
+                OPTIONS.archive_path = optarg;
+                break;
+            case 'z':
+                OPTIONS.compress_level = atoi(optarg);
+                if (OPTIONS.compress_level < 0 || OPTIONS.compress_level > 9){
+                    fprintf(stderr, "'%s' is not a valid compression level.\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'y':
+                OPTIONS.mime_types_path = optarg;
+                break;
+            case 'S':
+                if (*optarg != '\0' && *optarg != '/'){
+                    fprintf(stderr, "'%s' is not a valid stats path, it has to start with '/'.\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                OPTIONS.stats_path = *optarg ? optarg : NULL;
+                break;
+            case 'L':
+                if (!strcmp(optarg, "error")){
+                    OPTIONS.log_level = LEVEL_ERROR;
+                } else if (!strcmp(optarg, "warning")){
+                    OPTIONS.log_level = LEVEL_WARNING;
+                } else if (!strcmp(optarg, "info")){
+                    OPTIONS.log_level = LEVEL_INFO;
+                } else if (!strcmp(optarg, "debug")){
+                    OPTIONS.log_level = LEVEL_DEBUG;
+                } else {
+                    fprintf(stderr, "'%s' is not a known log level, use error, warning, info or debug.\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'a':
+                OPTIONS.access_log_path = optarg;
+                break;
+            case 'F':
+                if (!strcmp(optarg, "clf")){
+                    OPTIONS.access_log_format = ACCESS_LOG_CLF;
+                } else if (!strcmp(optarg, "json")){
+                    OPTIONS.access_log_format = ACCESS_LOG_JSON;
+                } else {
+                    fprintf(stderr, "'%s' is not a known access log format, use clf or json.\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            default:
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+}
+
 // Checks if <port> can be used as an actual port
 void check_valid_port(char *portstr)
 {
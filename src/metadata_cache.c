@@ -0,0 +1,349 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#include "metadata_cache.h"
+#include "logging.h"
+
+#define BUCKET_COUNT 16384 // Hash buckets (power of 2)
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct metadata_entry *buckets[BUCKET_COUNT];
+static struct metadata_entry *lru_head = NULL;
+static struct metadata_entry *lru_tail = NULL;
+static struct metadata_entry *expiry_head = NULL;
+static struct metadata_entry *expiry_tail = NULL;
+static struct metadata_cache_stats stats;
+static size_t cache_max_bytes = 0;
+static int cache_ttl = 0;
+static int max_open_fds = 0; // Cached entries keep their fds open up to this many
+
+// FNV-1a over the path
+static size_t hash_key(const char *key)
+{
+    size_t hash = 14695981039346656037ULL;
+    while (*key){
+        hash ^= (unsigned char)*key++;
+        hash *= 1099511628211ULL;
+    }
+    return hash & (BUCKET_COUNT - 1);
+}
+
+static void free_entry(struct metadata_entry *entry)
+{
+    if (entry->fd >= 0){
+        close(entry->fd);
+    }
+    free(entry->key);
+    free(entry->resolved_path);
+    free(entry);
+}
+
+// Drops a reference, the caller holds cache_lock
+static void release_locked(struct metadata_entry *entry)
+{
+    if (--entry->refcount == 0){
+        free_entry(entry);
+    }
+}
+
+// Takes an entry out of the hash and the LRU list, the caller holds cache_lock
+static void unlink_entry(struct metadata_entry *entry)
+{
+    struct metadata_entry **link = &buckets[hash_key(entry->key)];
+    while (*link != entry){
+        link = &(*link)->hash_next;
+    }
+    *link = entry->hash_next;
+
+    if (entry->lru_prev != NULL){
+        entry->lru_prev->lru_next = entry->lru_next;
+    } else {
+        lru_head = entry->lru_next;
+    }
+    if (entry->lru_next != NULL){
+        entry->lru_next->lru_prev = entry->lru_prev;
+    } else {
+        lru_tail = entry->lru_prev;
+    }
+
+    if (entry->expiry_prev != NULL){
+        entry->expiry_prev->expiry_next = entry->expiry_next;
+    } else {
+        expiry_head = entry->expiry_next;
+    }
+    if (entry->expiry_next != NULL){
+        entry->expiry_next->expiry_prev = entry->expiry_prev;
+    } else {
+        expiry_tail = entry->expiry_prev;
+    }
+
+    entry->cached = 0;
+    stats.entries--;
+    stats.bytes_used -= entry->charge;
+    if (entry->fd >= 0){
+        stats.open_fds--;
+    }
+    release_locked(entry); // Connections still sending from its fd keep it alive
+}
+
+// Moves an entry to the front of the LRU list, the caller holds cache_lock
+static void touch_entry(struct metadata_entry *entry)
+{
+    if (entry == lru_head){
+        return;
+    }
+    entry->lru_prev->lru_next = entry->lru_next;
+    if (entry->lru_next != NULL){
+        entry->lru_next->lru_prev = entry->lru_prev;
+    } else {
+        lru_tail = entry->lru_prev;
+    }
+
+    entry->lru_prev = NULL;
+    entry->lru_next = lru_head;
+    lru_head->lru_prev = entry;
+    lru_head = entry;
+}
+
+// Finds an entry without taking a reference, the caller holds cache_lock
+static struct metadata_entry *find_locked(const char *key)
+{
+    for (struct metadata_entry *entry = buckets[hash_key(key)]; entry != NULL; entry = entry->hash_next){
+        if (!strcmp(entry->key, key)){
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+// Sets up the cache, max_bytes or ttl of 0 disables it
+void metadata_cache_init(size_t max_bytes, int ttl)
+{
+    cache_max_bytes = ttl > 0 ? max_bytes : 0;
+    cache_ttl = ttl;
+
+    // Leave most descriptors to the connections
+    struct rlimit fd_limit;
+    if (getrlimit(RLIMIT_NOFILE, &fd_limit)){
+        log_perror("metadata_cache_init - getrlimit");
+        fd_limit.rlim_cur = 1024;
+    }
+    max_open_fds = fd_limit.rlim_cur == RLIM_INFINITY ? 65536 : fd_limit.rlim_cur / 4;
+}
+
+// Returns the entry for a requested path with a reference taken (or NULL on a miss)
+struct metadata_entry *metadata_cache_lookup(const char *key)
+{
+    if (cache_max_bytes == 0){
+        return NULL;
+    }
+
+    pthread_mutex_lock(&cache_lock);
+    struct metadata_entry *entry = find_locked(key);
+    if (entry != NULL && entry->expires <= time(NULL)){
+        unlink_entry(entry);
+        stats.expirations++;
+        entry = NULL;
+    }
+    if (entry != NULL){
+        touch_entry(entry);
+        entry->refcount++;
+        stats.hits++;
+        if (entry->status != 200){
+            stats.negative_hits++;
+        }
+    } else {
+        stats.misses++;
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    return entry;
+}
+
+// Makes an entry from what resolving key found (fd, file_stat and mime_type only matter when status is 200)
+// Returns it with a reference taken, it's only kept for later if the cache is on (NULL on error, fd is closed then)
+struct metadata_entry *metadata_cache_insert(const char *key, int status, const char *resolved_path,
+                                             const struct stat *file_stat, const char *mime_type, int fd)
+{
+    struct metadata_entry *entry = calloc(1, sizeof(struct metadata_entry));
+    if (entry == NULL){
+        log_perror("metadata_cache_insert - error allocating memory");
+        if (fd >= 0){
+            close(fd);
+        }
+        return NULL;
+    }
+    entry->fd = fd;
+    entry->status = status;
+    entry->key = strdup(key);
+    if (status == 200){
+        entry->resolved_path = strdup(resolved_path);
+        entry->stat = *file_stat;
+        entry->mime_type = mime_type;
+    }
+    if (entry->key == NULL || (status == 200 && entry->resolved_path == NULL)){
+        log_perror("metadata_cache_insert - error allocating memory");
+        free_entry(entry);
+        return NULL;
+    }
+    entry->refcount = 1;
+
+    if (cache_max_bytes == 0){
+        return entry; // Only the caller uses it
+    }
+
+    entry->charge = sizeof(struct metadata_entry) + strlen(key) + 1 +
+                    (entry->resolved_path != NULL ? strlen(entry->resolved_path) + 1 : 0);
+    entry->expires = time(NULL) + cache_ttl;
+
+    pthread_mutex_lock(&cache_lock);
+
+    // Another worker may have resolved it in the meantime
+    struct metadata_entry *existing = find_locked(key);
+    if (existing != NULL){
+        unlink_entry(existing);
+    }
+
+    // Make room by evicting the least recently used paths, and their descriptors if this one brings its own
+    while (lru_tail != NULL && (stats.bytes_used + entry->charge > cache_max_bytes ||
+                                (fd >= 0 && stats.open_fds >= max_open_fds))){
+        unlink_entry(lru_tail);
+        stats.evictions++;
+    }
+    if (stats.bytes_used + entry->charge > cache_max_bytes){
+        pthread_mutex_unlock(&cache_lock);
+        return entry; // Doesn't fit at all
+    }
+
+    size_t bucket = hash_key(key);
+    entry->hash_next = buckets[bucket];
+    buckets[bucket] = entry;
+    entry->lru_next = lru_head;
+    if (lru_head != NULL){
+        lru_head->lru_prev = entry;
+    } else {
+        lru_tail = entry;
+    }
+    lru_head = entry;
+    entry->expiry_prev = expiry_tail;
+    if (expiry_tail != NULL){
+        expiry_tail->expiry_next = entry;
+    } else {
+        expiry_head = entry;
+    }
+    expiry_tail = entry;
+
+    entry->refcount++; // The cache's own reference
+    entry->cached = 1;
+    stats.entries++;
+    stats.bytes_used += entry->charge;
+    if (fd >= 0){
+        stats.open_fds++;
+    }
+
+    pthread_mutex_unlock(&cache_lock);
+    return entry;
+}
+
+// Gives an entry the descriptor of its file, once it has to be read
+// If another worker got there first, fd is closed and the entry keeps the one it has
+void metadata_cache_attach_fd(struct metadata_entry *entry, int fd)
+{
+    pthread_mutex_lock(&cache_lock);
+    if (entry->fd >= 0){
+        pthread_mutex_unlock(&cache_lock);
+        close(fd);
+        return;
+    }
+    __atomic_store_n(&entry->fd, fd, __ATOMIC_RELEASE);
+
+    if (entry->cached){
+        // Older entries give up their descriptors so the fd limit isn't reached
+        while (stats.open_fds >= max_open_fds && lru_tail != NULL && lru_tail != entry){
+            unlink_entry(lru_tail);
+            stats.evictions++;
+        }
+        stats.open_fds++;
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+// Forgets what's known about a path (a file watch saw it change)
+void metadata_cache_invalidate(const char *key)
+{
+    if (cache_max_bytes == 0){
+        return;
+    }
+
+    pthread_mutex_lock(&cache_lock);
+    struct metadata_entry *entry = find_locked(key);
+    if (entry != NULL){
+        unlink_entry(entry);
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+// Forgets everything (a file watch lost track of what changed)
+void metadata_cache_invalidate_all(void)
+{
+    if (cache_max_bytes == 0){
+        return;
+    }
+
+    pthread_mutex_lock(&cache_lock);
+    while (lru_tail != NULL){
+        unlink_entry(lru_tail);
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+// Drops entries whose TTL has run out, so deleted files don't stay open
+void metadata_cache_expire(void)
+{
+    if (cache_max_bytes == 0){
+        return;
+    }
+
+    time_t now = time(NULL);
+    pthread_mutex_lock(&cache_lock);
+    while (expiry_head != NULL && expiry_head->expires <= now){
+        unlink_entry(expiry_head);
+        stats.expirations++;
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+// Drops a reference taken by metadata_cache_lookup() or metadata_cache_insert()
+void metadata_cache_release(struct metadata_entry *entry)
+{
+    if (!entry->cached && entry->refcount == 1 && cache_max_bytes == 0){
+        free_entry(entry); // Never was in the cache, so nobody else can see it
+        return;
+    }
+
+    pthread_mutex_lock(&cache_lock);
+    release_locked(entry);
+    pthread_mutex_unlock(&cache_lock);
+}
+
+// Copies the current counters
+void metadata_cache_get_stats(struct metadata_cache_stats *stats_copy)
+{
+    pthread_mutex_lock(&cache_lock);
+    *stats_copy = stats;
+    pthread_mutex_unlock(&cache_lock);
+}
+
+// Prints the counters
+void metadata_cache_report(void)
+{
+    struct metadata_cache_stats current;
+    metadata_cache_get_stats(&current);
+    log_message(LEVEL_INFO, "Metadata cache: %lu hits (%lu negative), %lu misses, %lu expirations, %lu evictions, "
+                "%zu entries, %zu bytes, %d open files",
+                current.hits, current.negative_hits, current.misses, current.expirations, current.evictions,
+                current.entries, current.bytes_used, current.open_fds);
+}
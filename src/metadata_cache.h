@@ -0,0 +1,74 @@
+#ifndef METADATA_CACHE_H
+#define METADATA_CACHE_H
+
+#include <stddef.h>
+#include <sys/stat.h>
+#include <time.h>
+
+// What resolving a requested path found out, kept for a few seconds
+struct metadata_entry {
+    char *key; // The path as requested (BASE_DIR + decoded URI), before resolving
+    int status; // 200, or the 403/404 resolving it gave
+    char *resolved_path; // Only set when status is 200
+    struct stat stat; // Size, mtime, inode and whether it's a directory
+    const char *mime_type; // From the resolved path's extension, NULL for directories
+    int fd; // The file opened read-only, -1 until the lookup or a response opens it (see metadata_cache_attach_fd())
+
+    time_t expires;
+    size_t charge; // How much of the cache's budget the entry uses
+    int refcount; // The cache holds one reference, every user another
+    int cached; // Cleared once the entry is evicted or has expired
+
+    struct metadata_entry *hash_next;
+    struct metadata_entry *lru_prev; // Most recently used at the head
+    struct metadata_entry *lru_next;
+    struct metadata_entry *expiry_prev; // Oldest at the head, every entry lives for the same TTL
+    struct metadata_entry *expiry_next;
+};
+
+// Counters for how well the cache is doing
+struct metadata_cache_stats {
+    unsigned long hits;
+    unsigned long negative_hits; // Hits that answered a 403/404 without touching the filesystem
+    unsigned long misses;
+    unsigned long expirations;
+    unsigned long evictions;
+    size_t entries;
+    size_t bytes_used;
+    int open_fds;
+};
+
+// Sets up the cache, max_bytes or ttl of 0 disables it
+void metadata_cache_init(size_t max_bytes, int ttl);
+
+// Returns the entry for a requested path with a reference taken (or NULL on a miss)
+struct metadata_entry *metadata_cache_lookup(const char *key);
+
+// Makes an entry from what resolving key found (fd, file_stat and mime_type only matter when status is 200)
+// Returns it with a reference taken, it's only kept for later if the cache is on (NULL on error, fd is closed then)
+struct metadata_entry *metadata_cache_insert(const char *key, int status, const char *resolved_path,
+                                             const struct stat *file_stat, const char *mime_type, int fd);
+
+// Gives an entry the descriptor of its file, once it has to be read
+// If another worker got there first, fd is closed and the entry keeps the one it has
+void metadata_cache_attach_fd(struct metadata_entry *entry, int fd);
+
+// Forgets what's known about a path (a file watch saw it change)
+void metadata_cache_invalidate(const char *key);
+
+// Forgets everything (a file watch lost track of what changed)
+void metadata_cache_invalidate_all(void);
+
+// Drops entries whose TTL has run out, so deleted files don't stay open
+void metadata_cache_expire(void);
+
+// Drops a reference taken by metadata_cache_lookup() or metadata_cache_insert()
+void metadata_cache_release(struct metadata_entry *entry);
+
+// Copies the current counters
+void metadata_cache_get_stats(struct metadata_cache_stats *stats);
+
+// Prints the counters
+void metadata_cache_report(void);
+
+#endif
@@ -1,13 +1,19 @@
+#include <ctype.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include "mime_types.h"
+#include "logging.h"
 
 // Mapping of extensions to MIME types (extend as needed)
-static const char extensions_to_mime_types[][2][256] = {
+static const char *const extensions_to_mime_types[][2] = {
     {".aac", "audio/aac"},
     {".abw", "application/x-abiword"},
     {".apng", "image/apng"},
     {".arc", "application/x-freearc"},
-    {".avi", "x-msvideo"},
+    {".avi", "video/x-msvideo"},
     {".avif", "image/avif"},
     {".azw", "application/vnd.amazon.ebook"},
     {".bash", "application/x-sh"},
@@ -103,22 +109,294 @@ static const char extensions_to_mime_types[][2][256] = {
     {".3gp", "video/3gpp"},
     {".3g2", "video/3gpp2"},
     {".7z", "application/x-7z-compressed"},
-    {"", ""} // Last key must be an empty string
+    {NULL, NULL} // Last key must be NULL
 };
 
-// Returns a file's MIME type based on its extensions
+// A slot of the lookup table
+struct mime_type {
+    char extension[MIME_EXTENSION_MAX]; // Lowercase, without the dot
+    const char *type;
+};
+
+// A minimal perfect hash over the known extensions: the bucket a key hashes to holds a displacement
+// that sends every key of the bucket to its own slot, so a lookup is one hash and one compare
+static struct mime_type *slots = NULL;
+static size_t slot_count = 0;
+static uint32_t *displacements = NULL;
+static size_t bucket_count = 0;
+
+// FNV-1a over the lowercased extension, stops at the end of the string or at length
+static uint64_t hash_extension(const char *extension, size_t *length)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    size_t i = 0;
+    while (extension[i] != '\0' && i < MIME_EXTENSION_MAX){
+        hash ^= (unsigned char)tolower((unsigned char)extension[i++]);
+        hash *= 1099511628211ULL;
+    }
+    *length = i;
+    return hash;
+}
+
+// Where a hash lands with a displacement (d0 * slot_count + d1)
+static size_t displaced_slot(uint64_t hash, uint32_t displacement, size_t table_size)
+{
+    size_t first = (hash >> 32) % table_size;
+    size_t step = table_size > 1 ? (uint32_t)hash % (table_size - 1) + 1 : 0;
+    size_t d0 = displacement / table_size, d1 = displacement % table_size;
+    return (first + d0 * step + d1) % table_size;
+}
+
+// Extensions gathered before the table is built, later ones replace earlier ones
+struct pending_type {
+    char extension[MIME_EXTENSION_MAX];
+    const char *type;
+    uint64_t hash;
+};
+static struct pending_type *pending = NULL;
+static size_t pending_count = 0;
+static size_t pending_max = 0;
+
+// Adds (or replaces) an extension, returns -1 on error
+static int add_pending(const char *extension, const char *type)
+{
+    if (*extension == '.'){
+        extension++;
+    }
+    size_t length;
+    uint64_t hash = hash_extension(extension, &length);
+    if (length == 0 || length >= MIME_EXTENSION_MAX || extension[length] != '\0'){
+        return 0; // Can't be looked up, so not worth keeping
+    }
+
+    for (size_t i = 0; i < pending_count; i++){
+        if (pending[i].hash == hash && !strcasecmp(pending[i].extension, extension)){
+            pending[i].type = type;
+            return 0;
+        }
+    }
+
+    if (pending_count == pending_max){
+        size_t new_max = pending_max ? pending_max * 2 : 256;
+        struct pending_type *new_pending = realloc(pending, new_max * sizeof(struct pending_type));
+        if (new_pending == NULL){
+            log_perror("add_pending - error reallocating memory");
+            return -1;
+        }
+        pending = new_pending;
+        pending_max = new_max;
+    }
+    for (size_t i = 0; i <= length; i++){
+        pending[pending_count].extension[i] = tolower((unsigned char)extension[i]);
+    }
+    pending[pending_count].type = type;
+    pending[pending_count].hash = hash;
+    pending_count++;
+    return 0;
+}
+
+// Reads a mime.types file ("type ext1 ext2 ..." per line, # starts a comment), returns -1 on error
+static int load_mime_types_file(const char *path)
+{
+    FILE *file = fopen(path, "r");
+    if (file == NULL){
+        log_perror("load_mime_types_file - error opening file");
+        return -1;
+    }
+
+    char *line = NULL;
+    size_t line_size = 0;
+    int retval = 0;
+    while (retval == 0 && getline(&line, &line_size, file) != -1){
+        char *comment = strchr(line, '#');
+        if (comment != NULL){
+            *comment = '\0';
+        }
+
+        char *save;
+        char *type = strtok_r(line, " \t\r\n", &save);
+        char *extension = strtok_r(NULL, " \t\r\n", &save);
+        if (type == NULL || extension == NULL){
+            continue;
+        }
+
+        // The table lives as long as the server does, so its types do too
+        char *type_copy = strdup(type);
+        if (type_copy == NULL){
+            log_perror("load_mime_types_file - error duplicating type");
+            retval = -1;
+            break;
+        }
+        for (; extension != NULL && retval == 0; extension = strtok_r(NULL, " \t\r\n", &save)){
+            retval = add_pending(extension, type_copy);
+        }
+    }
+
+    free(line);
+    fclose(file);
+    return retval;
+}
+
+// Compares buckets by size, largest first, for qsort()
+static const size_t *sort_bucket_sizes;
+static int compare_bucket_sizes(const void *a, const void *b)
+{
+    size_t size_a = sort_bucket_sizes[*(const size_t *)a], size_b = sort_bucket_sizes[*(const size_t *)b];
+    return (size_a < size_b) - (size_a > size_b);
+}
+
+// Finds a displacement for every bucket so no two keys share a slot, returns -1 if there's none
+// members gets the keys ordered by bucket, bucket_starts where each bucket's run begins
+static int build_perfect_hash(size_t table_size, size_t *bucket_sizes, size_t *bucket_starts, size_t *members,
+                              size_t *order, unsigned char *taken, size_t *bucket_slots)
+{
+    memset(taken, 0, table_size);
+    memset(bucket_sizes, 0, bucket_count * sizeof(size_t));
+    for (size_t i = 0; i < pending_count; i++){
+        bucket_sizes[pending[i].hash % bucket_count]++;
+    }
+    for (size_t b = 0, start = 0; b < bucket_count; b++){
+        bucket_starts[b] = start;
+        start += bucket_sizes[b];
+    }
+    for (size_t b = 0; b < bucket_count; b++){
+        order[b] = bucket_starts[b]; // Borrowed as a fill cursor for now
+    }
+    for (size_t i = 0; i < pending_count; i++){
+        members[order[pending[i].hash % bucket_count]++] = i;
+    }
+
+    // The crowded buckets go first, while there's still room
+    for (size_t b = 0; b < bucket_count; b++){
+        order[b] = b;
+    }
+    sort_bucket_sizes = bucket_sizes;
+    qsort(order, bucket_count, sizeof(size_t), compare_bucket_sizes);
+
+    uint64_t max_displacement = (uint64_t)table_size * table_size;
+    if (max_displacement > UINT32_MAX){
+        max_displacement = UINT32_MAX;
+    }
+    for (size_t o = 0; o < bucket_count; o++){
+        size_t bucket = order[o];
+        const size_t *bucket_members = members + bucket_starts[bucket];
+        size_t bucket_size = bucket_sizes[bucket];
+
+        uint64_t displacement;
+        for (displacement = 0; displacement < max_displacement; displacement++){
+            size_t placed = 0;
+            while (placed < bucket_size){
+                size_t slot = displaced_slot(pending[bucket_members[placed]].hash, displacement, table_size);
+                int clash = taken[slot];
+                for (size_t p = 0; p < placed && !clash; p++){
+                    clash = bucket_slots[p] == slot;
+                }
+                if (clash){
+                    break;
+                }
+                bucket_slots[placed++] = slot;
+            }
+            if (placed == bucket_size){
+                break;
+            }
+        }
+        if (displacement == max_displacement){
+            return -1;
+        }
+
+        displacements[bucket] = displacement;
+        for (size_t p = 0; p < bucket_size; p++){
+            taken[bucket_slots[p]] = 1;
+        }
+    }
+    return 0;
+}
+
+// Builds the lookup table from the built-in types and, if path isn't NULL, a mime.types file on top
+// Returns -1 on error
+int mime_types_init(const char *path)
+{
+    for (int i = 0; extensions_to_mime_types[i][0] != NULL; i++){
+        if (add_pending(extensions_to_mime_types[i][0], extensions_to_mime_types[i][1]) < 0){
+            return -1;
+        }
+    }
+    if (path != NULL && load_mime_types_file(path) < 0){
+        return -1;
+    }
+
+    // Around four keys to a bucket keeps the search for displacements short
+    bucket_count = pending_count / 4 + 1;
+    size_t table_size = pending_count;
+    size_t *bucket_sizes = malloc(bucket_count * sizeof(size_t));
+    size_t *bucket_starts = malloc(bucket_count * sizeof(size_t));
+    size_t *order = malloc(bucket_count * sizeof(size_t));
+    size_t *members = malloc(pending_count * sizeof(size_t));
+    size_t *bucket_slots = malloc(pending_count * sizeof(size_t));
+    unsigned char *taken = malloc(pending_count * 2);
+    displacements = malloc(bucket_count * sizeof(uint32_t));
+    int retval = -1;
+    if (bucket_sizes == NULL || bucket_starts == NULL || order == NULL || members == NULL || bucket_slots == NULL ||
+        taken == NULL || displacements == NULL){
+        log_perror("mime_types_init - error allocating memory");
+        goto done;
+    }
+
+    // Every key gets a slot of its own; should that ever fail, a slightly bigger table will do
+    while (build_perfect_hash(table_size, bucket_sizes, bucket_starts, members, order, taken, bucket_slots) < 0){
+        if (++table_size == pending_count * 2){
+            log_message(LEVEL_ERROR, "mime_types_init - couldn't build the lookup table");
+            goto done;
+        }
+    }
+
+    if ((slots = calloc(table_size, sizeof(struct mime_type))) == NULL){
+        log_perror("mime_types_init - error allocating memory");
+        goto done;
+    }
+    for (size_t i = 0; i < pending_count; i++){
+        uint32_t displacement = displacements[pending[i].hash % bucket_count];
+        struct mime_type *slot = &slots[displaced_slot(pending[i].hash, displacement, table_size)];
+        memcpy(slot->extension, pending[i].extension, MIME_EXTENSION_MAX);
+        slot->type = pending[i].type;
+    }
+    slot_count = table_size;
+    retval = 0;
+
+done:
+    free(bucket_sizes);
+    free(bucket_starts);
+    free(order);
+    free(members);
+    free(bucket_slots);
+    free(taken);
+    free(pending);
+    pending = NULL;
+    pending_count = pending_max = 0;
+    return retval;
+}
+
+// Returns a file's MIME type based on its extension (case doesn't matter)
 const char *get_MIME_type(const char *filename)
 {
-    const char *ext = strrchr(filename, '.');
+    // Only the last path component counts, a dot in a directory name isn't an extension
+    const char *name = strrchr(filename, '/');
+    name = name != NULL ? name + 1 : filename;
+    const char *extension = strrchr(name, '.');
+    if (extension == NULL || slot_count == 0){
+        return DEFAULT_MIME_TYPE;
+    }
+    extension++;
 
-    // Cycle through the list until the key is an empty string
-    for (int i = 0; extensions_to_mime_types[i][0][0] != '\0'; i++){
+    size_t length;
+    uint64_t hash = hash_extension(extension, &length);
+    if (length == 0 || extension[length] != '\0'){
+        return DEFAULT_MIME_TYPE;
+    }
 
-        // If the key matches with the extension, return the value (MIME type)
-        if (strcmp(ext, extensions_to_mime_types[i][0]) == 0){
-            return extensions_to_mime_types[i][1];
-        }   
+    const struct mime_type *slot = &slots[displaced_slot(hash, displacements[hash % bucket_count], slot_count)];
+    if (!strcasecmp(slot->extension, extension)){
+        return slot->type;
     }
-    printf("Unknown file extension detected: %s\n", ext);
-    return "application/octet-stream"; // Fallback for unknown types
-}
\ No newline at end of file
+    return DEFAULT_MIME_TYPE; // Fallback for unknown types
+}
@@ -4,7 +4,14 @@
 #include <stdio.h>
 #include <string.h>
 
-// Returns a file's MIME type based on its extensions
+#define MIME_EXTENSION_MAX 16 // Longer extensions than this (with the terminator) are never known
+#define DEFAULT_MIME_TYPE "application/octet-stream"
+
+// Builds the lookup table from the built-in types and, if path isn't NULL, a mime.types file on top
+// Returns -1 on error
+int mime_types_init(const char *path);
+
+// Returns a file's MIME type based on its extension (case doesn't matter)
 const char *get_MIME_type(const char *filename);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,25 @@
+#include "options.h"
+
+struct server_options OPTIONS = {
+    .engine = ENGINE_EPOLL,
+    .workers = 1,
+    .pin_cpus = 0,
+    .keepalive_timeout = 5,
+    .header_timeout = 10,
+    .send_timeout = 10,
+    .max_requests = 100,
+    .tcp_nodelay = 1,
+    .cache_size = 64 * 1024 * 1024,
+    .cache_max_file = 256 * 1024,
+    .meta_cache_size = 4 * 1024 * 1024,
+    .meta_cache_ttl = 2,
+    .listing_cache_size = 64 * 1024 * 1024,
+    .path_index = 0,
+    .archive_path = NULL,
+    .compress_level = 6,
+    .mime_types_path = NULL,
+    .stats_path = "/_stats",
+    .log_level = LEVEL_INFO,
+    .access_log_path = NULL,
+    .access_log_format = ACCESS_LOG_CLF,
+};
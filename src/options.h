@@ -0,0 +1,41 @@
+#ifndef OPTIONS_H
+#define OPTIONS_H
+
+#include <stddef.h>
+#include "logging.h"
+
+// Which system calls drive the connections
+enum io_engine {
+    ENGINE_EPOLL,
+    ENGINE_IO_URING
+};
+
+// Settings given on the command line
+struct server_options {
+    enum io_engine engine;
+    int workers; // How many event loops (threads) serve connections
+    int pin_cpus; // Whether each worker is pinned to its own CPU
+    int keepalive_timeout; // How long an idle persistent connection stays open (in seconds)
+    int header_timeout; // How long a request may take to arrive, from its first byte (in seconds)
+    int send_timeout; // How long a response may go without the client taking any of it (in seconds)
+    int max_requests; // How many requests one connection may make
+    int tcp_nodelay; // Whether client sockets get TCP_NODELAY
+    size_t cache_size; // Memory budget of the hot-file cache in bytes (0 turns it off)
+    size_t cache_max_file; // Largest file the cache takes
+    size_t meta_cache_size; // Memory budget of the path metadata cache in bytes (0 turns it off)
+    int meta_cache_ttl; // How long resolved paths and misses are trusted (in seconds, 0 turns it off)
+    size_t listing_cache_size; // Memory budget of the rendered directory listings in bytes (0 turns it off)
+    int path_index; // Whether the whole tree is indexed in memory at startup
+    const char *archive_path; // A site packed by tools/site_pack to serve instead of a directory (NULL for none)
+    int compress_level; // For compressing responses on the fly (0 turns it off)
+    const char *mime_types_path; // A mime.types file to add to the built-in types (NULL for none)
+    const char *stats_path; // Where the counters are served in the Prometheus text format (NULL for nowhere)
+    enum log_level log_level; // The least severe messages that are logged
+    const char *access_log_path; // Where answered requests are logged ("-" for stdout, NULL for nowhere)
+    enum access_log_format access_log_format;
+};
+
+// The running server's settings
+extern struct server_options OPTIONS;
+
+#endif
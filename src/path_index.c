@@ -0,0 +1,729 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "directory_resolution.h"
+#include "logging.h"
+#include "metadata_cache.h"
+#include "mime_types.h"
+#include "path_index.h"
+#include "server_stats.h"
+
+#define DIRENT_BATCH_SIZE 65536 // How much getdents64() reads at a time
+#define MAX_WALK_THREADS 8 // More than this only queue up on the same disk
+#define MIN_BUCKET_COUNT 1024 // Hash buckets to start with (power of 2)
+
+// Everything that adds, removes or changes a path in a directory
+static const uint32_t WATCH_MASK = IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_CREATE | IN_DELETE |
+                                   IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR | IN_DONT_FOLLOW;
+
+// What getdents64() fills its buffer with
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+// A path under BASE_DIR with what a response needs to know about it, allocated along with the path
+struct index_entry {
+    struct index_entry *next; // In its hash bucket, or in the list a walk returns
+    const char *mime_type; // NULL for anything but a regular file
+    struct timespec mtime;
+    off_t size;
+    ino_t ino;
+    uint32_t hash;
+    uint32_t mode;
+    uint16_t path_len;
+    uint8_t opaque; // A directory that couldn't be read, so what's under it isn't known
+    char path[]; // Relative to BASE_DIR, without a leading '/' ("" is BASE_DIR itself)
+};
+
+// A walk over part of the tree, shared by the threads doing it
+struct walk {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct index_entry **pending; // Directories found but not read yet
+    size_t pending_count;
+    size_t pending_capacity;
+    int busy; // Threads reading a directory, which may find more
+    int failed; // Out of memory, the walk's result can't be trusted
+    struct index_entry *found; // Everything found, the directories it started from excluded
+    size_t found_count;
+};
+
+// Readers take index_lock shared, only the thread following inotify changes the table
+static pthread_rwlock_t index_lock = PTHREAD_RWLOCK_INITIALIZER;
+static struct index_entry **buckets = NULL;
+static size_t bucket_count = 0;
+static struct path_index_stats stats; // entries and bytes_used under index_lock, the rest updated atomically
+static int index_enabled = 0;
+
+// inotify watches, one per directory, indexed by watch descriptor
+static pthread_mutex_t watch_lock = PTHREAD_MUTEX_INITIALIZER;
+static int inotify_fd = -1;
+static char **watched_dirs = NULL;
+static int watched_capacity = 0;
+static int watch_failed = 0; // A directory couldn't be watched, so the index would miss its changes
+
+// FNV-1a over len bytes of the path
+static uint32_t hash_path(const char *path, size_t len)
+{
+    uint32_t hash = 2166136261U;
+    for (size_t i = 0; i < len; i++){
+        hash ^= (unsigned char)path[i];
+        hash *= 16777619U;
+    }
+    return hash;
+}
+
+// Makes an entry for a path from its lstat() result (NULL on error)
+static struct index_entry *new_entry(const char *path, size_t len, const struct stat *file_stat)
+{
+    struct index_entry *entry = malloc(sizeof(struct index_entry) + len + 1);
+    if (entry == NULL){
+        log_perror("path_index - error allocating memory");
+        return NULL;
+    }
+    entry->next = NULL;
+    entry->mime_type = S_ISREG(file_stat->st_mode) ? get_MIME_type(path) : NULL;
+    entry->mtime = file_stat->st_mtim;
+    entry->size = file_stat->st_size;
+    entry->ino = file_stat->st_ino;
+    entry->hash = hash_path(path, len);
+    entry->mode = file_stat->st_mode;
+    entry->path_len = len;
+    entry->opaque = 0;
+    memcpy(entry->path, path, len);
+    entry->path[len] = '\0';
+    return entry;
+}
+
+// How much of the index's memory an entry takes up
+static size_t entry_charge(const struct index_entry *entry)
+{
+    return sizeof(struct index_entry) + entry->path_len + 1;
+}
+
+// Finds a path's entry, the caller holds index_lock
+static struct index_entry *find_locked(const char *path, size_t len)
+{
+    uint32_t hash = hash_path(path, len);
+    for (struct index_entry *entry = buckets[hash & (bucket_count - 1)]; entry != NULL; entry = entry->next){
+        if (entry->hash == hash && entry->path_len == len && !memcmp(entry->path, path, len)){
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+// Spreads the entries over a new array of new_count buckets, the caller holds index_lock for writing
+// Returns -1 (keeping the old array) on error
+static int resize_locked(size_t new_count)
+{
+    struct index_entry **new_buckets = calloc(new_count, sizeof(struct index_entry *));
+    if (new_buckets == NULL){
+        log_perror("path_index - error allocating memory");
+        return -1;
+    }
+    for (size_t i = 0; i < bucket_count; i++){
+        struct index_entry *entry = buckets[i];
+        while (entry != NULL){
+            struct index_entry *next = entry->next;
+            entry->next = new_buckets[entry->hash & (new_count - 1)];
+            new_buckets[entry->hash & (new_count - 1)] = entry;
+            entry = next;
+        }
+    }
+    free(buckets);
+    stats.bytes_used += (new_count - bucket_count) * sizeof(struct index_entry *);
+    buckets = new_buckets;
+    bucket_count = new_count;
+    return 0;
+}
+
+// Adds an entry, replacing the one for the same path, the caller holds index_lock for writing
+static void insert_locked(struct index_entry *entry)
+{
+    if (stats.entries >= bucket_count){
+        resize_locked(bucket_count * 2); // The chains just get longer if it fails
+    }
+
+    struct index_entry **link = &buckets[entry->hash & (bucket_count - 1)];
+    while (*link != NULL){
+        struct index_entry *existing = *link;
+        if (existing->hash == entry->hash && existing->path_len == entry->path_len &&
+            !memcmp(existing->path, entry->path, entry->path_len)){
+            *link = existing->next;
+            stats.entries--;
+            stats.bytes_used -= entry_charge(existing);
+            free(existing);
+            break;
+        }
+        link = &existing->next;
+    }
+
+    entry->next = buckets[entry->hash & (bucket_count - 1)];
+    buckets[entry->hash & (bucket_count - 1)] = entry;
+    stats.entries++;
+    stats.bytes_used += entry_charge(entry);
+}
+
+// Drops a path's entry, and everything under it if subtree is set, the caller holds index_lock for writing
+static void remove_locked(const char *path, size_t len, int subtree)
+{
+    // Only a subtree needs every bucket looked through
+    size_t first = subtree ? 0 : hash_path(path, len) & (bucket_count - 1);
+    size_t last = subtree ? bucket_count : first + 1;
+    for (size_t i = first; i < last; i++){
+        struct index_entry **link = &buckets[i];
+        while (*link != NULL){
+            struct index_entry *entry = *link;
+            if (entry->path_len >= len && !memcmp(entry->path, path, len) &&
+                (entry->path_len == len || (subtree && entry->path[len] == '/'))){
+                *link = entry->next;
+                stats.entries--;
+                stats.bytes_used -= entry_charge(entry);
+                free(entry);
+            } else {
+                link = &entry->next;
+            }
+        }
+    }
+}
+
+// Frees a list of entries linked through next
+static void free_entries(struct index_entry *entry)
+{
+    while (entry != NULL){
+        struct index_entry *next = entry->next;
+        free(entry);
+        entry = next;
+    }
+}
+
+// Watches a directory (path is its full path, relative_path what the index calls it)
+// Adding a directory that's already watched, like one that was moved, just updates its path
+static void watch_dir(const char *path, const char *relative_path)
+{
+    int wd = inotify_add_watch(inotify_fd, path, WATCH_MASK);
+    pthread_mutex_lock(&watch_lock);
+    if (wd < 0){
+        if (!watch_failed){
+            log_perror("path_index - inotify_add_watch");
+        }
+        watch_failed = 1;
+        pthread_mutex_unlock(&watch_lock);
+        return;
+    }
+
+    if (wd >= watched_capacity){
+        int new_capacity = watched_capacity ? watched_capacity * 2 : 64;
+        while (new_capacity <= wd){
+            new_capacity *= 2;
+        }
+        char **temp_watched_dirs = realloc(watched_dirs, new_capacity * sizeof(char *));
+        if (temp_watched_dirs == NULL){
+            log_perror("path_index - error reallocating memory");
+            watch_failed = 1;
+            pthread_mutex_unlock(&watch_lock);
+            return;
+        }
+        memset(temp_watched_dirs + watched_capacity, 0, (new_capacity - watched_capacity) * sizeof(char *));
+        watched_dirs = temp_watched_dirs;
+        watched_capacity = new_capacity;
+    }
+    char *copy = strdup(relative_path);
+    if (copy == NULL){
+        log_perror("path_index - error allocating memory");
+        watch_failed = 1;
+    } else {
+        free(watched_dirs[wd]);
+        watched_dirs[wd] = copy;
+    }
+    pthread_mutex_unlock(&watch_lock);
+}
+
+// Queues a directory for a walk's threads to read, returns -1 on error
+static int walk_push(struct walk *walk, struct index_entry *dir)
+{
+    pthread_mutex_lock(&walk->lock);
+    if (walk->pending_count == walk->pending_capacity){
+        size_t new_capacity = walk->pending_capacity ? walk->pending_capacity * 2 : 256;
+        struct index_entry **temp_pending = realloc(walk->pending, new_capacity * sizeof(struct index_entry *));
+        if (temp_pending == NULL){
+            log_perror("path_index - error reallocating memory");
+            walk->failed = 1;
+            pthread_mutex_unlock(&walk->lock);
+            return -1;
+        }
+        walk->pending = temp_pending;
+        walk->pending_capacity = new_capacity;
+    }
+    walk->pending[walk->pending_count++] = dir;
+    pthread_cond_signal(&walk->cond);
+    pthread_mutex_unlock(&walk->lock);
+    return 0;
+}
+
+// Indexes what's in one directory, adding the entries to a thread's list and queueing the directories among them
+// A directory that can't be read in full is marked opaque, lookups under it go to the filesystem then
+static void scan_dir(struct walk *walk, struct index_entry *dir, struct index_entry **found, size_t *found_count)
+{
+    // Watched first, so nothing that changes while it's read goes unnoticed
+    char path[PATH_MAX + 1];
+    snprintf(path, sizeof(path), "%s/%s", BASE_DIR, dir->path);
+    watch_dir(path, dir->path);
+
+    int dir_fd = openat(BASE_DIR_FD, dir->path_len ? dir->path : ".", O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (dir_fd < 0){
+        dir->opaque = 1;
+        return;
+    }
+
+    char batch[DIRENT_BATCH_SIZE] __attribute__((aligned(__alignof__(struct linux_dirent64))));
+    long nbytes;
+    while ((nbytes = syscall(SYS_getdents64, dir_fd, batch, sizeof(batch))) > 0){
+        for (long position = 0; position < nbytes; ){
+            struct linux_dirent64 *dir_entry = (struct linux_dirent64 *)(batch + position);
+            position += dir_entry->d_reclen;
+
+            const char *name = dir_entry->d_name;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))){
+                continue;
+            }
+
+            // Paths longer than this can't be requested anyway
+            size_t len = dir->path_len ? snprintf(path, sizeof(path), "%s/%s", dir->path, name) :
+                                         snprintf(path, sizeof(path), "%s", name);
+            if (len >= sizeof(path) - strlen(BASE_DIR)){
+                continue;
+            }
+
+            struct stat file_stat;
+            if (fstatat(dir_fd, name, &file_stat, AT_SYMLINK_NOFOLLOW) < 0){
+                if (errno != ENOENT){ // Unless it's just gone, something is there that the index doesn't know
+                    dir->opaque = 1;
+                }
+                continue;
+            }
+
+            struct index_entry *entry = new_entry(path, len, &file_stat);
+            if (entry == NULL || (S_ISDIR(file_stat.st_mode) && walk_push(walk, entry) < 0)){
+                free(entry);
+                __atomic_store_n(&walk->failed, 1, __ATOMIC_RELAXED);
+                continue;
+            }
+            entry->next = *found; // A queued directory is only read after this, by whichever thread
+            *found = entry;
+            (*found_count)++;
+        }
+    }
+    if (nbytes < 0){
+        dir->opaque = 1;
+    }
+    close(dir_fd);
+}
+
+// Takes directories off the walk's queue until there are none left and no thread could find more
+static void *walk_thread(void *arg)
+{
+    struct walk *walk = arg;
+    struct index_entry *found = NULL;
+    size_t found_count = 0;
+
+    pthread_mutex_lock(&walk->lock);
+    while (1){
+        while (walk->pending_count == 0 && walk->busy > 0){
+            pthread_cond_wait(&walk->cond, &walk->lock);
+        }
+        if (walk->pending_count == 0){
+            break;
+        }
+        struct index_entry *dir = walk->pending[--walk->pending_count];
+        walk->busy++;
+        pthread_mutex_unlock(&walk->lock);
+
+        scan_dir(walk, dir, &found, &found_count);
+
+        pthread_mutex_lock(&walk->lock);
+        if (--walk->busy == 0 && walk->pending_count == 0){
+            pthread_cond_broadcast(&walk->cond); // Everyone else is done too
+        }
+    }
+
+    // Hand what this thread found over to the walk
+    if (found != NULL){
+        struct index_entry *last = found;
+        while (last->next != NULL){
+            last = last->next;
+        }
+        last->next = walk->found;
+        walk->found = found;
+        walk->found_count += found_count;
+    }
+    pthread_mutex_unlock(&walk->lock);
+    return NULL;
+}
+
+// Indexes everything under a directory entry (which isn't in the table yet) with up to thread_count threads
+// Returns the entries found as a list, NULL with *count 0 if there are none or on error (*count is -1 then)
+static struct index_entry *walk_tree(struct index_entry *root, int thread_count, long *count)
+{
+    struct walk walk;
+    memset(&walk, 0, sizeof(walk));
+    pthread_mutex_init(&walk.lock, NULL);
+    pthread_cond_init(&walk.cond, NULL);
+
+    *count = -1;
+    if (walk_push(&walk, root) < 0){
+        pthread_mutex_destroy(&walk.lock);
+        pthread_cond_destroy(&walk.cond);
+        return NULL;
+    }
+
+    pthread_t threads[MAX_WALK_THREADS];
+    int started = 0;
+    for (int i = 1; i < thread_count && i < MAX_WALK_THREADS; i++){
+        if (pthread_create(&threads[started], NULL, walk_thread, &walk)){
+            break; // The threads there are manage
+        }
+        started++;
+    }
+    walk_thread(&walk);
+    for (int i = 0; i < started; i++){
+        pthread_join(threads[i], NULL);
+    }
+
+    free(walk.pending);
+    pthread_mutex_destroy(&walk.lock);
+    pthread_cond_destroy(&walk.cond);
+    if (walk.failed){
+        free_entries(walk.found);
+        return NULL;
+    }
+    *count = walk.found_count;
+    return walk.found;
+}
+
+// Indexes the whole of BASE_DIR, returning the entries with BASE_DIR's own first (NULL on error)
+static struct index_entry *walk_base_dir(long *count)
+{
+    struct stat base_stat;
+    if (fstat(BASE_DIR_FD, &base_stat)){
+        log_perror("path_index - error getting BASE_DIR's status");
+        return NULL;
+    }
+    struct index_entry *root = new_entry("", 0, &base_stat);
+    if (root == NULL){
+        return NULL;
+    }
+
+    long cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+    root->next = walk_tree(root, cpu_count < 1 ? 1 : cpu_count > MAX_WALK_THREADS ? MAX_WALK_THREADS : cpu_count, count);
+    if (*count < 0){
+        free(root);
+        return NULL;
+    }
+    (*count)++;
+    return root;
+}
+
+// Replaces the table's contents with a list of entries, the caller holds index_lock for writing
+// Returns -1 if there's no memory for the buckets (the entries are freed then)
+static int replace_all_locked(struct index_entry *entries, long count)
+{
+    for (size_t i = 0; i < bucket_count; i++){
+        free_entries(buckets[i]);
+        buckets[i] = NULL;
+    }
+    stats.entries = 0;
+    stats.bytes_used = bucket_count * sizeof(struct index_entry *);
+
+    size_t wanted = MIN_BUCKET_COUNT;
+    while (wanted < (size_t)count){
+        wanted *= 2;
+    }
+    if (wanted > bucket_count && resize_locked(wanted) < 0 && bucket_count == 0){
+        free_entries(entries);
+        return -1;
+    }
+    while (entries != NULL){
+        struct index_entry *next = entries->next;
+        insert_locked(entries);
+        entries = next;
+    }
+    return 0;
+}
+
+// Walks the whole tree again after inotify lost events, lookups go to the filesystem meanwhile
+static void rebuild_index(void)
+{
+    log_message(LEVEL_WARNING, "Too many changes at once for inotify, indexing %s again", BASE_DIR);
+    __atomic_store_n(&index_enabled, 0, __ATOMIC_RELEASE);
+    __atomic_fetch_add(&stats.rebuilds, 1, __ATOMIC_RELAXED);
+
+    long count;
+    struct index_entry *entries = walk_base_dir(&count);
+    if (entries == NULL){
+        log_message(LEVEL_WARNING, "Indexing %s failed, the index is off", BASE_DIR);
+        return;
+    }
+    pthread_rwlock_wrlock(&index_lock);
+    int replaced = replace_all_locked(entries, count);
+    pthread_rwlock_unlock(&index_lock);
+    if (replaced == 0){
+        __atomic_store_n(&index_enabled, 1, __ATOMIC_RELEASE);
+    }
+}
+
+// Brings a path's entry up to date after inotify reported it changed, indexing it all if it's a new directory
+static void refresh_path(const char *path, size_t len, int is_new)
+{
+    struct stat file_stat;
+    if (fstatat(BASE_DIR_FD, path, &file_stat, AT_SYMLINK_NOFOLLOW)){
+        if (errno != ENOENT && errno != ENOTDIR){
+            log_perror("path_index - error getting file status");
+        }
+        pthread_rwlock_wrlock(&index_lock);
+        remove_locked(path, len, 1);
+        pthread_rwlock_unlock(&index_lock);
+        return;
+    }
+
+    struct index_entry *entry = new_entry(path, len, &file_stat);
+    if (entry == NULL){
+        return;
+    }
+
+    struct index_entry *found = NULL;
+    int known = 0; // A directory the index already has, what's in it is up to date
+    if (S_ISDIR(file_stat.st_mode)){
+        pthread_rwlock_rdlock(&index_lock);
+        struct index_entry *existing = find_locked(path, len);
+        known = existing != NULL && S_ISDIR(existing->mode) && !is_new;
+        entry->opaque = known && existing->opaque;
+        pthread_rwlock_unlock(&index_lock);
+
+        // A directory created or moved here may already have things in it
+        long count = 0;
+        if (!known && (found = walk_tree(entry, 1, &count)) == NULL && count < 0){
+            free(entry);
+            rebuild_index(); // Without its contents the index would answer 404s it shouldn't
+            return;
+        }
+    }
+
+    pthread_rwlock_wrlock(&index_lock);
+    if (!S_ISDIR(file_stat.st_mode) || !known){
+        remove_locked(path, len, 1); // Whatever was under the path before is gone
+    }
+    insert_locked(entry);
+    while (found != NULL){
+        struct index_entry *next = found->next;
+        insert_locked(found);
+        found = next;
+    }
+    pthread_rwlock_unlock(&index_lock);
+}
+
+// Applies one inotify event to the index
+static void handle_event(const struct inotify_event *event)
+{
+    char dir[PATH_MAX + 1];
+    pthread_mutex_lock(&watch_lock);
+    if (event->wd < 0 || event->wd >= watched_capacity || watched_dirs[event->wd] == NULL){
+        pthread_mutex_unlock(&watch_lock);
+        return;
+    }
+    if (event->mask & IN_IGNORED){ // The kernel dropped the watch, the directory's parent reports it gone
+        free(watched_dirs[event->wd]);
+        watched_dirs[event->wd] = NULL;
+        pthread_mutex_unlock(&watch_lock);
+        return;
+    }
+    snprintf(dir, sizeof(dir), "%s", watched_dirs[event->wd]);
+    pthread_mutex_unlock(&watch_lock);
+
+    if (event->len == 0){
+        return;
+    }
+    char path[PATH_MAX + 1];
+    size_t len = dir[0] ? snprintf(path, sizeof(path), "%s/%s", dir, event->name) :
+                          snprintf(path, sizeof(path), "%s", event->name);
+    if (len >= sizeof(path)){
+        return;
+    }
+    __atomic_fetch_add(&stats.updates, 1, __ATOMIC_RELAXED);
+
+    if (event->mask & (IN_DELETE | IN_MOVED_FROM)){
+        pthread_rwlock_wrlock(&index_lock);
+        remove_locked(path, len, event->mask & IN_ISDIR);
+        pthread_rwlock_unlock(&index_lock);
+    } else {
+        refresh_path(path, len, event->mask & (IN_CREATE | IN_MOVED_TO));
+    }
+
+    // The metadata cache may have the path's old answer
+    char requested_path[PATH_MAX + 1];
+    snprintf(requested_path, sizeof(requested_path), "%s/%s", BASE_DIR, path);
+    metadata_cache_invalidate(requested_path);
+}
+
+// Follows inotify's events for as long as the server runs
+static void *watch_changes(void *arg)
+{
+    (void)arg;
+    char events[65536] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    while (1){
+        ssize_t nbytes = read(inotify_fd, events, sizeof(events));
+        if (nbytes < 0){
+            if (errno == EINTR){
+                continue;
+            }
+            log_perror("path_index - reading inotify events");
+            break;
+        }
+
+        for (char *ptr = events; ptr < events + nbytes; ){
+            struct inotify_event *event = (struct inotify_event *)ptr;
+            ptr += sizeof(struct inotify_event) + event->len;
+
+            if (event->mask & IN_Q_OVERFLOW){
+                rebuild_index();
+            } else {
+                handle_event(event);
+            }
+        }
+
+        if (__atomic_load_n(&watch_failed, __ATOMIC_RELAXED)){
+            break;
+        }
+    }
+
+    log_message(LEVEL_WARNING, "The index can't follow changes to %s any more, it's off", BASE_DIR);
+    __atomic_store_n(&index_enabled, 0, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+// Walks BASE_DIR with several threads, indexes everything under it and starts following changes
+// Returns -1 (and the index stays off) if it can't keep up with the tree
+int path_index_init(void)
+{
+    uint64_t start = stats_now_ns();
+
+    inotify_fd = inotify_init1(IN_CLOEXEC);
+    if (inotify_fd < 0){
+        log_perror("path_index_init - inotify_init1");
+        return -1;
+    }
+
+    long count;
+    struct index_entry *entries = walk_base_dir(&count);
+    if (entries == NULL || watch_failed){
+        free_entries(entries);
+        log_message(LEVEL_WARNING, "Can't watch every directory under %s (see fs.inotify.max_user_watches), "
+                    "the index is off", BASE_DIR);
+        return -1;
+    }
+    pthread_rwlock_wrlock(&index_lock);
+    int replaced = replace_all_locked(entries, count);
+    size_t entry_count = stats.entries, bytes_used = stats.bytes_used; // Before the watcher can change them
+    pthread_rwlock_unlock(&index_lock);
+    if (replaced < 0){
+        return -1;
+    }
+
+    pthread_t watcher;
+    if (pthread_create(&watcher, NULL, watch_changes, NULL)){
+        log_message(LEVEL_WARNING, "Can't start following changes to %s, the index is off", BASE_DIR);
+        return -1;
+    }
+    pthread_detach(watcher);
+    __atomic_store_n(&index_enabled, 1, __ATOMIC_RELEASE);
+
+    double elapsed_ms = (stats_now_ns() - start) / 1e6;
+    log_message(LEVEL_INFO, "Indexed %zu paths under %s in %.1f ms, %zu bytes (%.0f bytes per path, "
+                "about %.0f MiB per million paths)", entry_count, BASE_DIR, elapsed_ms, bytes_used,
+                (double)bytes_used / entry_count, (double)bytes_used / entry_count * 1e6 / (1 << 20));
+    return 0;
+}
+
+// Whether the index is answering lookups
+int path_index_enabled(void)
+{
+    return __atomic_load_n(&index_enabled, __ATOMIC_ACQUIRE);
+}
+
+// Looks a path relative to BASE_DIR up (no ".", ".." or empty components, len bytes of it)
+// must_be_dir is set for a path that ended in '/'. On INDEX_FOUND, fills the type, size, mtime and inode
+// into file_stat and the MIME type into mime_type (NULL for anything but a regular file)
+enum path_index_result path_index_lookup(const char *path, size_t len, int must_be_dir, struct stat *file_stat,
+                                         const char **mime_type)
+{
+    if (!path_index_enabled()){
+        return INDEX_UNKNOWN;
+    }
+
+    enum path_index_result result = INDEX_UNKNOWN;
+    pthread_rwlock_rdlock(&index_lock);
+    struct index_entry *entry = find_locked(path, len);
+    if (entry != NULL){
+        if (S_ISDIR(entry->mode) || (S_ISREG(entry->mode) && !must_be_dir)){
+            memset(file_stat, 0, sizeof(struct stat));
+            file_stat->st_mode = entry->mode;
+            file_stat->st_size = entry->size;
+            file_stat->st_ino = entry->ino;
+            file_stat->st_mtim = entry->mtime;
+            *mime_type = entry->mime_type;
+            result = INDEX_FOUND;
+        } else if (S_ISREG(entry->mode)){
+            result = INDEX_MISSING; // A file where a directory was asked for
+        }
+        // A symlink or anything else is left to the filesystem
+    } else {
+        // The deepest ancestor there is decides, nothing is under a directory that was read in full or a file
+        size_t parent_len = len;
+        while (entry == NULL && parent_len > 0){
+            while (parent_len > 0 && path[parent_len - 1] != '/'){
+                parent_len--;
+            }
+            if (parent_len > 0){
+                parent_len--;
+            }
+            entry = find_locked(path, parent_len);
+        }
+        if (entry != NULL && ((S_ISDIR(entry->mode) && !entry->opaque) || S_ISREG(entry->mode))){
+            result = INDEX_MISSING;
+        }
+    }
+    pthread_rwlock_unlock(&index_lock);
+
+    unsigned long *counter = result == INDEX_FOUND ? &stats.hits :
+                             result == INDEX_MISSING ? &stats.misses : &stats.fallbacks;
+    __atomic_fetch_add(counter, 1, __ATOMIC_RELAXED);
+    return result;
+}
+
+// Copies the current counters
+void path_index_get_stats(struct path_index_stats *stats_copy)
+{
+    pthread_rwlock_rdlock(&index_lock);
+    stats_copy->entries = stats.entries;
+    stats_copy->bytes_used = stats.bytes_used;
+    pthread_rwlock_unlock(&index_lock);
+    stats_copy->hits = __atomic_load_n(&stats.hits, __ATOMIC_RELAXED);
+    stats_copy->misses = __atomic_load_n(&stats.misses, __ATOMIC_RELAXED);
+    stats_copy->fallbacks = __atomic_load_n(&stats.fallbacks, __ATOMIC_RELAXED);
+    stats_copy->updates = __atomic_load_n(&stats.updates, __ATOMIC_RELAXED);
+    stats_copy->rebuilds = __atomic_load_n(&stats.rebuilds, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,41 @@
+#ifndef PATH_INDEX_H
+#define PATH_INDEX_H
+
+#include <stddef.h>
+#include <sys/stat.h>
+
+// What the index can tell about a path
+enum path_index_result {
+    INDEX_UNKNOWN, // The filesystem has to be asked (the index is off, or a symlink or unreadable directory is on the way)
+    INDEX_FOUND,
+    INDEX_MISSING // Nothing there, a 404
+};
+
+// Counters for how well the index is doing
+struct path_index_stats {
+    unsigned long hits;
+    unsigned long misses; // 404s answered without touching the filesystem
+    unsigned long fallbacks;
+    unsigned long updates; // Changes inotify reported
+    unsigned long rebuilds; // Whole walks after inotify's queue overflowed
+    size_t entries;
+    size_t bytes_used;
+};
+
+// Walks BASE_DIR with several threads, indexes everything under it and starts following changes
+// Returns -1 (and the index stays off) if it can't keep up with the tree
+int path_index_init(void);
+
+// Whether the index is answering lookups
+int path_index_enabled(void);
+
+// Looks a path relative to BASE_DIR up (no ".", ".." or empty components, len bytes of it)
+// must_be_dir is set for a path that ended in '/'. On INDEX_FOUND, fills the type, size, mtime and inode
+// into file_stat and the MIME type into mime_type (NULL for anything but a regular file)
+enum path_index_result path_index_lookup(const char *path, size_t len, int must_be_dir, struct stat *file_stat,
+                                         const char **mime_type);
+
+// Copies the current counters
+void path_index_get_stats(struct path_index_stats *stats);
+
+#endif
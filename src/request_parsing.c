@@ -1,22 +1,53 @@
 #include <ctype.h>
 #include <errno.h>
-#include <regex.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <linux/openat2.h>
+#include <sys/syscall.h>
+#include "connection.h"
+#include "content_encoding.h"
 #include "directory_resolution.h"
+#include "file_cache.h"
+#include "http_parser.h"
+#include "http_scan.h"
+#include "logging.h"
+#include "metadata_cache.h"
+#include "mime_types.h"
+#include "options.h"
+#include "path_index.h"
 #include "response_sending.h"
+#include "server_stats.h"
+#include "site_archive.h"
 
+#ifndef SYS_openat2
+#define SYS_openat2 437 // The same on every architecture
+#endif
+
+static int openat2_missing = 0; // Set once the kernel turns out not to have openat2()
 
 // Decodes a URL-encoded string and checks for forbidden characters
 int decode_URI(char *original_src, char *dest)
 {
-    // Intermediary variable in case original_src == dest
-    char src[strlen(original_src) + 1];
-    strcpy(src, original_src);
+    // Decoding only ever shrinks the string, so it can be done in place (original_src == dest)
+    const char *src = original_src;
+    size_t src_len = strlen(src);
+
+    size_t i = 0, j = 0;
+    while (i < src_len) {
+        // Everything up to the next '%', '+' or control character is copied in one go
+        size_t run = scan_uri_special(src + i, src_len - i);
+        if (dest + j != src + i) {
+            memmove(dest + j, src + i, run);
+        }
+        i += run;
+        j += run;
+        if (i == src_len) {
+            break;
+        }
 
-    int i = 0, j = 0;
-    while (src[i]) {
         // Convert '+' to space
         if (src[i] == '+') {
             dest[j++] = ' ';
@@ -25,11 +56,10 @@ int decode_URI(char *original_src, char *dest)
         // If it's not the beginning of a URL-encoded character
         } else if (src[i] != '%') {
             dest[j++] = src[i++]; // Copy the character as is
-        }
 
         // If the character is '%', convert the next two characters from hex to decimal if they are valid hex digits
-        if (src[i + 1] && isxdigit(src[i + 1]) && 
-            src[i + 2] && isxdigit(src[i + 2])) {
+        } else if (src[i + 1] && isxdigit(src[i + 1]) &&
+                   src[i + 2] && isxdigit(src[i + 2])) {
 
             char encoded_char[3] = {src[i + 1], src[i + 2], '\0'};
             long decoded_char = strtol(encoded_char, NULL, 16);
@@ -51,161 +81,534 @@ int decode_URI(char *original_src, char *dest)
     return 0;
 }
 
-// Parses the URI and returns a status code
-int URI_checker(char *request_URI, char *destination_path)
+// Turns the URI into a path under BASE_DIR and returns a status code
+int URI_to_path(const char *request_URI, char *destination_path)
 {
-    strtok(request_URI, "#"); // Seperate the path from the fragment
-    strtok(request_URI, "?"); // Seperate the path from the query
+    // Seperate the path from the query and fragment, the URI itself stays as it was for the access log
+    size_t path_len = strcspn(request_URI, "?#");
+    char path[path_len + 1];
+    memcpy(path, request_URI, path_len);
+    path[path_len] = '\0';
 
-    if (decode_URI(request_URI, request_URI)){ // If we found a forbidden URL-encoded character
+    if (decode_URI(path, path)){ // If we found a forbidden URL-encoded character
         return 400;
     }
 
-    if (strlen(request_URI) > (PATH_MAX - strlen(BASE_DIR))){ // If the path is too long
+    size_t base_len = strlen(BASE_DIR);
+    size_t decoded_len = strlen(path);
+    if (decoded_len > (PATH_MAX - base_len)){ // If the path is too long
         return 414;
     }
 
-    // Concatenate BASE_DIR and request_URI
-    size_t destination_lenght = strlen(BASE_DIR) + strlen(request_URI) + 1;
-    strncpy(destination_path, BASE_DIR, destination_lenght);
-    strncat(destination_path, request_URI, destination_lenght);
+    // Concatenate BASE_DIR and the path
+    memcpy(destination_path, BASE_DIR, base_len);
+    memcpy(destination_path + base_len, path, decoded_len + 1);
 
-    // Check if the path is inside our base directory
-    if (strncmp(destination_path, BASE_DIR, strlen(BASE_DIR))){
-        return 403;
-    }
+    return 200;
+}
 
+// Resolves the path in place and returns a status code
+int resolve_path(char *destination_path)
+{
     // Check if the requested path exists and is allowed for access
     if (realpath(destination_path, destination_path) == NULL){
         if (errno == EACCES){
             return 403;
-        } else if (errno == ENOENT){
+        } else if (errno == ENOENT || errno == ENOTDIR){
             return 404;
         } else {
-            perror("URI_checker - error resolving file path");
+            log_perror("URI_checker - error resolving file path");
             return 500;
         }
     }
 
+    // Check if the resolved path is still inside our base directory ("/.." or a symlink could lead out)
+    size_t base_length = strlen(BASE_DIR);
+    if (strncmp(destination_path, BASE_DIR, base_length) ||
+        (destination_path[base_length] != '/' && destination_path[base_length] != '\0' && base_length > 1)){
+        return 403;
+    }
+
     return 200; // If everything is fine with the URI
 }
 
-// Checks whether the request is HTTP version 0.9
-int http09_check(char *original_request, char *usable_path)
+// Whether a relative path is already in the form realpath() would give it (no ".", ".." or empty components)
+static int path_is_canonical(const char *path, size_t len)
 {
-    char *line;
-    char *uri_path;
+    const char *end = path + len;
+    while (path < end){
+        const char *slash = memchr(path, '/', end - path);
+        size_t component_len = (slash != NULL ? slash : end) - path;
+        if (component_len == 0 || (path[0] == '.' && (component_len == 1 || (component_len == 2 && path[1] == '.')))){
+            return 0;
+        }
+        path += component_len + 1;
+    }
+    return 1;
+}
 
-    // Make a copy for the check (because strtok() modifies its input)
-    char *request_copy = malloc((strlen(original_request) + 1));
-    if (request_copy == NULL){
-        perror("http09_check - error allocating memory");
+// Puts a canonical path relative to BASE_DIR (len bytes of it) back together with BASE_DIR
+static void join_base_dir(char *resolved_path, const char *relative_path, size_t len)
+{
+    if (len == 0){
+        strcpy(resolved_path, BASE_DIR);
+    } else {
+        snprintf(resolved_path, PATH_MAX + 1, "%s/%.*s", strcmp(BASE_DIR, "/") ? BASE_DIR : "", (int) len, relative_path);
+    }
+}
+
+// Looks a canonical path relative to BASE_DIR (len bytes of it, maybe followed by '/'s) up with a single openat2()
+// relative to BASE_DIR_FD, which the kernel doesn't let leave BASE_DIR, and fstat()s what it opened
+// Regular files keep their descriptor in *fd. Returns a status code, or -1 if the slower walk has to decide
+// (an old kernel, or a symlink that may still be fine)
+static int open_beneath(const char *relative_path, size_t len, char *resolved_path, int *fd, struct stat *file_stat)
+{
+    if (openat2_missing){
+        return -1;
+    }
+
+    // Without symlinks on the way, the path as it was asked for is already the resolved one
+    // A trailing '/' stays, so only a directory matches then, and O_NONBLOCK keeps a FIFO from stalling the worker
+    struct open_how how = {
+        .flags = O_RDONLY | O_CLOEXEC | O_NONBLOCK | O_NOCTTY,
+        .resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS | RESOLVE_NO_SYMLINKS,
+    };
+    int file_fd = syscall(SYS_openat2, BASE_DIR_FD, relative_path[0] != '\0' ? relative_path : ".", &how, sizeof(how));
+    if (file_fd < 0){
+        if (errno == ENOSYS){
+            log_message(LEVEL_INFO, "openat2() isn't available, resolving paths with realpath()");
+            openat2_missing = 1;
+        } else if (errno == ENOENT || errno == ENOTDIR){
+            return 404;
+        }
+        return -1; // A symlink (ELOOP), no permission or anything unexpected goes the slow way
+    }
+
+    if (fstat(file_fd, file_stat)){
+        log_perror("open_beneath - error getting file status");
+        close(file_fd);
         return 500;
     }
-    strcpy(request_copy, original_request);
+    if (S_ISREG(file_stat->st_mode)){
+        *fd = file_fd;
+    } else {
+        close(file_fd);
+    }
+
+    join_base_dir(resolved_path, relative_path, len);
+    return 200;
+}
+
+// Resolves a requested path the portable way, realpath() and a check that it stayed under BASE_DIR, then stat()s it
+static int walk_path(const char *requested_path, char *resolved_path, struct stat *file_stat)
+{
+    snprintf(resolved_path, PATH_MAX + 1, "%s", requested_path);
+    int status = resolve_path(resolved_path);
+
+    if (status == 200 && stat(resolved_path, file_stat)){
+        if (errno == EACCES){
+            status = 403;
+        } else if (errno == ENOENT || errno == ENOTDIR){ // It went away since realpath()
+            status = 404;
+        } else {
+            log_perror("get_path_metadata - error getting file status");
+            status = 500;
+        }
+    }
+    return status;
+}
+
+// Whether two stat() results are of the same file with the same contents, as far as headers go
+static int same_file_version(const struct stat *a, const struct stat *b)
+{
+    return a->st_ino == b->st_ino && a->st_size == b->st_size &&
+           a->st_mtim.tv_sec == b->st_mtim.tv_sec && a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
 
-    // HTTP/0.9 check
-    if ((line = strtok(request_copy, "\r\n")) == NULL){
-        free(request_copy);
-        return 400; // All versions of HTTP requests need to have at least one line
+// Whether a cached entry's open file has changed since its headers' stat() result was taken
+// An fstat() of the descriptor it holds is enough, no path is walked
+// A file that was deleted, or replaced by rename(), has no links left, the path leads elsewhere now
+static int metadata_is_stale(struct metadata_entry *entry)
+{
+    int fd = __atomic_load_n(&entry->fd, __ATOMIC_ACQUIRE);
+    struct stat file_stat;
+    if (entry->status != 200 || fd < 0 || S_ISDIR(entry->stat.st_mode)){
+        return 0;
     }
-    if (!strcmp(strtok(line, " "), "GET") && // Method is GET
-        (uri_path = strtok(NULL, " ")) != NULL && // URI is present
-        strtok(NULL, " ") == NULL && // HTTP version is not present
-        strtok(NULL, "\r\n") == NULL){ // The total request is only one line
+    return fstat(fd, &file_stat) < 0 || file_stat.st_nlink == 0 || !same_file_version(&file_stat, &entry->stat);
+}
 
-        int return_status_code = URI_checker(uri_path, usable_path); // Parse the URI for any problems
-        free(request_copy);
-        return return_status_code;
+// Returns what's at a requested path (BASE_DIR + decoded URI), looking it up on a cache miss
+// The entry comes with a reference taken, NULL means an internal error
+struct metadata_entry *get_path_metadata(const char *requested_path)
+{
+    struct metadata_entry *entry = metadata_cache_lookup(requested_path);
+    if (entry != NULL && !metadata_is_stale(entry)){
+        return entry;
+    }
+    if (entry != NULL){ // Rewritten in place since it was opened, it's looked up afresh
+        metadata_cache_invalidate(requested_path);
+        metadata_cache_release(entry);
     }
 
-    free(request_copy);
-    return 0;
+    // Everything after BASE_DIR, without the '/'s around it
+    const char *relative_path = requested_path + strlen(BASE_DIR);
+    relative_path += strspn(relative_path, "/");
+    size_t relative_len = strlen(relative_path);
+    while (relative_len > 0 && relative_path[relative_len - 1] == '/'){
+        relative_len--;
+    }
+
+    // The index or the kernel can answer for a path as it is, realpath() settles the dots (the symlinks before them come first)
+    char resolved_path[PATH_MAX + 1];
+    struct stat file_stat;
+    const char *mime_type = NULL;
+    int fd = -1;
+    int status = -1;
+    if (path_is_canonical(relative_path, relative_len)){
+        switch (path_index_lookup(relative_path, relative_len, relative_path[relative_len] == '/', &file_stat, &mime_type)){
+            case INDEX_FOUND:
+                join_base_dir(resolved_path, relative_path, relative_len);
+                status = 200;
+                break;
+            case INDEX_MISSING:
+                status = 404;
+                break;
+            case INDEX_UNKNOWN:
+                status = open_beneath(relative_path, relative_len, resolved_path, &fd, &file_stat);
+                break;
+        }
+    }
+    if (status < 0){
+        status = walk_path(requested_path, resolved_path, &file_stat);
+    }
+    if (status == 500){ // Not worth remembering
+        return NULL;
+    }
+    if (status == 200 && mime_type == NULL && !S_ISDIR(file_stat.st_mode)){
+        mime_type = get_MIME_type(resolved_path);
+    }
+
+    return metadata_cache_insert(requested_path, status, resolved_path, &file_stat, mime_type, fd);
 }
 
-// Checks whether the version's syntax is valid
-int http_version_check(char *http_version)
+// Opens the file behind a looked-up path and checks it's the one the metadata describes
+// Returns 200 or the status code to answer with instead
+static int open_entry_file(struct metadata_entry *entry)
 {
-    regex_t regex;
-    int regexreturn;
-    if (regcomp(&regex, "HTTP/[0-9]+\\.[0-9]+", REG_EXTENDED)){
-        perror("parse_request - regex compilation failure");
+    int fd = open(entry->resolved_path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 && errno == EACCES){
+        return 403;
+    } else if (fd < 0 && (errno == ENOENT || errno == ENOTDIR)){
+        metadata_cache_invalidate(entry->key);
+        return 404;
+    }
+
+    struct stat file_stat;
+    if (fd < 0 || fstat(fd, &file_stat)){
+        log_perror("open_path_metadata - error opening file");
+        if (fd >= 0){
+            close(fd);
+        }
         return 500;
     }
 
-    regexreturn = regexec(&regex, http_version, 0, NULL, 0);
-    if (!regexreturn){ // Version's syntax checks out
-        regfree(&regex);
+    // The headers were made from the stat() result, so the file must still be the same one
+    if (!same_file_version(&file_stat, &entry->stat)){
+        close(fd);
+        metadata_cache_invalidate(entry->key); // The client's retry looks it up afresh
+        return 503;
+    }
+
+    metadata_cache_attach_fd(entry, fd);
+    return 200;
+}
+
+// Opens the file behind a looked-up path, unless an earlier response already did
+// Files stay open while their entry is cached, returns 200 or the status code to answer with instead
+int open_path_metadata(struct metadata_entry *entry)
+{
+    if (__atomic_load_n(&entry->fd, __ATOMIC_ACQUIRE) >= 0){
         return 200;
-    } else if (regexreturn == REG_NOMATCH){ // Version is malformed
-        regfree(&regex);
-        return 400;
-    } else { // There was an error checking the version
-        char regex_error_massage[100];
-        regerror(regexreturn, &regex, regex_error_massage, sizeof(regex_error_massage));
-        fprintf(stderr, "parse_request - regex match failed: %s\n", regex_error_massage);
-        regfree(&regex);
+    }
+
+    uint64_t open_start = stats_now_ns();
+    int status = open_entry_file(entry);
+    stats_record_phase(PHASE_OPEN, stats_now_ns() - open_start);
+    return status;
+}
+
+// Parses the URI and returns a status code, leaving the resolved path in destination_path
+int URI_checker(char *request_URI, char *destination_path)
+{
+    int return_status_code = URI_to_path(request_URI, destination_path);
+    if (return_status_code != 200){
+        return return_status_code;
+    }
+
+    // The same lookup as every other request's, so the index and the metadata cache answer it too
+    struct metadata_entry *metadata = get_path_metadata(destination_path);
+    if (metadata == NULL){
         return 500;
     }
+    return_status_code = metadata->status;
+    if (return_status_code == 200){
+        strcpy(destination_path, metadata->resolved_path);
+    }
+    metadata_cache_release(metadata);
+    return return_status_code;
+}
+
+// Finds the site archive's file for a URI: the file at its path, or the index.html of the directory it names
+// Returns a status code, *entry is only set for 200
+static int find_archive_entry(const char *request_URI, const struct site_archive_entry **entry)
+{
+    size_t path_len = strcspn(request_URI, "?#");
+    char path[path_len + sizeof("/index.html")];
+    memcpy(path, request_URI, path_len);
+    path[path_len] = '\0';
+    if (decode_URI(path, path)){
+        return 400;
+    }
+    int wants_dir = path[0] != '\0' && path[strlen(path) - 1] == '/';
+
+    // Work the "." and ".." segments out the way realpath() would (there are no symlinks in an archive)
+    // What's kept is never ahead of what's read, so it's done in place
+    size_t len = 0;
+    const char *segment = path;
+    while (*segment){
+        size_t segment_len = strcspn(segment, "/");
+        if (segment_len == 2 && segment[0] == '.' && segment[1] == '.'){
+            if (len == 0){
+                return 403; // Above the site's root
+            }
+            while (len > 0 && path[len - 1] != '/'){
+                len--;
+            }
+            len -= len > 0;
+        } else if (segment_len > 0 && !(segment_len == 1 && segment[0] == '.')){
+            if (len > 0){
+                path[len++] = '/';
+            }
+            memmove(path + len, segment, segment_len);
+            len += segment_len;
+        }
+        segment += segment_len + (segment[segment_len] == '/');
+    }
+
+    if (!wants_dir && (*entry = site_archive_lookup(path, len)) != NULL){
+        return 200;
+    }
+    len += sprintf(path + len, "%sindex.html", len > 0 ? "/" : "");
+    return (*entry = site_archive_lookup(path, len)) != NULL ? 200 : 404;
+}
+
+// Parses the first request in the connection's buffer if it has fully arrived
+// The parser keeps its place, so a request split across many reads is only scanned once
+int handle_buffered_request(struct connection *conn)
+{
+    uint64_t parse_start = stats_now_ns();
+    ssize_t len = http_parser_execute(&conn->parser, conn->recv_buf, conn->recv_len);
+    uint64_t parse_end = stats_now_ns();
+    conn->parse_ns += parse_end - parse_start;
+
+    if (len == 0){
+        if (conn->recv_len < sizeof(conn->recv_buf) - 1){
+            return 0; // Wait for the rest
+        }
+        len = -(conn->parser.state == PARSER_REQUEST_LINE ? 414 : 431); // There's no room left for the rest
+    }
+
+    // A body is waited for and skipped, so its bytes are never taken for the next request
+    // One that can't fit in the buffer along with the head is refused, closing the connection
+    if (len > 0 && conn->parser.body_length > 0){
+        if (conn->parser.body_length > sizeof(conn->recv_buf) - 1 - len){
+            len = -413;
+        } else if (len + conn->parser.body_length > conn->recv_len){
+            return 0; // Wait for the rest of the body
+        }
+    }
+    stats_record_phase(PHASE_PARSE, conn->parse_ns);
+    conn->parse_ns = 0;
+    conn->request_start = parse_end;
+
+    int retval;
+    if (len < 0){ // Nothing after a malformed request can be trusted, so it all goes
+        conn->request_len = conn->recv_len;
+        handle_error_status_code(-len, conn);
+        retval = 1;
+    } else {
+        conn->request_len = len + conn->parser.body_length;
+        retval = parse_request_and_send_response(conn) < 0 ? -1 : 1;
+    }
+    conn->send_start = stats_now_ns();
+    return retval;
+}
+
+// Checks whether a comma-separated header value (like Connection's) contains a token
+static int header_has_token(const char *header_value, const char *token)
+{
+    size_t token_len = strlen(token);
+
+    while (*header_value){
+        header_value += strspn(header_value, " \t,");
+        size_t word_len = strcspn(header_value, ",");
+        while (word_len > 0 && (header_value[word_len - 1] == ' ' || header_value[word_len - 1] == '\t')){
+            word_len--;
+        }
+        if (word_len == token_len && !strncasecmp(header_value, token, token_len)){
+            return 1;
+        }
+        header_value += strcspn(header_value, ",");
+    }
+    return 0;
 }
 
-// Returns 0 if everything was sent properly
-int parse_request_and_send_response(const int sock, char *request)
+// Returns 0 if a response was queued on the connection
+int parse_request_and_send_response(struct connection *conn)
 {
-    char *line; // Split the request into lines with strtok()
-    char *method, *uri_file_path, *version;
+    struct http_parser *request = &conn->parser;
     char combined_path[PATH_MAX + 1]; // The path we'll pass into functions to work with a file/directory
     int return_status_code;
 
-    // Check for a HTTP/0.9 request
-    if ((return_status_code = http09_check(request, combined_path)) == 200){
+    conn->keep_alive = 0; // Until we know the client wants it
+    conn->accept_encodings = 0;
+    conn->is_http11 = 0;
 
-        FILE *open_file = fopen(combined_path, "rb");
-        if (open_file == NULL) {
-            perror("send_response - error opening file");
-            return handle_error_status_code(500, sock);
+    // A HTTP/0.9 request gets purely the response body
+    if (request->is_http09 && site_archive_loaded()){
+        const struct site_archive_entry *entry;
+        if ((return_status_code = find_archive_entry(request->uri.data, &entry)) != 200){
+            return handle_error_status_code(return_status_code, conn);
         }
-        // Send purely the response body
-        return send_file(sock, open_file);
-
-    } else if (return_status_code != 0){
-        return handle_error_status_code(return_status_code, sock);
+        connection_reset_response(conn);
+        connection_set_body_buffer(conn, site_archive_body(&entry->representations[0]),
+                                   entry->representations[0].body_len, NULL);
+        return 0;
     }
+    if (request->is_http09){
+        if ((return_status_code = URI_checker(request->uri.data, combined_path)) != 200){
+            return handle_error_status_code(return_status_code, conn);
+        }
 
+        struct stat open_file_stat;
+        int open_fd = open(combined_path, O_RDONLY | O_CLOEXEC);
+        if (open_fd < 0 || fstat(open_fd, &open_file_stat)) {
+            log_perror("send_response - error opening file");
+            if (open_fd >= 0) close(open_fd);
+            return handle_error_status_code(500, conn);
+        }
+        connection_reset_response(conn);
+        return send_file(conn, open_fd, open_file_stat.st_size);
+    }
 
-    // Get the first line of the request and split it into method, uri_file_path and version
-    if ((line = strtok(request, "\r\n")) == NULL){
-        return handle_error_status_code(400, sock);
+    // The header values we act on, the parser already NUL-terminated them in the buffer
+    conn->range = request->range.data;
+    conn->if_range = request->if_range.data;
+    conn->if_none_match = request->if_none_match.data;
+    conn->if_modified_since = request->if_modified_since.data;
+
+    // HTTP/1.1 keeps the connection open unless told otherwise, HTTP/1.0 only if asked to
+    const char *connection_header = request->connection.data;
+    int is_http11 = request->major_version > 1 || (request->major_version == 1 && request->minor_version >= 1);
+    conn->is_http11 = is_http11;
+    if (is_http11){
+        conn->keep_alive = connection_header == NULL || !header_has_token(connection_header, "close");
+    } else {
+        conn->keep_alive = connection_header != NULL && header_has_token(connection_header, "keep-alive");
+    }
+    if (conn->requests_served + 1 >= OPTIONS.max_requests){
+        conn->keep_alive = 0;
     }
-    if ((method = strtok(line, " ")) == NULL || 
-        (uri_file_path = strtok(NULL, " ")) == NULL || 
-        (version = strtok(NULL, " ")) == NULL){
 
-        return handle_error_status_code(400, sock);
+    // HTTP/1.1 requests must say which host they're for
+    if (is_http11 && request->host.data == NULL){
+        return handle_error_status_code(400, conn);
     }
 
+    conn->accept_encodings = parse_accept_encoding(request->accept_encoding.data);
 
-    // Check if the version is fine
-    return_status_code = http_version_check(version);
-    if (return_status_code != 200){
-        return handle_error_status_code(return_status_code, sock);
+
+    // Method check
+    int is_head_method;
+    if (!strcmp(request->method.data, "GET")){ // If method is GET
+        is_head_method = 0;
+    } else if (!strcmp(request->method.data, "HEAD")){ // If the method is HEAD
+        is_head_method = 1;
+    } else {
+        log_message(LEVEL_DEBUG, "parse_request - unsupported method %s", request->method.data);
+        return handle_error_status_code(501, conn);
     }
 
 
+    // The query only matters to directory listings, URI_to_path() cuts it off
+    size_t path_len = strcspn(request->uri.data, "?#");
+    char *query = request->uri.data + path_len;
+    conn->query = *query == '?' ? query + 1 : NULL;
+
+    // The stats endpoint takes the place of any file with its name
+    if (OPTIONS.stats_path != NULL && path_len == strlen(OPTIONS.stats_path) &&
+        !strncmp(request->uri.data, OPTIONS.stats_path, path_len)){
+        return send_stats_response(conn, is_head_method);
+    }
+
     // URI check
-    return_status_code = URI_checker(uri_file_path, combined_path);
+    uint64_t resolve_start = stats_now_ns();
+
+    // A packed site is answered from its mapping without touching the filesystem
+    if (site_archive_loaded()){
+        const struct site_archive_entry *entry;
+        return_status_code = find_archive_entry(request->uri.data, &entry);
+        stats_record_phase(PHASE_RESOLVE, stats_now_ns() - resolve_start);
+        if (return_status_code != 200){
+            return handle_error_status_code(return_status_code, conn);
+        }
+        return send_archive_response(entry, conn, is_head_method);
+    }
+
+    return_status_code = URI_to_path(request->uri.data, combined_path);
     if (return_status_code != 200){
-        return handle_error_status_code(return_status_code, sock);
+        return handle_error_status_code(return_status_code, conn);
     }
 
+    // Hot files are answered from memory before touching the filesystem,
+    // unless the client would rather get one of their encoded variants
+    // ("//" only shows up in unresolved paths and in the keys of those variants)
+    // A range is cut from the open file and validators are checked against the stat(), so those skip the cached copy
+    int is_plain_request = conn->range == NULL && conn->if_none_match == NULL && conn->if_modified_since == NULL;
+    struct file_cache_entry *cached_file = strstr(combined_path, "//") == NULL && is_plain_request ?
+                                           file_cache_lookup(combined_path) : NULL;
+    if (cached_file != NULL && (cached_file->variants & conn->accept_encodings)){
+        int wanted_variants = cached_file->variants & conn->accept_encodings;
+        char variant_key[PATH_MAX + 16];
+        file_cache_release(cached_file);
+        cached_file = NULL;
+
+        for (int i = 0; ENCODINGS[i].token != NULL; i++){
+            if (wanted_variants & ENCODINGS[i].encoding){
+                if (file_cache_variant_key(variant_key, sizeof(variant_key), combined_path, ENCODINGS[i].token) == 0){
+                    cached_file = file_cache_lookup(variant_key);
+                }
+                break; // Only the best one would be served
+            }
+        }
+    }
+    if (cached_file != NULL){
+        stats_record_phase(PHASE_RESOLVE, stats_now_ns() - resolve_start);
+        return send_cached_file_response(cached_file, conn, is_head_method);
+    }
 
-    // Method check
-    if (!strcmp(method, "GET")){ // If method is GET
-        return get_or_head_method(combined_path, sock, 0);
-    } else if (!strcmp(method, "HEAD")){ // If the method is HEAD
-        return get_or_head_method(combined_path, sock, 1);
-    } else {
-        perror("parse_request - unsupported method");
-        return handle_error_status_code(501, sock);
+    // realpath(), open() and fstat() only happen when the metadata cache doesn't know the path yet
+    struct metadata_entry *metadata = get_path_metadata(combined_path);
+    stats_record_phase(PHASE_RESOLVE, stats_now_ns() - resolve_start);
+    if (metadata == NULL){
+        return handle_error_status_code(500, conn);
     }
+    if (metadata->status != 200){
+        return_status_code = metadata->status;
+        metadata_cache_release(metadata);
+        return handle_error_status_code(return_status_code, conn);
+    }
+
+    return get_or_head_method(metadata, conn, is_head_method);
 }
\ No newline at end of file
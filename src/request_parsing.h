@@ -3,26 +3,43 @@
 
 #include <ctype.h>
 #include <errno.h>
-#include <regex.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include "connection.h"
+#include "content_encoding.h"
 #include "directory_resolution.h"
+#include "file_cache.h"
+#include "http_parser.h"
+#include "metadata_cache.h"
+#include "options.h"
 #include "response_sending.h"
 
 // Decodes a URL-encoded string and checks for forbidden characters
 int decode_URI(char *original_src, char *dest);
 
-// Parses the URI and returns a status code
-int URI_checker(char *request_URI, char *destination_path);
+// Turns the URI into a path under BASE_DIR and returns a status code
+int URI_to_path(const char *request_URI, char *destination_path);
+
+// Resolves the path in place and returns a status code
+int resolve_path(char *destination_path);
+
+// Returns what's at a requested path (BASE_DIR + decoded URI), looking it up on a cache miss
+// The entry comes with a reference taken, NULL means an internal error
+struct metadata_entry *get_path_metadata(const char *requested_path);
 
-// Checks whether the request is HTTP version 0.9
-int http09_check(char *original_request, char *usable_path);
+// Opens the file behind a looked-up path, unless an earlier response already did
+// Files stay open while their entry is cached, returns 200 or the status code to answer with instead
+int open_path_metadata(struct metadata_entry *entry);
+
+// Parses the URI and returns a status code, leaving the resolved path in destination_path
+int URI_checker(char *request_URI, char *destination_path);
 
-// Checks whether the version's syntax is valid
-int http_version_check(char *http_version);
+// Parses the first request in the connection's buffer if it has fully arrived
+// Returns 1 if a response was queued, 0 if more data is needed, -1 on error
+int handle_buffered_request(struct connection *conn);
 
-// Returns 0 if everything was sent properly
-int parse_request_and_send_response(const int sock, char *request);
+// Answers the request conn->parser has just parsed, returns 0 if a response was queued on the connection
+int parse_request_and_send_response(struct connection *conn);
 
 #endif
\ No newline at end of file
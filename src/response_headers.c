@@ -0,0 +1,143 @@
+#include <string.h>
+#include <time.h>
+#include "response_headers.h"
+#include "validators.h"
+
+// A piece of header text with its length worked out at compile time
+struct fragment {
+    const char *text;
+    size_t len;
+};
+
+#define FRAGMENT(text) {text, sizeof(text) - 1}
+#define STATUS_LINE(status) FRAGMENT("HTTP/1.1 " status "\r\n")
+#define STATUS_CODE_MAX 600
+
+// Status lines by code, so a status is a single lookup
+static const struct fragment STATUS_LINES[STATUS_CODE_MAX] = {
+    [200] = STATUS_LINE("200 OK"),
+    [206] = STATUS_LINE("206 Partial Content"),
+    [304] = STATUS_LINE("304 Not Modified"),
+    [400] = STATUS_LINE("400 Bad Request"),
+    [403] = STATUS_LINE("403 Forbidden"),
+    [404] = STATUS_LINE("404 Not Found"),
+    [413] = STATUS_LINE("413 Content Too Large"),
+    [414] = STATUS_LINE("414 URI Too Long"),
+    [416] = STATUS_LINE("416 Range Not Satisfiable"),
+    [431] = STATUS_LINE("431 Request Header Fields Too Large"),
+    [500] = STATUS_LINE("500 Internal Server Error"),
+    [501] = STATUS_LINE("501 Not Implemented"),
+    [503] = STATUS_LINE("503 Service Unavailable"),
+};
+
+static const struct fragment SERVER_HEADER = FRAGMENT("Server: Simple-HTTP-Server\r\n");
+static const struct fragment CONNECTION_HEADERS[2] = {
+    FRAGMENT("Connection: close\r\n\r\n"),
+    FRAGMENT("Connection: keep-alive\r\n\r\n")
+};
+
+// Every pair of decimal digits, so a number is written two digits at a time
+static const char DIGIT_PAIRS[] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+// Each event loop thread keeps its own Date line, rewritten when the second changes
+#define DATE_HEADER_SIZE (sizeof("Date: \r\n") + HTTP_DATE_SIZE)
+static __thread time_t date_second = -1;
+static __thread char date_header[DATE_HEADER_SIZE];
+static __thread size_t date_header_len;
+
+// Starts an empty header block in buffer
+void header_builder_init(struct header_builder *builder, char *buffer, size_t size)
+{
+    builder->data = buffer;
+    builder->size = size;
+    builder->len = 0;
+    builder->overflow = 0;
+}
+
+// Appends complete header lines as they are
+void header_append(struct header_builder *builder, const char *fragment, size_t len)
+{
+    if (builder->overflow || builder->size - builder->len < len){
+        builder->overflow = 1;
+        return;
+    }
+    memcpy(builder->data + builder->len, fragment, len);
+    builder->len += len;
+}
+
+// Appends the status line, Date and Server, returns -1 if we don't know the status code
+int header_append_status(struct header_builder *builder, int status_code)
+{
+    if (status_code < 0 || status_code >= STATUS_CODE_MAX || STATUS_LINES[status_code].text == NULL){
+        return -1;
+    }
+    header_append(builder, STATUS_LINES[status_code].text, STATUS_LINES[status_code].len);
+
+    time_t now = time(NULL);
+    if (now != date_second){
+        char date[HTTP_DATE_SIZE];
+        format_http_date(date, sizeof(date), now);
+        size_t date_len = strlen(date);
+        memcpy(date_header, "Date: ", 6);
+        memcpy(date_header + 6, date, date_len);
+        memcpy(date_header + 6 + date_len, "\r\n", 2);
+        date_header_len = 6 + date_len + 2;
+        date_second = now;
+    }
+    header_append(builder, date_header, date_header_len);
+    header_append(builder, SERVER_HEADER.text, SERVER_HEADER.len);
+    return 0;
+}
+
+// Appends a Content-Type line
+void header_append_content_type(struct header_builder *builder, const char *MIME_type)
+{
+    header_append(builder, "Content-Type: ", 14);
+    header_append(builder, MIME_type, strlen(MIME_type));
+    header_append(builder, "\r\n", 2);
+}
+
+// Appends a Content-Length line
+void header_append_content_length(struct header_builder *builder, uint64_t length)
+{
+    char line[sizeof("Content-Length: \r\n") + 20];
+    memcpy(line, "Content-Length: ", 16);
+    size_t digits = format_decimal(line + 16, length);
+    memcpy(line + 16 + digits, "\r\n", 2);
+    header_append(builder, line, 16 + digits + 2);
+}
+
+// Appends the Connection line and the empty line ending the block
+// Returns the block's length, or -1 if it didn't fit
+ssize_t header_builder_finish(struct header_builder *builder, int keep_alive)
+{
+    const struct fragment *connection = &CONNECTION_HEADERS[keep_alive ? 1 : 0];
+    header_append(builder, connection->text, connection->len);
+    return builder->overflow ? -1 : (ssize_t)builder->len;
+}
+
+// Writes a number in decimal (without a terminator), returns how many digits it took (at most 20)
+size_t format_decimal(char *destination, uint64_t value)
+{
+    char digits[20];
+    char *position = digits + sizeof(digits);
+
+    while (value >= 100){
+        position -= 2;
+        memcpy(position, DIGIT_PAIRS + (value % 100) * 2, 2);
+        value /= 100;
+    }
+    if (value >= 10){
+        position -= 2;
+        memcpy(position, DIGIT_PAIRS + value * 2, 2);
+    } else {
+        *--position = '0' + value;
+    }
+
+    size_t digit_count = digits + sizeof(digits) - position;
+    memcpy(destination, position, digit_count);
+    return digit_count;
+}
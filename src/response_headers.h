@@ -0,0 +1,40 @@
+#ifndef RESPONSE_HEADERS_H
+#define RESPONSE_HEADERS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define HEADER_BUF_SIZE 1024 // Room for the header block of any response we send
+
+// Assembles a header block from ready-made fragments into a caller's buffer, without allocating
+struct header_builder {
+    char *data;
+    size_t size;
+    size_t len;
+    int overflow; // Set once a fragment didn't fit, the block is unusable then
+};
+
+// Starts an empty header block in buffer
+void header_builder_init(struct header_builder *builder, char *buffer, size_t size);
+
+// Appends the status line, Date and Server, returns -1 if we don't know the status code
+int header_append_status(struct header_builder *builder, int status_code);
+
+// Appends complete header lines as they are
+void header_append(struct header_builder *builder, const char *fragment, size_t len);
+
+// Appends a Content-Type line
+void header_append_content_type(struct header_builder *builder, const char *MIME_type);
+
+// Appends a Content-Length line
+void header_append_content_length(struct header_builder *builder, uint64_t length);
+
+// Appends the Connection line and the empty line ending the block
+// Returns the block's length, or -1 if it didn't fit
+ssize_t header_builder_finish(struct header_builder *builder, int keep_alive);
+
+// Writes a number in decimal (without a terminator), returns how many digits it took (at most 20)
+size_t format_decimal(char *destination, uint64_t value);
+
+#endif
@@ -1,344 +1,751 @@
 #include <errno.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include "byte_ranges.h"
+#include "compression.h"
+#include "connection.h"
+#include "content_encoding.h"
+#include "directory_listing.h"
+#include "file_cache.h"
+#include "logging.h"
+#include "metadata_cache.h"
 #include "mime_types.h"
+#include "response_headers.h"
 #include "request_parsing.h"
+#include "server_stats.h"
 #include "socket_operations.h"
+#include "validators.h"
 
-// Send a response for status codes 4xx and 5xx
-int handle_error_status_code(int error_status_code, int receiving_socket)
+// Queues a response for status codes 4xx and 5xx
+int handle_error_status_code(int error_status_code, struct connection *conn)
 {
-    static char status_codes_to_responses[][2][256] = {
-        {"400", "HTTP/1.0 400 Bad Request\r\n\r\n"},
-        {"403", "HTTP/1.0 403 Forbidden\r\n\r\n"},
-        {"404", "HTTP/1.0 404 Not Found\r\n\r\n"},
-        {"414", "HTTP/1.0 414 URI Too Long\r\n\r\n"},
-        {"500", "HTTP/1.0 500 Internal Server Error\r\n\r\n"},
-        {"501", "HTTP/1.0 501 Not Implemented\r\n\r\n"},
-        {"", ""} // Last one must be an empty string
-    };
-
-    // Cycle through the list until we hit an emptry string
-    for (int i = 0; status_codes_to_responses[i][0][0] != '\0'; i++){
-        if (atoi(status_codes_to_responses[i][0]) == error_status_code){
-
-            size_t response_lenght = strlen(status_codes_to_responses[i][1]);
-            return sendall(receiving_socket, status_codes_to_responses[i][1], &response_lenght);
-        }
+    // Only a missing or forbidden file leaves the connection in a state worth keeping
+    if (error_status_code != 403 && error_status_code != 404){
+        conn->keep_alive = 0;
+    }
+
+    // An empty body, so the client knows where the next response starts
+    struct header_builder builder;
+    header_builder_init(&builder, conn->header_buf, sizeof(conn->header_buf));
+    if (header_append_status(&builder, error_status_code) < 0){
+        log_message(LEVEL_ERROR, "handle_error_status_code - unknown status code %d", error_status_code);
+        return -1;
     }
-    fprintf(stderr, "handle_error_status_code - unknown status code");
-    return -1;
+    header_append_content_length(&builder, 0);
+    ssize_t header_len = header_builder_finish(&builder, conn->keep_alive);
+
+    connection_reset_response(conn);
+    connection_set_headers(conn, conn->header_buf, header_len, NULL);
+    return 0;
 }
 
-// Sends a file over a connection, also closes the file
-int send_file(const int client_sock, FILE *open_file)
+// Queues a file as the response body, the file is closed once it's sent
+int send_file(struct connection *conn, int open_fd, size_t file_size)
+{
+    connection_set_body_file(conn, open_fd, 0, file_size);
+    return 0;
+}
+
+#define CHUNKED_BODY ((size_t)-1) // A body length that isn't known up front
+
+// Appends the Content-Type, the length (or chunked transfer coding for CHUNKED_BODY) and extra_headers,
+// which are complete header lines (like Content-Encoding) or an empty string
+static void append_body_headers(struct header_builder *builder, const char *file_MIME_type, size_t body_size,
+                                const char *extra_headers)
 {
+    header_append_content_type(builder, file_MIME_type);
+    if (body_size == CHUNKED_BODY){
+        header_append(builder, "Transfer-Encoding: chunked\r\n", 28);
+    } else {
+        header_append_content_length(builder, body_size);
+    }
+    header_append(builder, extra_headers, strlen(extra_headers));
+}
 
-    // Allocate initial memory for the buffer
-    size_t buffer_size = 4096;
-    char *file_buffer = malloc(buffer_size);
-    if (file_buffer == NULL) {
-        perror("send_file - error allocating memory");
-        fclose(open_file);
+// Assembles the header block of a response with a body in the connection's header buffer and queues it
+// in place of the previous response, returns -1 if it didn't fit (nothing is queued then)
+static int queue_response_headers(struct connection *conn, int status_code, const char *file_MIME_type,
+                                  size_t body_size, const char *extra_headers)
+{
+    struct header_builder builder;
+    header_builder_init(&builder, conn->header_buf, sizeof(conn->header_buf));
+    if (header_append_status(&builder, status_code) < 0){
         return -1;
     }
+    append_body_headers(&builder, file_MIME_type, body_size, extra_headers);
+    ssize_t header_len = header_builder_finish(&builder, conn->keep_alive);
+    if (header_len < 0){
+        log_message(LEVEL_ERROR, "queue_response_headers - headers don't fit");
+        return -1;
+    }
+
+    connection_reset_response(conn);
+    connection_set_headers(conn, conn->header_buf, header_len, NULL);
+    return 0;
+}
+
+// Queues a GET or HEAD response from a cached file, taking over the entry's reference
+int send_cached_file_response(struct file_cache_entry *entry, struct connection *conn, int is_head_method)
+{
+    // Only the status line, Date and Connection change from one response to the next
+    struct header_builder builder;
+    header_builder_init(&builder, conn->header_buf, sizeof(conn->header_buf));
+    header_append_status(&builder, 200);
+    header_append(&builder, entry->headers, entry->header_len);
+    ssize_t header_len = header_builder_finish(&builder, conn->keep_alive);
+    if (header_len < 0){
+        file_cache_release(entry);
+        return handle_error_status_code(500, conn);
+    }
 
-    // Read and send the file in chunks
-    size_t bytes_read;
-    while ((bytes_read = fread(file_buffer, 1, buffer_size, open_file)) > 0) {
-        if (sendall(client_sock, file_buffer, &bytes_read)){
-            fclose(open_file);
-            free(file_buffer);
-            return -1;
+    connection_reset_response(conn);
+    connection_set_headers(conn, conn->header_buf, header_len, NULL);
+    if (!is_head_method){
+        connection_set_body_buffer(conn, entry->body, entry->body_len, NULL);
+    }
+    conn->cache_entry = entry; // Keeps the bytes alive until they're sent
+    return 0;
+}
+
+// Queues a GET or HEAD response from the site archive, the body goes out straight from the mapping
+// Ranges are ignored (the whole file is sent), conditional requests get a 304 as usual
+int send_archive_response(const struct site_archive_entry *entry, struct connection *conn, int is_head_method)
+{
+    // The best encoded representation the client takes, the way a precompressed sibling is picked
+    const struct site_archive_representation *representation = &entry->representations[0];
+    for (int i = 0; ENCODINGS[i].token != NULL; i++){
+        if (entry->encodings & conn->accept_encodings & ENCODINGS[i].encoding){
+            representation = &entry->representations[i + 1];
+            break;
         }
     }
 
-    if (ferror(open_file)) {
-        perror("send_file - error reading file");
-        fclose(open_file);
-        free(file_buffer);
-        return -1;
+    // Only the status line, Date and Connection are added to the headers packed with it
+    const char *headers = site_archive_string(representation->headers_offset);
+    int not_modified = is_not_modified(conn->if_none_match, conn->if_modified_since,
+                                       site_archive_string(representation->etag_offset), representation->mtime);
+    struct header_builder builder;
+    header_builder_init(&builder, conn->header_buf, sizeof(conn->header_buf));
+    header_append_status(&builder, not_modified ? 304 : 200);
+    if (not_modified){
+        header_append(&builder, headers + representation->headers_len - representation->validators_len,
+                      representation->validators_len);
+    } else {
+        header_append(&builder, headers, representation->headers_len);
+    }
+    ssize_t header_len = header_builder_finish(&builder, conn->keep_alive);
+    if (header_len < 0){
+        return handle_error_status_code(500, conn);
     }
 
-    fclose(open_file);
-    free(file_buffer);
+    connection_reset_response(conn);
+    connection_set_headers(conn, conn->header_buf, header_len, NULL);
+    if (!is_head_method && !not_modified){
+        connection_set_body_buffer(conn, site_archive_body(representation), representation->body_len, NULL);
+    }
     return 0;
 }
 
-// Sends a GET or HEAD response for the requested path
-int send_file_response(char *file_path, int connected_client_socket, int is_head_method)
+// Puts a small open file into the cache and queues the response from there
+// Returns -1 if it couldn't be cached (nothing is queued then, and the caller keeps the reference)
+static int cache_and_send_file(const char *file_path, struct metadata_entry *metadata, const char *file_MIME_type,
+                               const char *extra_headers, int variants, struct connection *conn, int is_head_method)
 {
-    FILE *requested_file = fopen(file_path, "rb");
-    if (requested_file == NULL) {
-        perror("send_response - error opening file");
-        return handle_error_status_code(500, connected_client_socket);
-    }
-
-    // Get the file size
-    size_t file_size;
-    if (fseek(requested_file, 0, SEEK_END) || 
-        (file_size = ftell(requested_file)) == -1L || 
-        fseek(requested_file, 0, SEEK_SET)){
-
-        perror("send_response - error getting file size");
-        fclose(requested_file);
-        return handle_error_status_code(500, connected_client_socket);
-    }
-
-    const char *file_MIME_type = get_MIME_type(file_path);
-
-    // Get enough room for the response beginning
-    size_t response_beginning_size = snprintf(NULL, 0,
-                                    "HTTP/1.0 200 OK\r\n"
-                                    "Content-Type: %s\r\n"
-                                    "Content-Length: %ld\r\n"
-                                    "Connection: close\r\n\r\n",
-                                    file_MIME_type, file_size);
-
-    char *response_beginning = malloc(response_beginning_size + 1);
-    if (response_beginning == NULL){
-        perror("send_response - error allocating memory");
-        fclose(requested_file);
-        return handle_error_status_code(500, connected_client_socket);
-    }
-
-    // Build the response beginning
-    snprintf(response_beginning, response_beginning_size + 1,
-            "HTTP/1.0 200 OK\r\n"
-            "Content-Type: %s\r\n"
-            "Content-Length: %ld\r\n"
-            "Connection: close\r\n\r\n",
-            file_MIME_type, file_size);
-    
-    size_t response_beginning_lenght = strlen(response_beginning);
-
-    // First try to send the response beginning
-    if (sendall(connected_client_socket, response_beginning, &response_beginning_lenght) < 0){
-        fclose(requested_file);
-        free(response_beginning);
-        return handle_error_status_code(500, connected_client_socket);
-    }
-    free(response_beginning);
+    // The metadata may be a few seconds old, what goes into the cache stays much longer
+    // and its headers carry validators made from the metadata
+    struct stat current_stat;
+    if (fstat(metadata->fd, &current_stat) || current_stat.st_nlink == 0 || !file_cache_accepts(current_stat.st_size) ||
+        current_stat.st_size != metadata->stat.st_size || current_stat.st_mtim.tv_sec != metadata->stat.st_mtim.tv_sec ||
+        current_stat.st_mtim.tv_nsec != metadata->stat.st_mtim.tv_nsec){
+        return -1;
+    }
+    size_t file_size = current_stat.st_size;
 
-    if (is_head_method){ // If the method is HEAD, don't send the body (file)
-        fclose(requested_file);
+    char headers[HEADER_BUF_SIZE];
+    struct header_builder builder;
+    header_builder_init(&builder, headers, sizeof(headers));
+    append_body_headers(&builder, file_MIME_type, file_size, extra_headers);
+
+    struct file_cache_entry *entry = NULL;
+    if (!builder.overflow){
+        entry = file_cache_insert(file_path, metadata->fd, file_size, &current_stat, headers, builder.len, variants);
+    }
+    if (entry == NULL){
+        return -1;
+    }
+    return send_cached_file_response(entry, conn, is_head_method);
+}
+
+// Looks for precompressed siblings of a file (like app.js.br) and returns the ENCODING_* bits of those that exist
+// The best one the client accepts is put into chosen with a reference taken (or NULL)
+static int find_precompressed_variants(const char *file_path, int accept_encodings,
+                                       struct metadata_entry **chosen, const struct encoding_info **chosen_encoding)
+{
+    char sibling_path[PATH_MAX + 1];
+    int variants = 0;
+
+    *chosen = NULL;
+    *chosen_encoding = NULL;
+
+    // A sibling of a sibling isn't worth looking for
+    if (encoding_from_suffix(file_path) != NULL){
         return 0;
     }
 
-    // Send the rest of the response
-    return send_file(connected_client_socket, requested_file);
+    for (int i = 0; ENCODINGS[i].token != NULL; i++){
+        if (snprintf(sibling_path, sizeof(sibling_path), "%s%s", file_path, ENCODINGS[i].suffix) >= (int)sizeof(sibling_path)){
+            continue;
+        }
+
+        // Missing siblings are remembered by the metadata cache like any other 404
+        struct metadata_entry *sibling = get_path_metadata(sibling_path);
+        if (sibling == NULL){
+            continue;
+        }
+        if (sibling->status != 200 || !S_ISREG(sibling->stat.st_mode)){
+            metadata_cache_release(sibling);
+            continue;
+        }
+
+        variants |= ENCODINGS[i].encoding;
+        if (*chosen == NULL && (accept_encodings & ENCODINGS[i].encoding)){
+            *chosen = sibling;
+            *chosen_encoding = &ENCODINGS[i];
+        } else {
+            metadata_cache_release(sibling);
+        }
+    }
+
+    return variants;
 }
 
-// Little function for qsort() inside serve_directory_listing()
-static int simple_compare(const void *a, const void *b){ return strcasecmp(*(const char **)a, *(const char **)b); }
-// Builds a HTML document to send back as the body (Remember to free() afterwards)
-char *serve_directory_listing(char *absolute_path)
+// Returns the coding to compress to on the fly for this client (or NULL)
+static const struct encoding_info *pick_dynamic_encoding(int accept_encodings)
 {
-    DIR *this_dir;
-    struct dirent *dir_entry;
-    char **dir_entries;
-    size_t entry_count = 0;
-    size_t max_entries = 8;
-
-    size_t body_size = 4096;
-    size_t chars_written = 0;
-    char *response_body;
-    char *temp_response_body;
-
-    if ((dir_entries = malloc(max_entries * sizeof(char *))) == NULL){
-        perror("serve_directory - error allocating memory");
-        return NULL;
-    }
-
-    if ((this_dir = opendir(absolute_path)) == NULL){
-        perror("serve_directory - error opening directory");
-        free(dir_entries);
-        return NULL;
-    }
-
-    // Fill the list of directory entries
-    while ((dir_entry = readdir(this_dir))){
-        if (entry_count >= max_entries){
-            max_entries *= 2;
-            char **temp_dir_entries = realloc(dir_entries, max_entries * sizeof(char *));
-            if (temp_dir_entries == NULL){
-                perror("serve_directory - error reallocating memory");
-                free(dir_entries);
-                closedir(this_dir);
-                return NULL;
-            }
-            dir_entries = temp_dir_entries;
-        }
+    int usable = accept_encodings & compression_encodings();
 
-        // If the entry is a directory, append '/'
-        char entry_name[strlen(dir_entry->d_name) + 2];
-        strcpy(entry_name, dir_entry->d_name);
-        strcat(entry_name, ((dir_entry->d_type == DT_DIR) ? "/" : ""));
-
-        // Store the entry's name in dir_entries
-        if ((dir_entries[entry_count] = strdup(entry_name)) == NULL){
-            perror("serve_directory - error duplicating directory entry");
-            free(dir_entries);
-            closedir(this_dir);
-            return NULL;
+    for (int i = 0; ENCODINGS[i].token != NULL; i++){
+        if (usable & ENCODINGS[i].encoding){
+            return &ENCODINGS[i];
         }
-        entry_count++;
     }
+    return NULL;
+}
 
-    closedir(this_dir);
+// Queues a response with a body in memory, which gets cached under cache_key if it fits (and there is one)
+static int send_memory_response(const char *cache_key, char *body, size_t body_len, const char *file_MIME_type,
+                                const char *extra_headers, const struct timespec *source_mtime,
+                                struct connection *conn, int is_head_method)
+{
+    char headers[HEADER_BUF_SIZE];
+    struct header_builder builder;
+    header_builder_init(&builder, headers, sizeof(headers));
+    append_body_headers(&builder, file_MIME_type, body_len, extra_headers);
+
+    struct file_cache_entry *entry = cache_key != NULL && !builder.overflow ?
+                                     file_cache_insert_buffer(cache_key, body, body_len, headers, builder.len,
+                                                              source_mtime) : NULL;
+    if (entry != NULL){
+        return send_cached_file_response(entry, conn, is_head_method);
+    }
 
-    // Sort the entries
-    qsort(dir_entries, entry_count, sizeof(char *), simple_compare);
+    // Too big for the cache, this response is its only user
+    if (queue_response_headers(conn, 200, file_MIME_type, body_len, extra_headers) < 0){
+        free(body);
+        return handle_error_status_code(500, conn);
+    }
+    if (is_head_method){
+        free(body);
+        return 0;
+    }
+    connection_set_body_buffer(conn, body, body_len, body);
+    return 0;
+}
+
+// Queues a response compressed on the fly, taking over the metadata entry's reference
+// Small files are compressed once and cached, larger ones are streamed in chunks
+// Returns 1 if it can't be done for this request (the reference is kept then)
+static int send_compressed_file_response(struct metadata_entry *metadata, const struct encoding_info *encoding,
+                                         const char *file_MIME_type, const char *validators,
+                                         struct connection *conn, int is_head_method)
+{
+    size_t file_size = metadata->stat.st_size;
+    char extra_headers[256];
+    int status;
+    snprintf(extra_headers, sizeof(extra_headers), "Content-Encoding: %s\r\nVary: Accept-Encoding\r\n%s",
+             encoding->token, validators);
+
+    // Only HTTP/1.1 clients get here with a large file, the stream is sent with chunked transfer coding
+    if (file_size > COMPRESS_BUFFER_MAX){
+        if ((status = open_path_metadata(metadata)) != 200){
+            metadata_cache_release(metadata);
+            return handle_error_status_code(status, conn);
+        }
 
-    if ((response_body = malloc(body_size)) == NULL){
-        perror("serve_directory - error allocating memory");
-        free(dir_entries);
-        return NULL;
+        if (queue_response_headers(conn, 200, file_MIME_type, CHUNKED_BODY, extra_headers) < 0){
+            metadata_cache_release(metadata);
+            return handle_error_status_code(500, conn);
+        }
+        if (is_head_method){
+            metadata_cache_release(metadata);
+            return 0;
+        }
+
+        struct compressed_stream *stream = compressed_stream_new(encoding->encoding, metadata->fd, file_size);
+        if (stream == NULL){
+            metadata_cache_release(metadata);
+            return handle_error_status_code(500, conn);
+        }
+        if (connection_set_body_stream(conn, stream, metadata) < 0){
+            return handle_error_status_code(500, conn);
+        }
+        return 0;
     }
 
-    // Make the printable path
-    char relative_path[strlen(absolute_path) + 2];
-    strcpy(relative_path, absolute_path + strlen(BASE_DIR));
-    // Append a '/' if there isn't one at the end
-    if (!(relative_path[strlen(relative_path) - 1] == '/')) strcat(relative_path, "/");
+    // Each file is only compressed once per coding, until it changes
+    char cache_key[PATH_MAX + 16];
+    if (file_cache_variant_key(cache_key, sizeof(cache_key), metadata->resolved_path, encoding->token) < 0){
+        return 1;
+    }
+    struct file_cache_entry *cached_variant = file_cache_lookup(cache_key);
+    if (cached_variant != NULL){
+        if (cached_variant->source_mtime.tv_sec == metadata->stat.st_mtim.tv_sec &&
+            cached_variant->source_mtime.tv_nsec == metadata->stat.st_mtim.tv_nsec){
+            metadata_cache_release(metadata);
+            return send_cached_file_response(cached_variant, conn, is_head_method);
+        }
+        file_cache_release(cached_variant); // Replaced below
+    }
+
+    if ((status = open_path_metadata(metadata)) != 200){
+        metadata_cache_release(metadata);
+        return handle_error_status_code(status, conn);
+    }
+    size_t compressed_len;
+    char *compressed = compress_file(encoding->encoding, metadata->fd, file_size, &compressed_len);
+    if (compressed == NULL){
+        return 1;
+    }
+    struct timespec source_mtime = metadata->stat.st_mtim;
+    metadata_cache_release(metadata);
+
+    return send_memory_response(cache_key, compressed, compressed_len, file_MIME_type, extra_headers,
+                                &source_mtime, conn, is_head_method);
+}
+
+// Queues a 416 response for a Range header that doesn't fit the file
+static int send_range_not_satisfiable(off_t file_size, struct connection *conn)
+{
+    char content_range[64] = "Content-Range: bytes */";
+    size_t content_range_len = strlen(content_range);
+    content_range_len += format_decimal(content_range + content_range_len, file_size);
+    memcpy(content_range + content_range_len, "\r\n", 2);
+    content_range_len += 2;
+
+    struct header_builder builder;
+    header_builder_init(&builder, conn->header_buf, sizeof(conn->header_buf));
+    header_append_status(&builder, 416);
+    header_append(&builder, content_range, content_range_len);
+    header_append_content_length(&builder, 0);
+    ssize_t header_len = header_builder_finish(&builder, conn->keep_alive);
+
+    connection_reset_response(conn);
+    connection_set_headers(conn, conn->header_buf, header_len, NULL);
+    return 0;
+}
+
+// Queues a 206 response with the byte ranges the request asked for, sent straight from the file
+// Takes over the metadata entry's reference unless it returns 1 (the Range header is to be ignored)
+static int send_range_response(struct metadata_entry *metadata, const char *file_MIME_type, const char *validators,
+                               struct connection *conn)
+{
+    static unsigned long boundary_counter;
+    struct byte_range ranges[MAX_RANGES];
+    off_t file_size = metadata->stat.st_size;
+
+    int range_count = parse_range_header(conn->range, file_size, ranges, MAX_RANGES);
+    if (range_count < 0){
+        return 1;
+    }
+    if (range_count == 0){
+        metadata_cache_release(metadata);
+        return send_range_not_satisfiable(file_size, conn);
+    }
 
-    // Create beginning of the listing
-    char listing_beginning[strlen("<html><head><title>Directory listing for </title></head>\n"
-                                  "<body><h1>Directory listing for </h1><ul>\n")
-                                   + 2*strlen(relative_path) + 1];
-    snprintf(listing_beginning, sizeof(listing_beginning), 
-                          "<html><head><title>Directory listing for %s</title></head>\n"
-                          "<body><h1>Directory listing for %s</h1><ul>\n", 
-                           relative_path, relative_path);
+    char extra_headers[256];
 
-    if (body_size < sizeof(listing_beginning)){
-        temp_response_body = realloc(response_body, sizeof(listing_beginning));
-        if (temp_response_body == NULL){
-            perror("serve_directory - error reallocating memory");
-            free(response_body);
-            return NULL;
+    if (range_count == 1){
+        size_t range_length = ranges[0].last - ranges[0].first + 1;
+        snprintf(extra_headers, sizeof(extra_headers), "Content-Range: bytes %lld-%lld/%lld\r\n%sAccept-Ranges: bytes\r\n",
+                 (long long)ranges[0].first, (long long)ranges[0].last, (long long)file_size, validators);
+        if (queue_response_headers(conn, 206, file_MIME_type, range_length, extra_headers) < 0){
+            metadata_cache_release(metadata);
+            return handle_error_status_code(500, conn);
         }
-        response_body = temp_response_body;
-        body_size = sizeof(listing_beginning);
+        connection_set_body_cached_file(conn, metadata, ranges[0].first, range_length);
+        return 0;
     }
-    chars_written += snprintf(response_body, body_size, "%s", listing_beginning);
 
-    // Build the main body of the listing
-    for (size_t i = 0; i < entry_count; i++){
-        // Skip . and ..
-        if (!strcmp(dir_entries[i], "./") || !strcmp(dir_entries[i], "../")){
-            free(dir_entries[i]);
-            continue;
+    // Several ranges go out as multipart/byteranges, each part after its own little header block
+    char boundary[32];
+    snprintf(boundary, sizeof(boundary), "%020lu", __atomic_add_fetch(&boundary_counter, 1, __ATOMIC_RELAXED));
+
+    // One allocation holds the parts and, behind them, the text of every preamble and the closing boundary
+    size_t text_size = 0;
+    for (int i = 0; i < range_count; i++){
+        text_size += snprintf(NULL, 0, "%s--%s\r\nContent-Type: %s\r\nContent-Range: bytes %lld-%lld/%lld\r\n\r\n",
+                              i ? "\r\n" : "", boundary, file_MIME_type,
+                              (long long)ranges[i].first, (long long)ranges[i].last, (long long)file_size);
+    }
+    text_size += snprintf(NULL, 0, "\r\n--%s--\r\n", boundary) + 1;
+
+    struct body_part *parts = malloc((range_count + 1) * sizeof(struct body_part) + text_size);
+    if (parts == NULL){
+        log_perror("send_range_response - error allocating memory");
+        metadata_cache_release(metadata);
+        return handle_error_status_code(500, conn);
+    }
+
+    char *text = (char *)(parts + range_count + 1);
+    size_t text_left = text_size;
+    size_t body_length = 0;
+    for (int i = 0; i <= range_count; i++){
+        int written;
+        if (i < range_count){
+            written = snprintf(text, text_left, "%s--%s\r\nContent-Type: %s\r\nContent-Range: bytes %lld-%lld/%lld\r\n\r\n",
+                               i ? "\r\n" : "", boundary, file_MIME_type,
+                               (long long)ranges[i].first, (long long)ranges[i].last, (long long)file_size);
+            parts[i].file_offset = ranges[i].first;
+            parts[i].file_len = ranges[i].last - ranges[i].first + 1;
+        } else {
+            written = snprintf(text, text_left, "\r\n--%s--\r\n", boundary);
+            parts[i].file_offset = 0;
+            parts[i].file_len = 0;
         }
+        parts[i].preamble = text;
+        parts[i].preamble_len = written;
+        body_length += written + parts[i].file_len;
+        text += written;
+        text_left -= written;
+    }
+
+    char content_type[96];
+    snprintf(content_type, sizeof(content_type), "multipart/byteranges; boundary=%s", boundary);
+    snprintf(extra_headers, sizeof(extra_headers), "%sAccept-Ranges: bytes\r\n", validators);
+    if (queue_response_headers(conn, 206, content_type, body_length, extra_headers) < 0){
+        free(parts);
+        metadata_cache_release(metadata);
+        return handle_error_status_code(500, conn);
+    }
+    connection_set_body_parts(conn, metadata, parts, range_count + 1);
+    return 0;
+}
 
-        // Build and append list_entry to response_body
-        char list_entry[strlen("<li><a href=\"\"></a></li>\n") 
-                        + 2*strlen(dir_entries[i]) 
-                        + 1];
-        snprintf(list_entry, sizeof(list_entry), "<li><a href=\"%s\">%s</a></li>\n", 
-                                                   dir_entries[i],
-                                                   dir_entries[i]);
-
-        if (body_size - chars_written < sizeof(list_entry)){
-            temp_response_body = realloc(response_body, body_size + sizeof(list_entry));
-            if (temp_response_body == NULL){
-                free(dir_entries[i]);
-                continue;
-            }
-            response_body = temp_response_body;
-            body_size += sizeof(list_entry);
+// Formats the ETag and Last-Modified lines for a representation of a file (coding is NULL for the file as it is)
+// Returns whether the request's If-None-Match or If-Modified-Since say the client already has it
+static int format_validators(char *validators, size_t validators_size, const struct stat *file_stat, const char *coding,
+                             const struct connection *conn)
+{
+    char etag[ETAG_SIZE];
+    char last_modified[HTTP_DATE_SIZE];
+    format_etag(etag, sizeof(etag), file_stat, coding);
+    format_http_date(last_modified, sizeof(last_modified), file_stat->st_mtime);
+    snprintf(validators, validators_size, "ETag: %s\r\nLast-Modified: %s\r\n", etag, last_modified);
+
+    return is_not_modified(conn->if_none_match, conn->if_modified_since, etag, file_stat->st_mtime);
+}
+
+// Queues a 304 response, the headers are the validators (and Vary) of what the client already has
+static int send_not_modified_response(const char *extra_headers, struct connection *conn)
+{
+    struct header_builder builder;
+    header_builder_init(&builder, conn->header_buf, sizeof(conn->header_buf));
+    header_append_status(&builder, 304);
+    header_append(&builder, extra_headers, strlen(extra_headers));
+    ssize_t header_len = header_builder_finish(&builder, conn->keep_alive);
+    if (header_len < 0){
+        return handle_error_status_code(500, conn);
+    }
+
+    connection_reset_response(conn);
+    connection_set_headers(conn, conn->header_buf, header_len, NULL);
+    return 0;
+}
+
+// Queues a GET or HEAD response for a resolved file, taking over the metadata entry's reference
+int send_file_response(struct metadata_entry *metadata, struct connection *conn, int is_head_method)
+{
+    // The MIME type always comes from the name that was asked for
+    const char *file_MIME_type = metadata->mime_type;
+    char validators[ETAG_SIZE + HTTP_DATE_SIZE + 32];
+    char extra_headers[256];
+    int status;
+
+    char cache_key[PATH_MAX + 16];
+    snprintf(cache_key, sizeof(cache_key), "%s", metadata->resolved_path);
+
+    // Ranges are always cut from the file itself, never from a compressed variant
+    int wants_range = conn->range != NULL && !is_head_method && S_ISREG(metadata->stat.st_mode) &&
+                      (conn->if_range == NULL || if_range_matches(conn->if_range, &metadata->stat));
+
+    // Serve a precompressed sibling instead if there's one the client takes
+    struct metadata_entry *variant;
+    const struct encoding_info *variant_encoding;
+    int variants = find_precompressed_variants(metadata->resolved_path, wants_range ? 0 : conn->accept_encodings,
+                                               &variant, &variant_encoding);
+
+    // Otherwise compress it here if it's worth it
+    int compressible = metadata->stat.st_size >= COMPRESS_MIN_SIZE && is_compressible_MIME_type(file_MIME_type);
+    if (compressible){
+        variants |= compression_encodings();
+    }
+    const struct encoding_info *dynamic_encoding = NULL;
+    if (!wants_range && variant == NULL && compressible){
+        dynamic_encoding = pick_dynamic_encoding(conn->accept_encodings);
+    }
+    if (dynamic_encoding != NULL && metadata->stat.st_size > COMPRESS_BUFFER_MAX && !conn->is_http11){
+        dynamic_encoding = NULL; // Can't end a streamed body of unknown length any other way than by closing
+    }
+    const char *vary = variants ? "Vary: Accept-Encoding\r\n" : "";
+
+    // Which representation goes out decides the validators, and answering 304 needs nothing but the stat()
+    struct metadata_entry *representation = variant != NULL ? variant : metadata;
+    if (format_validators(validators, sizeof(validators), &representation->stat,
+                          dynamic_encoding != NULL ? dynamic_encoding->token : NULL, conn)){
+        snprintf(extra_headers, sizeof(extra_headers), "%s%s", validators, vary);
+        if (variant != NULL){
+            metadata_cache_release(variant);
         }
-        chars_written += snprintf(response_body + chars_written, body_size - chars_written, "%s", list_entry);
+        metadata_cache_release(metadata);
+        return send_not_modified_response(extra_headers, conn);
+    }
 
-        free(dir_entries[i]);
+    if (wants_range){
+        if ((status = open_path_metadata(metadata)) != 200){
+            metadata_cache_release(metadata);
+            return handle_error_status_code(status, conn);
+        }
+        int retval = send_range_response(metadata, file_MIME_type, validators, conn);
+        if (retval != 1){
+            return retval;
+        }
     }
 
-    // Close off the listing
-    char listing_end[strlen("</ul></body></html>") + 1];
-    snprintf(listing_end, sizeof(listing_end), "</ul></body></html>");
-    if (body_size - chars_written < sizeof(listing_end)){
-        temp_response_body = realloc(response_body, body_size + sizeof(listing_end));
-        if (temp_response_body == NULL){
-            perror("serve_directory - error reallocating memory");
-            free(response_body);
-            free(dir_entries);
-            return NULL;
+    if (dynamic_encoding != NULL){
+        int retval = send_compressed_file_response(metadata, dynamic_encoding, file_MIME_type, validators,
+                                                   conn, is_head_method);
+        if (retval != 1){
+            return retval;
         }
-        response_body = temp_response_body;
-        body_size += sizeof(listing_end);
+        format_validators(validators, sizeof(validators), &metadata->stat, NULL, conn); // Sent as it is after all
+    }
+
+    if (variant != NULL){
+        file_cache_variant_key(cache_key, sizeof(cache_key), metadata->resolved_path, variant_encoding->token);
+        metadata_cache_release(metadata);
+        metadata = variant;
+        snprintf(extra_headers, sizeof(extra_headers), "Content-Encoding: %s\r\nVary: Accept-Encoding\r\n%s",
+                 variant_encoding->token, validators);
+        variants = 0; // Only the original decides between variants
+    } else {
+        snprintf(extra_headers, sizeof(extra_headers), "%s%sAccept-Ranges: bytes\r\n", vary, validators);
+    }
+
+    size_t file_size = metadata->stat.st_size;
+
+    // The request may have named it differently (like a directory's index.html)
+    struct file_cache_entry *cached_file = file_cache_accepts(file_size) ? file_cache_lookup(cache_key) : NULL;
+    if (cached_file != NULL){
+        metadata_cache_release(metadata);
+        return send_cached_file_response(cached_file, conn, is_head_method);
+    }
+
+    // Only now does the file have to be open
+    if ((status = open_path_metadata(metadata)) != 200){
+        metadata_cache_release(metadata);
+        return handle_error_status_code(status, conn);
+    }
+
+    // Small files are kept in memory for next time
+    if (file_cache_accepts(file_size) &&
+        cache_and_send_file(cache_key, metadata, file_MIME_type, extra_headers, variants, conn, is_head_method) == 0){
+        metadata_cache_release(metadata);
+        return 0;
+    }
+
+    // The connection sends the header block first
+    if (queue_response_headers(conn, 200, file_MIME_type, file_size, extra_headers) < 0){
+        metadata_cache_release(metadata);
+        return handle_error_status_code(500, conn);
     }
-    snprintf(response_body + chars_written, body_size - chars_written, "%s", listing_end);
 
-    free(dir_entries);
-    return response_body;
+    if (is_head_method){ // If the method is HEAD, don't send the body (file)
+        metadata_cache_release(metadata);
+        return 0;
+    }
+
+    // Send the rest of the response straight from the cached descriptor
+    connection_set_body_cached_file(conn, metadata, 0, file_size);
+    return 0;
 }
 
-// Sends a GET response containing the directory listing
-int send_directory_listing_response(char *directory_path, int receiving_client_socket)
+// Queues a listing compressed on the fly, taking over the listing's reference
+// Small listings are compressed once per version of the directory and cached (views every time),
+// huge ones are streamed in chunks
+// Returns 1 if it can't be done for this request (the reference is kept then)
+static int send_compressed_listing_response(struct directory_listing *listing, const struct encoding_info *encoding,
+                                            struct connection *conn, int is_head_method)
 {
-    char *entity_body = serve_directory_listing(directory_path);
-    if (entity_body == NULL){
-        return handle_error_status_code(500, receiving_client_socket);
-    }
-
-    // Make enough room for the response and paste in the body
-    size_t response_size = snprintf(NULL, 0, 
-                                    "HTTP/1.0 200 OK\r\n"
-                                    "Content-Type: text/html\r\n"
-                                    "Content-Length: %lu\r\n"
-                                    "Connection: close\r\n\r\n"
-                                    "%s",
-                                    strlen(entity_body), entity_body) + 1;
-
-    char *response = malloc(response_size);
-    if (response == NULL){
-        perror("send_response - error allocating memory");
-        return handle_error_status_code(500, receiving_client_socket);
-    }
-
-    snprintf(response, response_size, 
-                "HTTP/1.0 200 OK\r\n"
-                "Content-Type: text/html\r\n"
-                "Content-Length: %lu\r\n"
-                "Connection: close\r\n\r\n"
-                "%s",
-                strlen(entity_body), entity_body);
-    
-    free(entity_body);
-
-    // Send the complete response
-    int sendallretval = sendall(receiving_client_socket, response, &response_size);
-    free(response);
-    return sendallretval;
+    char extra_headers[128];
+    snprintf(extra_headers, sizeof(extra_headers), "Content-Encoding: %s\r\nVary: Accept-Encoding\r\n",
+             encoding->token);
+
+    // Only HTTP/1.1 clients can take a body without knowing its length up front
+    if (listing->body_len > COMPRESS_BUFFER_MAX){
+        if (!conn->is_http11){
+            return 1;
+        }
+        if (queue_response_headers(conn, 200, listing->MIME_type, CHUNKED_BODY, extra_headers) < 0){
+            directory_listing_release(listing);
+            return handle_error_status_code(500, conn);
+        }
+        if (is_head_method){
+            directory_listing_release(listing);
+            return 0;
+        }
+
+        struct compressed_stream *stream = compressed_stream_new_buffer(encoding->encoding, listing->body,
+                                                                        listing->body_len);
+        if (stream == NULL){
+            directory_listing_release(listing);
+            return handle_error_status_code(500, conn);
+        }
+        if (connection_set_body_listing(conn, listing, stream) < 0){
+            return handle_error_status_code(500, conn);
+        }
+        return 0;
+    }
+
+    char cache_key[PATH_MAX + 16];
+    if (file_cache_variant_key(cache_key, sizeof(cache_key), listing->path, encoding->token) < 0){
+        return 1;
+    }
+    struct file_cache_entry *cached_variant = listing->is_view ? NULL : file_cache_lookup(cache_key);
+    if (cached_variant != NULL){
+        if (cached_variant->source_mtime.tv_sec == listing->mtime.tv_sec &&
+            cached_variant->source_mtime.tv_nsec == listing->mtime.tv_nsec){
+            directory_listing_release(listing);
+            return send_cached_file_response(cached_variant, conn, is_head_method);
+        }
+        file_cache_release(cached_variant); // Replaced below
+    }
+
+    size_t compressed_len;
+    char *compressed = compress_buffer(encoding->encoding, listing->body, listing->body_len, &compressed_len);
+    if (compressed == NULL){
+        return 1;
+    }
+    struct timespec source_mtime = listing->mtime;
+    const char *MIME_type = listing->MIME_type; // Static strings, they outlive the listing
+    int is_view = listing->is_view;
+    directory_listing_release(listing);
+
+    return send_memory_response(is_view ? NULL : cache_key, compressed, compressed_len, MIME_type, extra_headers,
+                                &source_mtime, conn, is_head_method);
 }
 
-// Sends a response GET or HEAD method, depending on the head_method_check parameter
-int get_or_head_method(char full_requested_path[], int client_socket, int head_method_check)
+// Queues a GET or HEAD response containing the directory listing
+// The query can ask for a page of it (offset, limit) and for JSON instead of HTML (format)
+int send_directory_listing_response(char *directory_path, struct connection *conn, int is_head_method)
 {
-    // Check whether the requested path is a file or directory
-    struct stat full_requested_path_stat;
-    if (stat(full_requested_path, &full_requested_path_stat)) {
-        perror("parse_request - error filling stat object");
-        return handle_error_status_code(500, client_socket);
+    enum listing_format format = LISTING_HTML;
+    size_t offset = 0, limit = SIZE_MAX;
+    if (conn->query != NULL && directory_listing_parse_query(conn->query, &format, &offset, &limit) < 0){
+        return handle_error_status_code(400, conn);
     }
 
-    if (!S_ISDIR(full_requested_path_stat.st_mode)){ // If it's a file
-        return send_file_response(full_requested_path, client_socket, head_method_check);
+    struct directory_listing *listing = directory_listing_get(directory_path);
+    if (listing == NULL){
+        return handle_error_status_code(500, conn);
+    }
+
+    // Anything but the whole HTML listing is rendered from the sorted index for this request alone
+    if (format != LISTING_HTML || offset > 0 || limit < listing->entry_count){
+        struct directory_listing *view = directory_listing_view(listing, format, offset, limit);
+        directory_listing_release(listing);
+        if (view == NULL){
+            return handle_error_status_code(500, conn);
+        }
+        listing = view;
+    }
+
+    const struct encoding_info *encoding = pick_dynamic_encoding(conn->accept_encodings);
+    if (encoding != NULL && listing->body_len >= COMPRESS_MIN_SIZE){
+        int retval = send_compressed_listing_response(listing, encoding, conn, is_head_method);
+        if (retval != 1){
+            return retval;
+        }
+    }
+
+    if (queue_response_headers(conn, 200, listing->MIME_type, listing->body_len,
+                               compression_encodings() ? "Vary: Accept-Encoding\r\n" : "") < 0){
+        directory_listing_release(listing);
+        return handle_error_status_code(500, conn);
+    }
+
+    // The body is sent straight from the shared listing
+    if (is_head_method){ // The length is still the real one, but there's no body
+        directory_listing_release(listing);
+        return 0;
+    }
+    connection_set_body_listing(conn, listing, NULL);
+    return 0;
+}
+
+// Queues a response GET or HEAD method, depending on the head_method_check parameter
+// Takes over the metadata entry's reference
+int get_or_head_method(struct metadata_entry *metadata, struct connection *conn, int head_method_check)
+{
+    if (!S_ISDIR(metadata->stat.st_mode)){ // If it's a file
+        return send_file_response(metadata, conn, head_method_check);
     }
 
     // If it's a directory, we'll try to serve index.html from it first
-    if ((strlen(full_requested_path) + strlen("/index.html")) > PATH_MAX){
-        return handle_error_status_code(414, client_socket);
+    char index_path[PATH_MAX + 1];
+    if ((strlen(metadata->resolved_path) + strlen("/index.html")) > PATH_MAX){
+        metadata_cache_release(metadata);
+        return handle_error_status_code(414, conn);
     }
-    strcat(full_requested_path, "/index.html");
+    snprintf(index_path, sizeof(index_path), "%s/index.html", metadata->resolved_path);
+    metadata_cache_release(metadata);
 
     // If there's a problem getting index.html, we'll try to serve the contents of the directory instead
-    if (realpath(full_requested_path, full_requested_path) == NULL){
-        full_requested_path[strlen(full_requested_path) - strlen("index.html")] = '\0';
+    struct metadata_entry *index_metadata = get_path_metadata(index_path);
+    if (index_metadata == NULL || index_metadata->status != 200 || S_ISDIR(index_metadata->stat.st_mode)){
+        if (index_metadata != NULL){
+            metadata_cache_release(index_metadata);
+        }
+        index_path[strlen(index_path) - strlen("index.html")] = '\0';
+
+        return send_directory_listing_response(index_path, conn, head_method_check);
+    }
+
+    return send_file_response(index_metadata, conn, head_method_check);
+}
 
-        return send_directory_listing_response(full_requested_path, client_socket);
-    }    
+// Queues a GET or HEAD response with the server's counters in the Prometheus text format
+int send_stats_response(struct connection *conn, int is_head_method)
+{
+    size_t body_len;
+    char *body = stats_render(&body_len);
+    if (body == NULL){
+        return handle_error_status_code(500, conn);
+    }
+    return send_memory_response(NULL, body, body_len, "text/plain; version=0.0.4; charset=utf-8",
+                                "Cache-Control: no-store\r\n", NULL, conn, is_head_method);
 }
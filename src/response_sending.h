@@ -3,30 +3,45 @@
 
 #include <errno.h>
 #include <dirent.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include "compression.h"
+#include "connection.h"
+#include "content_encoding.h"
+#include "directory_listing.h"
+#include "file_cache.h"
+#include "metadata_cache.h"
 #include "mime_types.h"
 #include "request_parsing.h"
+#include "site_archive.h"
 #include "socket_operations.h"
 
-// Send a response for status codes 4xx and 5xx
-int handle_error_status_code(int error_status_code, int receiving_socket);
+// Queues a response for status codes 4xx and 5xx
+int handle_error_status_code(int error_status_code, struct connection *conn);
 
-// Sends a file over a connection, also closes the file
-int send_file(const int client_sock, FILE *open_file);
+// Queues a file as the response body, the file is closed once it's sent
+int send_file(struct connection *conn, int open_fd, size_t file_size);
 
-// Sends a GET or HEAD response for the requested path
-int send_file_response(char *file_path, int connected_client_socket, int is_head_method);
+// Queues a GET or HEAD response from a cached file, taking over the entry's reference
+int send_cached_file_response(struct file_cache_entry *entry, struct connection *conn, int is_head_method);
 
-// Builds a HTML document to send back as the body (Remember to free() afterwards)   
-char *serve_directory_listing(char *absolute_path);
+// Queues a GET or HEAD response from the site archive, the body goes out straight from the mapping
+int send_archive_response(const struct site_archive_entry *entry, struct connection *conn, int is_head_method);
 
-// Sends a GET response containing the directory listing
-int send_directory_listing_response(char *directory_path, int receiving_client_socket);
+// Queues a GET or HEAD response for a resolved file, taking over the metadata entry's reference
+int send_file_response(struct metadata_entry *metadata, struct connection *conn, int is_head_method);
 
-// Sends a response GET or HEAD method, depending on the head_method_check parameter
-int get_or_head_method(char full_requested_path[], int client_socket, int head_method_check);
+// Queues a GET or HEAD response containing the directory listing
+int send_directory_listing_response(char *directory_path, struct connection *conn, int is_head_method);
+
+// Queues a GET or HEAD response with the server's counters in the Prometheus text format
+int send_stats_response(struct connection *conn, int is_head_method);
+
+// Queues a response GET or HEAD method, depending on the head_method_check parameter
+// Takes over the metadata entry's reference
+int get_or_head_method(struct metadata_entry *metadata, struct connection *conn, int head_method_check);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,377 @@
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "file_cache.h"
+#include "logging.h"
+#include "metadata_cache.h"
+#include "path_index.h"
+#include "server_stats.h"
+
+#define STATUS_CODE_MAX 600
+
+// Latencies go into log-linear buckets: every power of two of nanoseconds is split into 1 << SUB_BUCKET_BITS
+// buckets, so a bucket is never more than 25% wide (like an HDR histogram with 2 significant bits)
+#define SUB_BUCKET_BITS 2
+#define SUB_BUCKETS (1 << SUB_BUCKET_BITS)
+#define HISTOGRAM_BUCKETS ((64 - SUB_BUCKET_BITS + 1) * SUB_BUCKETS)
+
+// The histogram's buckets are exported at every power of two between these (in nanoseconds)
+#define EXPORT_MIN_SHIFT 10 // About a microsecond
+#define EXPORT_MAX_SHIFT 35 // About half a minute
+
+static const char *PHASE_NAMES[PHASE_COUNT] = {"parse", "resolve", "open", "send"};
+
+// One latency histogram
+struct histogram {
+    uint64_t buckets[HISTOGRAM_BUCKETS];
+    uint64_t count;
+    uint64_t sum_ns;
+};
+
+// Everything one thread counted, only ever written by that thread
+struct thread_stats {
+    uint64_t responses[STATUS_CODE_MAX]; // By status code
+    uint64_t bytes_sent;
+    uint64_t connections_opened;
+    uint64_t connections_closed;
+    struct histogram phases[PHASE_COUNT];
+
+    struct thread_stats *next;
+};
+
+// Every thread's counters, the lock only guards adding to the list
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct thread_stats *registry_head = NULL;
+
+static __thread struct thread_stats *local_stats = NULL;
+
+// Only the owning thread writes a counter, so this is a plain add that a scrape never sees half done
+#define STAT_ADD(counter, n) \
+    __atomic_store_n(&(counter), __atomic_load_n(&(counter), __ATOMIC_RELAXED) + (n), __ATOMIC_RELAXED)
+#define STAT_READ(counter) __atomic_load_n(&(counter), __ATOMIC_RELAXED)
+
+// Returns the calling thread's counters, registering them on first use (or NULL if that failed)
+static struct thread_stats *thread_stats_get(void)
+{
+    if (local_stats != NULL){
+        return local_stats;
+    }
+
+    struct thread_stats *stats = calloc(1, sizeof(struct thread_stats));
+    if (stats == NULL){
+        log_perror("thread_stats_get - error allocating memory");
+        return NULL;
+    }
+    pthread_mutex_lock(&registry_lock);
+    stats->next = registry_head;
+    __atomic_store_n(&registry_head, stats, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&registry_lock);
+
+    local_stats = stats;
+    return stats;
+}
+
+// Nanoseconds on the monotonic clock
+uint64_t stats_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Counts a finished response with its status code and how many bytes went out for it
+void stats_count_response(int status_code, uint64_t bytes_sent)
+{
+    struct thread_stats *stats = thread_stats_get();
+    if (stats == NULL){
+        return;
+    }
+    if (status_code > 0 && status_code < STATUS_CODE_MAX){
+        STAT_ADD(stats->responses[status_code], 1);
+    }
+    STAT_ADD(stats->bytes_sent, bytes_sent);
+}
+
+// Counts a client connection being opened
+void stats_connection_opened(void)
+{
+    struct thread_stats *stats = thread_stats_get();
+    if (stats != NULL){
+        STAT_ADD(stats->connections_opened, 1);
+    }
+}
+
+// Counts a client connection being closed
+void stats_connection_closed(void)
+{
+    struct thread_stats *stats = thread_stats_get();
+    if (stats != NULL){
+        STAT_ADD(stats->connections_closed, 1);
+    }
+}
+
+// Which bucket a duration falls into
+static int bucket_index(uint64_t value)
+{
+    if (value < SUB_BUCKETS){
+        return value;
+    }
+    int magnitude = 63 - __builtin_clzll(value); // At least SUB_BUCKET_BITS
+    int sub_bucket = (value >> (magnitude - SUB_BUCKET_BITS)) & (SUB_BUCKETS - 1);
+    return (magnitude - SUB_BUCKET_BITS + 1) * SUB_BUCKETS + sub_bucket;
+}
+
+// The smallest duration that no longer falls into a bucket
+static uint64_t bucket_upper_bound(int index)
+{
+    if (index < SUB_BUCKETS){
+        return index + 1;
+    }
+    int magnitude = index / SUB_BUCKETS + SUB_BUCKET_BITS - 1;
+    uint64_t sub_bucket = index % SUB_BUCKETS;
+    return (SUB_BUCKETS + sub_bucket + 1) << (magnitude - SUB_BUCKET_BITS);
+}
+
+// Records how long a phase of a request took
+void stats_record_phase(enum stats_phase phase, uint64_t duration_ns)
+{
+    struct thread_stats *stats = thread_stats_get();
+    if (stats == NULL){
+        return;
+    }
+    struct histogram *histogram = &stats->phases[phase];
+    STAT_ADD(histogram->buckets[bucket_index(duration_ns)], 1);
+    STAT_ADD(histogram->count, 1);
+    STAT_ADD(histogram->sum_ns, duration_ns);
+}
+
+// A growing text buffer for rendering
+struct text_buffer {
+    char *data;
+    size_t len;
+    size_t size;
+    int failed;
+};
+
+// Appends formatted text, setting failed if there's no memory for it
+static void text_printf(struct text_buffer *text, const char *format, ...)
+{
+    for (;;){
+        if (text->failed){
+            return;
+        }
+        va_list args;
+        va_start(args, format);
+        int written = vsnprintf(text->data + text->len, text->size - text->len, format, args);
+        va_end(args);
+        if (written < 0){
+            text->failed = 1;
+            return;
+        }
+        if ((size_t)written < text->size - text->len){
+            text->len += written;
+            return;
+        }
+
+        size_t new_size = (text->size + written + 1) * 2;
+        char *new_data = realloc(text->data, new_size);
+        if (new_data == NULL){
+            log_perror("stats_render - error reallocating memory");
+            text->failed = 1;
+            return;
+        }
+        text->data = new_data;
+        text->size = new_size;
+    }
+}
+
+// The duration below which a fraction of a histogram's samples fall, at the resolution of its buckets
+static double histogram_quantile(const struct histogram *histogram, double fraction)
+{
+    if (histogram->count == 0){
+        return 0;
+    }
+    uint64_t wanted = (uint64_t)(fraction * histogram->count);
+    uint64_t seen = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++){
+        seen += histogram->buckets[i];
+        if (seen > wanted){
+            return bucket_upper_bound(i) / 1e9;
+        }
+    }
+    return bucket_upper_bound(HISTOGRAM_BUCKETS - 1) / 1e9;
+}
+
+// Merges every thread's counters and renders them in the Prometheus text format
+// Returns a malloc()ed buffer (or NULL on error), *len is its length
+char *stats_render(size_t *len)
+{
+    // The merged counters are too big for a worker's stack
+    struct thread_stats *total = calloc(1, sizeof(struct thread_stats));
+    if (total == NULL){
+        log_perror("stats_render - error allocating memory");
+        return NULL;
+    }
+    for (struct thread_stats *stats = __atomic_load_n(&registry_head, __ATOMIC_ACQUIRE); stats != NULL;
+         stats = stats->next){
+        for (int code = 0; code < STATUS_CODE_MAX; code++){
+            total->responses[code] += STAT_READ(stats->responses[code]);
+        }
+        total->bytes_sent += STAT_READ(stats->bytes_sent);
+        total->connections_opened += STAT_READ(stats->connections_opened);
+        total->connections_closed += STAT_READ(stats->connections_closed);
+        for (int phase = 0; phase < PHASE_COUNT; phase++){
+            for (int i = 0; i < HISTOGRAM_BUCKETS; i++){
+                total->phases[phase].buckets[i] += STAT_READ(stats->phases[phase].buckets[i]);
+            }
+            total->phases[phase].count += STAT_READ(stats->phases[phase].count);
+            total->phases[phase].sum_ns += STAT_READ(stats->phases[phase].sum_ns);
+        }
+    }
+
+    struct text_buffer text = {NULL, 0, 0, 0};
+    text_printf(&text, "# HELP http_responses_total Responses sent in full, by status code.\n"
+                       "# TYPE http_responses_total counter\n");
+    for (int code = 0; code < STATUS_CODE_MAX; code++){
+        if (total->responses[code] > 0){
+            text_printf(&text, "http_responses_total{code=\"%d\"} %lu\n", code, total->responses[code]);
+        }
+    }
+    text_printf(&text, "# HELP http_sent_bytes_total Bytes written to client sockets, headers included.\n"
+                       "# TYPE http_sent_bytes_total counter\n"
+                       "http_sent_bytes_total %lu\n", total->bytes_sent);
+    text_printf(&text, "# HELP http_connections_total Client connections accepted.\n"
+                       "# TYPE http_connections_total counter\n"
+                       "http_connections_total %lu\n", total->connections_opened);
+    // Closes on one thread can be summed before the opens on another, which would make the gauge negative
+    uint64_t active = total->connections_opened > total->connections_closed ?
+                      total->connections_opened - total->connections_closed : 0;
+    text_printf(&text, "# HELP http_connections_active Client connections open right now.\n"
+                       "# TYPE http_connections_active gauge\n"
+                       "http_connections_active %lu\n", active);
+
+    struct file_cache_stats file_stats;
+    file_cache_get_stats(&file_stats);
+    unsigned long file_lookups = file_stats.hits + file_stats.misses;
+    text_printf(&text, "# HELP file_cache_hits_total Requests answered from the in-memory file cache.\n"
+                       "# TYPE file_cache_hits_total counter\n"
+                       "file_cache_hits_total %lu\n"
+                       "# HELP file_cache_misses_total File cache lookups that found nothing.\n"
+                       "# TYPE file_cache_misses_total counter\n"
+                       "file_cache_misses_total %lu\n"
+                       "# HELP file_cache_hit_ratio Share of file cache lookups that hit, since startup.\n"
+                       "# TYPE file_cache_hit_ratio gauge\n"
+                       "file_cache_hit_ratio %.4f\n"
+                       "# HELP file_cache_evictions_total Files dropped to make room.\n"
+                       "# TYPE file_cache_evictions_total counter\n"
+                       "file_cache_evictions_total %lu\n"
+                       "# HELP file_cache_invalidations_total Files dropped because they changed.\n"
+                       "# TYPE file_cache_invalidations_total counter\n"
+                       "file_cache_invalidations_total %lu\n"
+                       "# HELP file_cache_entries Files in the cache.\n"
+                       "# TYPE file_cache_entries gauge\n"
+                       "file_cache_entries %zu\n"
+                       "# HELP file_cache_bytes Memory the cached files take up.\n"
+                       "# TYPE file_cache_bytes gauge\n"
+                       "file_cache_bytes %zu\n",
+                file_stats.hits, file_stats.misses, file_lookups ? (double)file_stats.hits / file_lookups : 0.0,
+                file_stats.evictions, file_stats.invalidations, file_stats.entries, file_stats.bytes_used);
+
+    struct metadata_cache_stats metadata_stats;
+    metadata_cache_get_stats(&metadata_stats);
+    unsigned long metadata_lookups = metadata_stats.hits + metadata_stats.misses;
+    text_printf(&text, "# HELP metadata_cache_hits_total Path lookups answered from the metadata cache, 403/404s included.\n"
+                       "# TYPE metadata_cache_hits_total counter\n"
+                       "metadata_cache_hits_total %lu\n"
+                       "# HELP metadata_cache_negative_hits_total Cache hits that answered a 403 or 404.\n"
+                       "# TYPE metadata_cache_negative_hits_total counter\n"
+                       "metadata_cache_negative_hits_total %lu\n"
+                       "# HELP metadata_cache_misses_total Path lookups that had to resolve the path.\n"
+                       "# TYPE metadata_cache_misses_total counter\n"
+                       "metadata_cache_misses_total %lu\n"
+                       "# HELP metadata_cache_hit_ratio Share of path lookups that hit, since startup.\n"
+                       "# TYPE metadata_cache_hit_ratio gauge\n"
+                       "metadata_cache_hit_ratio %.4f\n"
+                       "# HELP metadata_cache_entries Paths in the cache.\n"
+                       "# TYPE metadata_cache_entries gauge\n"
+                       "metadata_cache_entries %zu\n"
+                       "# HELP metadata_cache_open_files Files the cache holds open.\n"
+                       "# TYPE metadata_cache_open_files gauge\n"
+                       "metadata_cache_open_files %d\n",
+                metadata_stats.hits, metadata_stats.negative_hits, metadata_stats.misses,
+                metadata_lookups ? (double)metadata_stats.hits / metadata_lookups : 0.0,
+                metadata_stats.entries, metadata_stats.open_fds);
+
+    if (path_index_enabled()){
+        struct path_index_stats index_stats;
+        path_index_get_stats(&index_stats);
+        text_printf(&text, "# HELP path_index_hits_total Path lookups the in-memory index found.\n"
+                           "# TYPE path_index_hits_total counter\n"
+                           "path_index_hits_total %lu\n"
+                           "# HELP path_index_misses_total Path lookups the index answered with a 404.\n"
+                           "# TYPE path_index_misses_total counter\n"
+                           "path_index_misses_total %lu\n"
+                           "# HELP path_index_fallbacks_total Path lookups the index left to the filesystem.\n"
+                           "# TYPE path_index_fallbacks_total counter\n"
+                           "path_index_fallbacks_total %lu\n"
+                           "# HELP path_index_updates_total Changes inotify reported to the index.\n"
+                           "# TYPE path_index_updates_total counter\n"
+                           "path_index_updates_total %lu\n"
+                           "# HELP path_index_rebuilds_total Times the whole tree was indexed again after inotify lost track.\n"
+                           "# TYPE path_index_rebuilds_total counter\n"
+                           "path_index_rebuilds_total %lu\n"
+                           "# HELP path_index_entries Paths in the index.\n"
+                           "# TYPE path_index_entries gauge\n"
+                           "path_index_entries %zu\n"
+                           "# HELP path_index_bytes Memory the index takes up.\n"
+                           "# TYPE path_index_bytes gauge\n"
+                           "path_index_bytes %zu\n",
+                    index_stats.hits, index_stats.misses, index_stats.fallbacks, index_stats.updates,
+                    index_stats.rebuilds, index_stats.entries, index_stats.bytes_used);
+    }
+
+    text_printf(&text, "# HELP http_phase_duration_seconds Time spent in each phase of answering a request.\n"
+                       "# TYPE http_phase_duration_seconds histogram\n");
+    for (int phase = 0; phase < PHASE_COUNT; phase++){
+        const struct histogram *histogram = &total->phases[phase];
+        uint64_t cumulative = 0;
+        int next_bucket = 0;
+        for (int shift = EXPORT_MIN_SHIFT; shift <= EXPORT_MAX_SHIFT; shift++){
+            // A power of two is where a bucket starts, so the count below it is exact
+            int end = (shift - SUB_BUCKET_BITS + 1) * SUB_BUCKETS;
+            for (; next_bucket < end; next_bucket++){
+                cumulative += histogram->buckets[next_bucket];
+            }
+            text_printf(&text, "http_phase_duration_seconds_bucket{phase=\"%s\",le=\"%.9g\"} %lu\n",
+                        PHASE_NAMES[phase], (double)((uint64_t)1 << shift) / 1e9, cumulative);
+        }
+        text_printf(&text, "http_phase_duration_seconds_bucket{phase=\"%s\",le=\"+Inf\"} %lu\n"
+                           "http_phase_duration_seconds_sum{phase=\"%s\"} %.9f\n"
+                           "http_phase_duration_seconds_count{phase=\"%s\"} %lu\n",
+                    PHASE_NAMES[phase], histogram->count, PHASE_NAMES[phase], histogram->sum_ns / 1e9,
+                    PHASE_NAMES[phase], histogram->count);
+    }
+
+    // The buckets are finer than the exported ones, so quantiles come out closer than a scraper could get them
+    text_printf(&text, "# HELP http_phase_duration_quantile_seconds Upper bound of a quantile of each phase's time, "
+                       "since startup.\n"
+                       "# TYPE http_phase_duration_quantile_seconds gauge\n");
+    static const double QUANTILES[] = {0.5, 0.9, 0.99, 0.999};
+    for (int phase = 0; phase < PHASE_COUNT; phase++){
+        for (size_t q = 0; q < sizeof(QUANTILES) / sizeof(QUANTILES[0]); q++){
+            text_printf(&text, "http_phase_duration_quantile_seconds{phase=\"%s\",quantile=\"%g\"} %.9g\n",
+                        PHASE_NAMES[phase], QUANTILES[q], histogram_quantile(&total->phases[phase], QUANTILES[q]));
+        }
+    }
+
+    free(total);
+    if (text.failed){
+        free(text.data);
+        return NULL;
+    }
+    *len = text.len;
+    return text.data;
+}
@@ -0,0 +1,35 @@
+#ifndef SERVER_STATS_H
+#define SERVER_STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// The phases of answering a request that get a latency histogram
+enum stats_phase {
+    PHASE_PARSE, // Running the parser over the request's bytes
+    PHASE_RESOLVE, // Turning the URI into a cached file or a path's metadata
+    PHASE_OPEN, // open() and fstat() of a file that wasn't open yet
+    PHASE_SEND, // From the response being queued to its last byte going out
+    PHASE_COUNT
+};
+
+// Nanoseconds on the monotonic clock
+uint64_t stats_now_ns(void);
+
+// Counts a finished response with its status code and how many bytes went out for it
+void stats_count_response(int status_code, uint64_t bytes_sent);
+
+// Counts a client connection being opened
+void stats_connection_opened(void);
+
+// Counts a client connection being closed
+void stats_connection_closed(void);
+
+// Records how long a phase of a request took
+void stats_record_phase(enum stats_phase phase, uint64_t duration_ns);
+
+// Merges every thread's counters and renders them in the Prometheus text format
+// Returns a malloc()ed buffer (or NULL on error), *len is its length
+char *stats_render(size_t *len);
+
+#endif
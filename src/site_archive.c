@@ -0,0 +1,179 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "content_encoding.h"
+#include "logging.h"
+#include "site_archive.h"
+
+static const char *archive_data = NULL; // The whole archive, mapped read-only for as long as the server runs
+static const struct site_archive_header *archive_header = NULL;
+static const uint32_t *archive_slots = NULL;
+static const struct site_archive_entry *archive_entries = NULL;
+static const char *archive_strings = NULL;
+
+// FNV-1a over len bytes of a path, the hash the slots are placed by
+uint64_t site_archive_hash(const char *path, size_t len)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++){
+        hash ^= (unsigned char)path[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Whether a NUL-terminated string of len bytes starts at offset in the strings
+static int string_fits(const struct site_archive_header *header, const char *strings, uint64_t offset, uint64_t len)
+{
+    return offset < header->strings_len && len < header->strings_len - offset && strings[offset + len] == '\0';
+}
+
+// Whether len bytes from offset on are inside the archive
+static int range_fits(const struct site_archive_header *header, uint64_t offset, uint64_t len)
+{
+    return offset <= header->size && len <= header->size - offset;
+}
+
+// Checks every offset in a mapped archive, so a damaged one can't make lookups read outside it
+// Returns -1 (with a message logged) if something is off
+static int validate_archive(const char *data, size_t size)
+{
+    const struct site_archive_header *header = (const struct site_archive_header *)data;
+    if (size < sizeof(struct site_archive_header) || memcmp(header->magic, SITE_ARCHIVE_MAGIC, sizeof(header->magic))){
+        log_message(LEVEL_ERROR, "site_archive - not a site archive");
+        return -1;
+    }
+    if (header->version != SITE_ARCHIVE_VERSION){
+        log_message(LEVEL_ERROR, "site_archive - archive version %u, this server reads %u", header->version,
+                    SITE_ARCHIVE_VERSION);
+        return -1;
+    }
+    if (header->size != size || header->slot_count == 0 || (header->slot_count & (header->slot_count - 1)) ||
+        header->entry_count >= header->slot_count ||
+        !range_fits(header, header->slots_offset, (uint64_t)header->slot_count * sizeof(uint32_t)) ||
+        !range_fits(header, header->entries_offset, (uint64_t)header->entry_count * sizeof(struct site_archive_entry)) ||
+        !range_fits(header, header->strings_offset, header->strings_len) ||
+        header->slots_offset % sizeof(uint32_t) || header->entries_offset % sizeof(uint64_t)){
+        log_message(LEVEL_ERROR, "site_archive - the archive's layout is damaged");
+        return -1;
+    }
+
+    const uint32_t *slots = (const uint32_t *)(data + header->slots_offset);
+    const struct site_archive_entry *entries = (const struct site_archive_entry *)(data + header->entries_offset);
+    const char *strings = data + header->strings_offset;
+    uint32_t used_slots = 0;
+    for (uint32_t i = 0; i < header->slot_count; i++){
+        if (slots[i] > header->entry_count){
+            log_message(LEVEL_ERROR, "site_archive - slot %u points past the entries", i);
+            return -1;
+        }
+        used_slots += slots[i] != 0;
+    }
+    if (used_slots == header->slot_count){ // A lookup for something that isn't there would never end
+        log_message(LEVEL_ERROR, "site_archive - the archive has no empty slots");
+        return -1;
+    }
+    for (uint32_t i = 0; i < header->entry_count; i++){
+        const struct site_archive_entry *entry = &entries[i];
+        int valid = string_fits(header, strings, entry->path_offset, entry->path_len);
+        for (int j = 0; j < SITE_ARCHIVE_REPRESENTATIONS && valid; j++){
+            const struct site_archive_representation *representation = &entry->representations[j];
+            if (j > 0 && (ENCODINGS[j - 1].token == NULL || !(entry->encodings & ENCODINGS[j - 1].encoding))){
+                continue;
+            }
+            valid = range_fits(header, representation->body_offset, representation->body_len) &&
+                    string_fits(header, strings, representation->headers_offset, representation->headers_len) &&
+                    representation->validators_len <= representation->headers_len &&
+                    representation->etag_offset < header->strings_len &&
+                    memchr(strings + representation->etag_offset, '\0',
+                           header->strings_len - representation->etag_offset) != NULL;
+        }
+        if (!valid){
+            log_message(LEVEL_ERROR, "site_archive - entry %u points outside the archive", i);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Maps an archive and checks everything in it points inside it, returns -1 on error
+int site_archive_open(const char *path)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0){
+        log_perror("site_archive_open - error opening archive");
+        return -1;
+    }
+    struct stat archive_stat;
+    if (fstat(fd, &archive_stat)){
+        log_perror("site_archive_open - error getting archive status");
+        close(fd);
+        return -1;
+    }
+    if (archive_stat.st_size < (off_t)sizeof(struct site_archive_header)){
+        log_message(LEVEL_ERROR, "site_archive_open - %s is too small to be an archive", path);
+        close(fd);
+        return -1;
+    }
+
+    // Bodies are only read in as they're sent, the index right away
+    char *data = mmap(NULL, archive_stat.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED){
+        log_perror("site_archive_open - mmap");
+        return -1;
+    }
+    const struct site_archive_header *header = (const struct site_archive_header *)data;
+    if (validate_archive(data, archive_stat.st_size) < 0){
+        munmap(data, archive_stat.st_size);
+        return -1;
+    }
+    madvise(data, header->strings_offset + header->strings_len, MADV_WILLNEED);
+
+    archive_data = data;
+    archive_header = header;
+    archive_slots = (const uint32_t *)(data + header->slots_offset);
+    archive_entries = (const struct site_archive_entry *)(data + header->entries_offset);
+    archive_strings = data + header->strings_offset;
+    log_message(LEVEL_INFO, "Serving %u files from %s (%llu bytes)", header->entry_count, path,
+                (unsigned long long)header->size);
+    return 0;
+}
+
+// Whether the server is serving from an archive
+int site_archive_loaded(void)
+{
+    return archive_data != NULL;
+}
+
+// Finds the entry for a path relative to the site's root (len bytes of it), NULL if there's none
+const struct site_archive_entry *site_archive_lookup(const char *path, size_t len)
+{
+    uint64_t hash = site_archive_hash(path, len);
+    uint32_t mask = archive_header->slot_count - 1;
+
+    // There's always an empty slot (checked on opening), so the probe ends
+    for (uint32_t slot = hash & mask; archive_slots[slot] != 0; slot = (slot + 1) & mask){
+        const struct site_archive_entry *entry = &archive_entries[archive_slots[slot] - 1];
+        if (entry->hash == hash && entry->path_len == len && !memcmp(archive_strings + entry->path_offset, path, len)){
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+// A string of the archive, NUL-terminated
+const char *site_archive_string(uint32_t offset)
+{
+    return archive_strings + offset;
+}
+
+// The body of a representation, straight from the mapping
+const char *site_archive_body(const struct site_archive_representation *representation)
+{
+    return archive_data + representation->body_offset;
+}
@@ -0,0 +1,68 @@
+#ifndef SITE_ARCHIVE_H
+#define SITE_ARCHIVE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// A site packed into one file by tools/site_pack, served from memory with --archive. The layout is:
+// the header, the hash slots, the entries, the strings (paths and header blocks), then every body on a page boundary
+// Numbers are in the byte order of the machine that packed it, offsets count from the start of the file
+#define SITE_ARCHIVE_MAGIC "SHTPACK1"
+#define SITE_ARCHIVE_VERSION 1
+#define SITE_ARCHIVE_ALIGN 4096 // Bodies start on page boundaries
+#define SITE_ARCHIVE_REPRESENTATIONS 4 // The file as it is, then one for each of ENCODINGS in its order
+
+// At the very start of the archive
+struct site_archive_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t entry_count;
+    uint32_t slot_count; // Power of 2, at most half of them used
+    uint32_t reserved;
+    uint64_t slots_offset; // uint32_t per slot, an entry's index + 1 or 0 for none, collisions take the next slot
+    uint64_t entries_offset;
+    uint64_t strings_offset;
+    uint64_t strings_len;
+    uint64_t size; // Of the whole archive
+};
+
+// One way of sending a file, as it is or encoded
+struct site_archive_representation {
+    uint64_t body_offset;
+    uint64_t body_len;
+    uint32_t headers_offset; // In the strings, from Content-Type to the last header line
+    uint32_t headers_len;
+    uint32_t validators_len; // The end of the headers a 304 repeats (ETag, Last-Modified and Vary)
+    uint32_t etag_offset; // In the strings, quotes included
+    int64_t mtime; // Of the file the body came from, for If-Modified-Since
+};
+
+// A file of the site, directories are only there as the paths of their files
+struct site_archive_entry {
+    uint64_t hash; // site_archive_hash() of the path
+    uint32_t path_offset; // In the strings, relative to the site's root without a leading '/'
+    uint32_t path_len;
+    uint32_t encodings; // ENCODING_* bits of the encoded representations there are
+    uint32_t reserved;
+    struct site_archive_representation representations[SITE_ARCHIVE_REPRESENTATIONS];
+};
+
+// FNV-1a over len bytes of a path, the hash the slots are placed by
+uint64_t site_archive_hash(const char *path, size_t len);
+
+// Maps an archive and checks everything in it points inside it, returns -1 on error
+int site_archive_open(const char *path);
+
+// Whether the server is serving from an archive
+int site_archive_loaded(void);
+
+// Finds the entry for a path relative to the site's root (len bytes of it), NULL if there's none
+const struct site_archive_entry *site_archive_lookup(const char *path, size_t len);
+
+// A string of the archive, NUL-terminated
+const char *site_archive_string(uint32_t offset);
+
+// The body of a representation, straight from the mapping
+const char *site_archive_body(const struct site_archive_representation *representation);
+
+#endif
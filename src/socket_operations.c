@@ -1,20 +1,23 @@
 #include <arpa/inet.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in.h>
-#include <poll.h>
+#include <netinet/tcp.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
+#include "logging.h"
 
-static int BACKLOG = 10; // Maximum queue size for incoming connections on the listening socket
-static int TIMEOUT = 3; // How long we wait on a socket (in seconds)
+static int BACKLOG = SOMAXCONN; // Maximum queue size for incoming connections on the listening socket
 
-// Returns a listening socket (or exits)
-int get_listener(const char *port)
+// Returns a listening socket (or exits), reuse_port lets several workers bind the same port
+int get_listener(const char *port, int reuse_port)
 {
     int listener; // Listening socket descriptor
     int yes=1; // For setsockopt() SO_REUSEADDR
@@ -28,7 +31,7 @@ int get_listener(const char *port)
     hints.ai_flags = AI_PASSIVE; // This machine's address
 
     if ((retval = getaddrinfo(NULL, port, &hints, &ai)) != 0) {
-        fprintf(stderr, "get_listener - %s\n", gai_strerror(retval));
+        log_message(LEVEL_ERROR, "get_listener - %s", gai_strerror(retval));
         exit(EXIT_FAILURE);
     }
     
@@ -41,6 +44,12 @@ int get_listener(const char *port)
         // Lose the "address already in use" error
         setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int));
 
+        // Every worker gets its own listener, the kernel spreads connections between them
+        if (reuse_port && setsockopt(listener, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(int)) < 0) {
+            log_perror("get_listener - SO_REUSEPORT");
+            exit(EXIT_FAILURE);
+        }
+
         if (bind(listener, p->ai_addr, p->ai_addrlen) < 0) {
             close(listener);
             continue;
@@ -51,14 +60,14 @@ int get_listener(const char *port)
 
     // If we got here, it means we didn't get bound
     if (p == NULL) {
-        fprintf(stderr, "get_listener - problem binding socket");
+        log_message(LEVEL_ERROR, "get_listener - problem binding socket");
         exit(EXIT_FAILURE);
     }
 
     freeaddrinfo(ai); // All done with this
 
     if (listen(listener, BACKLOG) == -1) {
-        perror("get_listener - listen");
+        log_perror("get_listener - listen");
         exit(EXIT_FAILURE);
     }
 
@@ -75,120 +84,228 @@ void *get_in_addr(struct sockaddr *sa)
     return &(((struct sockaddr_in6*)sa)->sin6_addr);
 }
 
-// Returns a new client socket or -1 on error
-int accept_and_print(const int listening_fd)
+// Returns a new non-blocking client socket, -1 on error (errno says which) or -2 if there's nobody left to accept
+// The client's address goes into *client_addr
+int accept_and_print(const int listening_fd, struct sockaddr_storage *client_addr)
 {
-    struct sockaddr_storage client_addr; // Client's address information
-    socklen_t addrlen = sizeof(client_addr);
+    socklen_t addrlen = sizeof(*client_addr);
     char addr_str[INET6_ADDRSTRLEN];
 
-    int new_fd = accept(listening_fd, (struct sockaddr *)&client_addr, &addrlen);
+    int new_fd = accept4(listening_fd, (struct sockaddr *)client_addr, &addrlen, SOCK_NONBLOCK | SOCK_CLOEXEC);
     if (new_fd == -1){
-        perror("accept - accept");
+        if (errno == EAGAIN || errno == EWOULDBLOCK){
+            return -2;
+        }
+        int accept_errno = errno;
+        log_perror("accept - accept");
+        errno = accept_errno; // The caller decides from errno whether to keep accepting
         return -1;
     }
 
-    // Print out who's connect()ing to us
-    inet_ntop(client_addr.ss_family,
-            get_in_addr((struct sockaddr *)&client_addr),
-            addr_str, 
-            sizeof addr_str);
-
-    printf("\nServer: Incoming connection from %s on socket %d\n", addr_str, new_fd);
+    // Log who's connect()ing to us
+    if (log_level_enabled(LEVEL_DEBUG)){
+        inet_ntop(client_addr->ss_family,
+                get_in_addr((struct sockaddr *)client_addr),
+                addr_str, 
+                sizeof addr_str);
+        log_message(LEVEL_DEBUG, "Incoming connection from %s on socket %d", addr_str, new_fd);
+    }
 
     return new_fd;
 }
 
-// send()s as much of the buffer as possible
-int sendall(const int send_fd, char *send_buf, size_t *send_buf_len)
+// Puts a socket into non-blocking mode
+int set_nonblocking(const int fd)
 {
-    int total = 0; // How many bytes we've sent
-    int bytesleft = *send_buf_len; // How many we have left to send
-    int sent;
-    int send_poll_rv;
-    
-    // Put the file descriptor into a pollfd object
-    struct pollfd send_poll_fd[1];
-    send_poll_fd[0].fd = send_fd;
-    send_poll_fd[0].events = POLLOUT | POLLHUP;
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0){
+        log_perror("set_nonblocking - fcntl");
+        return -1;
+    }
+    return 0;
+}
 
-    while(total < *send_buf_len) {
-        
-        send_poll_rv = poll(send_poll_fd, 1, TIMEOUT*1000);
-
-        // Check for error or timeout
-        if (send_poll_rv < 0){
-            perror("sendall - poll");
-            sent = -1;
-            break;
-
-        } else if (send_poll_rv == 0) {
-            fprintf(stderr, "sendall - timeout reached on socket %d\n", send_fd);
-            sent = -1;
-            break;
-
-        } else {
-            if (send_poll_fd[0].revents & POLLHUP){
-                printf("Connection on socket %d closed by client\n", send_fd);
-                sent = -1;
-                break;
-            }
+// Turns off Nagle's algorithm on a client socket, we coalesce small writes ourselves
+int set_tcp_nodelay(const int fd)
+{
+    int yes = 1;
+    if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes)) < 0){
+        log_perror("set_tcp_nodelay - setsockopt");
+        return -1;
+    }
+    return 0;
+}
 
-            // We got here if data is ready to be sent
-            sent = send(send_fd, send_buf+total, bytesleft, MSG_NOSIGNAL);
-            if (sent < 0){
-                perror("sendall - send");
-                break;
+// send()s as much of the buffer as the socket takes without blocking
+int send_nonblocking(const int send_fd, const char *send_buf, size_t *send_buf_len, int more)
+{
+    size_t total = 0; // How many bytes we've sent
+    ssize_t sent;
+    int flags = MSG_NOSIGNAL | (more ? MSG_MORE : 0);
+
+    while (total < *send_buf_len) {
+        sent = send(send_fd, send_buf + total, *send_buf_len - total, flags);
+        if (sent < 0){
+            if (errno == EINTR){
+                continue;
             }
-            total += sent;
-            bytesleft -= sent;
+            *send_buf_len = total;
+            if (errno == EAGAIN || errno == EWOULDBLOCK){
+                return 1; // Wait until the socket is writable again
+            }
+            log_perror("send_nonblocking - send");
+            return -1;
         }
+        total += sent;
     }
 
     *send_buf_len = total; // Return number actually sent here
-
-    return sent==-1?-1:0; // return -1 on failure, 0 on success
+    return 0;
 }
 
-// recv() data into a buffer
-int poll_recv(const int recv_fd, char *recv_buf, size_t recv_buf_len)
+// Gathers the buffers into as few packets as the socket takes without blocking, iov is used up as it goes
+int sendv_nonblocking(const int send_fd, struct iovec *iov, int iovcnt, int more, size_t *sent)
 {
-    struct pollfd recv_poll_fd[1]; // pollfd object that'll contain the recv()ing socket
-    int recv_poll_rv;
+    ssize_t written;
+    struct msghdr message;
+    int flags = MSG_NOSIGNAL | (more ? MSG_MORE : 0);
+    *sent = 0;
+
+    // sendmsg() rather than writev(), for the flags
+    memset(&message, 0, sizeof(message));
+    while (iovcnt > 0) {
+        message.msg_iov = iov;
+        message.msg_iovlen = iovcnt;
+        written = sendmsg(send_fd, &message, flags);
+        if (written < 0){
+            if (errno == EINTR){
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK){
+                return 1;
+            }
+            log_perror("sendv_nonblocking - sendmsg");
+            return -1;
+        }
+        *sent += written;
 
-    recv_poll_fd[0].fd = recv_fd;
-    recv_poll_fd[0].events = POLLIN | POLLHUP; // The events we want to check for
+        // Skip past whatever went out
+        while (iovcnt > 0 && (size_t)written >= iov->iov_len){
+            written -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0){
+            iov->iov_base = (char *)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
 
-    recv_poll_rv = poll(recv_poll_fd, 1, TIMEOUT*1000);
+    return 0;
+}
 
-    // Check for error or timeout
-    if (recv_poll_rv < 0){
-        perror("poll_recv - poll");
-        return -1;
+// recv()s into a buffer until the socket would block or the buffer is full
+int recv_nonblocking(const int recv_fd, char *recv_buf, size_t recv_buf_len, size_t *recv_len)
+{
+    ssize_t nbytes;
+
+    // Leave room for the terminating '\0'
+    while (*recv_len < recv_buf_len - 1) {
+        nbytes = recv(recv_fd, recv_buf + *recv_len, recv_buf_len - 1 - *recv_len, 0);
+        if (nbytes < 0){
+            if (errno == EINTR){
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK){
+                break;
+            }
+            log_perror("recv_nonblocking - recv");
+            return -1;
+        }
+        if (nbytes == 0){ // The client hung up
+            recv_buf[*recv_len] = '\0';
+            return 1;
+        }
+        *recv_len += nbytes;
+    }
 
-    } else if (recv_poll_rv == 0) {
-        fprintf(stderr, "poll_recv - timeout reached on socket %d\n", recv_fd);
-        return -1;
+    recv_buf[*recv_len] = '\0';
+    return 0;
+}
 
-    } else {
-        if (recv_poll_fd[0].revents & POLLHUP){ // If the client hung up
-            printf("Connection on socket %d closed by client\n", recv_fd);
+// sendfile()s part of a file straight from the page cache to the socket
+int sendfile_nonblocking(const int send_fd, const int file_fd, off_t *offset, size_t *count)
+{
+    ssize_t sent;
+
+    while (*count > 0) {
+        sent = sendfile(send_fd, file_fd, offset, *count); // Moves *offset along for us
+        if (sent < 0){
+            if (errno == EINTR){
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK){
+                return 1;
+            }
+            if (errno == EINVAL || errno == ENOSYS){
+                return -2; // This file can't be sendfile()d, the caller should splice() instead
+            }
+            log_perror("sendfile_nonblocking - sendfile");
+            return -1;
+        }
+        if (sent == 0){ // The file got shorter than when we started
+            log_message(LEVEL_WARNING, "sendfile_nonblocking - unexpected end of file on socket %d", send_fd);
             return -1;
+        }
+        *count -= sent;
+    }
 
-        // There is data to be recv()ed on the socket
-        } else {
-            int nbytes = recv(recv_fd, recv_buf, recv_buf_len - 1, 0);
+    return 0;
+}
 
-            // Check for errors on recv()
-            if (nbytes < 0){
-                perror("poll_recv - recv");
-                return -1;
+// splice()s part of a file to the socket through a pipe
+int splice_nonblocking(const int send_fd, const int file_fd, int pipe_fds[2], size_t *pipe_pending, off_t *offset, size_t *count)
+{
+    ssize_t moved;
 
-            } else { // We got some data from a client
-                recv_buf[nbytes] = '\0';
+    if (pipe_fds[0] < 0 && pipe2(pipe_fds, O_NONBLOCK | O_CLOEXEC) < 0){
+        log_perror("splice_nonblocking - pipe2");
+        return -1;
+    }
+
+    while (*count > 0 || *pipe_pending > 0) {
+        // Fill the pipe from the file if it's empty
+        if (*pipe_pending == 0){
+            moved = splice(file_fd, offset, pipe_fds[1], NULL, *count, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (moved < 0){
+                if (errno == EINTR){
+                    continue;
+                }
+                log_perror("splice_nonblocking - splice from file");
+                return -1;
+            }
+            if (moved == 0){
+                log_message(LEVEL_WARNING, "splice_nonblocking - unexpected end of file on socket %d", send_fd);
+                return -1;
+            }
+            *pipe_pending = moved;
+            *count -= moved;
+        }
 
-                return 0;
+        // Drain the pipe into the socket
+        moved = splice(pipe_fds[0], NULL, send_fd, NULL, *pipe_pending, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (moved < 0){
+            if (errno == EINTR){
+                continue;
             }
+            if (errno == EAGAIN || errno == EWOULDBLOCK){
+                return 1; // Whatever's left stays in the pipe until the socket is writable
+            }
+            log_perror("splice_nonblocking - splice to socket");
+            return -1;
         }
+        *pipe_pending -= moved;
     }
-}
\ No newline at end of file
+
+    return 0;
+}
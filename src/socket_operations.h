@@ -3,29 +3,54 @@
 
 #include <arpa/inet.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in.h>
-#include <poll.h>
+#include <netinet/tcp.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
-// Returns a listening socket (or exits)
-int get_listener(const char *port);
+// Returns a listening socket (or exits), reuse_port lets several workers bind the same port
+int get_listener(const char *port, int reuse_port);
 
 // Gets sockaddr, IPv4 or IPv6 (for accept_and_print())
 void *get_in_addr(struct sockaddr *sa);
 
-// Returns a new client socket or -1 on error
-int accept_and_print(const int listening_fd);
+// Returns a new non-blocking client socket, -1 on error or -2 if there's nobody left to accept
+// The client's address goes into *client_addr
+int accept_and_print(const int listening_fd, struct sockaddr_storage *client_addr);
 
-// send()s as much of the buffer as possible
-int sendall(const int send_fd, char *send_buf, size_t *send_buf_len);
+// Puts a socket into non-blocking mode
+int set_nonblocking(const int fd);
 
-// recv() data into a buffer
-int poll_recv(const int recv_fd, char *recv_buf, size_t recv_buf_len);
+// Turns off Nagle's algorithm on a client socket, we coalesce small writes ourselves
+int set_tcp_nodelay(const int fd);
+
+// send()s as much of the buffer as the socket takes without blocking
+// With more set, the kernel holds a partial packet back for what's sent next (MSG_MORE)
+// Returns 0 if everything was sent, 1 if the socket would block, -1 on error
+int send_nonblocking(const int send_fd, const char *send_buf, size_t *send_buf_len, int more);
+
+// Gathers the buffers into as few packets as the socket takes without blocking, iov is used up as it goes
+// more works like for send_nonblocking()
+// Returns 0 if everything was sent, 1 if the socket would block, -1 on error; *sent is how much went out
+int sendv_nonblocking(const int send_fd, struct iovec *iov, int iovcnt, int more, size_t *sent);
+
+// recv()s into a buffer until the socket would block or the buffer is full
+// Returns 0 if the socket would block, 1 if the client hung up, -1 on error
+int recv_nonblocking(const int recv_fd, char *recv_buf, size_t recv_buf_len, size_t *recv_len);
+
+// sendfile()s part of a file straight from the page cache to the socket, *offset moves past what was sent
+// Returns 0 once *count is 0, 1 if the socket would block, -1 on error, -2 if the file can't be sendfile()d
+int sendfile_nonblocking(const int send_fd, const int file_fd, off_t *offset, size_t *count);
+
+// splice()s part of a file to the socket through a pipe (created on first use if pipe_fds[0] is -1)
+// Returns 0 once everything is sent, 1 if the socket would block, -1 on error
+int splice_nonblocking(const int send_fd, const int file_fd, int pipe_fds[2], size_t *pipe_pending, off_t *offset, size_t *count);
 
 #endif
\ No newline at end of file
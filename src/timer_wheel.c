@@ -0,0 +1,129 @@
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+#include "timer_wheel.h"
+
+#define SLOT_MASK (TIMER_WHEEL_SLOTS - 1)
+#define MAX_DELTA ((1ULL << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1)
+
+// The current tick, read from the coarse monotonic clock (no system call)
+uint64_t timer_wheel_clock(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec;
+}
+
+// Sets up an empty wheel starting at the current tick
+void timer_wheel_init(struct timer_wheel *wheel)
+{
+    memset(wheel->slots, 0, sizeof(wheel->slots));
+    wheel->now = timer_wheel_clock();
+    wheel->next_tick = wheel->now;
+}
+
+// Sets up a timer that isn't armed
+void timer_init(struct timer *timer)
+{
+    timer->next = NULL;
+    timer->pprev = NULL;
+    timer->expires = 0;
+}
+
+// Whether the timer is waiting to go off
+int timer_armed(const struct timer *timer)
+{
+    return timer->pprev != NULL;
+}
+
+// Links the timer into the slot its expiry falls in, as seen from the next tick to run
+static void timer_place(struct timer_wheel *wheel, struct timer *timer)
+{
+    if (timer->expires < wheel->next_tick){
+        timer->expires = wheel->next_tick;
+    }
+    uint64_t delta = timer->expires - wheel->next_tick;
+    if (delta > MAX_DELTA){
+        timer->expires = wheel->next_tick + MAX_DELTA;
+        delta = MAX_DELTA;
+    }
+
+    // The lowest level whose range reaches that far, slotted by the expiry's bits for that level
+    int level = 0;
+    while (level < TIMER_WHEEL_LEVELS - 1 && delta >= (1ULL << (TIMER_WHEEL_BITS * (level + 1)))){
+        level++;
+    }
+    struct timer **slot = &wheel->slots[level][(timer->expires >> (TIMER_WHEEL_BITS * level)) & SLOT_MASK];
+
+    timer->next = *slot;
+    if (*slot != NULL){
+        (*slot)->pprev = &timer->next;
+    }
+    *slot = timer;
+    timer->pprev = slot;
+}
+
+// Arms the timer to go off at a tick (right on the next advance if that's already past), re-arming it if it was armed
+void timer_wheel_arm(struct timer_wheel *wheel, struct timer *timer, uint64_t expires)
+{
+    timer_cancel(timer);
+    timer->expires = expires;
+    timer_place(wheel, timer);
+}
+
+// Disarms the timer if it's armed
+void timer_cancel(struct timer *timer)
+{
+    if (timer->pprev == NULL){
+        return;
+    }
+    *timer->pprev = timer->next;
+    if (timer->next != NULL){
+        timer->next->pprev = timer->pprev;
+    }
+    timer->next = NULL;
+    timer->pprev = NULL;
+}
+
+// Takes every timer out of a higher level's slot and places it again, which puts it a level (or more) lower
+// Returns the slot's index, the level above only has to cascade too when this one wrapped around to 0
+static int cascade(struct timer_wheel *wheel, int level)
+{
+    int index = (wheel->next_tick >> (TIMER_WHEEL_BITS * level)) & SLOT_MASK;
+    struct timer *pending = wheel->slots[level][index];
+    wheel->slots[level][index] = NULL;
+
+    while (pending != NULL){
+        struct timer *timer = pending;
+        pending = timer->next;
+        timer_place(wheel, timer);
+    }
+    return index;
+}
+
+// Moves the wheel on to the current tick, calling expire(timer, arg) for every timer that's due, once disarmed
+// expire may arm or cancel any timer, this one included
+void timer_wheel_advance(struct timer_wheel *wheel, void (*expire)(struct timer *timer, void *arg), void *arg)
+{
+    wheel->now = timer_wheel_clock();
+
+    while (wheel->next_tick <= wheel->now){
+        int index = wheel->next_tick & SLOT_MASK;
+        if (index == 0){ // A lap of level 0 is done, the next slot of each level above comes down
+            for (int level = 1; level < TIMER_WHEEL_LEVELS && cascade(wheel, level) == 0; level++);
+        }
+        wheel->next_tick++; // Timers re-armed for this tick from expire() go off on the next one
+
+        // The slot's list moves to a local head, so expire() can unlink whatever it likes from it
+        struct timer *pending = wheel->slots[0][index];
+        wheel->slots[0][index] = NULL;
+        if (pending != NULL){
+            pending->pprev = &pending;
+        }
+        while (pending != NULL){
+            struct timer *timer = pending;
+            timer_cancel(timer);
+            expire(timer, arg);
+        }
+    }
+}
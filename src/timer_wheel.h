@@ -0,0 +1,48 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <stdint.h>
+
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS 4 // Together they reach 2^24 ticks (about 194 days) ahead, later timers are cut to that
+
+// A deadline in a timer wheel, embedded in whatever it times out
+struct timer {
+    struct timer *next;
+    struct timer **pprev; // NULL while the timer isn't armed
+    uint64_t expires; // The tick it's due at
+};
+
+// A hierarchical timer wheel with a tick per second of the monotonic clock
+// Level 0 has a slot for each of the next 64 ticks, every level above covers 64 times as long with slots as much
+// coarser, and a slot's timers move down a level once it comes up. Arming and cancelling are O(1)
+struct timer_wheel {
+    uint64_t now; // The current tick, as of the last timer_wheel_advance()
+    uint64_t next_tick; // The first tick whose timers haven't run yet
+    struct timer *slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+};
+
+// The current tick, read from the coarse monotonic clock (no system call)
+uint64_t timer_wheel_clock(void);
+
+// Sets up an empty wheel starting at the current tick
+void timer_wheel_init(struct timer_wheel *wheel);
+
+// Sets up a timer that isn't armed
+void timer_init(struct timer *timer);
+
+// Whether the timer is waiting to go off
+int timer_armed(const struct timer *timer);
+
+// Arms the timer to go off at a tick (right on the next advance if that's already past), re-arming it if it was armed
+void timer_wheel_arm(struct timer_wheel *wheel, struct timer *timer, uint64_t expires);
+
+// Disarms the timer if it's armed
+void timer_cancel(struct timer *timer);
+
+// Moves the wheel on to the current tick, calling expire(timer, arg) for every timer that's due, once disarmed
+// expire may arm or cancel any timer, this one included
+void timer_wheel_advance(struct timer_wheel *wheel, void (*expire)(struct timer *timer, void *arg), void *arg);
+
+#endif
@@ -0,0 +1,688 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#include "connection.h"
+#include "file_cache.h"
+#include "logging.h"
+#include "metadata_cache.h"
+#include "options.h"
+#include "request_parsing.h"
+#include "socket_operations.h"
+#include "uring_loop.h"
+
+static unsigned RING_ENTRIES = 1024; // Submission queue size, the completion queue is four times bigger
+static unsigned RECV_BUFFER_COUNT = 1024; // Provided buffers the kernel picks from for recv (power of 2)
+static unsigned RECV_BUFFER_SIZE = 4096;
+static size_t URING_CHUNK_SIZE = 65536; // How much of a file one linked read/send moves
+static unsigned short BUFFER_GROUP = 0;
+
+// What a completion belongs to, kept in the low bits of user_data (malloc() gives connections 16-byte alignment)
+enum uring_op {
+    OP_ACCEPT = 1,
+    OP_TIMER,
+    OP_WATCH_INOTIFY,
+    OP_RECV,
+    OP_SEND_HEADERS,
+    OP_SEND_BODY,
+    OP_SEND_CHUNK,
+    OP_READ_CHUNK
+};
+#define OP_MASK 15ULL
+
+// The rings shared with the kernel and everything that belongs to them
+struct uring {
+    int ring_fd;
+    unsigned sq_entries;
+
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned sq_local_tail; // Includes SQEs we've filled in but not handed over yet
+
+    void *sq_ring_ptr, *cq_ring_ptr;
+    size_t sq_ring_size, cq_ring_size, sqes_size;
+
+    // Provided buffers for recv, the kernel picks one per completion
+    struct io_uring_buf_ring *buf_ring;
+    char *recv_buffers;
+    unsigned short buf_tail;
+
+    struct timer_wheel timers; // Every connection's deadline
+    int accept_paused; // Out of descriptors or memory, accept is armed again on the next tick
+};
+
+static int uring_enter(int ring_fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+// Hands every prepared SQE to the kernel, waiting for wait_nr completions
+static int uring_submit(struct uring *ring, unsigned wait_nr)
+{
+    __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+
+    for (;;){
+        unsigned to_submit = ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+        int ret = uring_enter(ring->ring_fd, to_submit, wait_nr, wait_nr ? IORING_ENTER_GETEVENTS : 0);
+        if (ret >= 0){
+            return 0;
+        }
+        if (errno == EINTR){
+            continue;
+        }
+        if (errno == EAGAIN || errno == EBUSY){
+            return 0; // The completion queue is backed up, reap it and try again next time
+        }
+        log_perror("uring_submit - io_uring_enter");
+        return -1;
+    }
+}
+
+// Makes sure needed SQEs can be filled in without submitting in between, handing what's queued to the kernel if not
+// A chain of linked SQEs has to reach the kernel in one submission, or it ends where the submission did
+// Returns -1 if there isn't room even then
+static int uring_reserve(struct uring *ring, unsigned needed)
+{
+    if (ring->sq_entries - (ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE)) >= needed){
+        return 0;
+    }
+    if (uring_submit(ring, 0) < 0){
+        return -1;
+    }
+    if (ring->sq_entries - (ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE)) < needed){
+        log_message(LEVEL_ERROR, "uring_reserve - submission queue is full");
+        return -1;
+    }
+    return 0;
+}
+
+// Returns a zeroed SQE to fill in (or NULL if the queue stays full)
+static struct io_uring_sqe *uring_get_sqe(struct uring *ring)
+{
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+    if (ring->sq_local_tail - head >= ring->sq_entries){
+        // Full, hand what we have to the kernel first
+        if (uring_submit(ring, 0) < 0){
+            return NULL;
+        }
+        head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+        if (ring->sq_local_tail - head >= ring->sq_entries){
+            log_message(LEVEL_ERROR, "uring_get_sqe - submission queue is full");
+            return NULL;
+        }
+    }
+
+    struct io_uring_sqe *sqe = &ring->sqes[ring->sq_local_tail & *ring->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_local_tail++;
+    return sqe;
+}
+
+// Gives a recv buffer back to the kernel
+static void uring_recycle_buffer(struct uring *ring, unsigned short buffer_id)
+{
+    struct io_uring_buf *buf = &ring->buf_ring->bufs[ring->buf_tail & (RECV_BUFFER_COUNT - 1)];
+    buf->addr = (uint64_t)(uintptr_t)(ring->recv_buffers + (size_t)buffer_id * RECV_BUFFER_SIZE);
+    buf->len = RECV_BUFFER_SIZE;
+    buf->bid = buffer_id;
+    ring->buf_tail++;
+    __atomic_store_n(&ring->buf_ring->tail, ring->buf_tail, __ATOMIC_RELEASE);
+}
+
+// Releases whatever uring_setup() got as far as setting up, the ring's descriptor included
+static void uring_teardown(struct uring *ring)
+{
+    if (ring->sqes != NULL){
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->sq_ring_ptr != NULL){
+        munmap(ring->sq_ring_ptr, ring->sq_ring_size);
+    }
+    close(ring->ring_fd);
+    free(ring->buf_ring);
+    free(ring->recv_buffers);
+    memset(ring, 0, sizeof(*ring));
+    ring->ring_fd = -1;
+}
+
+// Maps the rings and registers the recv buffers, returns -1 if io_uring isn't usable here
+// Nothing is left behind on failure, so the caller can fall back to epoll
+static int uring_setup(struct uring *ring)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    memset(ring, 0, sizeof(*ring));
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = RING_ENTRIES * 4;
+
+    ring->ring_fd = syscall(__NR_io_uring_setup, RING_ENTRIES, &params);
+    if (ring->ring_fd < 0){
+        log_perror("uring_setup - io_uring_setup");
+        return -1;
+    }
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP)){
+        log_message(LEVEL_ERROR, "uring_setup - kernel is too old");
+        uring_teardown(ring);
+        return -1;
+    }
+
+    // Both rings share one mapping
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (ring->cq_ring_size > ring->sq_ring_size){
+        ring->sq_ring_size = ring->cq_ring_size;
+    }
+    ring->sq_ring_ptr = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring_ptr == MAP_FAILED){
+        log_perror("uring_setup - mmap rings");
+        ring->sq_ring_ptr = NULL;
+        uring_teardown(ring);
+        return -1;
+    }
+    ring->cq_ring_ptr = ring->sq_ring_ptr;
+
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED){
+        log_perror("uring_setup - mmap sqes");
+        ring->sqes = NULL;
+        uring_teardown(ring);
+        return -1;
+    }
+
+    char *sq_ptr = ring->sq_ring_ptr;
+    char *cq_ptr = ring->cq_ring_ptr;
+    ring->sq_head = (unsigned *)(sq_ptr + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq_ptr + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq_ptr + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq_ptr + params.sq_off.array);
+    ring->cq_head = (unsigned *)(cq_ptr + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq_ptr + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq_ptr + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq_ptr + params.cq_off.cqes);
+    ring->sq_entries = params.sq_entries;
+    ring->sq_local_tail = *ring->sq_tail;
+
+    // SQE i always sits in slot i
+    for (unsigned i = 0; i < params.sq_entries; i++){
+        ring->sq_array[i] = i;
+    }
+
+    // Register the ring of provided recv buffers
+    size_t buf_ring_size = RECV_BUFFER_COUNT * sizeof(struct io_uring_buf);
+    if (posix_memalign((void **)&ring->buf_ring, sysconf(_SC_PAGESIZE), buf_ring_size) ||
+        (ring->recv_buffers = malloc((size_t)RECV_BUFFER_COUNT * RECV_BUFFER_SIZE)) == NULL){
+        log_perror("uring_setup - error allocating memory");
+        uring_teardown(ring);
+        return -1;
+    }
+    memset(ring->buf_ring, 0, buf_ring_size);
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)ring->buf_ring;
+    reg.ring_entries = RECV_BUFFER_COUNT;
+    reg.bgid = BUFFER_GROUP;
+    if (syscall(__NR_io_uring_register, ring->ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0){
+        log_perror("uring_setup - IORING_REGISTER_PBUF_RING");
+        uring_teardown(ring);
+        return -1;
+    }
+    for (unsigned i = 0; i < RECV_BUFFER_COUNT; i++){
+        uring_recycle_buffer(ring, i);
+    }
+
+    return 0;
+}
+
+// Queues an operation for a connection (or for the loop itself if conn is NULL)
+static struct io_uring_sqe *queue_op(struct uring *ring, struct connection *conn, enum uring_op op)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    if (sqe == NULL){
+        return NULL;
+    }
+    sqe->user_data = (uint64_t)(uintptr_t)conn | op;
+    if (conn != NULL){
+        conn->uring_inflight++;
+    }
+    return sqe;
+}
+
+// Arms multishot accept, one SQE keeps producing a completion per new connection
+static int queue_accept(struct uring *ring, const int listener)
+{
+    struct io_uring_sqe *sqe = queue_op(ring, NULL, OP_ACCEPT);
+    if (sqe == NULL){
+        return -1;
+    }
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listener;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    return 0;
+}
+
+// Arms the once-a-second tick that moves the timer wheel along
+static int queue_timer(struct uring *ring)
+{
+    static struct __kernel_timespec one_second = { .tv_sec = 1, .tv_nsec = 0 };
+
+    struct io_uring_sqe *sqe = queue_op(ring, NULL, OP_TIMER);
+    if (sqe == NULL){
+        return -1;
+    }
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = (uint64_t)(uintptr_t)&one_second;
+    sqe->len = 1;
+    return 0;
+}
+
+// Waits for the file cache's inotify descriptor to become readable
+static int queue_inotify_poll(struct uring *ring)
+{
+    int inotify_fd = file_cache_inotify_fd();
+    if (inotify_fd < 0){
+        return 0;
+    }
+
+    struct io_uring_sqe *sqe = queue_op(ring, NULL, OP_WATCH_INOTIFY);
+    if (sqe == NULL){
+        return -1;
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = inotify_fd;
+    sqe->poll32_events = POLLIN;
+    return 0;
+}
+
+// Asks for the next part of the request, the kernel picks the buffer
+// When a whole provided buffer wouldn't fit in what's left of recv_buf, it's read straight into recv_buf instead
+static int queue_recv(struct uring *ring, struct connection *conn)
+{
+    struct io_uring_sqe *sqe = queue_op(ring, conn, OP_RECV);
+    if (sqe == NULL){
+        return -1;
+    }
+    size_t room = sizeof(conn->recv_buf) - 1 - conn->recv_len;
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->fd;
+    if (room < RECV_BUFFER_SIZE){
+        sqe->addr = (uint64_t)(uintptr_t)(conn->recv_buf + conn->recv_len);
+        sqe->len = room;
+        return 0;
+    }
+    sqe->len = RECV_BUFFER_SIZE;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = BUFFER_GROUP;
+    return 0;
+}
+
+// Queues a send, more tells the kernel to hold a partial packet back for the send linked after it
+// A linked send gets MSG_WAITALL: without it a short send completes fine and what's linked goes out after a part of it,
+// with it io_uring keeps sending until all of it is out, and only a real failure breaks the chain
+// (provided buffer rings need 5.19, which has MSG_WAITALL for sends too)
+static int queue_send(struct uring *ring, struct connection *conn, enum uring_op op, const char *buf, size_t len,
+                      int link, int more)
+{
+    struct io_uring_sqe *sqe = queue_op(ring, conn, op);
+    if (sqe == NULL){
+        return -1;
+    }
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = conn->fd;
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = len;
+    sqe->msg_flags = MSG_NOSIGNAL | (more ? MSG_MORE : 0) | (link ? MSG_WAITALL : 0);
+    sqe->flags = link ? IOSQE_IO_LINK : 0;
+    return 0;
+}
+
+// Unlinks the last SQE queued since chain_start, so the chain doesn't run on into whatever is queued next
+static void uring_end_chain(struct uring *ring, unsigned chain_start)
+{
+    if (ring->sq_local_tail == chain_start){
+        return;
+    }
+    struct io_uring_sqe *last = &ring->sqes[(ring->sq_local_tail - 1) & *ring->sq_mask];
+    last->flags &= ~IOSQE_IO_LINK;
+    if (last->opcode == IORING_OP_SEND){
+        last->msg_flags &= ~MSG_WAITALL;
+    }
+}
+
+// Queues the longest chain of linked operations that moves the response along
+// A failed send or a short read breaks the chain (linked sends wait for all of theirs), the rest come back -ECANCELED
+// and get requeued
+// Returns 0 if something was queued, 1 if the response is done, -1 on error
+static int queue_response(struct uring *ring, struct connection *conn)
+{
+    // A compressed stream's next chunk is made once the last one is out
+    if (connection_refill_body(conn) < 0){
+        return -1;
+    }
+
+    // Sends with more of the response linked behind them share packets with it
+    int headers_left = conn->header_sent < conn->header_len;
+    int body_follows = conn->body_sent < conn->body_len;
+    int chunk_left = conn->chunk_sent < conn->chunk_len;
+    int file_left = !chunk_left && conn->body_fd >= 0 && conn->body_remaining > 0;
+    int file_follows = chunk_left || file_left;
+    unsigned needed = headers_left + body_follows + chunk_left + 2 * file_left;
+    if (needed == 0){
+        return 1;
+    }
+    if (file_left && conn->uring_chunk == NULL && (conn->uring_chunk = malloc(URING_CHUNK_SIZE)) == NULL){
+        log_perror("queue_response - error allocating memory");
+        return -1;
+    }
+
+    // The whole chain goes in one submission, so nothing may be submitted while it's built
+    if (uring_reserve(ring, needed) < 0){
+        return -1;
+    }
+    unsigned chain_start = ring->sq_local_tail;
+
+    if (headers_left && queue_send(ring, conn, OP_SEND_HEADERS, conn->header_data + conn->header_sent,
+                                   conn->header_len - conn->header_sent, 1, body_follows || file_follows) < 0){
+        goto failed;
+    }
+
+    if (body_follows && queue_send(ring, conn, OP_SEND_BODY, conn->body_data + conn->body_sent,
+                                   conn->body_len - conn->body_sent, 1, file_follows) < 0){
+        goto failed;
+    }
+
+    if (chunk_left){
+        if (queue_send(ring, conn, OP_SEND_CHUNK, conn->uring_chunk + conn->chunk_sent,
+                       conn->chunk_len - conn->chunk_sent, 0, 0) < 0){
+            goto failed;
+        }
+
+    } else if (file_left){
+        size_t chunk = conn->body_remaining < URING_CHUNK_SIZE ? conn->body_remaining : URING_CHUNK_SIZE;
+
+        // Read the next chunk of the file, then send it
+        struct io_uring_sqe *sqe = queue_op(ring, conn, OP_READ_CHUNK);
+        if (sqe == NULL){
+            goto failed;
+        }
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = conn->body_fd;
+        sqe->addr = (uint64_t)(uintptr_t)conn->uring_chunk;
+        sqe->len = chunk;
+        sqe->off = conn->body_offset;
+        sqe->flags = IOSQE_IO_LINK;
+
+        if (queue_send(ring, conn, OP_SEND_CHUNK, conn->uring_chunk, chunk, 0, 0) < 0){
+            goto failed;
+        }
+
+    } else {
+        // Nothing follows, so the last send shouldn't be linked to the next submission
+        uring_end_chain(ring, chain_start);
+    }
+    return 0;
+
+failed:
+    uring_end_chain(ring, chain_start); // What's queued still runs, but on its own
+    return -1;
+}
+
+// Frees a connection once the kernel is done with it
+static void close_connection(struct connection *conn)
+{
+    if (conn->state != CONN_CLOSING){
+        conn->state = CONN_CLOSING;
+        timer_cancel(&conn->timer);
+        shutdown(conn->fd, SHUT_RDWR); // Completes whatever is still pending on the socket
+    }
+    if (conn->uring_inflight > 0){
+        return;
+    }
+
+    connection_free(conn);
+}
+
+// Answers every complete request in the buffer until a response has to wait on the socket
+// Returns 0 to keep the connection, -1 to close it
+static int continue_connection(struct uring *ring, struct connection *conn)
+{
+    for (;;){
+        if (conn->state == CONN_READING_REQUEST){
+            int retval = handle_buffered_request(conn);
+            if (retval < 0){
+                return -1;
+            }
+            if (retval == 0){
+                if (conn->peer_closed){ // The client hung up without finishing another request
+                    log_message(LEVEL_DEBUG, "Connection on socket %d closed by client", conn->fd);
+                    return -1;
+                }
+                return queue_recv(ring, conn);
+            }
+        }
+
+        int retval = queue_response(ring, conn);
+        if (retval != 1){
+            return retval;
+        }
+        log_message(LEVEL_DEBUG, "Response sent succesfully on socket %d", conn->fd);
+
+        connection_response_done(conn);
+        if (conn->state == CONN_CLOSING){
+            return -1;
+        }
+    }
+}
+
+// Takes what a recv brought in and carries on with the connection
+static int handle_recv(struct uring *ring, struct connection *conn, struct io_uring_cqe *cqe)
+{
+    if (cqe->res == -ENOBUFS){ // Every buffer is in use, try again
+        return queue_recv(ring, conn);
+    }
+    if (cqe->res < 0){
+        log_message(LEVEL_ERROR, "uring_loop - recv: %s", strerror(-cqe->res));
+        return -1;
+    }
+
+    if (cqe->res == 0){
+        conn->peer_closed = 1;
+        return continue_connection(ring, conn);
+    }
+
+    // Copy the data out so the buffer can go straight back to the kernel (queue_recv() made sure it all fits)
+    if (cqe->flags & IORING_CQE_F_BUFFER){
+        unsigned short buffer_id = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        memcpy(conn->recv_buf + conn->recv_len, ring->recv_buffers + (size_t)buffer_id * RECV_BUFFER_SIZE, cqe->res);
+        uring_recycle_buffer(ring, buffer_id);
+    }
+    conn->recv_len += cqe->res;
+    conn->recv_buf[conn->recv_len] = '\0';
+
+    return continue_connection(ring, conn);
+}
+
+// Accounts for a finished send or read and queues the next step once the chain is through
+static int handle_send_progress(struct uring *ring, struct connection *conn, enum uring_op op, struct io_uring_cqe *cqe)
+{
+    if (cqe->res < 0 && cqe->res != -ECANCELED){
+        log_message(LEVEL_ERROR, "uring_loop - send: %s", strerror(-cqe->res));
+        return -1;
+    }
+
+    if (cqe->res > 0){
+        if (op != OP_READ_CHUNK){
+            conn->response_bytes += cqe->res;
+        }
+        switch (op){
+            case OP_SEND_HEADERS: conn->header_sent += cqe->res; break;
+            case OP_SEND_BODY: conn->body_sent += cqe->res; break;
+            case OP_SEND_CHUNK: conn->chunk_sent += cqe->res; break;
+            case OP_READ_CHUNK:
+                conn->chunk_len = cqe->res;
+                conn->chunk_sent = 0;
+                conn->body_offset += cqe->res;
+                conn->body_remaining -= cqe->res;
+                break;
+            default: break;
+        }
+    } else if (cqe->res == 0 && op == OP_READ_CHUNK){
+        log_message(LEVEL_WARNING, "uring_loop - unexpected end of file on socket %d", conn->fd);
+        return -1;
+    }
+
+    // Wait for the rest of the chain before deciding what's next
+    if (conn->uring_inflight > 0){
+        return 0;
+    }
+
+    return continue_connection(ring, conn);
+}
+
+// Shuts down a connection whose timer went off, if its deadline has really passed
+static void expire_connection(struct timer *timer, void *arg)
+{
+    struct uring *ring = arg;
+    struct connection *conn = connection_from_timer(timer);
+
+    if (connection_deadline_passed(conn, &ring->timers)){
+        log_message(LEVEL_DEBUG, "uring_loop - timeout reached on socket %d", conn->fd);
+        conn->state = CONN_CLOSING;
+        shutdown(conn->fd, SHUT_RDWR); // Its pending operations fail and close it from there
+    }
+}
+
+// Sets up a connection for a freshly accepted socket
+static void handle_accept(struct uring *ring, struct io_uring_cqe *cqe, const int listener)
+{
+    // The kernel stopped the multishot accept, rearm it
+    // Unless it ran out of something, then it would only fail again straight away, so it waits for the next tick
+    int out_of_resources = cqe->res == -EMFILE || cqe->res == -ENFILE || cqe->res == -ENOBUFS || cqe->res == -ENOMEM;
+    if (!(cqe->flags & IORING_CQE_F_MORE)){
+        if (out_of_resources){
+            ring->accept_paused = 1;
+        } else {
+            queue_accept(ring, listener);
+        }
+    }
+    if (cqe->res < 0){
+        log_message(LEVEL_ERROR, "uring_loop - accept: %s", strerror(-cqe->res));
+        return;
+    }
+
+    if (OPTIONS.tcp_nodelay){
+        set_tcp_nodelay(cqe->res); // Only costs latency if it fails
+    }
+    struct connection *conn = connection_new(cqe->res);
+    if (conn == NULL){
+        close(cqe->res);
+        return;
+    }
+    log_message(LEVEL_DEBUG, "Incoming connection on socket %d", conn->fd);
+    if (log_access_enabled()){ // The multishot accept doesn't give us the address
+        socklen_t addrlen = sizeof(conn->peer_addr);
+        if (getpeername(conn->fd, (struct sockaddr *)&conn->peer_addr, &addrlen) < 0){
+            conn->peer_addr.ss_family = 0;
+        }
+    }
+
+    if (queue_recv(ring, conn) < 0){
+        close_connection(conn);
+        return;
+    }
+    connection_update_deadline(conn, &ring->timers); // The request has to arrive within the header timeout
+}
+
+// Runs the io_uring loop on a listening socket (returns -2 if io_uring isn't available, -1 on failure)
+int run_uring_loop(const int listener)
+{
+    struct uring ring;
+
+    if (uring_setup(&ring) < 0){
+        return -2;
+    }
+    timer_wheel_init(&ring.timers);
+
+    // io_uring waits on the listener itself, it doesn't need to be non-blocking
+    int flags = fcntl(listener, F_GETFL, 0);
+    if (flags >= 0){
+        fcntl(listener, F_SETFL, flags & ~O_NONBLOCK);
+    }
+
+    if (queue_accept(&ring, listener) < 0 || queue_timer(&ring) < 0 || queue_inotify_poll(&ring) < 0){
+        uring_teardown(&ring);
+        return -1;
+    }
+
+    for (;;){
+        if (uring_submit(&ring, 1) < 0){
+            return -1;
+        }
+
+        // Reap every completion that's ready
+        unsigned head = *ring.cq_head;
+        unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++){
+            struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+            enum uring_op op = cqe->user_data & OP_MASK;
+            struct connection *conn = (struct connection *)(uintptr_t)(cqe->user_data & ~OP_MASK);
+
+            if (op == OP_ACCEPT){
+                handle_accept(&ring, cqe, listener);
+                continue;
+            }
+            if (op == OP_TIMER){
+                timer_wheel_advance(&ring.timers, expire_connection, &ring);
+                metadata_cache_expire();
+                if (file_cache_report_if_requested()){
+                    metadata_cache_report();
+                }
+                queue_timer(&ring);
+                if (ring.accept_paused){
+                    ring.accept_paused = 0;
+                    queue_accept(&ring, listener);
+                }
+                continue;
+            }
+            if (op == OP_WATCH_INOTIFY){
+                file_cache_process_events();
+                queue_inotify_poll(&ring);
+                continue;
+            }
+
+            conn->uring_inflight--;
+            if (conn->state == CONN_CLOSING){
+                if (op == OP_RECV && (cqe->flags & IORING_CQE_F_BUFFER)){
+                    uring_recycle_buffer(&ring, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+                }
+                close_connection(conn);
+                continue;
+            }
+
+            int retval = (op == OP_RECV) ? handle_recv(&ring, conn, cqe)
+                                         : handle_send_progress(&ring, conn, op, cqe);
+            if (retval < 0){
+                close_connection(conn);
+            } else {
+                connection_update_deadline(conn, &ring.timers);
+            }
+        }
+        __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+    }
+}
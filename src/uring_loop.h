@@ -0,0 +1,10 @@
+#ifndef URING_LOOP_H
+#define URING_LOOP_H
+
+#include <linux/io_uring.h>
+#include "connection.h"
+
+// Runs the io_uring loop on a listening socket (returns -2 if io_uring isn't available, -1 on failure)
+int run_uring_loop(const int listener);
+
+#endif
@@ -0,0 +1,76 @@
+#include <stdio.h>
+#include <string.h>
+#include "validators.h"
+
+// Makes the strong entity tag of a file (quotes included) from its inode, size and mtime
+// A coding (like "gzip") tells a compressed representation apart, NULL means the file as it is
+void format_etag(char *etag, size_t etag_size, const struct stat *file_stat, const char *coding)
+{
+    snprintf(etag, etag_size, "\"%llx-%llx-%llx.%lx%s%s\"",
+             (unsigned long long)file_stat->st_ino, (unsigned long long)file_stat->st_size,
+             (unsigned long long)file_stat->st_mtim.tv_sec, (unsigned long)file_stat->st_mtim.tv_nsec,
+             coding != NULL ? "-" : "", coding != NULL ? coding : "");
+}
+
+// Formats a time as used in Last-Modified and Date headers
+void format_http_date(char *date, size_t date_size, time_t time)
+{
+    struct tm date_tm;
+    gmtime_r(&time, &date_tm);
+    strftime(date, date_size, "%a, %d %b %Y %H:%M:%S GMT", &date_tm);
+}
+
+// Reads an IMF-fixdate, returns -1 if the value isn't one
+int parse_http_date(const char *header_value, time_t *time)
+{
+    struct tm date_tm;
+    memset(&date_tm, 0, sizeof(date_tm));
+
+    const char *end = strptime(header_value, "%a, %d %b %Y %H:%M:%S GMT", &date_tm);
+    if (end == NULL || end[strspn(end, " \t")] != '\0'){
+        return -1;
+    }
+    *time = timegm(&date_tm);
+    return 0;
+}
+
+// Whether an If-None-Match list names the entity tag, comparing weakly (W/ is ignored)
+static int etag_list_matches(const char *header_value, const char *etag)
+{
+    size_t etag_len = strlen(etag);
+
+    while (*header_value){
+        header_value += strspn(header_value, " \t,");
+        size_t item_len = strcspn(header_value, ",");
+        size_t tag_len = strcspn(header_value, " \t,");
+
+        if (tag_len == 1 && *header_value == '*'){
+            return 1;
+        }
+        const char *tag = header_value;
+        if (tag_len > 2 && !strncmp(tag, "W/", 2)){
+            tag += 2;
+            tag_len -= 2;
+        }
+        if (tag_len == etag_len && !strncmp(tag, etag, etag_len)){
+            return 1;
+        }
+        header_value += item_len;
+    }
+    return 0;
+}
+
+// Whether the client's copy is still current, so a 304 will do
+// If-None-Match wins over If-Modified-Since, either can be NULL
+int is_not_modified(const char *if_none_match, const char *if_modified_since, const char *etag, time_t last_modified)
+{
+    if (if_none_match != NULL){
+        return etag_list_matches(if_none_match, etag);
+    }
+
+    time_t since;
+    if (if_modified_since != NULL && parse_http_date(if_modified_since, &since) == 0){
+        return last_modified <= since;
+    }
+    return 0;
+}
@@ -0,0 +1,25 @@
+#ifndef VALIDATORS_H
+#define VALIDATORS_H
+
+#include <stddef.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#define ETAG_SIZE 80 // Room for a quoted entity tag with a coding on the end
+#define HTTP_DATE_SIZE 32 // Room for an IMF-fixdate like "Sun, 06 Nov 1994 08:49:37 GMT"
+
+// Makes the strong entity tag of a file (quotes included) from its inode, size and mtime
+// A coding (like "gzip") tells a compressed representation apart, NULL means the file as it is
+void format_etag(char *etag, size_t etag_size, const struct stat *file_stat, const char *coding);
+
+// Formats a time as used in Last-Modified and Date headers
+void format_http_date(char *date, size_t date_size, time_t time);
+
+// Reads an IMF-fixdate, returns -1 if the value isn't one
+int parse_http_date(const char *header_value, time_t *time);
+
+// Whether the client's copy is still current, so a 304 will do
+// If-None-Match wins over If-Modified-Since, either can be NULL
+int is_not_modified(const char *if_none_match, const char *if_modified_since, const char *etag, time_t last_modified);
+
+#endif
@@ -0,0 +1,100 @@
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "event_loop.h"
+#include "logging.h"
+#include "options.h"
+#include "socket_operations.h"
+#include "uring_loop.h"
+
+// What a worker thread needs to get going
+struct worker {
+    pthread_t thread;
+    int id;
+    int listener;
+    int pin_cpus;
+};
+
+// Pins the calling thread to a single CPU
+static void pin_to_cpu(int cpu)
+{
+    cpu_set_t cpu_set;
+    CPU_ZERO(&cpu_set);
+    CPU_SET(cpu, &cpu_set);
+
+    int retval = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set), &cpu_set);
+    if (retval != 0){
+        log_message(LEVEL_WARNING, "pin_to_cpu - couldn't pin to CPU %d: %s", cpu, strerror(retval));
+    }
+}
+
+// Runs the loop of the engine picked in OPTIONS on a listener (returns only on failure)
+int run_selected_loop(const int listener)
+{
+    if (OPTIONS.engine == ENGINE_IO_URING){
+        int retval = run_uring_loop(listener);
+        if (retval != -2){
+            return retval;
+        }
+        log_message(LEVEL_WARNING, "io_uring isn't available, falling back to epoll");
+    }
+
+    return run_event_loop(listener);
+}
+
+// Thread body, runs one event loop on the worker's own listener
+static void *worker_main(void *arg)
+{
+    struct worker *self = arg;
+
+    if (self->pin_cpus){
+        long cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+        pin_to_cpu(self->id % (cpu_count > 0 ? cpu_count : 1));
+    }
+
+    run_selected_loop(self->listener);
+    return NULL; // Only if the loop failed
+}
+
+// Starts worker_count event loops, each with its own SO_REUSEPORT listener (returns only on failure)
+int run_workers(const char *port, int worker_count, int pin_cpus)
+{
+    struct worker *workers = calloc(worker_count, sizeof(struct worker));
+    if (workers == NULL){
+        log_perror("run_workers - error allocating memory");
+        return -1;
+    }
+
+    // Bind every listener up front, so the kernel balances between all of them from the start
+    for (int i = 0; i < worker_count; i++){
+        workers[i].id = i;
+        workers[i].pin_cpus = pin_cpus;
+        workers[i].listener = get_listener(port, 1);
+        if (set_nonblocking(workers[i].listener) < 0){
+            free(workers);
+            return -1;
+        }
+    }
+
+    for (int i = 0; i < worker_count; i++){
+        int retval = pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]);
+        if (retval != 0){
+            log_message(LEVEL_ERROR, "run_workers - pthread_create: %s", strerror(retval));
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    log_message(LEVEL_INFO, "Started %d workers", worker_count);
+
+    // The workers never return unless their loop fails
+    for (int i = 0; i < worker_count; i++){
+        pthread_join(workers[i].thread, NULL);
+    }
+
+    free(workers);
+    return -1;
+}
@@ -0,0 +1,19 @@
+#ifndef WORKERS_H
+#define WORKERS_H
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "event_loop.h"
+#include "options.h"
+#include "socket_operations.h"
+#include "uring_loop.h"
+
+// Runs the loop of the engine picked in OPTIONS on a listener (returns only on failure)
+int run_selected_loop(const int listener);
+
+// Starts worker_count event loops, each with its own SO_REUSEPORT listener (returns only on failure)
+int run_workers(const char *port, int worker_count, int pin_cpus);
+
+#endif
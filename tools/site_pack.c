@@ -0,0 +1,452 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "../src/compression.h"
+#include "../src/content_encoding.h"
+#include "../src/mime_types.h"
+#include "../src/response_headers.h"
+#include "../src/site_archive.h"
+#include "../src/validators.h"
+
+// Packs a directory into one archive for the server's --archive mode
+// Every file gets its headers rendered up front, precompressed siblings (.br, .zst, .gz) become its encoded
+// representations, and with --compress text files without one get compressed here
+
+#define PACKED_HEADERS_MAX 512 // The server adds the status line, Date, Server and Connection around them
+
+// A regular file found under the directory
+struct pack_file {
+    char *path; // Relative to the directory, without a leading '/'
+    struct stat stat;
+    uint64_t body_offset; // Where its contents go in the archive
+};
+
+// A body compressed here, written after the files' own bodies
+struct pack_body {
+    char *data;
+    size_t len;
+    uint64_t offset;
+};
+
+static struct pack_file *files = NULL;
+static size_t file_count = 0, file_capacity = 0;
+static struct pack_body *bodies = NULL;
+static size_t body_count = 0, body_capacity = 0;
+static char *strings = NULL;
+static size_t strings_len = 0, strings_capacity = 0;
+static size_t root_len; // Of the directory's path, cut off the paths nftw() gives
+
+// Grows an array to hold one more element (or exits)
+static void *grow(void *array, size_t *capacity, size_t count, size_t element_size)
+{
+    if (count < *capacity){
+        return array;
+    }
+    *capacity = *capacity ? *capacity * 2 : 256;
+    void *grown = realloc(array, *capacity * element_size);
+    if (grown == NULL){
+        perror("realloc");
+        exit(EXIT_FAILURE);
+    }
+    return grown;
+}
+
+// Adds len bytes and a terminator to the strings, returns where they start
+static uint32_t add_string(const char *string, size_t len)
+{
+    while (strings_capacity - strings_len < len + 1){
+        strings_capacity = strings_capacity ? strings_capacity * 2 : 65536;
+        if ((strings = realloc(strings, strings_capacity)) == NULL){
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (strings_len + len + 1 > UINT32_MAX){
+        fprintf(stderr, "Too many files to pack, the strings don't fit in 4G.\n");
+        exit(EXIT_FAILURE);
+    }
+    uint32_t offset = strings_len;
+    memcpy(strings + strings_len, string, len);
+    strings[strings_len + len] = '\0';
+    strings_len += len + 1;
+    return offset;
+}
+
+// nftw() callback, collects the regular files and skips whatever the server couldn't serve from an archive
+static int collect_file(const char *path, const struct stat *file_stat, int type, struct FTW *ftw)
+{
+    (void)ftw;
+    if (type == FTW_SL){
+        fprintf(stderr, "Skipping symlink %s\n", path);
+        return 0;
+    }
+    if (type == FTW_DNR || type == FTW_NS){
+        fprintf(stderr, "Skipping unreadable %s\n", path);
+        return 0;
+    }
+    if (type != FTW_F || !S_ISREG(file_stat->st_mode)){
+        return 0;
+    }
+
+    files = grow(files, &file_capacity, file_count, sizeof(*files));
+    struct pack_file *file = &files[file_count++];
+    if ((file->path = strdup(path + root_len + 1)) == NULL){
+        perror("strdup");
+        exit(EXIT_FAILURE);
+    }
+    file->stat = *file_stat;
+    return 0;
+}
+
+// Orders files by path, so archives of the same tree come out the same
+static int compare_files(const void *a, const void *b)
+{
+    return strcmp(((const struct pack_file *)a)->path, ((const struct pack_file *)b)->path);
+}
+
+// Finds a collected file by path, NULL if there's none
+static struct pack_file *find_file(const char *path)
+{
+    struct pack_file key = {.path = (char *)path};
+    return bsearch(&key, files, file_count, sizeof(*files), compare_files);
+}
+
+// Rounds an offset up to where the next body may start
+static uint64_t align_body(uint64_t offset)
+{
+    return (offset + SITE_ARCHIVE_ALIGN - 1) & ~(uint64_t)(SITE_ARCHIVE_ALIGN - 1);
+}
+
+// Renders a representation's headers into the strings, the validators (what a 304 repeats) go last
+static void add_representation(struct site_archive_representation *representation, const char *MIME_type,
+                               const char *coding, const struct stat *etag_stat, const char *etag_coding, int vary)
+{
+    char etag[ETAG_SIZE];
+    char last_modified[HTTP_DATE_SIZE];
+    char validators[ETAG_SIZE + HTTP_DATE_SIZE + 64];
+    format_etag(etag, sizeof(etag), etag_stat, etag_coding);
+    format_http_date(last_modified, sizeof(last_modified), etag_stat->st_mtime);
+    int validators_len = snprintf(validators, sizeof(validators), "ETag: %s\r\nLast-Modified: %s\r\n%s", etag,
+                                  last_modified, vary ? "Vary: Accept-Encoding\r\n" : "");
+
+    char headers[PACKED_HEADERS_MAX];
+    struct header_builder builder;
+    header_builder_init(&builder, headers, sizeof(headers));
+    header_append_content_type(&builder, MIME_type);
+    header_append_content_length(&builder, representation->body_len);
+    if (coding != NULL){
+        char encoding_line[64];
+        int line_len = snprintf(encoding_line, sizeof(encoding_line), "Content-Encoding: %s\r\n", coding);
+        header_append(&builder, encoding_line, line_len);
+    }
+    header_append(&builder, validators, validators_len);
+    if (builder.overflow){
+        fprintf(stderr, "The headers for a %s file don't fit.\n", MIME_type);
+        exit(EXIT_FAILURE);
+    }
+
+    representation->headers_offset = add_string(headers, builder.len);
+    representation->headers_len = builder.len;
+    representation->validators_len = validators_len;
+    representation->etag_offset = add_string(etag, strlen(etag));
+    representation->mtime = etag_stat->st_mtime;
+}
+
+// Reads a whole file (Remember to free() afterwards), returns NULL on error
+static char *read_file(const char *path, size_t size)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0){
+        perror(path);
+        return NULL;
+    }
+    char *data = malloc(size ? size : 1);
+    size_t done = 0;
+    while (data != NULL && done < size){
+        ssize_t got = read(fd, data + done, size - done);
+        if (got <= 0){
+            fprintf(stderr, "%s: %s\n", path, got < 0 ? strerror(errno) : "changed while packing");
+            free(data);
+            data = NULL;
+            break;
+        }
+        done += got;
+    }
+    close(fd);
+    return data;
+}
+
+// Compresses a file with every encoding we can and keeps the results that came out smaller
+// Returns the ENCODING_* bits it added, the bodies go to the end of bodies in ENCODINGS order
+static int compress_representations(const char *path, const struct pack_file *file, int wanted)
+{
+    char *data = read_file(path, file->stat.st_size);
+    if (data == NULL){
+        exit(EXIT_FAILURE);
+    }
+    int added = 0;
+    for (int i = 0; ENCODINGS[i].token != NULL; i++){
+        if (!(wanted & ENCODINGS[i].encoding)){
+            continue;
+        }
+        size_t compressed_len;
+        char *compressed = compress_buffer(ENCODINGS[i].encoding, data, file->stat.st_size, &compressed_len);
+        if (compressed == NULL || compressed_len >= (size_t)file->stat.st_size){
+            free(compressed);
+            continue;
+        }
+        bodies = grow(bodies, &body_capacity, body_count, sizeof(*bodies));
+        bodies[body_count++] = (struct pack_body){compressed, compressed_len, 0};
+        added |= ENCODINGS[i].encoding;
+    }
+    free(data);
+    return added;
+}
+
+// Writes len bytes at offset, returns -1 on error
+static int write_at(int fd, const void *data, size_t len, uint64_t offset)
+{
+    size_t done = 0;
+    while (done < len){
+        ssize_t written = pwrite(fd, (const char *)data + done, len - done, offset + done);
+        if (written < 0){
+            perror("pwrite");
+            return -1;
+        }
+        done += written;
+    }
+    return 0;
+}
+
+// Copies a file's contents to its place in the archive, returns -1 on error
+static int copy_body(int archive_fd, const char *path, const struct pack_file *file)
+{
+    char *data = read_file(path, file->stat.st_size);
+    if (data == NULL){
+        return -1;
+    }
+    int retval = write_at(archive_fd, data, file->stat.st_size, file->body_offset);
+    free(data);
+    return retval;
+}
+
+// Prints how the program is meant to be run
+static void print_usage(const char *program_name)
+{
+    fprintf(stderr, "Usage: %s [options] <directory> <archive>\n"
+                    "Options:\n"
+                    "  --compress              Add gzip (and zstd) versions of text files that have no precompressed sibling\n"
+                    "  --compress-level N      Level for --compress, 1-9 (default 9)\n"
+                    "  --mime-types FILE       Add the types of a mime.types file to the built-in ones, like the server does\n",
+                    program_name);
+}
+
+int main(int argc, char *argv[])
+{
+    static struct option long_options[] = {
+        {"compress", no_argument, NULL, 'c'},
+        {"compress-level", required_argument, NULL, 'z'},
+        {"mime-types", required_argument, NULL, 'y'},
+        {NULL, 0, NULL, 0}
+    };
+    int compress = 0, compress_level = 9;
+    const char *mime_types_path = NULL;
+    int option;
+    while ((option = getopt_long(argc, argv, "", long_options, NULL)) != -1){
+        switch (option){
+            case 'c':
+                compress = 1;
+                break;
+            case 'z':
+                compress_level = atoi(optarg);
+                if (compress_level < 1 || compress_level > 9){
+                    fprintf(stderr, "'%s' is not a valid compression level.\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'y':
+                mime_types_path = optarg;
+                break;
+            default:
+                print_usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if (argc - optind != 2){
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    const char *root = argv[optind];
+    const char *archive_path = argv[optind + 1];
+    if (mime_types_init(mime_types_path) < 0){
+        return EXIT_FAILURE;
+    }
+    compression_init(compress ? compress_level : 0);
+
+    // Every regular file, symlinks aren't followed (the server wouldn't know where they lead once packed)
+    root_len = strlen(root);
+    while (root_len > 1 && root[root_len - 1] == '/'){
+        root_len--;
+    }
+    char root_path[root_len + 1];
+    memcpy(root_path, root, root_len);
+    root_path[root_len] = '\0';
+    if (nftw(root_path, collect_file, 64, FTW_PHYS) < 0){
+        perror(root_path);
+        return EXIT_FAILURE;
+    }
+    qsort(files, file_count, sizeof(*files), compare_files);
+
+    struct site_archive_entry *entries = calloc(file_count ? file_count : 1, sizeof(*entries));
+    uint32_t slot_count = 2;
+    while (slot_count < 2 * file_count){
+        slot_count *= 2;
+    }
+    uint32_t *slots = calloc(slot_count, sizeof(*slots));
+    if (entries == NULL || slots == NULL){
+        perror("calloc");
+        return EXIT_FAILURE;
+    }
+
+    // Each entry's representations, with the lengths known up front so the headers can be rendered
+    // A body's offset is filled in once the index's size is known
+    size_t *first_body = malloc((file_count ? file_count : 1) * sizeof(*first_body));
+    if (first_body == NULL){
+        perror("malloc");
+        return EXIT_FAILURE;
+    }
+    for (size_t i = 0; i < file_count; i++){
+        struct pack_file *file = &files[i];
+        struct site_archive_entry *entry = &entries[i];
+        size_t path_len = strlen(file->path);
+        char full_path[root_len + path_len + 2];
+        sprintf(full_path, "%s/%s", root_path, file->path);
+        const char *MIME_type = get_MIME_type(file->path);
+
+        // Siblings first, compressing here only fills in what they don't cover
+        struct pack_file *siblings[SITE_ARCHIVE_REPRESENTATIONS - 1] = {NULL};
+        for (int j = 0; ENCODINGS[j].token != NULL; j++){
+            char sibling_path[path_len + strlen(ENCODINGS[j].suffix) + 1];
+            sprintf(sibling_path, "%s%s", file->path, ENCODINGS[j].suffix);
+            if ((siblings[j] = find_file(sibling_path)) != NULL){
+                entry->encodings |= ENCODINGS[j].encoding;
+            }
+        }
+        first_body[i] = body_count;
+        int compressed = 0;
+        if (compress && entry->encodings == 0 && file->stat.st_size >= COMPRESS_MIN_SIZE && is_compressible_MIME_type(MIME_type)){
+            compressed = compress_representations(full_path, file, compression_encodings());
+            entry->encodings |= compressed;
+        }
+
+        entry->path_offset = add_string(file->path, path_len);
+        entry->path_len = path_len;
+        entry->hash = site_archive_hash(file->path, path_len);
+        entry->representations[0].body_len = file->stat.st_size;
+        add_representation(&entry->representations[0], MIME_type, NULL, &file->stat, NULL, entry->encodings != 0);
+        size_t body = first_body[i];
+        for (int j = 0; ENCODINGS[j].token != NULL; j++){
+            struct site_archive_representation *representation = &entries[i].representations[j + 1];
+            if (siblings[j] != NULL){
+                representation->body_len = siblings[j]->stat.st_size;
+                add_representation(representation, MIME_type, ENCODINGS[j].token, &siblings[j]->stat, NULL, 1);
+            } else if (compressed & ENCODINGS[j].encoding){
+                representation->body_len = bodies[body++].len;
+                add_representation(representation, MIME_type, ENCODINGS[j].token, &file->stat, ENCODINGS[j].token, 1);
+            }
+        }
+
+        uint32_t slot = entry->hash & (slot_count - 1);
+        while (slots[slot] != 0){
+            slot = (slot + 1) & (slot_count - 1);
+        }
+        slots[slot] = i + 1;
+    }
+
+    // Layout: header, slots, entries, strings, then the bodies each on a page boundary
+    struct site_archive_header header = {
+        .magic = SITE_ARCHIVE_MAGIC,
+        .version = SITE_ARCHIVE_VERSION,
+        .entry_count = file_count,
+        .slot_count = slot_count,
+        .slots_offset = sizeof(header),
+    };
+    header.entries_offset = (header.slots_offset + (uint64_t)slot_count * sizeof(*slots) + 7) & ~(uint64_t)7;
+    header.strings_offset = header.entries_offset + (uint64_t)file_count * sizeof(*entries);
+    header.strings_len = strings_len;
+    uint64_t offset = align_body(header.strings_offset + strings_len);
+    for (size_t i = 0; i < file_count; i++){
+        files[i].body_offset = offset;
+        offset = align_body(offset + files[i].stat.st_size);
+    }
+    for (size_t i = 0; i < body_count; i++){
+        bodies[i].offset = offset;
+        offset = align_body(offset + bodies[i].len);
+    }
+    header.size = offset;
+
+    // Point the representations at their bodies, siblings share the body of the file they are
+    for (size_t i = 0; i < file_count; i++){
+        struct site_archive_entry *entry = &entries[i];
+        entry->representations[0].body_offset = files[i].body_offset;
+        size_t body = first_body[i];
+        for (int j = 0; ENCODINGS[j].token != NULL; j++){
+            if (!(entry->encodings & ENCODINGS[j].encoding)){
+                continue;
+            }
+            char sibling_path[strlen(files[i].path) + strlen(ENCODINGS[j].suffix) + 1];
+            sprintf(sibling_path, "%s%s", files[i].path, ENCODINGS[j].suffix);
+            struct pack_file *sibling = find_file(sibling_path);
+            entry->representations[j + 1].body_offset = sibling != NULL ? sibling->body_offset : bodies[body++].offset;
+        }
+    }
+
+    // Written to a temporary name first, so a server never maps a half-written archive
+    char temporary_path[strlen(archive_path) + sizeof(".tmp")];
+    sprintf(temporary_path, "%s.tmp", archive_path);
+    int archive_fd = open(temporary_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (archive_fd < 0){
+        perror(temporary_path);
+        return EXIT_FAILURE;
+    }
+    int failed = ftruncate(archive_fd, header.size) < 0 ||
+                 write_at(archive_fd, &header, sizeof(header), 0) < 0 ||
+                 write_at(archive_fd, slots, (size_t)slot_count * sizeof(*slots), header.slots_offset) < 0 ||
+                 write_at(archive_fd, entries, file_count * sizeof(*entries), header.entries_offset) < 0 ||
+                 write_at(archive_fd, strings, strings_len, header.strings_offset) < 0;
+    for (size_t i = 0; i < file_count && !failed; i++){
+        char full_path[root_len + strlen(files[i].path) + 2];
+        sprintf(full_path, "%s/%s", root_path, files[i].path);
+        failed = copy_body(archive_fd, full_path, &files[i]) < 0;
+    }
+    for (size_t i = 0; i < body_count && !failed; i++){
+        failed = write_at(archive_fd, bodies[i].data, bodies[i].len, bodies[i].offset) < 0;
+    }
+    if (failed || fsync(archive_fd) < 0 || close(archive_fd) < 0 || rename(temporary_path, archive_path) < 0){
+        perror(archive_path);
+        unlink(temporary_path);
+        return EXIT_FAILURE;
+    }
+
+    printf("Packed %zu files into %s (%llu bytes, %zu compressed here)\n", file_count, archive_path,
+           (unsigned long long)header.size, body_count);
+    for (size_t i = 0; i < file_count; i++){
+        free(files[i].path);
+    }
+    for (size_t i = 0; i < body_count; i++){
+        free(bodies[i].data);
+    }
+    free(files);
+    free(bodies);
+    free(strings);
+    free(entries);
+    free(slots);
+    free(first_body);
+    return 0;
+}